@@ -1,12 +1,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <vulkan/vulkan_core.h>
 
 #include "carpvk.h"
+#include "carpvkspirv.h"
 
 #define VMA_IMPLEMENTATION
 
@@ -28,8 +37,17 @@
 #include "carpvkassert.h"
 
 static const uint32_t cVulkanApiVersion = VK_API_VERSION_1_3;
-static const size_t cVulkanScratchBufferSize = 16 * 1024 * 1024;
+static const size_t cVulkanStagingBlockSize = 16 * 1024 * 1024;
 static const size_t cVulkanUniformBufferSize = 64 * 1024 * 1024;
+static const size_t cVulkanDynamicUniformRingSize = 4 * 1024 * 1024;
+// Readback blocks grow on demand, large reads like screenshots get their own block.
+static const size_t cVulkanReadbackBlockSize = 1024 * 1024;
+// Largest single dynamic uniform, clamped to maxUniformBufferRange.
+static const size_t cVulkanDynamicUniformRange = 64 * 1024;
+
+// "CVPC", file header for the on-disk pipeline cache.
+static const uint32_t cPipelineCacheFileMagic = 0x43505643;
+static const uint32_t cPipelineCacheFileVersion = 1;
 
 struct VulkanInstanceBuilder
 {
@@ -72,13 +90,49 @@ static VkQueue sVkQueue = {};
 static VkSwapchainKHR sVkSwapchain = {};
 static VkImage sVkSwapchainImages[32] = {};
 
+// Without surface presentImage blits into offscreen images, one per frame in flight.
+static bool sVkHeadless = false;
+static Image sVkOffscreenImages[CarpVk::FramesInFlight] = {};
+
 static VkQueryPool sVkQueryPools[CarpVk::FramesInFlight] = {};
 static int sVkQueryPoolIndexCounts[CarpVk::FramesInFlight] = {};
 
+// Bindless heap, one update after bind set with an array per descriptor type.
+enum BindlessBinding : uint32_t
+{
+    BindlessBindingSampledImage,
+    BindlessBindingStorageImage,
+    BindlessBindingStorageBuffer,
+    BindlessBindingCount,
+};
+
+struct BindlessPendingFree
+{
+    uint32_t binding = 0;
+    uint32_t index = 0;
+    uint64_t submissionValue = 0;
+};
+
+static bool sVkBindlessSupported = false;
+static bool sVkPushDescriptorsSupported = false;
+static PFN_vkCmdPushDescriptorSetKHR sVkCmdPushDescriptorSet = nullptr;
+static VkDescriptorSetLayout sVkBindlessSetLayout = {};
+static VkDescriptorPool sVkBindlessDescriptorPool = {};
+static VkDescriptorSet sVkBindlessDescriptorSet = {};
+static uint32_t sVkBindlessCapacities[BindlessBindingCount] = {};
+static uint32_t sVkBindlessNextIndices[BindlessBindingCount] = {};
+static std::vector<uint32_t> sVkBindlessFreeIndices[BindlessBindingCount];
+static std::vector<BindlessPendingFree> sVkBindlessPendingFrees;
+
 static VkSemaphore sVkAcquireSemaphores[CarpVk::FramesInFlight] = {};
 static VkSemaphore sVkReleaseSemaphores[CarpVk::FramesInFlight] = {};
 
-static VkFence sVkFences[CarpVk::FramesInFlight] = {};
+// Counts submissions to sVkQueue, each submit signals the next value.
+static VkSemaphore sVkTimelineSemaphore = {};
+static uint64_t sVkSubmissionValue = 0;
+// Submission value and frame number of the frame that last used the frame index.
+static uint64_t sVkFrameSubmissionValues[CarpVk::FramesInFlight] = {};
+static int64_t sVkFrameSubmissionFrames[CarpVk::FramesInFlight] = {};
 static VkCommandPool sVkCommandPools[CarpVk::FramesInFlight] = {};
 
 static VkCommandBuffer sVkCommandBuffers[CarpVk::FramesInFlight] = {};
@@ -87,6 +141,267 @@ static VmaAllocator sVkAllocator = {};
 
 static VkDescriptorPool sVkDescriptorPool;
 
+// Linear per frame slot pools, sets are allocated in order and all reset together.
+struct FrameDescriptorPools
+{
+    std::vector<VkDescriptorPool> pools;
+    uint32_t currentPool = 0;
+};
+static FrameDescriptorPools sVkFrameDescriptorPools[CarpVk::FramesInFlight];
+
+// VK_EXT_descriptor_buffer backend. Sets are ranges of one host visible buffer, persistent sets
+// first and then a linear range per frame slot. The VkDescriptorSet handles given out are
+// indices into the set records, not driver objects. Handles carry a generation, handles of
+// reset frame slots or of freed persistent sets fail the lookup.
+struct DescriptorBufferLayout
+{
+    VkDeviceSize size = 0;
+    std::vector<uint32_t> bindings;
+    std::vector<VkDeviceSize> bindingOffsets;
+};
+
+struct DescriptorBufferSet
+{
+    VkDescriptorSetLayout layout = {};
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    // Persistent sets only, bumped when the set is freed.
+    uint32_t generation = 0;
+};
+
+// Persistent range of a destroyed layout's sets, reused once the frames that could read it finished.
+struct DescriptorBufferRange
+{
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint64_t submissionValue = 0;
+};
+
+static bool sVkDescriptorBufferSupported = false;
+static VkPhysicalDeviceDescriptorBufferPropertiesEXT sVkDescriptorBufferProperties = {};
+static Buffer sVkDescriptorBuffer;
+static VkDeviceAddress sVkDescriptorBufferAddress = 0;
+static std::unordered_map<VkDescriptorSetLayout, DescriptorBufferLayout> sVkDescriptorBufferLayouts;
+static std::vector<DescriptorBufferSet> sVkDescriptorBufferSets;
+static std::vector<uint32_t> sVkDescriptorBufferFreeSets;
+static std::vector<DescriptorBufferRange> sVkDescriptorBufferFreeRanges;
+static std::vector<DescriptorBufferRange> sVkDescriptorBufferPendingRanges;
+static VkDeviceSize sVkDescriptorBufferPersistentUsed = 0;
+static std::vector<DescriptorBufferSet> sVkFrameDescriptorBufferSets[CarpVk::FramesInFlight];
+static VkDeviceSize sVkFrameDescriptorBufferUsed[CarpVk::FramesInFlight] = {};
+static uint32_t sVkFrameDescriptorBufferGenerations[CarpVk::FramesInFlight] = {};
+
+static PFN_vkGetDescriptorSetLayoutSizeEXT sVkGetDescriptorSetLayoutSize = nullptr;
+static PFN_vkGetDescriptorSetLayoutBindingOffsetEXT sVkGetDescriptorSetLayoutBindingOffset = nullptr;
+static PFN_vkGetDescriptorEXT sVkGetDescriptor = nullptr;
+static PFN_vkCmdBindDescriptorBuffersEXT sVkCmdBindDescriptorBuffers = nullptr;
+static PFN_vkCmdSetDescriptorBufferOffsetsEXT sVkCmdSetDescriptorBufferOffsets = nullptr;
+
+// VK_EXT_shader_object path, graphics programs are linked shaders with all state set dynamically.
+struct ShaderObjectFunctions
+{
+    PFN_vkCreateShadersEXT createShaders = nullptr;
+    PFN_vkDestroyShaderEXT destroyShader = nullptr;
+    PFN_vkCmdBindShadersEXT cmdBindShaders = nullptr;
+    PFN_vkCmdSetVertexInputEXT cmdSetVertexInput = nullptr;
+    PFN_vkCmdSetPolygonModeEXT cmdSetPolygonMode = nullptr;
+    PFN_vkCmdSetRasterizationSamplesEXT cmdSetRasterizationSamples = nullptr;
+    PFN_vkCmdSetSampleMaskEXT cmdSetSampleMask = nullptr;
+    PFN_vkCmdSetAlphaToCoverageEnableEXT cmdSetAlphaToCoverageEnable = nullptr;
+    PFN_vkCmdSetColorBlendEnableEXT cmdSetColorBlendEnable = nullptr;
+    PFN_vkCmdSetColorBlendEquationEXT cmdSetColorBlendEquation = nullptr;
+    PFN_vkCmdSetColorWriteMaskEXT cmdSetColorWriteMask = nullptr;
+};
+
+struct ShaderObjectProgram
+{
+    // Vertex and fragment, null when the program does not have the stage.
+    VkShaderEXT shaders[2] = {};
+    std::vector<VkPipelineColorBlendAttachmentState> blendChannels;
+    // Render target formats of the builder, its pipeline is only usable with these.
+    std::vector<VkFormat> colorFormats;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+    VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+    VkCullModeFlags cullMode = VK_CULL_MODE_NONE;
+    VkFrontFace frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    bool depthTest = false;
+    bool writeDepth = false;
+    bool used = false;
+};
+
+static bool sVkShaderObjectsSupported = false;
+static ShaderObjectFunctions sVkShaderObjectFns;
+static std::vector<ShaderObjectProgram> sVkShaderObjectPrograms;
+static std::vector<uint32_t> sVkShaderObjectFreePrograms;
+// Shader objects are created from code, not modules, and need the set layouts of the pipeline layout.
+// The code comes from the reflection entry of the module.
+struct PipelineLayoutContents
+{
+    std::vector<VkDescriptorSetLayout> setLayouts;
+    std::vector<VkPushConstantRange> pushConstantRanges;
+};
+static std::unordered_map<VkPipelineLayout, PipelineLayoutContents> sVkPipelineLayoutContents;
+
+// Reflections are shared by modules with identical code, layouts by identical stage combinations.
+struct ReflectedLayoutsEntry
+{
+    std::vector<uint64_t> key;
+    ReflectedLayouts layouts;
+};
+// Full code is kept to resolve hash collisions and for shader objects. Removed with the last module using it.
+struct ShaderReflectionEntry
+{
+    std::vector<uint32_t> code;
+    ShaderReflection reflection;
+    uint64_t hash = 0;
+    uint32_t moduleCount = 0;
+};
+static std::unordered_multimap<uint64_t, ShaderReflectionEntry> sVkShaderReflections;
+static std::unordered_map<VkShaderModule, ShaderReflectionEntry*> sVkShaderModuleReflections;
+static std::unordered_multimap<uint64_t, uint32_t> sVkReflectedLayoutLookup;
+static std::deque<ReflectedLayoutsEntry> sVkReflectedLayouts;
+
+// Hash-consed set layouts, pipeline layouts and samplers, the destroy functions release a
+// reference and destroy the object with the last one.
+struct SharedHandleEntry
+{
+    std::vector<uint64_t> key;
+    uint64_t hash = 0;
+    uint32_t refCount = 0;
+};
+struct SharedHandleCache
+{
+    // Key hash to handle, full key is kept in the entry to resolve hash collisions.
+    std::unordered_multimap<uint64_t, uint64_t> lookup;
+    std::unordered_map<uint64_t, SharedHandleEntry> entries;
+    uint64_t requests = 0;
+};
+static SharedHandleCache sVkSharedSetLayouts;
+static SharedHandleCache sVkSharedPipelineLayouts;
+static SharedHandleCache sVkSharedSamplers;
+
+// Descriptor set cache, full key is kept to resolve hash collisions.
+struct DescriptorCacheEntry
+{
+    std::vector<uint64_t> key;
+    uint64_t hash = 0;
+    VkDescriptorSetLayout layout = {};
+    VkDescriptorSet descriptorSet = {};
+    uint64_t lastUsedValue = 0;
+    // Least recently used list, head is the most recent.
+    uint32_t prev = ~0u;
+    uint32_t next = ~0u;
+    bool used = false;
+};
+
+struct RetiredDescriptorSet
+{
+    VkDescriptorSet descriptorSet = {};
+    uint64_t lastUsedValue = 0;
+};
+
+// Pools of a single layout sized from its bindings, so allocation only fails when a pool is full.
+struct DescriptorLayoutPools
+{
+    std::vector<VkDescriptorPoolSize> setPoolSizes;
+    std::vector<VkDescriptorPool> pools;
+    uint32_t nextPoolSetCount = 64;
+    std::vector<RetiredDescriptorSet> retiredSets;
+};
+
+struct PendingDescriptorPoolDestroy
+{
+    VkDescriptorPool pool = {};
+    uint64_t submissionValue = 0;
+};
+
+static std::vector<DescriptorCacheEntry> sVkDescriptorCacheEntries;
+static std::vector<uint32_t> sVkDescriptorCacheFreeEntries;
+static std::unordered_multimap<uint64_t, uint32_t> sVkDescriptorCacheLookup;
+static std::unordered_map<VkDescriptorSetLayout, DescriptorLayoutPools> sVkDescriptorLayoutPools;
+static std::vector<PendingDescriptorPoolDestroy> sVkPendingDescriptorPoolDestroys;
+static uint32_t sVkDescriptorCacheHead = ~0u;
+static uint32_t sVkDescriptorCacheTail = ~0u;
+static DescriptorSetCacheStats sVkDescriptorCacheStats;
+
+static VkPipelineCache sVkPipelineCache = {};
+static char sVkPipelineCacheFilename[512] = {};
+static PipelineCacheStats sVkPipelineCacheStats = {};
+// Pipelines can be created from the compile threads, counters are kept separately as atomics.
+static std::atomic<uint64_t> sVkPipelineCacheHits = 0;
+static std::atomic<uint64_t> sVkPipelineCacheMisses = 0;
+static std::atomic<uint64_t> sVkPipelineCacheUnknown = 0;
+static std::atomic<uint64_t> sVkPipelineCreationTimeNs = 0;
+
+// Pipelines of getGraphicsPipelineVariant/getComputePipelineVariant, full key is kept to
+// resolve hash collisions.
+struct PipelineVariant
+{
+    std::vector<uint64_t> key;
+    std::vector<VkShaderModule> modules;
+    VkPipelineLayout pipelineLayout = {};
+    VkPipeline pipeline = {};
+};
+
+struct PendingPipelineDestroy
+{
+    VkPipeline pipeline = {};
+    uint64_t submissionValue = 0;
+};
+
+static std::unordered_multimap<uint64_t, PipelineVariant> sVkPipelineVariants;
+static std::vector<PendingPipelineDestroy> sVkPendingPipelineDestroys;
+static PipelineVariantStats sVkPipelineVariantStats;
+
+struct StageSpecializationInfo
+{
+    VkSpecializationMapEntry mapEntries[CarpVk::MaxSpecializationConstants] = {};
+    VkSpecializationInfo info = {};
+};
+
+// Entry point name and specialization data a stage info points to, copied for the compile threads.
+struct PipelineCompileStage
+{
+    std::vector<char> entryName;
+    std::vector<VkSpecializationMapEntry> mapEntries;
+    std::vector<uint8_t> specializationData;
+    VkSpecializationInfo specializationInfo = {};
+    bool specialized = false;
+};
+
+struct PipelineCompileJob
+{
+    GPBuilder graphicsBuilder = {};
+    CPBuilder computeBuilder = {};
+    // Builders only hold pointers, the arrays are copied here so caller can free them.
+    std::vector<VkPipelineShaderStageCreateInfo> stageInfos;
+    // One per stage info, or one for the compute stage.
+    std::vector<PipelineCompileStage> stages;
+    std::vector<SpecializationConstants> stageSpecializations;
+    std::vector<VkFormat> colorFormats;
+    std::vector<VkPipelineColorBlendAttachmentState> blendChannels;
+    const char* pipelineName = nullptr;
+    uint32_t slotIndex = ~0u;
+    bool compute = false;
+};
+
+struct AsyncPipelineSlot
+{
+    VkPipeline pipeline = {};
+    bool ready = false;
+    bool used = false;
+};
+
+static std::vector<std::thread> sPipelineCompileThreads;
+static std::deque<PipelineCompileJob> sPipelineCompileJobs;
+static std::vector<AsyncPipelineSlot> sAsyncPipelineSlots;
+static std::vector<uint32_t> sAsyncPipelineFreeSlots;
+static std::mutex sPipelineCompileMutex;
+static std::condition_variable sPipelineCompileCondition;
+static std::condition_variable sPipelineReadyCondition;
+static bool sPipelineCompileThreadsQuit = false;
+
 static CarpSwapChainFormats sVkSwapchainFormats = {};
 
 static int64_t sVkFrameIndex = -1;
@@ -106,19 +421,256 @@ static PFN_vkCmdDebugMarkerInsertEXT cmdDebugMarkerInsert = nullptr;
 static std::vector<Image*> sAllImages;
 static std::vector<Image*> sAllRenderTargetImages;
 
+// Transient images alias the start of a shared block, images in a block never overlap in use points.
+struct TransientImage
+{
+    Image* image = nullptr;
+    uint32_t firstUse = 0;
+    uint32_t lastUse = 0;
+    uint32_t blockIndex = 0;
+};
+static std::vector<TransientImage> sVkTransientImages;
+static std::vector<VmaAllocation> sVkTransientBlocks;
+static TransientImageStats sVkTransientImageStats;
+
 static VulkanInstanceBuilder sVkInstanceBuilder;
 
 
 
-static Buffer sVkUniformBuffer = {};
-static size_t sVkUniformBufferOffset = {};
-static Buffer sVkScratchBuffer[CarpVk::FramesInFlight] = {};
-static size_t sVkScratchBufferOffset = 0;
+// Two level segregated fit allocator per uniform backing buffer. Block sizes are multiples of
+// the alignment so every offset stays aligned.
+static constexpr uint32_t cUniformSecondLevelLog2 = 3;
+static constexpr uint32_t cUniformSecondLevelCount = 1u << cUniformSecondLevelLog2;
+static constexpr uint32_t cUniformFirstLevelCount = 64;
+
+struct UniformHeapBlock
+{
+    size_t offset = 0;
+    size_t size = 0;
+    uint32_t prevPhysical = ~0u;
+    uint32_t nextPhysical = ~0u;
+    uint32_t prevFree = ~0u;
+    uint32_t nextFree = ~0u;
+    bool free = false;
+};
+
+struct UniformHeap
+{
+    Buffer buffer;
+    std::vector<UniformHeapBlock> blocks;
+    std::vector<uint32_t> unusedBlocks;
+    uint32_t freeHeads[cUniformFirstLevelCount][cUniformSecondLevelCount] = {};
+    uint64_t firstLevelBitmap = 0;
+    uint32_t secondLevelBitmaps[cUniformFirstLevelCount] = {};
+    size_t usedBytes = 0;
+    uint32_t allocationCount = 0;
+};
+
+struct UniformPendingFree
+{
+    uint32_t bufferIndex = 0;
+    uint32_t blockIndex = 0;
+    uint64_t submissionValue = 0;
+};
+
+static UniformHeap sVkUniformHeaps[CarpVk::MaxUniformBuffers];
+static uint32_t sVkUniformHeapCount = 0;
+static size_t sVkUniformAlignment = 256;
+static std::vector<UniformPendingFree> sVkUniformPendingFrees;
+
+// One persistently mapped buffer holding a region per frame slot, plus one range of padding so
+// the descriptor range never reads past the end.
+struct DynamicUniformRing
+{
+    Buffer buffer;
+    size_t frameSize = 0;
+    size_t range = 0;
+    size_t alignment = 0;
+    size_t frameStart = 0;
+    size_t head = 0;
+    size_t flushedHead = 0;
+};
+static DynamicUniformRing sVkDynamicUniformRing;
+
+static UploadStats sVkUploadStats;
+// Staging memory per frame slot, grows by chaining blocks when a frame needs more and frees
+// the extra blocks after the slot has not needed them for a number of frames.
+struct StagingRing
+{
+    const char* name = nullptr;
+    size_t blockSize = 0;
+    uint32_t shrinkIdleFrames = 0;
+    // Copy destination in host cached memory instead of a write combined copy source.
+    bool readback = false;
+    std::vector<Buffer> blocks[CarpVk::FramesInFlight];
+    // Last frame index the slot needed all of its blocks, idle time counts frames, not slot uses.
+    int64_t lastNeededFrame[CarpVk::FramesInFlight] = {};
+    uint32_t usedBlocks[CarpVk::FramesInFlight] = {};
+    uint32_t currentBlock = 0;
+    size_t currentOffset = 0;
+    size_t frameBytes = 0;
+    StagingStats stats;
+};
+
+struct StagingAllocation
+{
+    VkBuffer buffer = VK_NULL_HANDLE;
+    BufferCopyRegion region;
+    void* data = nullptr;
+    VmaAllocation allocation = {};
+};
+
+struct QueuedUpload
+{
+    Buffer* buffer = nullptr;
+    size_t dstOffset = 0;
+    size_t size = 0;
+    // Written at queue time inside a frame, staged on flush when queued outside of one.
+    StagingAllocation staging;
+    // Offset in sVkQueuedUploadData when not staged yet.
+    size_t dataOffset = 0;
+};
+static std::vector<QueuedUpload> sVkQueuedUploads;
+static std::vector<uint8_t> sVkQueuedUploadData;
+// Between beginFrame/beginPreFrame and the submit, the staging slot of the frame is open.
+static bool sVkFrameRecording = false;
+
+static StagingRing sVkStagingRing;
+static StagingRing sVkReadbackRing;
+
+struct Readback
+{
+    uint64_t submissionValue = 0;
+    StagingAllocation allocation;
+    size_t size = 0;
+    FnReadbackDone doneFn = nullptr;
+    void* userData = nullptr;
+    std::vector<uint8_t> data;
+    // Bumped when the slot is freed, tickets of earlier uses do not match.
+    uint32_t generation = 0;
+    bool used = false;
+    bool ready = false;
+};
+static std::vector<Readback> sVkReadbacks;
+static std::vector<uint32_t> sVkReadbackFreeSlots;
+
+
+
+// Per thread so secondary command buffers can record barriers in parallel.
+static thread_local std::vector<VkImageMemoryBarrier2> sVkImageBarriers;
+static thread_local std::vector<VkBufferMemoryBarrier2> sVkBufferBarriers;
+static thread_local std::vector<VkMemoryBarrier2> sVkMemoryBarriers;
+
+struct RecordedBarriers
+{
+    std::vector<VkImageMemoryBarrier2> imageBarriers;
+    std::vector<VkBufferMemoryBarrier2> bufferBarriers;
+    std::vector<VkMemoryBarrier2> memoryBarriers;
+};
+
+// Secondary command buffers of a thread index, pool is created on first use and reset with the frame.
+struct ThreadCommandBuffers
+{
+    VkCommandPool commandPool = {};
+    std::vector<VkCommandBuffer> commandBuffers;
+    // Barriers left unflushed at the end of each command buffer.
+    std::vector<RecordedBarriers> leftoverBarriers;
+    uint32_t usedCount = 0;
+};
+static ThreadCommandBuffers sVkThreadCommandBuffers[CarpVk::FramesInFlight][CarpVk::MaxRecordingThreads];
+static thread_local VkCommandBuffer sVkThreadCommandBuffer = {};
+static thread_local uint32_t sVkThreadIndex = ~0u;
+static thread_local uint32_t sVkThreadBufferIndex = ~0u;
+static thread_local bool sVkThreadInsideRendering = false;
+// Extent of the rendering scope on this thread, shader objects set the viewport again on bind.
+static thread_local int sVkThreadRenderWidth = 0;
+static thread_local int sVkThreadRenderHeight = 0;
+// Formats of the rendering scope on this thread, for the blend state and pipelines of programs.
+static thread_local VkFormat sVkThreadRenderColorFormats[32] = {};
+static thread_local uint32_t sVkThreadRenderColorCount = 0;
+static thread_local VkFormat sVkThreadRenderDepthFormat = VK_FORMAT_UNDEFINED;
+
+// Attachment formats of beginSecondaryRendering for the secondaries to inherit.
+struct SecondaryRenderingState
+{
+    VkFormat colorFormats[32] = {};
+    uint32_t colorFormatCount = 0;
+    VkFormat depthFormat = VK_FORMAT_UNDEFINED;
+    int32_t width = 0;
+    int32_t height = 0;
+    bool active = false;
+};
+static SecondaryRenderingState sVkSecondaryRendering;
+
+// Optional transfer only queue for uploads, sVkTransferQueue is null when not in use.
+struct TransferAcquire
+{
+    Image* image = nullptr;
+    Buffer* buffer = nullptr;
+    VkImageMemoryBarrier2 imageBarrier = {};
+    VkBufferMemoryBarrier2 bufferBarrier = {};
+};
 
+static VkQueue sVkTransferQueue = {};
+static uint32_t sVkTransferQueueIndex = ~0u;
+static VkCommandPool sVkTransferCommandPools[CarpVk::FramesInFlight] = {};
+static VkCommandBuffer sVkTransferCommandBuffers[CarpVk::FramesInFlight] = {};
+static StagingRing sVkTransferStagingRing;
+static VkSemaphore sVkTransferTimelineSemaphore = {};
+static uint64_t sVkTransferSubmissionValue = 0;
+static uint64_t sVkTransferFrameSubmissionValues[CarpVk::FramesInFlight] = {};
+static bool sVkTransferRecording = false;
+// Acquires for uploads recorded this frame, and for uploads submitted at the end of last frame.
+static std::vector<TransferAcquire> sVkTransferRecordedAcquires;
+static std::vector<TransferAcquire> sVkTransferPendingAcquires;
+static uint64_t sVkTransferPendingValue = 0;
+static bool sVkInPreFrame = false;
+
+// Optional compute only queue, sVkComputeQueue is null when not in use.
+static VkQueue sVkComputeQueue = {};
+static uint32_t sVkComputeQueueIndex = ~0u;
+static VkCommandPool sVkComputeCommandPools[CarpVk::FramesInFlight] = {};
+static VkCommandBuffer sVkComputeCommandBuffers[CarpVk::FramesInFlight] = {};
+static VkSemaphore sVkComputeTimelineSemaphore = {};
+static uint64_t sVkComputeSubmissionValue = 0;
+static uint64_t sVkComputeFrameSubmissionValues[CarpVk::FramesInFlight] = {};
+static int64_t sVkComputeSubmittedFrame = -1;
+static bool sVkAsyncComputeRecording = false;
+
+// Semaphores the next graphics submission waits for, besides swapchain acquire.
+static std::vector<VkSemaphoreSubmitInfo> sVkGraphicsWaitInfos;
+
+struct GpuTimerQuery
+{
+    const char* name = nullptr;
+    uint32_t beginQuery = 0;
+    uint32_t endQuery = 0;
+    int32_t depth = 0;
+};
 
+struct GpuTimerHistory
+{
+    const char* name = nullptr;
+    double samples[CarpVk::GpuTimerHistoryLength] = {};
+    double sum = 0.0;
+    int32_t head = 0;
+    int32_t count = 0;
+    // Last frame this name was seen on, sum of all timers with same name in a frame.
+    int64_t frame = -1;
+    double frameMilliseconds = 0.0;
+};
 
-static std::vector<VkImageMemoryBarrier2> sVkImageBarriers;
-static std::vector<VkBufferMemoryBarrier2> sVkBufferBarriers;
+static std::vector<GpuTimerQuery> sVkGpuTimers[CarpVk::FramesInFlight];
+static int64_t sVkGpuTimerFrames[CarpVk::FramesInFlight] = {};
+static std::vector<uint32_t> sVkGpuTimerStack;
+static std::vector<GpuTimerResult> sVkGpuTimerResults;
+static std::vector<GpuTimerHistory> sVkGpuTimerHistories;
+static std::vector<GpuTimerAverage> sVkGpuTimerAverages;
+static int64_t sVkGpuTimerResultsFrame = -1;
+static double sVkTimestampPeriod = 0.0;
+static uint64_t sVkTimestampMask = ~0ull;
+static bool sVkRenderPipelineTimer = false;
+static bool sVkComputePipelineTimer = false;
 
 
 struct SwapChainSupportDetails
@@ -138,6 +690,20 @@ struct SwapChainFormats
     VkColorSpaceKHR colorSpace;
 };
 
+// Written in front of the vkGetPipelineCacheData blob. Blobs from another device
+// or driver are thrown away on load instead of being handed to the driver.
+struct PipelineCacheFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendorID;
+    uint32_t deviceID;
+    uint32_t driverVersion;
+    uint32_t padding;
+    uint64_t dataSize;
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+};
+
 static constexpr uint32_t sFormatFlagBits =
     VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BIT |
     VK_FORMAT_FEATURE_BLIT_SRC_BIT |
@@ -170,14 +736,14 @@ static const VkValidationFeatureEnableEXT sEnabledValidationFeatures[] =
 static const char* sDeviceExtensions[] =
 {
     VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-    // Cannot use, renderdoc stops working
+    // Cannot use by default, renderdoc stops working. Added with useShaderObjects when supported.
     // VK_EXT_SHADER_OBJECT_EXTENSION_NAME,
-    // VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME,
+    // VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME is added when useDescriptorBuffer is set and supported.
 
     //VK_EXT_VERTEX_INPUT_DYNAMIC_STATE_EXTENSION_NAME,
 
     // VK_KHR_MAINTENANCE1_EXTENSION_NAME
-    // VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME
+    // VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME is added when supported, see usePushDescriptors.
 };
 
 
@@ -196,6 +762,43 @@ static const char* sDefaultValidationLayers[] =
     //"VK_LAYER_LUNARG_api_dump"
 };
 
+// Swapchain extension is only required when there is a surface to present to.
+static std::vector<const char*> sGetRequiredDeviceExtensions()
+{
+    std::vector<const char*> extensions;
+    for(const char* extension : sDeviceExtensions)
+    {
+        if(sVkHeadless && strcmp(extension, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0)
+            continue;
+        extensions.push_back(extension);
+    }
+    if(sVkPushDescriptorsSupported)
+    {
+        extensions.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+    }
+    if(sVkDescriptorBufferSupported)
+    {
+        extensions.push_back(VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME);
+    }
+    if(sVkShaderObjectsSupported)
+    {
+        extensions.push_back(VK_EXT_SHADER_OBJECT_EXTENSION_NAME);
+    }
+    return extensions;
+}
+
+static const char* sGetDeviceTypeText(VkPhysicalDeviceType deviceType)
+{
+    switch(deviceType)
+    {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: return "discrete";
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: return "integrated";
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: return "virtual";
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: return "cpu";
+        default: return "other";
+    }
+}
+
 static void sSetObjectName(uint64_t object, VkDebugReportObjectTypeEXT objectType, const char* name)
 {
     // Check for a valid function pointer
@@ -289,6 +892,52 @@ static SwapChainSupportDetails sQuerySwapChainSupport(VkPhysicalDevice physicalD
     return details;
 }
 
+// Returns family that has transfer but not graphics, preferring one without compute, or -1.
+static int sFindTransferQueueFamily(VkPhysicalDevice physicalDevice, uint32_t graphicsFamilyIndex)
+{
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    ASSERT(queueFamilyCount < 256);
+    VkQueueFamilyProperties queueFamilies[256];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies);
+
+    int index = -1;
+    for (uint32_t i = 0; i < queueFamilyCount; ++i)
+    {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        if(i == graphicsFamilyIndex || queueFamilies[i].queueCount == 0)
+            continue;
+        if((flags & VK_QUEUE_TRANSFER_BIT) == 0 || (flags & VK_QUEUE_GRAPHICS_BIT) != 0)
+            continue;
+
+        if((flags & VK_QUEUE_COMPUTE_BIT) == 0)
+            return i;
+        if(index == -1)
+            index = i;
+    }
+    return index;
+}
+
+// Returns family that has compute but not graphics, or -1.
+static int sFindComputeQueueFamily(VkPhysicalDevice physicalDevice, uint32_t graphicsFamilyIndex)
+{
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    ASSERT(queueFamilyCount < 256);
+    VkQueueFamilyProperties queueFamilies[256];
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies);
+
+    for (uint32_t i = 0; i < queueFamilyCount; ++i)
+    {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        if(i == graphicsFamilyIndex || queueFamilies[i].queueCount == 0)
+            continue;
+        if((flags & VK_QUEUE_COMPUTE_BIT) != 0 && (flags & VK_QUEUE_GRAPHICS_BIT) == 0)
+            return i;
+    }
+    return -1;
+}
+
 // Returns index that has all bits (graphics, compute and transfer) and supports present.
 static int sFindQueueFamilies(VkPhysicalDevice physicalDevice, VkSurfaceKHR surface)
 {
@@ -307,6 +956,10 @@ static int sFindQueueFamilies(VkPhysicalDevice physicalDevice, VkSurfaceKHR surf
         if ((queueFamilies[i].queueFlags & queueBits) != queueBits)
             continue;
 
+        // Headless has nothing to present to.
+        if(!surface)
+            return i;
+
         VkBool32 presentSupport = false;
         vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupport);
 
@@ -326,6 +979,11 @@ static void sDestroySwapchain()
     sVkSwapchainCount = 0u;
     sVkSwapchainWidth = sVkSwapchainHeight = 0u;
 
+    for(Image& image : sVkOffscreenImages)
+    {
+        destroyImage(image);
+    }
+
     if(sVkSwapchain != VK_NULL_HANDLE)
         vkDestroySwapchainKHR(sVkDevice, sVkSwapchain, nullptr);
     sVkSwapchain = VK_NULL_HANDLE;
@@ -341,9 +999,8 @@ static VkSemaphore sCreateSemaphore()
     return semaphore;
 }
 
-static VkCommandPool sCreateCommandPool()
+static VkCommandPool sCreateCommandPool(uint32_t familyIndex)
 {
-    uint32_t familyIndex = sVkQueueIndex;
     VkCommandPoolCreateInfo poolCreateInfo = { VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
     poolCreateInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT; // | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
     //poolCreateInfo.flags = 0; //VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
@@ -372,15 +1029,41 @@ static VkQueryPool sCreateQueryPool(uint32_t queryCount)
 }
 
 
-static VkFence sCreateFence()
+static VkSemaphore sCreateTimelineSemaphore(uint64_t initialValue)
 {
-    VkFenceCreateInfo createInfo = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-    createInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    VkSemaphoreTypeCreateInfo typeInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = initialValue,
+    };
+    VkSemaphoreCreateInfo semaphoreInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+    semaphoreInfo.pNext = &typeInfo;
 
-    VkFence result = {};
-    VK_CHECK_CALL(vkCreateFence(sVkDevice, &createInfo, nullptr, &result));
-    ASSERT(result);
-    return result;
+    VkSemaphore semaphore = {};
+    VK_CHECK_CALL(vkCreateSemaphore(sVkDevice, &semaphoreInfo, nullptr, &semaphore));
+    ASSERT(semaphore);
+    return semaphore;
+}
+
+static bool sWaitTimelineSemaphore(VkSemaphore semaphore, uint64_t value, uint64_t timeoutNs)
+{
+    if(value == 0)
+    {
+        return true;
+    }
+    VkSemaphoreWaitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &semaphore,
+        .pValues = &value,
+    };
+    VkResult res = vkWaitSemaphores(sVkDevice, &waitInfo, timeoutNs);
+    if(res == VK_TIMEOUT)
+    {
+        return false;
+    }
+    VK_CHECK_CALL(res);
+    return res == VK_SUCCESS;
 }
 
 
@@ -483,20 +1166,25 @@ static bool sCreatePhysicalDevice(bool useIntegratedGpu)
 
     VkPhysicalDevice primary = nullptr;
     VkPhysicalDevice secondary = nullptr;
+    // Cpu and virtual devices, only used headless when there are no gpus.
+    VkPhysicalDevice fallback = nullptr;
 
     int primaryQueueIndex = -1;
     int secondaryQueueIndex = -1;
+    int fallbackQueueIndex = -1;
 
+    std::vector<const char*> requiredExtensions = sGetRequiredDeviceExtensions();
 
     for(uint32_t i = 0; i < count; ++i)
     {
-        int requiredExtensionCount = ARRAYSIZES(sDeviceExtensions);
+        int requiredExtensionCount = int(requiredExtensions.size());
 
         VkPhysicalDeviceProperties prop;
         VkPhysicalDevice physicalDevice = devices[i];
         vkGetPhysicalDeviceProperties(physicalDevice, &prop);
-        if(!(prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
-                 prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU))
+        bool isGpu = prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
+            prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU;
+        if(!isGpu && !sVkHeadless)
         {
             printf("Not discrete nor integrated gpu\n");
             continue;
@@ -520,12 +1208,15 @@ static bool sCreatePhysicalDevice(bool useIntegratedGpu)
             printf("No timestamp and queries for %s\n", prop.deviceName);
             continue;
         }
-        SwapChainSupportDetails swapChainSupport = sQuerySwapChainSupport(physicalDevice, sVkSurface);
-        bool swapChainAdequate = swapChainSupport.formatCount > 0 && swapChainSupport.presentModeCount > 0;
-        if(!swapChainAdequate)
+        if(sVkSurface)
         {
-            printf("No swapchain for: %s\n", prop.deviceName);
-            continue;
+            SwapChainSupportDetails swapChainSupport = sQuerySwapChainSupport(physicalDevice, sVkSurface);
+            bool swapChainAdequate = swapChainSupport.formatCount > 0 && swapChainSupport.presentModeCount > 0;
+            if(!swapChainAdequate)
+            {
+                printf("No swapchain for: %s\n", prop.deviceName);
+                continue;
+            }
         }
         uint32_t formatIndex = ~0u;
 
@@ -566,7 +1257,7 @@ static bool sCreatePhysicalDevice(bool useIntegratedGpu)
                 &extensionCount,
                 availableExtensions);
 
-            for (const char* requiredExtension : sDeviceExtensions)
+            for (const char* requiredExtension : requiredExtensions)
             {
                 for (const auto &extension: availableExtensions)
                 {
@@ -589,13 +1280,21 @@ static bool sCreatePhysicalDevice(bool useIntegratedGpu)
             primaryQueueIndex = queueIndex;
             break;
         }
-        else if(!secondary &&
-                (prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU ||
-                 prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU))
+        else if(!secondary && isGpu)
         {
             secondary = devices[i];
             secondaryQueueIndex = queueIndex;
         }
+        else if(!fallback && !isGpu)
+        {
+            fallback = devices[i];
+            fallbackQueueIndex = queueIndex;
+        }
+    }
+    if(!secondary && fallback)
+    {
+        secondary = fallback;
+        secondaryQueueIndex = fallbackQueueIndex;
     }
     if(!primary && !secondary)
     {
@@ -616,24 +1315,43 @@ static bool sCreatePhysicalDevice(bool useIntegratedGpu)
     VkPhysicalDeviceProperties prop;
     vkGetPhysicalDeviceProperties(sVkPhysicalDevice, &prop);
 
-    const char *typeText = prop.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU ? "discrete" : "integrated";
+    const char *typeText = sGetDeviceTypeText(prop.deviceType);
     printf("Picking %s device: %s\n", typeText, prop.deviceName);
     return true;
 }
 
 
-bool sCreateDeviceWithQueues()
+static bool sFindSwapchainFormats()
 {
-    SwapChainSupportDetails swapChainSupport = sQuerySwapChainSupport(sVkPhysicalDevice, sVkSurface);
-    bool swapChainAdequate = swapChainSupport.formatCount > 0 && swapChainSupport.presentModeCount > 0;
-    if(!swapChainAdequate)
-        return false;
-
     sVkSwapchainFormats.presentColorFormat = VK_FORMAT_UNDEFINED;
     sVkSwapchainFormats.depthFormat = sDefaultPresent[0].depth;
     sVkSwapchainFormats.colorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
     sVkSwapchainFormats.defaultColorFormat = VK_FORMAT_UNDEFINED;
 
+    if(!sVkSurface)
+    {
+        // Offscreen present image only needs to be renderable and blittable.
+        for (const auto& format : sDefaultPresent)
+        {
+            if(format.colorSpace != VK_COLOR_SPACE_SRGB_NONLINEAR_KHR)
+                continue;
+            VkFormatProperties formatProperties;
+            vkGetPhysicalDeviceFormatProperties(sVkPhysicalDevice, format.color, &formatProperties);
+            if(((formatProperties.optimalTilingFeatures) & sFormatFlagBits) == sFormatFlagBits)
+            {
+                sVkSwapchainFormats.presentColorFormat = format.color;
+                sVkSwapchainFormats.depthFormat = format.depth;
+                break;
+            }
+        }
+        return sVkSwapchainFormats.presentColorFormat != VK_FORMAT_UNDEFINED;
+    }
+
+    SwapChainSupportDetails swapChainSupport = sQuerySwapChainSupport(sVkPhysicalDevice, sVkSurface);
+    bool swapChainAdequate = swapChainSupport.formatCount > 0 && swapChainSupport.presentModeCount > 0;
+    if(!swapChainAdequate)
+        return false;
+
     for(uint32_t i = 0; i < swapChainSupport.formatCount && sVkSwapchainFormats.presentColorFormat == VK_FORMAT_UNDEFINED; ++i)
     {
         for (const auto& format : sDefaultPresent)
@@ -658,8 +1376,78 @@ FoundSwapChain:
         sVkSwapchainFormats.colorSpace = sDefaultPresent[0].colorSpace;
         sVkSwapchainFormats.depthFormat = sDefaultPresent[0].depth;
     }
-    ASSERT(sVkSwapchainFormats.presentColorFormat != VK_FORMAT_UNDEFINED);
-    if(sVkSwapchainFormats.presentColorFormat == VK_FORMAT_UNDEFINED)
+    return sVkSwapchainFormats.presentColorFormat != VK_FORMAT_UNDEFINED;
+}
+
+static bool sHasDeviceExtension(VkPhysicalDevice physicalDevice, const char* extensionName)
+{
+    uint32_t extensionCount = 0;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> extensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, extensions.data());
+    for(const VkExtensionProperties& extension : extensions)
+    {
+        if(strcmp(extension.extensionName, extensionName) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool sHasDescriptorBufferSupport(VkPhysicalDevice physicalDevice)
+{
+    if(!sHasDeviceExtension(physicalDevice, VK_EXT_DESCRIPTOR_BUFFER_EXTENSION_NAME))
+    {
+        return false;
+    }
+    VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT };
+    VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+    features12.pNext = &descriptorBufferFeatures;
+    VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+    features2.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+    return descriptorBufferFeatures.descriptorBuffer && features12.bufferDeviceAddress;
+}
+
+static bool sHasShaderObjectSupport(VkPhysicalDevice physicalDevice)
+{
+    if(!sHasDeviceExtension(physicalDevice, VK_EXT_SHADER_OBJECT_EXTENSION_NAME))
+    {
+        return false;
+    }
+    VkPhysicalDeviceShaderObjectFeaturesEXT shaderObjectFeatures = {
+        VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_OBJECT_FEATURES_EXT };
+    VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+    features2.pNext = &shaderObjectFeatures;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+    return shaderObjectFeatures.shaderObject;
+}
+
+static bool sHasBindlessSupport(VkPhysicalDevice physicalDevice)
+{
+    VkPhysicalDeviceVulkan12Features features12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES };
+    VkPhysicalDeviceFeatures2 features2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2 };
+    features2.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+
+    return features12.shaderSampledImageArrayNonUniformIndexing
+        && features12.shaderStorageImageArrayNonUniformIndexing
+        && features12.shaderStorageBufferArrayNonUniformIndexing
+        && features12.descriptorBindingSampledImageUpdateAfterBind
+        && features12.descriptorBindingStorageImageUpdateAfterBind
+        && features12.descriptorBindingStorageBufferUpdateAfterBind
+        && features12.descriptorBindingUpdateUnusedWhilePending
+        && features12.descriptorBindingPartiallyBound
+        && features12.runtimeDescriptorArray;
+}
+
+bool sCreateDeviceWithQueues()
+{
+    bool foundFormats = sFindSwapchainFormats();
+    ASSERT(foundFormats);
+    if(!foundFormats)
     {
         return false;
     }
@@ -678,19 +1466,73 @@ FoundSwapChain:
 
     ASSERT_RETURN_FALSE(sVkSwapchainFormats.defaultColorFormat != VK_FORMAT_UNDEFINED);
 
-    float queuePriority = 1.0f;
-    VkDeviceQueueCreateInfo queueCreateInfo = {};
-    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queueCreateInfo.queueFamilyIndex = sVkQueueIndex;
-    queueCreateInfo.queueCount = 1;
-    queueCreateInfo.pQueuePriorities = &queuePriority;
-
-    /*
-    VkPhysicalDeviceDescriptorIndexingFeatures descriptorIndexingFeatures = {
-        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
-        .pNext = nullptr,
+    sVkTransferQueueIndex = ~0u;
+    if(sVkInstanceBuilder.vulkanInstanceParams.useAsyncTransferQueue)
+    {
+        int transferIndex = sFindTransferQueueFamily(sVkPhysicalDevice, sVkQueueIndex);
+        if(transferIndex == -1)
+        {
+            printf("No separate transfer queue family, uploads use the graphics queue\n");
+        }
+        else
+        {
+            sVkTransferQueueIndex = uint32_t(transferIndex);
+        }
+    }
+
+    sVkComputeQueueIndex = ~0u;
+    if(sVkInstanceBuilder.vulkanInstanceParams.useAsyncComputeQueue)
+    {
+        int computeIndex = sFindComputeQueueFamily(sVkPhysicalDevice, sVkQueueIndex);
+        if(computeIndex == -1)
+        {
+            printf("No separate compute queue family, async compute uses the graphics queue\n");
+        }
+        else
+        {
+            sVkComputeQueueIndex = uint32_t(computeIndex);
+        }
+    }
+
+    // Transfer and compute can end up on the same family, they get separate queues if it has them.
+    uint32_t sharedFamilyQueueCount = 1;
+    if(sVkComputeQueueIndex != ~0u && sVkComputeQueueIndex == sVkTransferQueueIndex)
+    {
+        uint32_t queueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(sVkPhysicalDevice, &queueFamilyCount, nullptr);
+        ASSERT(queueFamilyCount < 256);
+        VkQueueFamilyProperties queueFamilies[256];
+        vkGetPhysicalDeviceQueueFamilyProperties(sVkPhysicalDevice, &queueFamilyCount, queueFamilies);
+        sharedFamilyQueueCount = MIN_VALUE(queueFamilies[sVkComputeQueueIndex].queueCount, 2u);
+    }
+
+    float queuePriorities[] = { 1.0f, 1.0f };
+    VkDeviceQueueCreateInfo queueCreateInfos[3] = {};
+    uint32_t queueCreateInfoCount = 0;
+    queueCreateInfos[queueCreateInfoCount++] = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = sVkQueueIndex,
+        .queueCount = 1,
+        .pQueuePriorities = queuePriorities,
     };
-    */
+    if(sVkTransferQueueIndex != ~0u)
+    {
+        queueCreateInfos[queueCreateInfoCount++] = {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = sVkTransferQueueIndex,
+            .queueCount = sVkTransferQueueIndex == sVkComputeQueueIndex ? sharedFamilyQueueCount : 1,
+            .pQueuePriorities = queuePriorities,
+        };
+    }
+    if(sVkComputeQueueIndex != ~0u && sVkComputeQueueIndex != sVkTransferQueueIndex)
+    {
+        queueCreateInfos[queueCreateInfoCount++] = {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .queueFamilyIndex = sVkComputeQueueIndex,
+            .queueCount = 1,
+            .pQueuePriorities = queuePriorities,
+        };
+    }
 
     static constexpr VkPhysicalDeviceFeatures deviceFeatures = {
         .fillModeNonSolid = VK_TRUE,
@@ -703,31 +1545,111 @@ FoundSwapChain:
         .synchronization2 = VK_TRUE,
         .dynamicRendering = VK_TRUE,
     };
-    /*
-    static constexpr VkPhysicalDeviceVulkan12Features deviceFeatures12 = {
+    VkPhysicalDeviceVulkan12Features deviceFeatures12 = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
         .pNext = (void *) &deviceFeatures13,
-        .descriptorBindingUniformBufferUpdateAfterBind = VK_TRUE,
-        .descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
-        .descriptorBindingStorageImageUpdateAfterBind = VK_TRUE,
-        .descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE,
-        .descriptorBindingUniformTexelBufferUpdateAfterBind = VK_TRUE,
-        .descriptorBindingStorageTexelBufferUpdateAfterBind = VK_TRUE,
-        .descriptorBindingUpdateUnusedWhilePending = VK_TRUE,
-        .descriptorBindingPartiallyBound = VK_TRUE,
+        .timelineSemaphore = VK_TRUE,
     };
-*/
-    static constexpr VkPhysicalDeviceFeatures2 physicalDeviceFeatures2 = {
+
+    sVkDescriptorBufferSupported = false;
+    if(sVkInstanceBuilder.vulkanInstanceParams.useDescriptorBuffer)
+    {
+        sVkDescriptorBufferSupported = sHasDescriptorBufferSupport(sVkPhysicalDevice);
+        if(sVkDescriptorBufferSupported)
+        {
+            deviceFeatures12.bufferDeviceAddress = VK_TRUE;
+            sVkDescriptorBufferProperties = VkPhysicalDeviceDescriptorBufferPropertiesEXT{
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_PROPERTIES_EXT };
+            VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+            properties2.pNext = &sVkDescriptorBufferProperties;
+            vkGetPhysicalDeviceProperties2(sVkPhysicalDevice, &properties2);
+            sVkDescriptorBufferProperties.pNext = nullptr;
+        }
+        else
+        {
+            printf("No descriptor buffer support, descriptor sets use pools\n");
+        }
+    }
+
+    sVkBindlessSupported = false;
+    if(sVkInstanceBuilder.vulkanInstanceParams.useBindless && sVkDescriptorBufferSupported)
+    {
+        // Bindless heap is an update after bind pool set, those cannot be mixed with descriptor buffers.
+        printf("Bindless heap is not supported with descriptor buffers, bindless heap is disabled\n");
+    }
+    else if(sVkInstanceBuilder.vulkanInstanceParams.useBindless)
+    {
+        sVkBindlessSupported = sHasBindlessSupport(sVkPhysicalDevice);
+        if(sVkBindlessSupported)
+        {
+            deviceFeatures12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+            deviceFeatures12.shaderStorageImageArrayNonUniformIndexing = VK_TRUE;
+            deviceFeatures12.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+            deviceFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+            deviceFeatures12.descriptorBindingStorageImageUpdateAfterBind = VK_TRUE;
+            deviceFeatures12.descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+            deviceFeatures12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+            deviceFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
+            deviceFeatures12.runtimeDescriptorArray = VK_TRUE;
+        }
+        else
+        {
+            printf("No descriptor indexing support, bindless heap is disabled\n");
+        }
+    }
+
+    sVkPushDescriptorsSupported = false;
+    if(sVkInstanceBuilder.vulkanInstanceParams.usePushDescriptors)
+    {
+        sVkPushDescriptorsSupported = sHasDeviceExtension(sVkPhysicalDevice, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+        if(!sVkPushDescriptorsSupported)
+        {
+            printf("No push descriptor support, push set layouts cannot be created\n");
+        }
+    }
+
+    sVkShaderObjectsSupported = false;
+    if(sVkInstanceBuilder.vulkanInstanceParams.useShaderObjects)
+    {
+        sVkShaderObjectsSupported = sHasShaderObjectSupport(sVkPhysicalDevice);
+        if(!sVkShaderObjectsSupported)
+        {
+            printf("No shader object support, graphics programs use pipelines\n");
+        }
+    }
+
+    // Optional feature structs go in front of the 1.2 and 1.3 ones.
+    void* featureChain = (void *) &deviceFeatures12;
+    VkPhysicalDeviceDescriptorBufferFeaturesEXT descriptorBufferFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_BUFFER_FEATURES_EXT,
+        .descriptorBuffer = VK_TRUE,
+    };
+    if(sVkDescriptorBufferSupported)
+    {
+        descriptorBufferFeatures.pNext = featureChain;
+        featureChain = &descriptorBufferFeatures;
+    }
+    VkPhysicalDeviceShaderObjectFeaturesEXT shaderObjectFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SHADER_OBJECT_FEATURES_EXT,
+        .shaderObject = VK_TRUE,
+    };
+    if(sVkShaderObjectsSupported)
+    {
+        shaderObjectFeatures.pNext = featureChain;
+        featureChain = &shaderObjectFeatures;
+    }
+
+    const VkPhysicalDeviceFeatures2 physicalDeviceFeatures2 = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
-        .pNext = (void *) &deviceFeatures13,
+        .pNext = featureChain,
         .features = deviceFeatures,
     };
 
     VkDeviceCreateInfo createInfo = { .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
     createInfo.pNext = &physicalDeviceFeatures2;
 
-    createInfo.queueCreateInfoCount = 1;
-    createInfo.pQueueCreateInfos = &queueCreateInfo;
+    createInfo.queueCreateInfoCount = queueCreateInfoCount;
+    createInfo.pQueueCreateInfos = queueCreateInfos;
 
 
 
@@ -735,8 +1657,9 @@ FoundSwapChain:
     /*
         deviceExts.push_back(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
     */
-    createInfo.enabledExtensionCount = ARRAYSIZES(sDeviceExtensions);
-    createInfo.ppEnabledExtensionNames = sDeviceExtensions;
+    std::vector<const char*> deviceExtensions = sGetRequiredDeviceExtensions();
+    createInfo.enabledExtensionCount = uint32_t(deviceExtensions.size());
+    createInfo.ppEnabledExtensionNames = deviceExtensions.empty() ? nullptr : deviceExtensions.data();
 
 
     createInfo.ppEnabledLayerNames = sVkInstanceBuilder.m_createInfo.ppEnabledLayerNames;
@@ -747,9 +1670,70 @@ FoundSwapChain:
 
     ASSERT_RETURN_FALSE(sVkDevice);
 
-    vkGetDeviceQueue(sVkDevice, 0, sVkQueueIndex, &sVkQueue);
+    vkGetDeviceQueue(sVkDevice, sVkQueueIndex, 0, &sVkQueue);
     ASSERT_RETURN_FALSE(sVkQueue);
 
+    sVkCmdPushDescriptorSet = nullptr;
+    if(sVkPushDescriptorsSupported)
+    {
+        sVkCmdPushDescriptorSet = (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdPushDescriptorSetKHR");
+        ASSERT_RETURN_FALSE(sVkCmdPushDescriptorSet);
+    }
+
+    if(sVkDescriptorBufferSupported)
+    {
+        sVkGetDescriptorSetLayoutSize = (PFN_vkGetDescriptorSetLayoutSizeEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkGetDescriptorSetLayoutSizeEXT");
+        sVkGetDescriptorSetLayoutBindingOffset = (PFN_vkGetDescriptorSetLayoutBindingOffsetEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkGetDescriptorSetLayoutBindingOffsetEXT");
+        sVkGetDescriptor = (PFN_vkGetDescriptorEXT)vkGetDeviceProcAddr(sVkDevice, "vkGetDescriptorEXT");
+        sVkCmdBindDescriptorBuffers = (PFN_vkCmdBindDescriptorBuffersEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdBindDescriptorBuffersEXT");
+        sVkCmdSetDescriptorBufferOffsets = (PFN_vkCmdSetDescriptorBufferOffsetsEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetDescriptorBufferOffsetsEXT");
+        ASSERT_RETURN_FALSE(sVkGetDescriptorSetLayoutSize && sVkGetDescriptorSetLayoutBindingOffset
+            && sVkGetDescriptor && sVkCmdBindDescriptorBuffers && sVkCmdSetDescriptorBufferOffsets);
+    }
+
+    sVkShaderObjectFns = ShaderObjectFunctions{};
+    if(sVkShaderObjectsSupported)
+    {
+        ShaderObjectFunctions& fns = sVkShaderObjectFns;
+        fns.createShaders = (PFN_vkCreateShadersEXT)vkGetDeviceProcAddr(sVkDevice, "vkCreateShadersEXT");
+        fns.destroyShader = (PFN_vkDestroyShaderEXT)vkGetDeviceProcAddr(sVkDevice, "vkDestroyShaderEXT");
+        fns.cmdBindShaders = (PFN_vkCmdBindShadersEXT)vkGetDeviceProcAddr(sVkDevice, "vkCmdBindShadersEXT");
+        fns.cmdSetVertexInput = (PFN_vkCmdSetVertexInputEXT)vkGetDeviceProcAddr(sVkDevice, "vkCmdSetVertexInputEXT");
+        fns.cmdSetPolygonMode = (PFN_vkCmdSetPolygonModeEXT)vkGetDeviceProcAddr(sVkDevice, "vkCmdSetPolygonModeEXT");
+        fns.cmdSetRasterizationSamples = (PFN_vkCmdSetRasterizationSamplesEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetRasterizationSamplesEXT");
+        fns.cmdSetSampleMask = (PFN_vkCmdSetSampleMaskEXT)vkGetDeviceProcAddr(sVkDevice, "vkCmdSetSampleMaskEXT");
+        fns.cmdSetAlphaToCoverageEnable = (PFN_vkCmdSetAlphaToCoverageEnableEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetAlphaToCoverageEnableEXT");
+        fns.cmdSetColorBlendEnable = (PFN_vkCmdSetColorBlendEnableEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetColorBlendEnableEXT");
+        fns.cmdSetColorBlendEquation = (PFN_vkCmdSetColorBlendEquationEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetColorBlendEquationEXT");
+        fns.cmdSetColorWriteMask = (PFN_vkCmdSetColorWriteMaskEXT)vkGetDeviceProcAddr(
+            sVkDevice, "vkCmdSetColorWriteMaskEXT");
+        ASSERT_RETURN_FALSE(fns.createShaders && fns.destroyShader && fns.cmdBindShaders
+            && fns.cmdSetVertexInput && fns.cmdSetPolygonMode && fns.cmdSetRasterizationSamples
+            && fns.cmdSetSampleMask && fns.cmdSetAlphaToCoverageEnable && fns.cmdSetColorBlendEnable
+            && fns.cmdSetColorBlendEquation && fns.cmdSetColorWriteMask);
+    }
+
+    if(sVkTransferQueueIndex != ~0u)
+    {
+        vkGetDeviceQueue(sVkDevice, sVkTransferQueueIndex, 0, &sVkTransferQueue);
+        ASSERT_RETURN_FALSE(sVkTransferQueue);
+    }
+    if(sVkComputeQueueIndex != ~0u)
+    {
+        uint32_t queueIndex = sVkComputeQueueIndex == sVkTransferQueueIndex ? sharedFamilyQueueCount - 1 : 0;
+        vkGetDeviceQueue(sVkDevice, sVkComputeQueueIndex, queueIndex, &sVkComputeQueue);
+        ASSERT_RETURN_FALSE(sVkComputeQueue);
+    }
+
     // Init VMA
     {
         VmaVulkanFunctions vulkanFunctions = {};
@@ -762,6 +1746,10 @@ FoundSwapChain:
         allocatorCreateInfo.device = sVkDevice;
         allocatorCreateInfo.instance = sVkInstance;
         allocatorCreateInfo.pVulkanFunctions = &vulkanFunctions;
+        if(sVkDescriptorBufferSupported)
+        {
+            allocatorCreateInfo.flags |= VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+        }
 
         VK_CHECK_CALL(vmaCreateAllocator(&allocatorCreateInfo, &sVkAllocator));
         if (!sVkAllocator)
@@ -775,8 +1763,33 @@ FoundSwapChain:
 
 
 
+static bool sCreateOffscreenImages(int width, int height)
+{
+    ASSERT_RETURN_FALSE(width > 0 && height > 0);
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        destroyImage(sVkOffscreenImages[i]);
+        if(!createImage(uint32_t(width), uint32_t(height), sVkSwapchainFormats.presentColorFormat,
+            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+            "Offscreen present image", sVkOffscreenImages[i]))
+        {
+            printf("Failed to create offscreen present image\n");
+            return false;
+        }
+        sVkSwapchainImages[i] = sVkOffscreenImages[i].image;
+    }
+    sVkSwapchainCount = CarpVk::FramesInFlight;
+    sVkSwapchainWidth = width;
+    sVkSwapchainHeight = height;
+    return true;
+}
+
 static bool sCreateSwapchain(VSyncType vsyncMode, int width, int height)
 {
+    if(sVkHeadless)
+    {
+        return sCreateOffscreenImages(width, height);
+    }
     VkPresentModeKHR findPresentMode = VkPresentModeKHR::VK_PRESENT_MODE_FIFO_KHR;
     switch (vsyncMode)
     {
@@ -896,1333 +1909,5306 @@ static bool sCreateSwapchain(VSyncType vsyncMode, int width, int height)
     return true;
 }
 
-static bool sCreateDescriptorPool()
+static bool sCreateBindlessHeap()
 {
-    VkDevice device = getVkDevice();
-
-
-    static constexpr int MAX_SIZES = 4096;
+    VkPhysicalDeviceVulkan12Properties properties12 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES };
+    VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+    properties2.pNext = &properties12;
+    vkGetPhysicalDeviceProperties2(sVkPhysicalDevice, &properties2);
+
+    uint32_t sampledLimit = MIN_VALUE(properties12.maxDescriptorSetUpdateAfterBindSampledImages,
+        properties12.maxPerStageDescriptorUpdateAfterBindSampledImages);
+    sampledLimit = MIN_VALUE(sampledLimit, properties12.maxDescriptorSetUpdateAfterBindSamplers);
+    sampledLimit = MIN_VALUE(sampledLimit, properties12.maxPerStageDescriptorUpdateAfterBindSamplers);
+    uint32_t storageImageLimit = MIN_VALUE(properties12.maxDescriptorSetUpdateAfterBindStorageImages,
+        properties12.maxPerStageDescriptorUpdateAfterBindStorageImages);
+    uint32_t storageBufferLimit = MIN_VALUE(properties12.maxDescriptorSetUpdateAfterBindStorageBuffers,
+        properties12.maxPerStageDescriptorUpdateAfterBindStorageBuffers);
+
+    sVkBindlessCapacities[BindlessBindingSampledImage] =
+        MIN_VALUE(uint32_t(CarpVk::BindlessSampledImageCount), sampledLimit);
+    sVkBindlessCapacities[BindlessBindingStorageImage] =
+        MIN_VALUE(uint32_t(CarpVk::BindlessStorageImageCount), storageImageLimit);
+    sVkBindlessCapacities[BindlessBindingStorageBuffer] =
+        MIN_VALUE(uint32_t(CarpVk::BindlessStorageBufferCount), storageBufferLimit);
+
+    static constexpr VkDescriptorType bindingTypes[BindlessBindingCount] = {
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    };
 
-    VkDescriptorPoolSize poolSizes[] =
+    VkDescriptorSetLayoutBinding setBindings[BindlessBindingCount] = {};
+    VkDescriptorBindingFlags setBindingFlags[BindlessBindingCount] = {};
+    VkDescriptorPoolSize poolSizes[BindlessBindingCount] = {};
+    for(uint32_t i = 0; i < BindlessBindingCount; ++i)
     {
-        { .type = VK_DESCRIPTOR_TYPE_SAMPLER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, .descriptorCount = MAX_SIZES },
-        { .type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, .descriptorCount = MAX_SIZES },
+        setBindings[i] = VkDescriptorSetLayoutBinding{
+            .binding = i,
+            .descriptorType = bindingTypes[i],
+            .descriptorCount = sVkBindlessCapacities[i],
+            .stageFlags = VK_SHADER_STAGE_ALL,
+        };
+        setBindingFlags[i] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT
+            | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT
+            | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+        poolSizes[i] = { .type = bindingTypes[i], .descriptorCount = sVkBindlessCapacities[i] };
+    }
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlags = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .pNext = nullptr,
+        .bindingCount = BindlessBindingCount,
+        .pBindingFlags = setBindingFlags,
     };
+    VkDescriptorSetLayoutCreateInfo layoutInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext = &bindingFlags,
+        .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+        .bindingCount = BindlessBindingCount,
+        .pBindings = setBindings,
+    };
+    VK_CHECK_CALL(vkCreateDescriptorSetLayout(sVkDevice, &layoutInfo, nullptr, &sVkBindlessSetLayout));
+    ASSERT_RETURN_FALSE(sVkBindlessSetLayout);
 
-    VkDescriptorPoolCreateInfo poolInfo = {};
-    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    poolInfo.poolSizeCount = ARRAYSIZES(poolSizes);
+    VkDescriptorPoolCreateInfo poolInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    poolInfo.poolSizeCount = BindlessBindingCount;
     poolInfo.pPoolSizes = poolSizes;
-    poolInfo.maxSets = MAX_SIZES;
-    //poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
-    VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr, &sVkDescriptorPool);
-    VK_CHECK_CALL(result);
-    return result == VK_SUCCESS;
+    poolInfo.maxSets = 1;
+    VK_CHECK_CALL(vkCreateDescriptorPool(sVkDevice, &poolInfo, nullptr, &sVkBindlessDescriptorPool));
+    ASSERT_RETURN_FALSE(sVkBindlessDescriptorPool);
+
+    VkDescriptorSetAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocInfo.descriptorPool = sVkBindlessDescriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &sVkBindlessSetLayout;
+    VK_CHECK_CALL(vkAllocateDescriptorSets(sVkDevice, &allocInfo, &sVkBindlessDescriptorSet));
+    ASSERT_RETURN_FALSE(sVkBindlessDescriptorSet);
+
+    printf("Bindless heap: %u sampled images, %u storage images, %u storage buffers\n",
+        sVkBindlessCapacities[BindlessBindingSampledImage],
+        sVkBindlessCapacities[BindlessBindingStorageImage],
+        sVkBindlessCapacities[BindlessBindingStorageBuffer]);
+    return true;
 }
 
-static bool sGetWindowSize(int32_t* w, int32_t* h)
+static void sDestroyBindlessHeap()
 {
-    if(sVkInstanceBuilder.vulkanInstanceParams.getWindowSizeFn)
+    if(sVkBindlessDescriptorPool)
     {
-        sVkInstanceBuilder.vulkanInstanceParams.getWindowSizeFn(
-            w, h,
-            sVkInstanceBuilder.vulkanInstanceParams.userData);
-        return true;
+        vkDestroyDescriptorPool(sVkDevice, sVkBindlessDescriptorPool, nullptr);
     }
-    return false;
+    if(sVkBindlessSetLayout)
+    {
+        vkDestroyDescriptorSetLayout(sVkDevice, sVkBindlessSetLayout, nullptr);
+    }
+    sVkBindlessDescriptorPool = {};
+    sVkBindlessSetLayout = {};
+    sVkBindlessDescriptorSet = {};
+    for(uint32_t i = 0; i < BindlessBindingCount; ++i)
+    {
+        sVkBindlessCapacities[i] = 0;
+        sVkBindlessNextIndices[i] = 0;
+        sVkBindlessFreeIndices[i].clear();
+    }
+    sVkBindlessPendingFrees.clear();
 }
 
-static bool sResizeSwapchain()
+static uint32_t sAllocateBindlessIndex(uint32_t binding)
 {
-    int32_t oldWidth = sVkSwapchainWidth;
-    int32_t oldHeight = sVkSwapchainHeight;
-    if(sGetWindowSize(&sVkSwapchainWidth, &sVkSwapchainHeight))
+    if(!sVkBindlessDescriptorSet)
+    {
+        return ~0u;
+    }
+    std::vector<uint32_t>& freeIndices = sVkBindlessFreeIndices[binding];
+    if(!freeIndices.empty())
+    {
+        uint32_t index = freeIndices.back();
+        freeIndices.pop_back();
+        return index;
+    }
+    if(sVkBindlessNextIndices[binding] >= sVkBindlessCapacities[binding])
     {
+        printf("Bindless heap binding %u is full\n", binding);
+        return ~0u;
     }
+    return sVkBindlessNextIndices[binding]++;
+}
 
-    bool wasInMinimized = false;
-    while (sVkSwapchainWidth == 0 || sVkSwapchainHeight == 0)
+// Index can be reused once the submissions that might read it are done.
+static void sFreeBindlessIndex(uint32_t binding, uint32_t index)
+{
+    if(index == ~0u || !sVkBindlessDescriptorSet)
     {
+        return;
+    }
+    ASSERT(index < sVkBindlessNextIndices[binding]);
+    sVkBindlessPendingFrees.push_back(BindlessPendingFree{
+        .binding = binding,
+        .index = index,
+        .submissionValue = getNextSubmissionValue(),
+    });
+}
 
-        if(sGetWindowSize(&sVkSwapchainWidth, &sVkSwapchainHeight))
+static void sRecycleBindlessIndices()
+{
+    if(sVkBindlessPendingFrees.empty())
+    {
+        return;
+    }
+    uint64_t completedValue = getCompletedSubmissionValue();
+    uint32_t writeIndex = 0;
+    for(const BindlessPendingFree& pending : sVkBindlessPendingFrees)
+    {
+        if(pending.submissionValue <= completedValue)
         {
+            sVkBindlessFreeIndices[pending.binding].push_back(pending.index);
+        }
+        else
+        {
+            sVkBindlessPendingFrees[writeIndex++] = pending;
         }
-
-        //glfwWaitEvents();
-        //glfwGetFramebufferSize(window, &width, &height);
-        wasInMinimized = true;
     }
+    sVkBindlessPendingFrees.resize(writeIndex);
+}
 
-    VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
-    VK_CHECK_CALL(vkQueueWaitIdle(sVkQueue));
-    VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
-    VK_CHECK_CALL(vkQueueWaitIdle(sVkQueue));
-
+static uint32_t sWriteBindlessDescriptor(uint32_t binding, VkDescriptorType descriptorType,
+    const VkDescriptorImageInfo* imageInfo, const VkDescriptorBufferInfo* bufferInfo)
+{
+    uint32_t index = sAllocateBindlessIndex(binding);
+    if(index == ~0u)
+    {
+        return ~0u;
+    }
+    VkWriteDescriptorSet descriptor{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+    descriptor.dstSet = sVkBindlessDescriptorSet;
+    descriptor.dstBinding = binding;
+    descriptor.dstArrayElement = index;
+    descriptor.descriptorCount = 1;
+    descriptor.descriptorType = descriptorType;
+    descriptor.pImageInfo = imageInfo;
+    descriptor.pBufferInfo = bufferInfo;
+    vkUpdateDescriptorSets(sVkDevice, 1, &descriptor, 0, nullptr);
+    return index;
+}
 
+static bool sCreateGenericDescriptorPool(uint32_t maxSets, uint32_t descriptorCount, VkDescriptorPool& outPool)
+{
+    VkDevice device = getVkDevice();
 
-    VkSwapchainKHR oldSwapchain = sVkSwapchain;
+    VkDescriptorPoolSize poolSizes[] =
+    {
+        { .type = VK_DESCRIPTOR_TYPE_SAMPLER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, .descriptorCount = descriptorCount },
+        { .type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, .descriptorCount = descriptorCount },
+    };
 
-    sCreateSwapchain(sVkInstanceBuilder.vulkanInstanceParams.vsyncMode,
-        sVkSwapchainWidth, sVkSwapchainHeight);
+    VkDescriptorPoolCreateInfo poolInfo = {};
+    poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    poolInfo.poolSizeCount = ARRAYSIZES(poolSizes);
+    poolInfo.pPoolSizes = poolSizes;
+    poolInfo.maxSets = maxSets;
+    //poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+    VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr, &outPool);
+    VK_CHECK_CALL(result);
+    return result == VK_SUCCESS;
+}
 
-    vkDestroySwapchainKHR(sVkDevice, oldSwapchain, nullptr);
+static bool sCreateDescriptorPool()
+{
+    static constexpr int MAX_SIZES = 4096;
+    return sCreateGenericDescriptorPool(MAX_SIZES, MAX_SIZES, sVkDescriptorPool);
+}
 
-    if(sVkInstanceBuilder.vulkanInstanceParams.resizedFn)
+// Called after the wait for the slot, none of its sets can be in use anymore.
+static void sResetFrameDescriptorPools(uint32_t frameIndex)
+{
+    FrameDescriptorPools& framePools = sVkFrameDescriptorPools[frameIndex];
+    for(VkDescriptorPool pool : framePools.pools)
     {
-        sVkInstanceBuilder.vulkanInstanceParams.resizedFn(
-            sVkInstanceBuilder.vulkanInstanceParams.userData);
+        VK_CHECK_CALL(vkResetDescriptorPool(sVkDevice, pool, 0));
     }
-    return true;
+    framePools.currentPool = 0;
+    sVkFrameDescriptorBufferSets[frameIndex].clear();
+    sVkFrameDescriptorBufferUsed[frameIndex] = 0;
+    sVkFrameDescriptorBufferGenerations[frameIndex]++;
 }
 
-static BufferCopyRegion sUploadToScratchBuffer(const void *data, size_t size)
+static void sDestroyFrameDescriptorPools()
 {
-    int64_t frameIndex = getFrameIndexWrapped();
-
-    Buffer &scratchBuffer = sVkScratchBuffer[frameIndex];
-    ASSERT(scratchBuffer.data);
-    ASSERT(size > 0);
+    for(FrameDescriptorPools& framePools : sVkFrameDescriptorPools)
+    {
+        for(VkDescriptorPool pool : framePools.pools)
+        {
+            vkDestroyDescriptorPool(sVkDevice, pool, nullptr);
+        }
+        framePools = FrameDescriptorPools{};
+    }
+}
 
-    size_t currentOffset = sVkScratchBufferOffset;
-    size_t roundedUpSize = ((currentOffset + size + 255) & (~(size_t(255)))) - currentOffset;
-    ASSERT(currentOffset + roundedUpSize <= scratchBuffer.size);
+static VkDescriptorSet sMakeDescriptorBufferSetHandle(uint32_t frameSlot, uint32_t generation, uint32_t index)
+{
+    // Slot 0 is persistent, frame sets store frame index + 1. Zero stays a null handle.
+    return (VkDescriptorSet)((uint64_t(frameSlot) << 56) | (uint64_t(generation & 0xff'ffffu) << 32)
+        | uint64_t(index + 1));
+}
 
-    memcpy((unsigned char *)scratchBuffer.data + currentOffset, data, size);
+static DescriptorBufferSet* sGetDescriptorBufferSet(VkDescriptorSet descriptorSet)
+{
+    uint64_t value = (uint64_t)descriptorSet;
+    uint32_t frameSlot = uint32_t(value >> 56);
+    uint32_t generation = uint32_t(value >> 32) & 0xff'ffffu;
+    uint32_t index = uint32_t(value & 0xffff'ffffu) - 1;
+    if(frameSlot > uint32_t(CarpVk::FramesInFlight))
+    {
+        ASSERT(false);
+        return nullptr;
+    }
+    std::vector<DescriptorBufferSet>& sets = frameSlot == 0
+        ? sVkDescriptorBufferSets
+        : sVkFrameDescriptorBufferSets[frameSlot - 1];
+    uint32_t currentGeneration = 0;
+    if(frameSlot == 0 && index < sets.size())
+    {
+        currentGeneration = sets[index].generation;
+    }
+    else if(frameSlot > 0)
+    {
+        currentGeneration = sVkFrameDescriptorBufferGenerations[frameSlot - 1];
+    }
+    // Frame sets are gone once their slot is reset, persistent ones when their layout is destroyed.
+    bool valid = index < sets.size() && sets[index].layout
+        && generation == (currentGeneration & 0xff'ffffu);
+    ASSERT(valid);
+    if(!valid)
+    {
+        return nullptr;
+    }
+    return &sets[index];
+}
 
-    vmaFlushAllocation(sVkAllocator, scratchBuffer.allocation, currentOffset, roundedUpSize);
+// Frees the persistent sets of a destroyed layout, their ranges wait for the frames in flight.
+static void sFreeDescriptorBufferSets(VkDescriptorSetLayout layout)
+{
+    for(uint32_t i = 0; i < sVkDescriptorBufferSets.size(); ++i)
+    {
+        DescriptorBufferSet& set = sVkDescriptorBufferSets[i];
+        if(set.layout != layout)
+            continue;
+        sVkDescriptorBufferPendingRanges.push_back(DescriptorBufferRange{
+            .offset = set.offset,
+            .size = set.size,
+            .submissionValue = getNextSubmissionValue(),
+        });
+        set = DescriptorBufferSet{ .generation = set.generation + 1 };
+        sVkDescriptorBufferFreeSets.push_back(i);
+    }
+}
 
-    sVkScratchBufferOffset += roundedUpSize;
+static void sRecycleDescriptorBufferRanges()
+{
+    if(sVkDescriptorBufferPendingRanges.empty())
+    {
+        return;
+    }
+    uint64_t completedValue = getCompletedSubmissionValue();
+    uint32_t writeIndex = 0;
+    for(const DescriptorBufferRange& pending : sVkDescriptorBufferPendingRanges)
+    {
+        if(pending.submissionValue <= completedValue)
+            sVkDescriptorBufferFreeRanges.push_back(pending);
+        else
+            sVkDescriptorBufferPendingRanges[writeIndex++] = pending;
+    }
+    sVkDescriptorBufferPendingRanges.resize(writeIndex);
 
-    return { .srcOffset = currentOffset, .size = roundedUpSize };
+    // Merge touching ranges so that larger layouts fit again.
+    std::sort(sVkDescriptorBufferFreeRanges.begin(), sVkDescriptorBufferFreeRanges.end(),
+        [](const DescriptorBufferRange& a, const DescriptorBufferRange& b)
+    {
+        return a.offset < b.offset;
+    });
+    writeIndex = 0;
+    for(const DescriptorBufferRange& range : sVkDescriptorBufferFreeRanges)
+    {
+        if(writeIndex > 0)
+        {
+            DescriptorBufferRange& last = sVkDescriptorBufferFreeRanges[writeIndex - 1];
+            if(last.offset + last.size == range.offset)
+            {
+                last.size += range.size;
+                continue;
+            }
+        }
+        sVkDescriptorBufferFreeRanges[writeIndex++] = range;
+    }
+    sVkDescriptorBufferFreeRanges.resize(writeIndex);
 }
 
-
-static void sUploadScratchBufferToGpuBuffer(Buffer &gpuBuffer, const BufferCopyRegion &region)
+static VkDeviceSize sAlignDescriptorBufferOffset(VkDeviceSize offset)
 {
-    int64_t frameIndex = getFrameIndexWrapped();
-    Buffer &scratchBuffer = sVkScratchBuffer[frameIndex];
-    ASSERT(scratchBuffer.data);
-    ASSERT(region.srcOffset + region.size <= scratchBuffer.size);
-    ASSERT(region.dstOffset + region.size <= gpuBuffer.size);
-
-    VkBufferCopy copyRegion = {
-        .srcOffset = region.srcOffset,
-        .dstOffset = region.dstOffset,
-        .size = VkDeviceSize(region.size)
-    };
-    bufferBarrier(gpuBuffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
-    flushBarriers();
-    vkCmdCopyBuffer(getVkCommandBuffer(), scratchBuffer.buffer, gpuBuffer.buffer, 1, &copyRegion);
+    VkDeviceSize alignment = MAX_VALUE(sVkDescriptorBufferProperties.descriptorBufferOffsetAlignment, VkDeviceSize(1));
+    return (offset + alignment - 1) / alignment * alignment;
 }
 
+static bool sCreateDescriptorBuffer()
+{
+    VkDeviceSize size = VkDeviceSize(CarpVk::DescriptorBufferPersistentSize)
+        + VkDeviceSize(CarpVk::DescriptorBufferFrameSize) * CarpVk::FramesInFlight;
+    // Combined image samplers need both usages, so one buffer holds every descriptor type.
+    if(!createBuffer(size,
+        VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT
+            | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT
+            | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        "Descriptor buffer", sVkDescriptorBuffer))
+    {
+        return false;
+    }
+    ASSERT_RETURN_FALSE(sVkDescriptorBuffer.data);
 
+    VkBufferDeviceAddressInfo addressInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+    addressInfo.buffer = sVkDescriptorBuffer.buffer;
+    sVkDescriptorBufferAddress = vkGetBufferDeviceAddress(sVkDevice, &addressInfo);
+    sVkDescriptorBufferPersistentUsed = 0;
+    return sVkDescriptorBufferAddress != 0;
+}
 
+static void sDestroyDescriptorBuffer()
+{
+    destroyBuffer(sVkDescriptorBuffer);
+    sVkDescriptorBufferAddress = 0;
+    sVkDescriptorBufferLayouts.clear();
+    sVkDescriptorBufferSets.clear();
+    sVkDescriptorBufferFreeSets.clear();
+    sVkDescriptorBufferFreeRanges.clear();
+    sVkDescriptorBufferPendingRanges.clear();
+    sVkDescriptorBufferPersistentUsed = 0;
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkFrameDescriptorBufferSets[i].clear();
+        sVkFrameDescriptorBufferUsed[i] = 0;
+    }
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-bool initVulkan(const VulkanInstanceParams &params)
+static void sRegisterDescriptorBufferLayout(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptors, int32_t count)
 {
-    sVkInstanceBuilder.vulkanInstanceParams = params;
-    for(int i = 0; i < params.extensionCount; ++i)
+    DescriptorBufferLayout& bufferLayout = sVkDescriptorBufferLayouts[layout];
+    sVkGetDescriptorSetLayoutSize(sVkDevice, layout, &bufferLayout.size);
+    bufferLayout.bindings.resize(count);
+    bufferLayout.bindingOffsets.resize(count);
+    for(int32_t i = 0; i < count; ++i)
     {
-        sVkInstanceBuilder.extensions[i] = params.extensions[i];
+        bufferLayout.bindings[i] = descriptors[i].bindingIndex;
+        sVkGetDescriptorSetLayoutBindingOffset(sVkDevice, layout, descriptors[i].bindingIndex,
+            &bufferLayout.bindingOffsets[i]);
     }
+}
+
+static VkDescriptorSet sAllocateDescriptorBufferSet(VkDescriptorSetLayout layout, int64_t frameIndex)
+{
+    auto bufferLayout = sVkDescriptorBufferLayouts.find(layout);
+    ASSERT(bufferLayout != sVkDescriptorBufferLayouts.end());
+    if(bufferLayout == sVkDescriptorBufferLayouts.end())
     {
-        uint32_t extraExtensionCount = 0;
-        const char *const *extraExtensions = params.getExtraExtensionsFn(&extraExtensionCount);
+        return VK_NULL_HANDLE;
+    }
+    VkDeviceSize setSize = bufferLayout->second.size;
 
-        for(uint32_t i = 0; i < extraExtensionCount; ++i)
+    if(frameIndex >= 0)
+    {
+        VkDeviceSize rangeStart = VkDeviceSize(CarpVk::DescriptorBufferPersistentSize)
+            + VkDeviceSize(CarpVk::DescriptorBufferFrameSize) * frameIndex;
+        VkDeviceSize& used = sVkFrameDescriptorBufferUsed[frameIndex];
+        std::vector<DescriptorBufferSet>& sets = sVkFrameDescriptorBufferSets[frameIndex];
+        VkDeviceSize offset = sAlignDescriptorBufferOffset(rangeStart + used);
+        if(offset + setSize > rangeStart + VkDeviceSize(CarpVk::DescriptorBufferFrameSize))
         {
-            sVkInstanceBuilder.extensions[params.extensionCount + i] = extraExtensions[i];
+            printf("Descriptor buffer is full\n");
+            ASSERT(false);
+            return VK_NULL_HANDLE;
         }
-        sVkInstanceBuilder.extensionCount = params.extensionCount + extraExtensionCount;
+        used = offset + setSize - rangeStart;
+        sets.push_back(DescriptorBufferSet{ .layout = layout, .offset = offset, .size = setSize });
+        return sMakeDescriptorBufferSetHandle(uint32_t(frameIndex) + 1,
+            sVkFrameDescriptorBufferGenerations[frameIndex], uint32_t(sets.size() - 1));
     }
 
+    // Persistent sets reuse the ranges of destroyed layouts first, then bump through their range.
+    VkDeviceSize offset = ~VkDeviceSize(0);
+    for(uint32_t i = 0; i < sVkDescriptorBufferFreeRanges.size(); ++i)
+    {
+        DescriptorBufferRange& range = sVkDescriptorBufferFreeRanges[i];
+        VkDeviceSize alignedOffset = sAlignDescriptorBufferOffset(range.offset);
+        VkDeviceSize rangeEnd = range.offset + range.size;
+        if(alignedOffset + setSize > rangeEnd)
+            continue;
+        offset = alignedOffset;
+        range.size = rangeEnd - (alignedOffset + setSize);
+        range.offset = alignedOffset + setSize;
+        if(range.size == 0)
+            sVkDescriptorBufferFreeRanges.erase(sVkDescriptorBufferFreeRanges.begin() + i);
+        break;
+    }
+    if(offset == ~VkDeviceSize(0))
+    {
+        offset = sAlignDescriptorBufferOffset(sVkDescriptorBufferPersistentUsed);
+        if(offset + setSize > VkDeviceSize(CarpVk::DescriptorBufferPersistentSize))
+        {
+            printf("Descriptor buffer is full\n");
+            ASSERT(false);
+            return VK_NULL_HANDLE;
+        }
+        sVkDescriptorBufferPersistentUsed = offset + setSize;
+    }
 
-    sVkInstanceBuilder.m_createInfo.ppEnabledExtensionNames = sVkInstanceBuilder.extensions;
-    sVkInstanceBuilder.m_createInfo.enabledExtensionCount = sVkInstanceBuilder.extensionCount;
-
-    if(params.useValidation && !sUseDefaultValidationLayers())
+    uint32_t index = uint32_t(sVkDescriptorBufferSets.size());
+    if(!sVkDescriptorBufferFreeSets.empty())
     {
-        printf("Failed to initialize vulkan.\n");
-        return false;
+        index = sVkDescriptorBufferFreeSets.back();
+        sVkDescriptorBufferFreeSets.pop_back();
     }
+    else
+    {
+        sVkDescriptorBufferSets.push_back(DescriptorBufferSet{});
+    }
+    DescriptorBufferSet& set = sVkDescriptorBufferSets[index];
+    set.layout = layout;
+    set.offset = offset;
+    set.size = setSize;
+    return sMakeDescriptorBufferSetHandle(0, set.generation, index);
+}
 
-    if(!sCreateInstance())
+static size_t sGetDescriptorBufferDescriptorSize(VkDescriptorType type)
+{
+    switch(type)
     {
-        printf("Failed to initialize vulkan.\n");
-        return false;
+        case VK_DESCRIPTOR_TYPE_SAMPLER: return sVkDescriptorBufferProperties.samplerDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER: return sVkDescriptorBufferProperties.combinedImageSamplerDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE: return sVkDescriptorBufferProperties.sampledImageDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE: return sVkDescriptorBufferProperties.storageImageDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER: return sVkDescriptorBufferProperties.uniformBufferDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER: return sVkDescriptorBufferProperties.storageBufferDescriptorSize;
+        case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT: return sVkDescriptorBufferProperties.inputAttachmentDescriptorSize;
+        default: return 0;
     }
-    printf("Success on creating instance\n");
+}
 
+// Same inputs as the vkUpdateDescriptorSets path, descriptors are written into the mapped buffer.
+static bool sWriteDescriptorBufferSet(VkDescriptorSet descriptorSet,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetCount)
+{
+    ASSERT_RETURN_FALSE(descriptorSetCount > 0);
+    ASSERT_RETURN_FALSE(descriptorSetLayout);
+    ASSERT_RETURN_FALSE(descriptorSetInfos);
+    const DescriptorBufferSet* set = sGetDescriptorBufferSet(descriptorSet);
+    ASSERT_RETURN_FALSE(set);
+    auto bufferLayout = sVkDescriptorBufferLayouts.find(set->layout);
+    ASSERT_RETURN_FALSE(bufferLayout != sVkDescriptorBufferLayouts.end());
+    const DescriptorBufferLayout& layout = bufferLayout->second;
 
-    sVkSurface = params.createSurfaceFn(sVkInstance, params.userData);
-    if(!sVkSurface)
+    uint8_t* setData = (uint8_t*)sVkDescriptorBuffer.data + set->offset;
+    for(int i = 0; i < descriptorSetCount; ++i)
     {
-        printf("Failed to create surface\n");
-        return false;
+        const DescriptorInfo& info = descriptorSetInfos[i];
+        VkDescriptorType type = descriptorSetLayout[i].descriptorType;
+        size_t descriptorSize = sGetDescriptorBufferDescriptorSize(type);
+
+        uint32_t bindingIndex = 0;
+        while(bindingIndex < layout.bindings.size() && layout.bindings[bindingIndex] != descriptorSetLayout[i].bindingIndex)
+            ++bindingIndex;
+        if(descriptorSize == 0 || bindingIndex >= layout.bindings.size())
+        {
+            printf("Failed to set descriptor binds!\n");
+            ASSERT(false);
+            return false;
+        }
+
+        VkDescriptorGetInfoEXT getInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_GET_INFO_EXT };
+        getInfo.type = type;
+        VkDescriptorAddressInfoEXT addressInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_ADDRESS_INFO_EXT };
+        if(info.type == DescriptorInfo::DescriptorType::BUFFER)
+        {
+            ASSERT_RETURN_FALSE(info.bufferInfo.buffer && info.bufferInfo.range > 0u);
+            VkBufferDeviceAddressInfo bufferAddressInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO };
+            bufferAddressInfo.buffer = info.bufferInfo.buffer;
+            addressInfo.address = vkGetBufferDeviceAddress(sVkDevice, &bufferAddressInfo) + info.bufferInfo.offset;
+            addressInfo.range = info.bufferInfo.range;
+            if(type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+                getInfo.data.pUniformBuffer = &addressInfo;
+            else
+                getInfo.data.pStorageBuffer = &addressInfo;
+        }
+        else if(info.type == DescriptorInfo::DescriptorType::IMAGE)
+        {
+            ASSERT_RETURN_FALSE(info.imageInfo.sampler || type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+            if(type == VK_DESCRIPTOR_TYPE_SAMPLER)
+                getInfo.data.pSampler = &info.imageInfo.sampler;
+            else if(type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+                getInfo.data.pCombinedImageSampler = &info.imageInfo;
+            else if(type == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE)
+                getInfo.data.pSampledImage = &info.imageInfo;
+            else if(type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+                getInfo.data.pStorageImage = &info.imageInfo;
+            else
+                getInfo.data.pInputAttachmentImage = &info.imageInfo;
+        }
+        else
+        {
+            printf("Failed to set descriptor binds!\n");
+            return false;
+        }
+        sVkGetDescriptor(sVkDevice, &getInfo, descriptorSize, setData + layout.bindingOffsets[bindingIndex]);
     }
+    VK_CHECK_CALL(vmaFlushAllocation(sVkAllocator, sVkDescriptorBuffer.allocation, set->offset, layout.size));
+    return true;
+}
 
-    if(!sCreatePhysicalDevice(params.useIntegratedGpu))
+// Descriptor buffer bindings are command buffer state, every command buffer binds it once.
+static void sBindDescriptorBuffers(VkCommandBuffer commandBuffer)
+{
+    if(!sVkDescriptorBufferSupported)
     {
-        printf("Failed to create physical device\n");
-        return false;
+        return;
     }
+    VkDescriptorBufferBindingInfoEXT bindingInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_BUFFER_BINDING_INFO_EXT };
+    bindingInfo.address = sVkDescriptorBufferAddress;
+    bindingInfo.usage = VK_BUFFER_USAGE_RESOURCE_DESCRIPTOR_BUFFER_BIT_EXT
+        | VK_BUFFER_USAGE_SAMPLER_DESCRIPTOR_BUFFER_BIT_EXT;
+    sVkCmdBindDescriptorBuffers(commandBuffer, 1, &bindingInfo);
+}
 
-    if(!sCreateDeviceWithQueues())
+static void sBindDescriptorSet(VkCommandBuffer commandBuffer, VkPipelineBindPoint bindPoint,
+    VkPipelineLayout pipelineLayout, uint32_t setIndex, VkDescriptorSet descriptorSet,
+    const uint32_t* dynamicOffsets, uint32_t dynamicOffsetCount)
+{
+    if(!sVkDescriptorBufferSupported)
     {
-        printf("Failed to create logical device with queues\n");
-        return false;
+        vkCmdBindDescriptorSets(commandBuffer, bindPoint, pipelineLayout,
+            setIndex, 1, &descriptorSet, dynamicOffsetCount, dynamicOffsets);
+        return;
     }
+    // Descriptor buffers have no dynamic descriptors.
+    ASSERT_RETURN(dynamicOffsetCount == 0);
+    // Handles of reset frame slots or destroyed layouts fail here instead of binding reused memory.
+    const DescriptorBufferSet* set = sGetDescriptorBufferSet(descriptorSet);
+    ASSERT_RETURN(set);
+    uint32_t bufferIndex = 0;
+    VkDeviceSize offset = set->offset;
+    sVkCmdSetDescriptorBufferOffsets(commandBuffer, bindPoint, pipelineLayout, setIndex, 1, &bufferIndex, &offset);
+}
 
-    if(!sCreateSwapchain(params.vsyncMode, params.width, params.height))
+// FNV-1a over the key words.
+static uint64_t sHashKey(const std::vector<uint64_t>& key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for(uint64_t word : key)
     {
-        printf("Failed to create swapchain\n");
-        return false;
+        hash = (hash ^ word) * 1099511628211ull;
     }
+    return hash;
+}
+
+static void sUnlinkDescriptorCacheEntry(uint32_t index)
+{
+    DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[index];
+    if(entry.prev != ~0u)
+        sVkDescriptorCacheEntries[entry.prev].next = entry.next;
+    else
+        sVkDescriptorCacheHead = entry.next;
+    if(entry.next != ~0u)
+        sVkDescriptorCacheEntries[entry.next].prev = entry.prev;
+    else
+        sVkDescriptorCacheTail = entry.prev;
+    entry.prev = ~0u;
+    entry.next = ~0u;
+}
 
+static void sPushFrontDescriptorCacheEntry(uint32_t index)
+{
+    DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[index];
+    entry.prev = ~0u;
+    entry.next = sVkDescriptorCacheHead;
+    if(sVkDescriptorCacheHead != ~0u)
+        sVkDescriptorCacheEntries[sVkDescriptorCacheHead].prev = index;
+    else
+        sVkDescriptorCacheTail = index;
+    sVkDescriptorCacheHead = index;
+}
 
-    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+// Set goes back to its layout pools and is rewritten once the frames using it are done.
+static void sRemoveDescriptorCacheEntry(uint32_t index)
+{
+    sUnlinkDescriptorCacheEntry(index);
+    DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[index];
+    auto range = sVkDescriptorCacheLookup.equal_range(entry.hash);
+    for(auto it = range.first; it != range.second; ++it)
     {
-        sVkQueryPools[i] = sCreateQueryPool(CarpVk::QueryCount);
-        ASSERT(sVkQueryPools[i]);
-        if(!sVkQueryPools[i])
+        if(it->second == index)
         {
-            printf("Failed to create vulkan query pool!\n");
-            return false;
+            sVkDescriptorCacheLookup.erase(it);
+            break;
         }
     }
+    auto pools = sVkDescriptorLayoutPools.find(entry.layout);
+    if(pools != sVkDescriptorLayoutPools.end())
+    {
+        pools->second.retiredSets.push_back(RetiredDescriptorSet{
+            .descriptorSet = entry.descriptorSet,
+            .lastUsedValue = entry.lastUsedValue,
+        });
+    }
+    entry = DescriptorCacheEntry{};
+    sVkDescriptorCacheFreeEntries.push_back(index);
+    sVkDescriptorCacheStats.cachedSetCount--;
+}
 
-
-    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+// Handle values get reused by new objects, so sets pointing to destroyed ones cannot stay cached.
+static void sForgetCachedDescriptorSets(uint64_t handle)
+{
+    if(handle == 0 || sVkDescriptorCacheStats.cachedSetCount == 0)
     {
-        sVkAcquireSemaphores[i] = sCreateSemaphore();
-        ASSERT(sVkAcquireSemaphores[i]);
-        if(!sVkAcquireSemaphores[i])
+        return;
+    }
+    for(uint32_t i = 0; i < sVkDescriptorCacheEntries.size(); ++i)
+    {
+        const DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[i];
+        if(!entry.used)
+            continue;
+        // Key is layout, count, then type, handle, and two words per descriptor.
+        bool found = false;
+        for(size_t word = 2; word + 3 < entry.key.size() && !found; word += 4)
         {
-            printf("Failed to create vulkan acquire semapohore!\n");
-            return false;
+            found = entry.key[word + 1] == handle
+                || (entry.key[word] == uint64_t(DescriptorInfo::DescriptorType::IMAGE) && entry.key[word + 3] == handle);
         }
-
-        sVkReleaseSemaphores[i] = sCreateSemaphore();
-        ASSERT(sVkReleaseSemaphores[i]);
-        if(!sVkReleaseSemaphores[i])
+        if(found)
         {
-            printf("Failed to create vulkan release semaphore!\n");
-            return false;
+            sRemoveDescriptorCacheEntry(i);
         }
+    }
+}
 
-        sVkFences[i] = sCreateFence();
-        ASSERT(sVkFences[i]);
-        if(!sVkFences[i])
+static void sForgetDescriptorLayout(VkDescriptorSetLayout layout)
+{
+    auto pools = sVkDescriptorLayoutPools.find(layout);
+    if(pools == sVkDescriptorLayoutPools.end())
+    {
+        return;
+    }
+    for(uint32_t i = 0; i < sVkDescriptorCacheEntries.size(); ++i)
+    {
+        if(sVkDescriptorCacheEntries[i].used && sVkDescriptorCacheEntries[i].layout == layout)
         {
-            printf("Failed to create vulkan fence!\n");
-            return false;
+            sRemoveDescriptorCacheEntry(i);
         }
     }
-    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    // Sets of this frame can still be bound, pools go away after it.
+    for(VkDescriptorPool pool : pools->second.pools)
     {
-        sVkCommandPools[i] = sCreateCommandPool();
-        ASSERT(sVkCommandPools[i]);
-        if(!sVkCommandPools[i])
+        sVkPendingDescriptorPoolDestroys.push_back(PendingDescriptorPoolDestroy{
+            .pool = pool,
+            .submissionValue = getNextSubmissionValue(),
+        });
+    }
+    sVkDescriptorLayoutPools.erase(pools);
+}
+
+static void sRecycleDescriptorPools()
+{
+    if(sVkPendingDescriptorPoolDestroys.empty())
+    {
+        return;
+    }
+    uint64_t completedValue = getCompletedSubmissionValue();
+    uint32_t writeIndex = 0;
+    for(const PendingDescriptorPoolDestroy& pending : sVkPendingDescriptorPoolDestroys)
+    {
+        if(pending.submissionValue <= completedValue)
         {
-            printf("Failed to create vulkan command pool!\n");
-            return false;
+            vkDestroyDescriptorPool(sVkDevice, pending.pool, nullptr);
+            sVkDescriptorCacheStats.poolCount--;
         }
+        else
+        {
+            sVkPendingDescriptorPoolDestroys[writeIndex++] = pending;
+        }
+    }
+    sVkPendingDescriptorPoolDestroys.resize(writeIndex);
+}
 
-        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-        allocateInfo.commandPool = sVkCommandPools[i];
-        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        allocateInfo.commandBufferCount = 1; // CarpVk::FramesInFlight;
-
+static VkDescriptorSet sAllocateCachedDescriptorSet(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptorSetLayout, int count)
+{
+    DescriptorLayoutPools& pools = sVkDescriptorLayoutPools[layout];
+    if(pools.setPoolSizes.empty())
+    {
+        for(int i = 0; i < count; ++i)
         {
-            VK_CHECK_CALL(vkAllocateCommandBuffers(sVkDevice, &allocateInfo, &sVkCommandBuffers[i]));
-            //for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+            bool found = false;
+            for(VkDescriptorPoolSize& poolSize : pools.setPoolSizes)
             {
-                if(!sVkCommandBuffers[i])
+                if(poolSize.type == descriptorSetLayout[i].descriptorType)
                 {
-                    printf("Failed to create vulkan command buffer!\n");
-                    return false;
+                    poolSize.descriptorCount += descriptorSetLayout[i].descriptorCount;
+                    found = true;
                 }
-
-                static const char *s = "Main command buffer";
-                sSetObjectName((uint64_t)sVkCommandBuffers[i], VK_DEBUG_REPORT_OBJECT_TYPE_COMMAND_BUFFER_EXT, s);
+            }
+            if(!found)
+            {
+                pools.setPoolSizes.push_back(VkDescriptorPoolSize{
+                    .type = descriptorSetLayout[i].descriptorType,
+                    .descriptorCount = descriptorSetLayout[i].descriptorCount,
+                });
             }
         }
     }
 
-    if(!sCreateDescriptorPool())
+    uint64_t completedValue = getCompletedSubmissionValue();
+    for(size_t i = 0; i < pools.retiredSets.size(); ++i)
     {
-        printf("Failed to create descriptor pool\n");
-        return false;
+        if(pools.retiredSets[i].lastUsedValue <= completedValue)
+        {
+            VkDescriptorSet descriptorSet = pools.retiredSets[i].descriptorSet;
+            pools.retiredSets[i] = pools.retiredSets.back();
+            pools.retiredSets.pop_back();
+            return descriptorSet;
+        }
     }
 
-    for(Buffer &buffer : sVkScratchBuffer)
+    if(sVkDescriptorBufferSupported)
     {
-        const char* name = "Scratch buffer";
+        return sAllocateDescriptorBufferSet(layout, -1);
+    }
 
-        if(!createBuffer(cVulkanScratchBufferSize,
-            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-            name, buffer))
+    VkDescriptorSetAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+    VkDescriptorSet descriptorSet = {};
+    if(!pools.pools.empty())
+    {
+        allocInfo.descriptorPool = pools.pools.back();
+        if(vkAllocateDescriptorSets(sVkDevice, &allocInfo, &descriptorSet) == VK_SUCCESS)
         {
-            printf("Failed to create scratch buffer\n");
-            return false;
+            return descriptorSet;
         }
     }
-    if(!createBuffer(cVulkanUniformBufferSize,
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        "Uniform buffers", sVkUniformBuffer))
+
+    // Pool full, grow with a bigger one.
+    uint32_t setCount = pools.nextPoolSetCount;
+    pools.nextPoolSetCount = MIN_VALUE(setCount * 2, 1024u);
+    std::vector<VkDescriptorPoolSize> poolSizes = pools.setPoolSizes;
+    for(VkDescriptorPoolSize& poolSize : poolSizes)
     {
-        printf("Failed to create uniform buffer\n");
-        return false;
+        poolSize.descriptorCount *= setCount;
     }
-    return true;
-}
-
+    VkDescriptorPoolCreateInfo poolInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+    poolInfo.poolSizeCount = uint32_t(poolSizes.size());
+    poolInfo.pPoolSizes = poolSizes.data();
+    poolInfo.maxSets = setCount;
+    VkDescriptorPool pool = {};
+    VK_CHECK_CALL(vkCreateDescriptorPool(sVkDevice, &poolInfo, nullptr, &pool));
+    if(!pool)
+    {
+        return VK_NULL_HANDLE;
+    }
+    pools.pools.push_back(pool);
+    sVkDescriptorCacheStats.poolCount++;
 
+    allocInfo.descriptorPool = pool;
+    VK_CHECK_CALL(vkAllocateDescriptorSets(sVkDevice, &allocInfo, &descriptorSet));
+    return descriptorSet;
+}
 
-void deinitVulkan()
+static void sDestroyDescriptorSetCache()
 {
-    if(sVkInstance == nullptr)
+    for(auto& pools : sVkDescriptorLayoutPools)
     {
-        return;
+        for(VkDescriptorPool pool : pools.second.pools)
+        {
+            vkDestroyDescriptorPool(sVkDevice, pool, nullptr);
+        }
     }
-    if(sVkDevice)
+    for(const PendingDescriptorPoolDestroy& pending : sVkPendingDescriptorPoolDestroys)
     {
-        VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+        vkDestroyDescriptorPool(sVkDevice, pending.pool, nullptr);
+    }
+    sVkDescriptorLayoutPools.clear();
+    sVkPendingDescriptorPoolDestroys.clear();
+    sVkDescriptorCacheEntries.clear();
+    sVkDescriptorCacheFreeEntries.clear();
+    sVkDescriptorCacheLookup.clear();
+    sVkDescriptorCacheHead = ~0u;
+    sVkDescriptorCacheTail = ~0u;
+    sVkDescriptorCacheStats = DescriptorSetCacheStats{};
+}
 
-        if(sVkInstanceBuilder.vulkanInstanceParams.destroyBuffersFn)
+static void sDestroyShaderObjectProgram(ShaderObjectProgram& program)
+{
+    for(VkShaderEXT shader : program.shaders)
+    {
+        if(shader)
         {
-            sVkInstanceBuilder.vulkanInstanceParams.destroyBuffersFn(sVkInstanceBuilder.vulkanInstanceParams.userData);
+            sVkShaderObjectFns.destroyShader(sVkDevice, shader, nullptr);
         }
+    }
+    program = ShaderObjectProgram{};
+}
 
-        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+static void sDestroyShaderObjectPrograms()
+{
+    for(ShaderObjectProgram& program : sVkShaderObjectPrograms)
+    {
+        if(program.used)
         {
-            if(sVkCommandPools[i])
-            {
-                vkDestroyCommandPool(sVkDevice, sVkCommandPools[i], nullptr);
-            }
-            sVkCommandPools[i] = {};
+            sDestroyShaderObjectProgram(program);
         }
-        sDestroySwapchain();
+    }
+    sVkShaderObjectPrograms.clear();
+    sVkShaderObjectFreePrograms.clear();
+    sVkPipelineLayoutContents.clear();
+}
 
-        destroyBuffer(sVkUniformBuffer);
+static void sDestroyReflectedLayouts()
+{
+    for(ReflectedLayoutsEntry& entry : sVkReflectedLayouts)
+    {
+        ReflectedLayouts& layouts = entry.layouts;
+        destroyPipelineLayouts(&layouts.pipelineLayout, 1);
+        destroyDescriptorSetLayouts(layouts.setLayouts, int32_t(layouts.setLayoutCount));
+    }
+    sVkReflectedLayouts.clear();
+    sVkReflectedLayoutLookup.clear();
+    sVkShaderReflections.clear();
+    sVkShaderModuleReflections.clear();
+}
 
-        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+// Returns the shared handle with this key and adds a reference to it, 0 when there is none.
+static uint64_t sFindSharedHandle(SharedHandleCache& cache, const std::vector<uint64_t>& key, uint64_t hash)
+{
+    cache.requests++;
+    auto range = cache.lookup.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        SharedHandleEntry& entry = cache.entries[it->second];
+        if(entry.key == key)
         {
-            destroyBuffer(sVkScratchBuffer[i]);
-            vkDestroyQueryPool(sVkDevice, sVkQueryPools[i], nullptr);
+            entry.refCount++;
+            return it->second;
         }
+    }
+    return 0;
+}
 
+static void sAddSharedHandle(SharedHandleCache& cache, std::vector<uint64_t>&& key, uint64_t hash, uint64_t handle)
+{
+    if(handle == 0)
+    {
+        return;
+    }
+    cache.lookup.emplace(hash, handle);
+    cache.entries[handle] = SharedHandleEntry{ .key = std::move(key), .hash = hash, .refCount = 1 };
+}
 
-        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
-        {
-            vkDestroyFence(sVkDevice, sVkFences[i], nullptr);
-            vkDestroySemaphore(sVkDevice, sVkAcquireSemaphores[i], nullptr);
-            vkDestroySemaphore(sVkDevice, sVkReleaseSemaphores[i], nullptr);
-        }
-
-        if(sVkDescriptorPool)
-        {
-            vkDestroyDescriptorPool(sVkDevice, sVkDescriptorPool, nullptr);
-            sVkDescriptorPool = {};
-        }
-        if(sVkAllocator)
+// Drops a reference, true when the object should be destroyed. Handles that were not created
+// shared are always destroyed.
+static bool sReleaseSharedHandle(SharedHandleCache& cache, uint64_t handle)
+{
+    auto entry = cache.entries.find(handle);
+    if(entry == cache.entries.end())
+    {
+        return true;
+    }
+    ASSERT(entry->second.refCount > 0);
+    if(--entry->second.refCount > 0)
+    {
+        return false;
+    }
+    auto range = cache.lookup.equal_range(entry->second.hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        if(it->second == handle)
         {
-            vmaDestroyAllocator(sVkAllocator);
-            sVkAllocator = nullptr;
+            cache.lookup.erase(it);
+            break;
         }
-
-
-        vkDestroyDevice(sVkDevice, nullptr);
-        sVkDevice = nullptr;
     }
+    cache.entries.erase(entry);
+    return true;
+}
 
-    if(sVkSurface)
+// Objects the application never destroyed.
+static void sDestroySharedHandles()
+{
+    for(auto& entry : sVkSharedPipelineLayouts.entries)
     {
-        vkDestroySurfaceKHR(sVkInstance, sVkSurface, nullptr);
-        sVkSurface = {};
+        vkDestroyPipelineLayout(sVkDevice, (VkPipelineLayout)entry.first, nullptr);
     }
-    if(sVkDebugMessenger)
+    for(auto& entry : sVkSharedSetLayouts.entries)
     {
-        auto dest = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(sVkInstance, "vkDestroyDebugUtilsMessengerEXT");
-        dest(sVkInstance, sVkDebugMessenger, nullptr);
-        sVkDebugMessenger = {};
+        vkDestroyDescriptorSetLayout(sVkDevice, (VkDescriptorSetLayout)entry.first, nullptr);
     }
+    for(auto& entry : sVkSharedSamplers.entries)
+    {
+        vkDestroySampler(sVkDevice, (VkSampler)entry.first, nullptr);
+    }
+    sVkSharedPipelineLayouts = SharedHandleCache{};
+    sVkSharedSetLayouts = SharedHandleCache{};
+    sVkSharedSamplers = SharedHandleCache{};
+}
 
-    vkDestroyInstance(sVkInstance, nullptr);
+// Points the stage info at the constants, stages without constants keep their own pSpecializationInfo.
+static void sApplySpecialization(const SpecializationConstants& constants, StageSpecializationInfo& outInfo,
+    VkPipelineShaderStageCreateInfo& stageInfo)
+{
+    if(constants.count == 0)
+    {
+        return;
+    }
+    ASSERT(constants.count <= uint32_t(CarpVk::MaxSpecializationConstants));
+    for(uint32_t i = 0; i < constants.count; ++i)
+    {
+        outInfo.mapEntries[i] = VkSpecializationMapEntry{
+            .constantID = constants.constantIds[i],
+            .offset = uint32_t(i * sizeof(uint32_t)),
+            .size = sizeof(uint32_t),
+        };
+    }
+    outInfo.info = VkSpecializationInfo{
+        .mapEntryCount = constants.count,
+        .pMapEntries = outInfo.mapEntries,
+        .dataSize = constants.count * sizeof(uint32_t),
+        .pData = constants.values,
+    };
+    stageInfo.pSpecializationInfo = &outInfo.info;
 }
 
-void printExtensions()
+static void sAppendStageVariantKey(const VkPipelineShaderStageCreateInfo& stageInfo,
+    const SpecializationConstants* constants, std::vector<uint64_t>& key)
 {
-    VkExtensionProperties allExtensions[256] = {};
-    uint32_t extensionCount = 0;
-    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
-    ASSERT(extensionCount < 256);
-    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, allExtensions);
+    key.push_back((uint64_t)stageInfo.module);
+    key.push_back((uint64_t(stageInfo.flags) << 32) | uint64_t(stageInfo.stage));
+    uint64_t nameHash = 14695981039346656037ull;
+    for(const char* c = stageInfo.pName; c && *c; ++c)
+    {
+        nameHash = (nameHash ^ uint64_t(uint8_t(*c))) * 1099511628211ull;
+    }
+    key.push_back(nameHash);
 
-    for(int i = 0; i < extensionCount; ++i)
+    // Sorted by id so the order the constants were set in does not matter.
+    uint64_t constantWords[CarpVk::MaxSpecializationConstants] = {};
+    uint32_t count = constants ? MIN_VALUE(constants->count, uint32_t(CarpVk::MaxSpecializationConstants)) : 0;
+    for(uint32_t i = 0; i < count; ++i)
     {
-        printf("Extenstion: %s\n", allExtensions[i].extensionName);
+        constantWords[i] = (uint64_t(constants->constantIds[i]) << 32) | constants->values[i];
     }
-    printf("Extensions: %i\n", extensionCount);
+    std::sort(constantWords, constantWords + count);
+    key.push_back(count);
+    key.insert(key.end(), constantWords, constantWords + count);
 }
 
-void printLayers()
+static VkPipeline sFindPipelineVariant(const std::vector<uint64_t>& key, uint64_t hash)
 {
-    VkLayerProperties allLayers[256] = {};
-    uint32_t layerCount = 0;
-    vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
-    ASSERT(layerCount < 256);
-    vkEnumerateInstanceLayerProperties(&layerCount, allLayers);
-    for(int i = 0; i < layerCount; ++i)
+    auto range = sVkPipelineVariants.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it)
     {
-        printf("Layer: %s\n", allLayers[i].layerName);
+        if(it->second.key == key)
+        {
+            sVkPipelineVariantStats.hits++;
+            return it->second.pipeline;
+        }
     }
-    printf("Layers: %i\n", layerCount);
+    sVkPipelineVariantStats.misses++;
+    return VK_NULL_HANDLE;
 }
 
-
-bool createDescriptorSet(VkDescriptorSetLayout layout, VkDescriptorSet* outSet)
+// Drops the variants made with the module or layout, their handles can be reused once destroyed.
+// Variants can still be bound by frames in flight, their pipelines go away after them.
+static void sForgetPipelineVariants(VkShaderModule module, VkPipelineLayout pipelineLayout)
 {
-    VkDescriptorSetAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    allocInfo.descriptorPool = sVkDescriptorPool;
-    allocInfo.descriptorSetCount = 1;
-    allocInfo.pSetLayouts = &layout;
-
-    VkDescriptorSet descriptorSet = {};
-    VK_CHECK_CALL(vkAllocateDescriptorSets(sVkDevice, &allocInfo, &descriptorSet));
-    ASSERT(descriptorSet);
-
-    *outSet = descriptorSet;
-    return true;
+    for(auto it = sVkPipelineVariants.begin(); it != sVkPipelineVariants.end();)
+    {
+        const std::vector<VkShaderModule>& modules = it->second.modules;
+        bool usesModule = module && std::find(modules.begin(), modules.end(), module) != modules.end();
+        bool usesLayout = pipelineLayout && it->second.pipelineLayout == pipelineLayout;
+        if(!usesModule && !usesLayout)
+        {
+            ++it;
+            continue;
+        }
+        sVkPendingPipelineDestroys.push_back(PendingPipelineDestroy{
+            .pipeline = it->second.pipeline,
+            .submissionValue = getNextSubmissionValue(),
+        });
+        it = sVkPipelineVariants.erase(it);
+    }
+    sVkPipelineVariantStats.variantCount = uint32_t(sVkPipelineVariants.size());
 }
 
+static void sRecyclePipelineVariants()
+{
+    if(sVkPendingPipelineDestroys.empty())
+    {
+        return;
+    }
+    uint64_t completedValue = getCompletedSubmissionValue();
+    uint32_t writeIndex = 0;
+    for(const PendingPipelineDestroy& pending : sVkPendingPipelineDestroys)
+    {
+        if(pending.submissionValue <= completedValue)
+        {
+            vkDestroyPipeline(sVkDevice, pending.pipeline, nullptr);
+        }
+        else
+        {
+            sVkPendingPipelineDestroys[writeIndex++] = pending;
+        }
+    }
+    sVkPendingPipelineDestroys.resize(writeIndex);
+}
 
-
-
-VkImageView createImageView(VkImage image, VkFormat format)
+static void sDestroyPipelineVariants()
 {
-    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat(format);
+    for(auto& variant : sVkPipelineVariants)
+    {
+        vkDestroyPipeline(sVkDevice, variant.second.pipeline, nullptr);
+    }
+    for(const PendingPipelineDestroy& pending : sVkPendingPipelineDestroys)
+    {
+        vkDestroyPipeline(sVkDevice, pending.pipeline, nullptr);
+    }
+    sVkPipelineVariants.clear();
+    sVkPendingPipelineDestroys.clear();
+    sVkPipelineVariantStats = PipelineVariantStats{};
+}
 
-    VkImageViewCreateInfo createInfo = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
-    createInfo.image = image;
-    createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    createInfo.format = format;
+static void sResetThreadCommandBuffers(uint32_t frameIndex)
+{
+    for(ThreadCommandBuffers& threadBuffers : sVkThreadCommandBuffers[frameIndex])
+    {
+        if(!threadBuffers.commandPool)
+            continue;
+        VK_CHECK_CALL(vkResetCommandPool(sVkDevice, threadBuffers.commandPool, 0));
+        threadBuffers.usedCount = 0;
+    }
+}
 
-    //createInfo.components.r = VK_COMPONENT_SWIZZLE_R; // VK_COMPONENT_SWIZZLE_IDENTITY;
-    //createInfo.components.g = VK_COMPONENT_SWIZZLE_G; //VK_COMPONENT_SWIZZLE_IDENTITY;
-    //createInfo.components.b = VK_COMPONENT_SWIZZLE_B; //VK_COMPONENT_SWIZZLE_IDENTITY;
-    //createInfo.components.a = VK_COMPONENT_SWIZZLE_A; //VK_COMPONENT_SWIZZLE_IDENTITY;
+static void sDestroyThreadCommandBuffers()
+{
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        for(ThreadCommandBuffers& threadBuffers : sVkThreadCommandBuffers[i])
+        {
+            if(threadBuffers.commandPool)
+            {
+                vkDestroyCommandPool(sVkDevice, threadBuffers.commandPool, nullptr);
+            }
+            threadBuffers = ThreadCommandBuffers{};
+        }
+    }
+}
 
-    createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-    createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+static bool sGetWindowSize(int32_t* w, int32_t* h)
+{
+    if(sVkInstanceBuilder.vulkanInstanceParams.getWindowSizeFn)
+    {
+        sVkInstanceBuilder.vulkanInstanceParams.getWindowSizeFn(
+            w, h,
+            sVkInstanceBuilder.vulkanInstanceParams.userData);
+        return true;
+    }
+    return false;
+}
 
-    createInfo.subresourceRange.aspectMask = aspectMask;
-    createInfo.subresourceRange.baseMipLevel = 0;
-    createInfo.subresourceRange.levelCount = 1;
-    createInfo.subresourceRange.baseArrayLayer = 0;
-    createInfo.subresourceRange.layerCount = 1;
+static bool sResizeSwapchain()
+{
+    int32_t oldWidth = sVkSwapchainWidth;
+    int32_t oldHeight = sVkSwapchainHeight;
+    if(sGetWindowSize(&sVkSwapchainWidth, &sVkSwapchainHeight))
+    {
+    }
 
-    VkImageView view = {};
-    VK_CHECK_CALL(vkCreateImageView(sVkDevice, &createInfo, nullptr, &view));
+    bool wasInMinimized = false;
+    while (sVkSwapchainWidth == 0 || sVkSwapchainHeight == 0)
+    {
 
-    ASSERT(view);
-    return view;
-}
+        if(sGetWindowSize(&sVkSwapchainWidth, &sVkSwapchainHeight))
+        {
+        }
 
+        //glfwWaitEvents();
+        //glfwGetFramebufferSize(window, &width, &height);
+        wasInMinimized = true;
+    }
 
-bool createImage(uint32_t width, uint32_t height,
-    VkFormat imageFormat, VkImageUsageFlags usage, const char* imageName,
-    Image& outImage)
-{
-    VkImageCreateInfo createInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
-    createInfo.imageType = VK_IMAGE_TYPE_2D;
-    createInfo.format = imageFormat;
-    createInfo.extent = { width, height, 1 };
-    createInfo.mipLevels = 1;
-    createInfo.arrayLayers = 1;
-    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
-    createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    createInfo.usage = usage;
-    createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    createInfo.queueFamilyIndexCount = 1;
-    uint32_t indices[] = { (uint32_t)sVkQueueIndex };
-    createInfo.pQueueFamilyIndices = indices;
+    VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+    VK_CHECK_CALL(vkQueueWaitIdle(sVkQueue));
+    VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+    VK_CHECK_CALL(vkQueueWaitIdle(sVkQueue));
 
-    VmaAllocationCreateInfo allocInfo = {};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
 
 
-    VK_CHECK_CALL(vmaCreateImage(sVkAllocator,
-        &createInfo, &allocInfo, &outImage.image, &outImage.allocation, nullptr));
+    VkSwapchainKHR oldSwapchain = sVkSwapchain;
 
-    ASSERT_RETURN_FALSE(outImage.image && outImage.allocation);
+    sCreateSwapchain(sVkInstanceBuilder.vulkanInstanceParams.vsyncMode,
+        sVkSwapchainWidth, sVkSwapchainHeight);
 
-    outImage.view = createImageView(outImage.image, imageFormat);
-    ASSERT_RETURN_FALSE(outImage.view);
+    vkDestroySwapchainKHR(sVkDevice, oldSwapchain, nullptr);
 
-    sSetObjectName((uint64_t)outImage.image, VK_DEBUG_REPORT_OBJECT_TYPE_IMAGE_EXT, imageName);
-    outImage.imageName = imageName;
-    outImage.width = width;
-    outImage.height = height;
-    outImage.format = createInfo.format;
-    outImage.layout = createInfo.initialLayout;
+    if(sVkInstanceBuilder.vulkanInstanceParams.resizedFn)
+    {
+        sVkInstanceBuilder.vulkanInstanceParams.resizedFn(
+            sVkInstanceBuilder.vulkanInstanceParams.userData);
+    }
+    return true;
+}
 
-    if((usage & (VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)) != 0)
+static bool sAddStagingBlock(StagingRing& ring, uint32_t slot, size_t minSize)
+{
+    size_t roundedUpSize = (minSize + 255) & (~(size_t(255)));
+    size_t size = MAX_VALUE(ring.blockSize, roundedUpSize);
+    Buffer buffer;
+    if(ring.readback)
     {
-        sAllRenderTargetImages.push_back(&outImage);
+        VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+        createInfo.size = size;
+        createInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+        VmaAllocationCreateInfo allocInfo = {};
+        allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+        allocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        VmaAllocationInfo vmaAllocInfo;
+        if(vmaCreateBuffer(sVkAllocator, &createInfo, &allocInfo,
+            &buffer.buffer, &buffer.allocation, &vmaAllocInfo) == VK_SUCCESS)
+        {
+            sSetObjectName((uint64_t)buffer.buffer, VK_DEBUG_REPORT_OBJECT_TYPE_BUFFER_EXT, ring.name);
+            buffer.data = vmaAllocInfo.pMappedData;
+            buffer.bufferName = ring.name;
+            buffer.size = size;
+            buffer.usage = createInfo.usage;
+        }
     }
     else
     {
-        sAllImages.push_back(&outImage);
+        createBuffer(size,
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+            ring.name, buffer);
     }
+    if(!buffer.buffer || !buffer.data)
+    {
+        printf("Failed to create staging block of %zu bytes\n", size);
+        return false;
+    }
+    ring.blocks[slot].push_back(buffer);
+    ring.stats.allocatedBytes += size;
+    ring.stats.blockCount++;
     return true;
 }
-void destroyImage(Image& image)
-{
-    if (image.view)
-        vkDestroyImageView(sVkDevice, image.view, nullptr);
-    if (image.image)
-        vmaDestroyImage(sVkAllocator, image.image, image.allocation);
 
-    image = Image{};
+static bool sCreateStagingRing(StagingRing& ring, const char* name, size_t blockSize, uint32_t shrinkIdleFrames,
+    bool readback = false)
+{
+    ring.name = name;
+    ring.readback = readback;
+    ring.blockSize = blockSize;
+    ring.shrinkIdleFrames = shrinkIdleFrames;
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        if(!sAddStagingBlock(ring, i, blockSize))
+        {
+            return false;
+        }
+    }
+    return true;
 }
 
-bool createBuffer(size_t size,
-    VkBufferUsageFlags usage,
-    VkMemoryPropertyFlags memoryFlags,
-    const char* bufferName,
-    Buffer &outBuffer)
+static void sDestroyStagingRing(StagingRing& ring)
 {
-    destroyBuffer(outBuffer);
+    for(std::vector<Buffer>& blocks : ring.blocks)
+    {
+        for(Buffer& buffer : blocks)
+        {
+            destroyBuffer(buffer);
+        }
+        blocks.clear();
+    }
+    ring = StagingRing{};
+}
 
-    VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-    createInfo.size = size;
-    createInfo.usage = usage;
+static void sGetUniformLevels(size_t size, uint32_t& firstLevel, uint32_t& secondLevel)
+{
+    firstLevel = uint32_t(std::bit_width(size)) - 1;
+    secondLevel = uint32_t(size >> (firstLevel - cUniformSecondLevelLog2)) & (cUniformSecondLevelCount - 1);
+}
 
-    VmaAllocationCreateInfo allocInfo = {};
-    allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
-    if(memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+static void sInsertFreeUniformBlock(UniformHeap& heap, uint32_t blockIndex)
+{
+    UniformHeapBlock& block = heap.blocks[blockIndex];
+    uint32_t firstLevel = 0;
+    uint32_t secondLevel = 0;
+    sGetUniformLevels(block.size, firstLevel, secondLevel);
+    uint32_t& head = heap.freeHeads[firstLevel][secondLevel];
+    block.free = true;
+    block.prevFree = ~0u;
+    block.nextFree = head;
+    if(head != ~0u)
     {
-        allocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
-            | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+        heap.blocks[head].prevFree = blockIndex;
     }
-    VmaAllocation allocation;
-    VmaAllocationInfo vmaAllocInfo;
-    VK_CHECK_CALL(vmaCreateBuffer(sVkAllocator, &createInfo,
-        &allocInfo, &outBuffer.buffer, &allocation, &vmaAllocInfo));
+    head = blockIndex;
+    heap.firstLevelBitmap |= uint64_t(1) << firstLevel;
+    heap.secondLevelBitmaps[firstLevel] |= 1u << secondLevel;
+}
 
-    void* data = nullptr;
-    if (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+static void sRemoveFreeUniformBlock(UniformHeap& heap, uint32_t blockIndex)
+{
+    UniformHeapBlock& block = heap.blocks[blockIndex];
+    uint32_t firstLevel = 0;
+    uint32_t secondLevel = 0;
+    sGetUniformLevels(block.size, firstLevel, secondLevel);
+    if(block.prevFree != ~0u)
     {
-        data = vmaAllocInfo.pMappedData;
-        ASSERT(data);
+        heap.blocks[block.prevFree].nextFree = block.nextFree;
     }
-    outBuffer.data = data;
-
-    sSetObjectName((uint64_t)outBuffer.buffer, VK_DEBUG_REPORT_OBJECT_TYPE_BUFFER_EXT, bufferName);
-
-    outBuffer.allocation = allocation;
-    outBuffer.bufferName = bufferName;
-    outBuffer.size = size;
-    outBuffer.usage = usage;
-    return true;
+    if(block.nextFree != ~0u)
+    {
+        heap.blocks[block.nextFree].prevFree = block.prevFree;
+    }
+    uint32_t& head = heap.freeHeads[firstLevel][secondLevel];
+    if(head == blockIndex)
+    {
+        head = block.nextFree;
+        if(head == ~0u)
+        {
+            heap.secondLevelBitmaps[firstLevel] &= ~(1u << secondLevel);
+            if(heap.secondLevelBitmaps[firstLevel] == 0)
+            {
+                heap.firstLevelBitmap &= ~(uint64_t(1) << firstLevel);
+            }
+        }
+    }
+    block.free = false;
+    block.prevFree = ~0u;
+    block.nextFree = ~0u;
 }
 
-
-void uploadToGpuBuffer(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size)
+static uint32_t sNewUniformBlock(UniformHeap& heap)
 {
-    BufferCopyRegion region = sUploadToScratchBuffer(data, size);
-    region.dstOffset = dstOffset;
-    sUploadScratchBufferToGpuBuffer(gpuBuffer, region);
+    if(!heap.unusedBlocks.empty())
+    {
+        uint32_t blockIndex = heap.unusedBlocks.back();
+        heap.unusedBlocks.pop_back();
+        heap.blocks[blockIndex] = UniformHeapBlock{};
+        return blockIndex;
+    }
+    heap.blocks.push_back(UniformHeapBlock{});
+    return uint32_t(heap.blocks.size() - 1);
 }
-void uploadToUniformBuffer(UniformBuffer &uniformBuffer, const void *data, size_t size)
+
+static uint32_t sAllocateUniformBlock(UniformHeap& heap, size_t size)
 {
-    BufferCopyRegion region = sUploadToScratchBuffer(data, size);
-    region.dstOffset = uniformBuffer.offset;
-    sUploadScratchBufferToGpuBuffer(sVkUniformBuffer, region);
+    // Round the request up to the next list so any block found is large enough.
+    uint32_t firstLevel = 0;
+    uint32_t secondLevel = 0;
+    sGetUniformLevels(size, firstLevel, secondLevel);
+    size_t searchSize = size + (size_t(1) << (firstLevel - cUniformSecondLevelLog2)) - 1;
+    sGetUniformLevels(searchSize, firstLevel, secondLevel);
+
+    uint32_t secondLevelMap = heap.secondLevelBitmaps[firstLevel] & (~0u << secondLevel);
+    if(secondLevelMap == 0)
+    {
+        uint64_t firstLevelMap = firstLevel + 1 < cUniformFirstLevelCount
+            ? heap.firstLevelBitmap & (~uint64_t(0) << (firstLevel + 1))
+            : 0;
+        if(firstLevelMap == 0)
+        {
+            return ~0u;
+        }
+        firstLevel = uint32_t(std::countr_zero(firstLevelMap));
+        secondLevelMap = heap.secondLevelBitmaps[firstLevel];
+    }
+    secondLevel = uint32_t(std::countr_zero(secondLevelMap));
+    uint32_t blockIndex = heap.freeHeads[firstLevel][secondLevel];
+    ASSERT(blockIndex != ~0u && heap.blocks[blockIndex].size >= size);
+    sRemoveFreeUniformBlock(heap, blockIndex);
+
+    // Split off the remainder, new block can reallocate the block list.
+    size_t remainder = heap.blocks[blockIndex].size - size;
+    if(remainder >= sVkUniformAlignment)
+    {
+        uint32_t restIndex = sNewUniformBlock(heap);
+        UniformHeapBlock& block = heap.blocks[blockIndex];
+        UniformHeapBlock& rest = heap.blocks[restIndex];
+        rest.offset = block.offset + size;
+        rest.size = remainder;
+        rest.prevPhysical = blockIndex;
+        rest.nextPhysical = block.nextPhysical;
+        if(block.nextPhysical != ~0u)
+        {
+            heap.blocks[block.nextPhysical].prevPhysical = restIndex;
+        }
+        block.nextPhysical = restIndex;
+        block.size = size;
+        sInsertFreeUniformBlock(heap, restIndex);
+    }
+    heap.usedBytes += heap.blocks[blockIndex].size;
+    heap.allocationCount++;
+    return blockIndex;
 }
 
-void uploadToImage(uint32_t width, uint32_t height, uint32_t pixelSize,
-    Image& targetImage, void* data, uint32_t dataSize)
+static void sFreeUniformBlock(UniformHeap& heap, uint32_t blockIndex)
 {
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
-    int64_t frameIndex = getFrameIndexWrapped();
-
-    Buffer &scratchBuffer = sVkScratchBuffer[frameIndex];
-
-    ASSERT(data != nullptr || dataSize > 0u);
-    VkDeviceSize size = scratchBuffer.size;
-    ASSERT(size);
-
-    ASSERT(size >= width * height * pixelSize);
-    ASSERT(targetImage.image);
+    ASSERT_RETURN(blockIndex < heap.blocks.size() && !heap.blocks[blockIndex].free);
+    heap.usedBytes -= heap.blocks[blockIndex].size;
+    heap.allocationCount--;
 
-    BufferCopyRegion copyRegion = sUploadToScratchBuffer(data, dataSize);
+    // Merge with free neighbours, the absorbed block goes back to the unused list.
+    uint32_t prevIndex = heap.blocks[blockIndex].prevPhysical;
+    if(prevIndex != ~0u && heap.blocks[prevIndex].free)
     {
-        imageBarrier(targetImage,
-            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-        flushBarriers();
+        sRemoveFreeUniformBlock(heap, prevIndex);
+        UniformHeapBlock& prev = heap.blocks[prevIndex];
+        const UniformHeapBlock& block = heap.blocks[blockIndex];
+        prev.size += block.size;
+        prev.nextPhysical = block.nextPhysical;
+        if(block.nextPhysical != ~0u)
+        {
+            heap.blocks[block.nextPhysical].prevPhysical = prevIndex;
+        }
+        heap.unusedBlocks.push_back(blockIndex);
+        blockIndex = prevIndex;
     }
+    uint32_t nextIndex = heap.blocks[blockIndex].nextPhysical;
+    if(nextIndex != ~0u && heap.blocks[nextIndex].free)
+    {
+        sRemoveFreeUniformBlock(heap, nextIndex);
+        UniformHeapBlock& block = heap.blocks[blockIndex];
+        const UniformHeapBlock& next = heap.blocks[nextIndex];
+        block.size += next.size;
+        block.nextPhysical = next.nextPhysical;
+        if(next.nextPhysical != ~0u)
+        {
+            heap.blocks[next.nextPhysical].prevPhysical = blockIndex;
+        }
+        heap.unusedBlocks.push_back(nextIndex);
+    }
+    sInsertFreeUniformBlock(heap, blockIndex);
+}
 
-    VkBufferImageCopy2 region{
-        .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
-        .bufferOffset = copyRegion.srcOffset,
-        .bufferRowLength = 0,
-        .bufferImageHeight = 0,
-        .imageSubresource {
-            .aspectMask = sGetAspectMaskFromFormat(targetImage.format),
-            .mipLevel = 0,
-            .baseArrayLayer = 0,
-            .layerCount = 1,
-        },
-        .imageOffset = { 0, 0, 0 },
-        .imageExtent = { width, height, 1 },
-    };
-
-    VkCopyBufferToImageInfo2 imageInfo = {
-        .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
-        .srcBuffer = scratchBuffer.buffer,
-        .dstImage = targetImage.image,
-        .dstImageLayout = targetImage.layout,
-        .regionCount = 1,
-        .pRegions = &region,
-    };
+static bool sAddUniformHeap(size_t size)
+{
+    ASSERT_RETURN_FALSE(sVkUniformHeapCount < uint32_t(CarpVk::MaxUniformBuffers));
+    if(sVkUniformHeapCount == 0)
+    {
+        VkPhysicalDeviceProperties prop;
+        vkGetPhysicalDeviceProperties(sVkPhysicalDevice, &prop);
+        // At least 16 bytes so the two level lists have room for the second level bits.
+        sVkUniformAlignment = MAX_VALUE(size_t(prop.limits.minUniformBufferOffsetAlignment), size_t(16));
+    }
+    size = (size + sVkUniformAlignment - 1) & ~(sVkUniformAlignment - 1);
 
-    vkCmdCopyBufferToImage2(commandBuffer, &imageInfo);
+    UniformHeap& heap = sVkUniformHeaps[sVkUniformHeapCount];
+    heap = UniformHeap{};
+    if(!createBuffer(size,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        "Uniform buffers", heap.buffer))
+    {
+        return false;
+    }
+    for(uint32_t i = 0; i < cUniformFirstLevelCount; ++i)
+    {
+        for(uint32_t j = 0; j < cUniformSecondLevelCount; ++j)
+        {
+            heap.freeHeads[i][j] = ~0u;
+        }
+    }
+    uint32_t blockIndex = sNewUniformBlock(heap);
+    heap.blocks[blockIndex].size = size;
+    sInsertFreeUniformBlock(heap, blockIndex);
+    sVkUniformHeapCount++;
+    return true;
 }
 
-
-void destroyBuffer(Buffer& buffer)
+static void sRecycleUniformBlocks()
 {
-    if(!sVkAllocator)
+    if(sVkUniformPendingFrees.empty())
+    {
         return;
-    if(buffer.buffer && buffer.allocation)
+    }
+    uint64_t completedValue = getCompletedSubmissionValue();
+    uint32_t writeIndex = 0;
+    for(const UniformPendingFree& pending : sVkUniformPendingFrees)
     {
-        vmaDestroyBuffer(sVkAllocator, buffer.buffer, buffer.allocation);
+        if(pending.submissionValue <= completedValue)
+        {
+            sFreeUniformBlock(sVkUniformHeaps[pending.bufferIndex], pending.blockIndex);
+        }
+        else
+        {
+            sVkUniformPendingFrees[writeIndex++] = pending;
+        }
     }
-    buffer = Buffer{};
+    sVkUniformPendingFrees.resize(writeIndex);
 }
 
-
-
-
-
-
-void imageBarrier(Image& image,
-    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout)
+static void sDestroyUniformHeaps()
 {
-    if(image.accessMask == dstAccessMask && image.layout == newLayout && image.stageMask == dstStageMask)
-        return;
-    imageBarrier(image, image.stageMask, image.accessMask, image.layout,
-        dstStageMask, dstAccessMask, newLayout);
+    for(uint32_t i = 0; i < sVkUniformHeapCount; ++i)
+    {
+        destroyBuffer(sVkUniformHeaps[i].buffer);
+        sVkUniformHeaps[i] = UniformHeap{};
+    }
+    sVkUniformHeapCount = 0;
+    sVkUniformPendingFrees.clear();
 }
 
-void imageBarrier(Image& image,
-    VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
-    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout)
+static bool sCreateDynamicUniformRing(size_t frameSize)
 {
-    if(image.accessMask == dstAccessMask && image.layout == newLayout && image.stageMask == dstStageMask)
-        return;
-
+    VkPhysicalDeviceProperties prop;
+    vkGetPhysicalDeviceProperties(sVkPhysicalDevice, &prop);
 
-    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat((VkFormat)image.format);
-    imageBarrier(image.image, srcStageMask, srcAccessMask, oldLayout,
-        dstStageMask, dstAccessMask, newLayout, aspectMask);
-    image.stageMask = dstStageMask;
-    image.accessMask = dstAccessMask;
-    image.layout = newLayout;
+    DynamicUniformRing& ring = sVkDynamicUniformRing;
+    ring.alignment = size_t(prop.limits.minUniformBufferOffsetAlignment);
+    ring.range = MIN_VALUE(cVulkanDynamicUniformRange, size_t(prop.limits.maxUniformBufferRange));
+    frameSize = frameSize > 0 ? frameSize : cVulkanDynamicUniformRingSize;
+    ring.frameSize = (frameSize + ring.alignment - 1) & ~(ring.alignment - 1);
+    return createBuffer(ring.frameSize * CarpVk::FramesInFlight + ring.range,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+        "Dynamic uniform ring", ring.buffer);
 }
 
-void imageBarrier(VkImage image,
-    VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
-    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout,
-    uint32_t aspectMask)
+static void sFreeReadback(uint32_t index)
 {
-    if(srcAccessMask == dstAccessMask && oldLayout == newLayout && srcStageMask == dstStageMask)
-        return;
-
-    VkImageMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
-    barrier.srcAccessMask = srcAccessMask;
-    barrier.dstAccessMask = dstAccessMask;
-    barrier.srcStageMask = srcStageMask;
-    barrier.dstStageMask = dstStageMask;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
-    barrier.srcQueueFamilyIndex = sVkQueueIndex;
-    barrier.dstQueueFamilyIndex = sVkQueueIndex;
-    barrier.image = image;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.aspectMask = aspectMask;
-    // Andoird error?
-    barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
-    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+    uint32_t generation = sVkReadbacks[index].generation + 1;
+    sVkReadbacks[index] = Readback{ .generation = generation };
+    sVkReadbackFreeSlots.push_back(index);
+}
 
-    sVkImageBarriers.push_back(barrier);
+static bool sIsReadbackTicketValid(ReadbackTicket ticket)
+{
+    return ticket.index < sVkReadbacks.size() && sVkReadbacks[ticket.index].used
+        && sVkReadbacks[ticket.index].generation == ticket.generation;
 }
 
-void bufferBarrier(UniformBuffer& uniformBuffer,
-     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+static void sCompleteReadback(uint32_t index)
 {
-    Buffer& buffer = sVkUniformBuffer;
-    if(buffer.stageMask == dstStageMask && buffer.accessMask == dstAccessMask)
+    Readback& readback = sVkReadbacks[index];
+    const StagingAllocation& allocation = readback.allocation;
+    VK_CHECK_CALL(vmaInvalidateAllocation(sVkAllocator, allocation.allocation,
+        allocation.region.srcOffset, allocation.region.size));
+    readback.ready = true;
+    if(readback.doneFn)
     {
+        readback.doneFn(allocation.data, readback.size, readback.userData);
+        sFreeReadback(index);
         return;
     }
-    bufferBarrier(buffer.buffer,
-        buffer.stageMask, buffer.accessMask,
-        dstStageMask, dstAccessMask, uniformBuffer.size, uniformBuffer.offset);
-
-    buffer.accessMask = dstAccessMask;
-    buffer.stageMask = dstStageMask;
+    // Ring memory is reused after the frame slot comes around again, polled data has to outlive it.
+    const uint8_t* data = (const uint8_t*)allocation.data;
+    readback.data.assign(data, data + readback.size);
 }
 
-
-void bufferBarrier(Buffer& buffer,
-     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+// Before the slot's readback memory is reset, the slot's submission has finished by then.
+static void sCompleteReadbacks()
 {
-    if(buffer.stageMask == dstStageMask && buffer.accessMask == dstAccessMask)
+    uint64_t completedValue = getCompletedSubmissionValue();
+    for(uint32_t i = 0; i < sVkReadbacks.size(); ++i)
     {
-        return;
+        const Readback& readback = sVkReadbacks[i];
+        if(readback.used && !readback.ready && readback.submissionValue <= completedValue)
+        {
+            sCompleteReadback(i);
+        }
     }
-    bufferBarrier(buffer.buffer,
-        buffer.stageMask, buffer.accessMask,
-        dstStageMask, dstAccessMask,
-        buffer.size, 0);
-
-    buffer.accessMask = dstAccessMask;
-    buffer.stageMask = dstStageMask;
 }
 
-void bufferBarrier(VkBuffer buffer,
-
-    const VkPipelineStageFlags2 srcStageMask, const VkAccessFlags2 srcAccessMask,
-    const VkPipelineStageFlags2 dstStageMask, const VkAccessFlags2 dstAccessMask,
-    const size_t size, const size_t offset)
+// Slot must not be in use by the gpu anymore.
+static void sResetDynamicUniformRing(uint32_t slot)
 {
-    if(srcAccessMask == dstAccessMask && srcStageMask == dstStageMask)
-        return;
-
-    ASSERT(size > 0);
-    VkBufferMemoryBarrier2 bufferBarrier = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
-        .srcStageMask = srcStageMask,
-        .srcAccessMask = srcAccessMask,
-        .dstStageMask = dstStageMask,
-        .dstAccessMask = dstAccessMask,
-        .srcQueueFamilyIndex = sVkQueueIndex,
-        .dstQueueFamilyIndex = sVkQueueIndex,
-        .buffer = buffer,
-        .offset = offset,
-        .size = size,
-    };
-
-    sVkBufferBarriers.push_back(bufferBarrier);
+    DynamicUniformRing& ring = sVkDynamicUniformRing;
+    ring.frameStart = ring.frameSize * slot;
+    ring.head = ring.frameStart;
+    ring.flushedHead = ring.frameStart;
 }
 
-
-
-bool createShader(const char* code, int codeSize, VkShaderModule& outModule)
+// No-op on host coherent memory.
+static void sFlushDynamicUniformRing()
 {
-    VkShaderModuleCreateInfo createInfo = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
-    createInfo.codeSize = codeSize;
-    createInfo.pCode = (uint32_t*)code;
-    VK_CHECK_CALL(vkCreateShaderModule(sVkDevice, &createInfo, nullptr, &outModule));
-    ASSERT_RETURN_FALSE(outModule);
-    return true;
+    DynamicUniformRing& ring = sVkDynamicUniformRing;
+    if(ring.head > ring.flushedHead)
+    {
+        VK_CHECK_CALL(vmaFlushAllocation(sVkAllocator, ring.buffer.allocation,
+            ring.flushedHead, ring.head - ring.flushedHead));
+        ring.flushedHead = ring.head;
+    }
 }
 
-bool createShader(const char* filename, VkShaderModule& outModule)
+// Slot must not be in use by the gpu anymore.
+static void sResetStagingRing(StagingRing& ring, uint32_t slot)
 {
-    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+    std::vector<Buffer>& blocks = ring.blocks[slot];
+    if(blocks.size() <= 1 || ring.usedBlocks[slot] >= blocks.size())
+    {
+        ring.lastNeededFrame[slot] = sVkFrameIndex;
+    }
 
-    if (!file.is_open())
+    if(ring.shrinkIdleFrames > 0 && sVkFrameIndex - ring.lastNeededFrame[slot] >= int64_t(ring.shrinkIdleFrames))
     {
-        printf("Failed to load file: %s\n", filename);
-        return false;
+        size_t keepCount = MAX_VALUE(size_t(ring.usedBlocks[slot]), size_t(1));
+        while(blocks.size() > keepCount)
+        {
+            ring.stats.allocatedBytes -= blocks.back().size;
+            ring.stats.blockCount--;
+            destroyBuffer(blocks.back());
+            blocks.pop_back();
+        }
+        ring.stats.shrinkCount++;
+        ring.lastNeededFrame[slot] = sVkFrameIndex;
     }
 
-    std::vector<char> buffer;
+    ring.usedBlocks[slot] = 0;
+    ring.currentBlock = 0;
+    ring.currentOffset = 0;
+    ring.frameBytes = 0;
+}
 
-    std::streamsize fileSize = file.tellg();
-    buffer.resize(fileSize);
-    file.seekg(0);
-    file.read(buffer.data(), fileSize);
-    file.close();
+static StagingAllocation sAllocateFromStagingRing(StagingRing& ring, size_t size)
+{
+    uint32_t slot = uint32_t(getFrameIndexWrapped());
+    std::vector<Buffer>& blocks = ring.blocks[slot];
+    ASSERT(!blocks.empty());
+    ASSERT(size > 0);
 
-    return createShader(buffer.data(), (int)buffer.size(), outModule);
+    size_t roundedUpSize = (size + 255) & (~(size_t(255)));
+    if(ring.currentOffset + roundedUpSize > blocks[ring.currentBlock].size)
+    {
+        // Chain to the next block, the unused tail of the current one is wasted for this frame.
+        uint32_t nextBlock = ring.currentBlock + 1;
+        while(nextBlock < blocks.size() && blocks[nextBlock].size < roundedUpSize)
+        {
+            ++nextBlock;
+        }
+        if(nextBlock >= blocks.size())
+        {
+            if(!sAddStagingBlock(ring, slot, roundedUpSize))
+            {
+                ASSERT(false);
+                return {};
+            }
+            ring.stats.growCount++;
+            nextBlock = uint32_t(blocks.size() - 1);
+        }
+        ring.currentBlock = nextBlock;
+        ring.currentOffset = 0;
+    }
 
+    Buffer &stagingBuffer = blocks[ring.currentBlock];
+    ASSERT(stagingBuffer.data);
+    size_t currentOffset = ring.currentOffset;
+
+    ring.currentOffset += roundedUpSize;
+    ring.frameBytes += roundedUpSize;
+    ring.usedBlocks[slot] = MAX_VALUE(ring.usedBlocks[slot], ring.currentBlock + 1);
+    ring.stats.lastFrameBytes = ring.frameBytes;
+    ring.stats.highWaterMark = MAX_VALUE(ring.stats.highWaterMark, uint64_t(ring.frameBytes));
+
+    return {
+        .buffer = stagingBuffer.buffer,
+        .region = { .srcOffset = currentOffset, .size = roundedUpSize },
+        .data = (unsigned char *)stagingBuffer.data + currentOffset,
+        .allocation = stagingBuffer.allocation,
+    };
 }
 
-
-VkDescriptorSetLayout createSetLayout(const DescriptorSetLayout* descriptors, int32_t count)
+static StagingAllocation sUploadToStagingRing(StagingRing& ring, const void *data, size_t size)
 {
-    ASSERT(count > 0);
-    ASSERT(count < 16);
+    StagingAllocation allocation = sAllocateFromStagingRing(ring, size);
+    if(allocation.data)
+    {
+        memcpy(allocation.data, data, size);
+        vmaFlushAllocation(sVkAllocator, allocation.allocation, allocation.region.srcOffset, allocation.region.size);
+    }
+    return allocation;
+}
 
+static void sUploadStagingToGpuBuffer(Buffer &gpuBuffer, const StagingAllocation &allocation)
+{
+    const BufferCopyRegion& region = allocation.region;
+    ASSERT(allocation.buffer);
+    ASSERT(region.dstOffset + region.size <= gpuBuffer.size);
 
-    VkDescriptorSetLayoutBinding setBindings[16] = {};
-    //VkDescriptorBindingFlags setBindingFlags[16] = {};
+    VkBufferCopy copyRegion = {
+        .srcOffset = region.srcOffset,
+        .dstOffset = region.dstOffset,
+        .size = VkDeviceSize(region.size)
+    };
+    bufferBarrier(gpuBuffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+    flushBarriers();
+    vkCmdCopyBuffer(getVkCommandBuffer(), allocation.buffer, gpuBuffer.buffer, 1, &copyRegion);
+}
 
-    for (int32_t i = 0; i < count; ++i)
-    {
-        const DescriptorSetLayout& layout = descriptors[i];
+static size_t sGetStagingBlockSize()
+{
+    size_t blockSize = sVkInstanceBuilder.vulkanInstanceParams.stagingBlockSize;
+    return blockSize > 0 ? blockSize : cVulkanStagingBlockSize;
+}
 
-        setBindings[i] = VkDescriptorSetLayoutBinding{
-            .binding = layout.bindingIndex,
-            .descriptorType = VkDescriptorType(layout.descriptorType),
-            .descriptorCount = 1,
-            .stageFlags = layout.stage, // VK_SHADER_STAGE_VERTEX_BIT;
-            .pImmutableSamplers = layout.immutableSampler ? &layout.immutableSampler : nullptr,
-        };
+static bool sCreateTransferQueueResources()
+{
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkTransferCommandPools[i] = sCreateCommandPool(sVkTransferQueueIndex);
+        if(!sVkTransferCommandPools[i])
+        {
+            printf("Failed to create vulkan transfer command pool!\n");
+            return false;
+        }
 
-        //setBindingFlags[i] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = sVkTransferCommandPools[i];
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+        VK_CHECK_CALL(vkAllocateCommandBuffers(sVkDevice, &allocateInfo, &sVkTransferCommandBuffers[i]));
+        if(!sVkTransferCommandBuffers[i])
+        {
+            printf("Failed to create vulkan transfer command buffer!\n");
+            return false;
+        }
+        static const char *s = "Transfer command buffer";
+        sSetObjectName((uint64_t)sVkTransferCommandBuffers[i], VK_DEBUG_REPORT_OBJECT_TYPE_COMMAND_BUFFER_EXT, s);
     }
-/*
-    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlags = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
-        .pNext = nullptr,
-        .bindingCount = uint32_t(count),
-        .pBindingFlags = setBindingFlags,
-    };
-*/
-    VkDescriptorSetLayoutCreateInfo createInfo = {
-        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-        //.pNext = &bindingFlags,
-        //.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
-        .bindingCount = uint32_t(count),
-        .pBindings = setBindings,
-    };
-
-    VkDescriptorSetLayout setLayout = {};
-    VK_CHECK_CALL(vkCreateDescriptorSetLayout(sVkDevice, &createInfo, nullptr, &setLayout));
-
-    ASSERT(setLayout);
-    return setLayout;
+    const VulkanInstanceParams& params = sVkInstanceBuilder.vulkanInstanceParams;
+    if(!sCreateStagingRing(sVkTransferStagingRing, "Transfer staging buffer",
+        sGetStagingBlockSize(), params.stagingShrinkIdleFrames))
+    {
+        printf("Failed to create transfer staging buffer\n");
+        return false;
+    }
+    sVkTransferTimelineSemaphore = sCreateTimelineSemaphore(0);
+    return sVkTransferTimelineSemaphore != VK_NULL_HANDLE;
 }
 
-
-void destroyShaderModule(VkShaderModule* shaderModules, int32_t shaderModuleCount)
+static void sDestroyTransferQueueResources()
 {
-    for (int32_t i = 0; i < shaderModuleCount; ++i)
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
     {
-        vkDestroyShaderModule(sVkDevice, shaderModules[i], nullptr);
-        shaderModules[i] = {};
+        if(sVkTransferCommandPools[i])
+        {
+            vkDestroyCommandPool(sVkDevice, sVkTransferCommandPools[i], nullptr);
+        }
+        sVkTransferCommandPools[i] = {};
+        sVkTransferCommandBuffers[i] = {};
+    }
+    sDestroyStagingRing(sVkTransferStagingRing);
+    if(sVkTransferTimelineSemaphore)
+    {
+        vkDestroySemaphore(sVkDevice, sVkTransferTimelineSemaphore, nullptr);
     }
+    sVkTransferTimelineSemaphore = {};
 }
 
-VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout descriptorSetLayout)
+// Async uploads only take resources that have never been used on the graphics queue,
+// their old content does not need an ownership transfer to the transfer queue.
+static bool sCanUseTransferQueue(uint64_t stageMask, uint64_t accessMask)
 {
-    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
-    pipelineLayoutCreateInfo.setLayoutCount = 1;
-    pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout;
-    VkPipelineLayout result = {};
-    VK_CHECK_CALL(vkCreatePipelineLayout(sVkDevice, &pipelineLayoutCreateInfo, nullptr, &result));
-    return result;
+    return sVkTransferQueue && !sVkInPreFrame && stageMask == 0 && accessMask == 0;
 }
 
-void destroyPipelines(VkPipeline* pipelines, int32_t pipelineCount)
+static VkCommandBuffer sBeginTransferCommandBuffer()
 {
-    for (int32_t i = 0; i < pipelineCount; ++i)
+    int64_t frameIndex = getFrameIndexWrapped();
+    VkCommandBuffer commandBuffer = sVkTransferCommandBuffers[frameIndex];
+    if(!sVkTransferRecording)
     {
-        vkDestroyPipeline(sVkDevice, pipelines[i], nullptr);
-        pipelines[i] = {};
+        VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+        VK_CHECK_CALL(vkResetCommandPool(sVkDevice, sVkTransferCommandPools[frameIndex], 0));
+        VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+        sVkTransferRecording = true;
     }
+    return commandBuffer;
 }
 
-void destroyPipelineLayouts(VkPipelineLayout* pipelineLayouts, int32_t pipelineLayoutCount)
+// Submits uploads recorded during this frame, graphics acquires them on the next frame.
+static void sSubmitTransferCommandBuffer()
 {
-    for (int32_t i = 0; i < pipelineLayoutCount; ++i)
+    if(!sVkTransferRecording)
     {
-        vkDestroyPipelineLayout(sVkDevice, pipelineLayouts[i], nullptr);
-        pipelineLayouts[i] = {};
+        return;
     }
-}
+    int64_t frameIndex = getFrameIndexWrapped();
+    VkCommandBuffer commandBuffer = sVkTransferCommandBuffers[frameIndex];
+    VK_CHECK_CALL(vkEndCommandBuffer(commandBuffer));
+    sVkTransferRecording = false;
 
-void destroyDescriptorSetLayouts(VkDescriptorSetLayout* layouts, int32_t amount)
-{
-    for (int32_t i = 0; i < amount; ++i)
+    VkCommandBufferSubmitInfo commandBufferSubmitInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .commandBuffer = commandBuffer,
+    };
+
+    uint64_t submissionValue = ++sVkTransferSubmissionValue;
+    VkSemaphoreSubmitInfo signalInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkTransferTimelineSemaphore,
+        .value = submissionValue,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+    };
+
+    VkSubmitInfo2 submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = &commandBufferSubmitInfo,
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = &signalInfo
+    };
+    VK_CHECK_CALL(vkQueueSubmit2(sVkTransferQueue, 1, &submitInfo, VK_NULL_HANDLE));
+    sVkTransferFrameSubmissionValues[frameIndex] = submissionValue;
+
+    for(const TransferAcquire& acquire : sVkTransferRecordedAcquires)
     {
-        vkDestroyDescriptorSetLayout(sVkDevice, layouts[i], nullptr);
-        layouts[i] = {};
+        sVkTransferPendingAcquires.push_back(acquire);
     }
+    sVkTransferRecordedAcquires.clear();
+    sVkTransferPendingValue = submissionValue;
 }
 
-
-void destroyDescriptorPools(VkDescriptorPool* pools, int32_t poolCount)
+// Queues the acquire half of the ownership transfers into the graphics barriers.
+static void sAcquireTransferredResources()
 {
-    for (int32_t i = 0; i < poolCount; ++i)
+    if(sVkTransferPendingAcquires.empty())
     {
-        vkDestroyDescriptorPool(sVkDevice, pools[i], nullptr);
-        pools[i] = {};
+        return;
+    }
+    for(const TransferAcquire& acquire : sVkTransferPendingAcquires)
+    {
+        if(acquire.image)
+        {
+            sVkImageBarriers.push_back(acquire.imageBarrier);
+            acquire.image->stageMask = acquire.imageBarrier.dstStageMask;
+            acquire.image->accessMask = acquire.imageBarrier.dstAccessMask;
+            acquire.image->layout = acquire.imageBarrier.newLayout;
+            acquire.image->pendingAcquire = false;
+        }
+        if(acquire.buffer)
+        {
+            sVkBufferBarriers.push_back(acquire.bufferBarrier);
+            acquire.buffer->stageMask = acquire.bufferBarrier.dstStageMask;
+            acquire.buffer->accessMask = acquire.bufferBarrier.dstAccessMask;
+            acquire.buffer->pendingAcquire = false;
+        }
     }
+    sVkTransferPendingAcquires.clear();
+
+    // Acquire barriers wait at copy stage, work that does not touch the uploads
+    // can overlap with the transfer queue.
+    sVkGraphicsWaitInfos.push_back(VkSemaphoreSubmitInfo{
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkTransferTimelineSemaphore,
+        .value = sVkTransferPendingValue,
+        .stageMask = VK_PIPELINE_STAGE_2_COPY_BIT
+    });
 }
 
-
-
-VkInstance_T* getVkInstance()
+static bool sCreateComputeQueueResources()
 {
-    return sVkInstance;
-}
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkComputeCommandPools[i] = sCreateCommandPool(sVkComputeQueueIndex);
+        if(!sVkComputeCommandPools[i])
+        {
+            printf("Failed to create vulkan compute command pool!\n");
+            return false;
+        }
 
-VkDevice_T* getVkDevice()
-{
-    return sVkDevice;
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = sVkComputeCommandPools[i];
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1;
+        VK_CHECK_CALL(vkAllocateCommandBuffers(sVkDevice, &allocateInfo, &sVkComputeCommandBuffers[i]));
+        if(!sVkComputeCommandBuffers[i])
+        {
+            printf("Failed to create vulkan compute command buffer!\n");
+            return false;
+        }
+        static const char *s = "Async compute command buffer";
+        sSetObjectName((uint64_t)sVkComputeCommandBuffers[i], VK_DEBUG_REPORT_OBJECT_TYPE_COMMAND_BUFFER_EXT, s);
+    }
+    sVkComputeTimelineSemaphore = sCreateTimelineSemaphore(0);
+    return sVkComputeTimelineSemaphore != VK_NULL_HANDLE;
 }
 
-
-VkCommandBuffer_T* getVkCommandBuffer()
+static void sDestroyComputeQueueResources()
 {
-    int64_t frameIndex = getFrameIndexWrapped();
-    VkCommandBuffer commandBuffer = sVkCommandBuffers[frameIndex];
-    return commandBuffer;
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        if(sVkComputeCommandPools[i])
+        {
+            vkDestroyCommandPool(sVkDevice, sVkComputeCommandPools[i], nullptr);
+        }
+        sVkComputeCommandPools[i] = {};
+        sVkComputeCommandBuffers[i] = {};
+    }
+    if(sVkComputeTimelineSemaphore)
+    {
+        vkDestroySemaphore(sVkDevice, sVkComputeTimelineSemaphore, nullptr);
+    }
+    sVkComputeTimelineSemaphore = {};
 }
 
-VkDescriptorPool getVkDescriptorPool()
+static uint32_t sGetQueueFamilyIndex(QueueType queueType)
 {
-    return sVkDescriptorPool;
+    switch(queueType)
+    {
+        case QueueType::GRAPHICS: return sVkQueueIndex;
+        case QueueType::ASYNC_COMPUTE: return sVkComputeQueue ? sVkComputeQueueIndex : sVkQueueIndex;
+        case QueueType::TRANSFER: return sVkTransferQueue ? sVkTransferQueueIndex : sVkQueueIndex;
+    }
+    return sVkQueueIndex;
 }
 
-const CarpSwapChainFormats& getSwapChainFormats()
+// Family of the command buffer barriers are currently recorded into.
+static uint32_t sGetRecordingQueueFamilyIndex()
 {
-    return sVkSwapchainFormats;
+    if(sVkThreadCommandBuffer)
+        return sVkQueueIndex;
+    return sVkAsyncComputeRecording ? sVkComputeQueueIndex : sVkQueueIndex;
 }
 
+static PipelineCacheFileHeader sGetPipelineCacheFileHeader(uint64_t dataSize)
+{
+    VkPhysicalDeviceProperties prop;
+    vkGetPhysicalDeviceProperties(sVkPhysicalDevice, &prop);
 
+    PipelineCacheFileHeader header = {
+        .magic = cPipelineCacheFileMagic,
+        .version = cPipelineCacheFileVersion,
+        .vendorID = prop.vendorID,
+        .deviceID = prop.deviceID,
+        .driverVersion = prop.driverVersion,
+        .dataSize = dataSize,
+    };
+    memcpy(header.pipelineCacheUUID, prop.pipelineCacheUUID, VK_UUID_SIZE);
+    return header;
+}
 
-VkPipeline createGraphicsPipeline(const GPBuilder& builder, const char* pipelineName)
+static bool sLoadPipelineCacheFile(std::vector<char>& outData)
 {
-    VkDevice device = getVkDevice();
+    outData.clear();
+    if(sVkPipelineCacheFilename[0] == '\0')
+    {
+        return false;
+    }
 
-    VkPipelineVertexInputStateCreateInfo vertexInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+    std::ifstream file(sVkPipelineCacheFilename, std::ios::ate | std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
 
-    VkPipelineInputAssemblyStateCreateInfo assemblyInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
-    assemblyInfo.topology = builder.topology;
-    assemblyInfo.primitiveRestartEnable = VK_FALSE;
+    std::streamsize fileSize = file.tellg();
+    file.seekg(0);
+    if(fileSize < std::streamsize(sizeof(PipelineCacheFileHeader)))
+    {
+        printf("Pipeline cache file too small, discarding: %s\n", sVkPipelineCacheFilename);
+        return false;
+    }
 
-    VkPipelineViewportStateCreateInfo viewportInfo = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
-    viewportInfo.scissorCount = 1;
-    viewportInfo.viewportCount = 1;
+    PipelineCacheFileHeader fileHeader = {};
+    file.read((char*)&fileHeader, sizeof(PipelineCacheFileHeader));
 
-    VkPipelineRasterizationStateCreateInfo rasterInfo = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
-    rasterInfo.lineWidth = 1.0f;
-    if (builder.topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+    PipelineCacheFileHeader deviceHeader = sGetPipelineCacheFileHeader(fileHeader.dataSize);
+    if(fileHeader.magic != deviceHeader.magic
+        || fileHeader.version != deviceHeader.version
+        || fileHeader.vendorID != deviceHeader.vendorID
+        || fileHeader.deviceID != deviceHeader.deviceID
+        || fileHeader.driverVersion != deviceHeader.driverVersion
+        || memcmp(fileHeader.pipelineCacheUUID, deviceHeader.pipelineCacheUUID, VK_UUID_SIZE) != 0)
     {
-        rasterInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE; // VK_FRONT_FACE_CLOCKWISE;
-        rasterInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+        printf("Pipeline cache file is for another device or driver, discarding: %s\n", sVkPipelineCacheFilename);
+        return false;
     }
-    else
+    if(fileHeader.dataSize != uint64_t(fileSize) - sizeof(PipelineCacheFileHeader))
     {
-        rasterInfo.cullMode = VK_CULL_MODE_NONE;
-        // notice VkPhysicalDeviceFeatures .fillModeNonSolid = VK_TRUE required
-        //rasterInfo.polygonMode = VK_POLYGON_MODE_LINE;
+        printf("Pipeline cache file size mismatch, discarding: %s\n", sVkPipelineCacheFilename);
+        return false;
     }
-    VkPipelineMultisampleStateCreateInfo multiSampleInfo = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
-    multiSampleInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
-    VkPipelineDepthStencilStateCreateInfo depthInfo = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
-    depthInfo.depthTestEnable = builder.depthTest ? VK_TRUE : VK_FALSE;
-    depthInfo.depthWriteEnable = builder.writeDepth ? VK_TRUE : VK_FALSE;
-    depthInfo.depthCompareOp = builder.depthCompareOp;
-
-    VkPipelineColorBlendStateCreateInfo blendInfo = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
-        .attachmentCount = (uint32_t)builder.blendChannelCount,
-        .pAttachments = builder.blendChannels,
-    };
-
-    VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
-    VkPipelineDynamicStateCreateInfo dynamicInfo = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
-    dynamicInfo.pDynamicStates = dynamicStates;
-    dynamicInfo.dynamicStateCount = ARRAYSIZES(dynamicStates);
 
+    outData.resize(fileHeader.dataSize);
+    file.read(outData.data(), std::streamsize(fileHeader.dataSize));
+    if(!file)
+    {
+        outData.clear();
+        return false;
+    }
+    return true;
+}
 
-    VkGraphicsPipelineCreateInfo createInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
-    createInfo.stageCount = builder.stageInfoCount;
-    createInfo.pStages = builder.stageInfos;
-    createInfo.pVertexInputState = &vertexInfo;
-    createInfo.pInputAssemblyState = &assemblyInfo;
-    createInfo.pViewportState = &viewportInfo;
-    createInfo.pRasterizationState = &rasterInfo;
-    createInfo.pMultisampleState = &multiSampleInfo;
-    createInfo.pDepthStencilState = &depthInfo;
-    createInfo.pColorBlendState = &blendInfo;
-    createInfo.pDynamicState = &dynamicInfo;
-    createInfo.renderPass = VK_NULL_HANDLE;
-    createInfo.layout = builder.pipelineLayout;
-    createInfo.basePipelineHandle = VK_NULL_HANDLE;
+static bool sCreatePipelineCache()
+{
+    std::vector<char> data;
+    sLoadPipelineCacheFile(data);
 
+    VkPipelineCacheCreateInfo createInfo = { VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.size() > 0 ? data.data() : nullptr;
 
-    //Needed for dynamic rendering
+    VkResult res = vkCreatePipelineCache(sVkDevice, &createInfo, nullptr, &sVkPipelineCache);
+    if(res != VK_SUCCESS && data.size() > 0)
+    {
+        // Driver rejected the blob, start with an empty cache.
+        createInfo.initialDataSize = 0;
+        createInfo.pInitialData = nullptr;
+        res = vkCreatePipelineCache(sVkDevice, &createInfo, nullptr, &sVkPipelineCache);
+        data.clear();
+    }
+    VK_CHECK_CALL(res);
 
-    const VkPipelineRenderingCreateInfo pipelineRenderingCreateInfo{
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
-        .colorAttachmentCount = (uint32_t)builder.colorFormatCount,
-        .pColorAttachmentFormats = builder.colorFormats,
-        .depthAttachmentFormat = builder.depthFormat,
-    };
+    sVkPipelineCacheStats.loadedBytes = data.size();
+    return res == VK_SUCCESS;
+}
 
-    createInfo.pNext = &pipelineRenderingCreateInfo;
+static void sRecordPipelineCreationFeedback(const VkPipelineCreationFeedback& feedback)
+{
+    if((feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT) == 0)
+    {
+        sVkPipelineCacheUnknown++;
+        return;
+    }
+    if(feedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT)
+    {
+        sVkPipelineCacheHits++;
+    }
+    else
+    {
+        sVkPipelineCacheMisses++;
+    }
+    sVkPipelineCreationTimeNs += feedback.duration;
+}
 
+static void sInitGpuTimestamps()
+{
+    VkPhysicalDeviceProperties prop;
+    vkGetPhysicalDeviceProperties(sVkPhysicalDevice, &prop);
+    sVkTimestampPeriod = prop.limits.timestampPeriod;
 
-    VkPipeline pipeline = {};
-    VK_CHECK_CALL(vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &createInfo, nullptr, &pipeline));
-    ASSERT(pipeline);
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(sVkPhysicalDevice, &queueFamilyCount, nullptr);
+    ASSERT(queueFamilyCount < 256 && sVkQueueIndex < queueFamilyCount);
+    VkQueueFamilyProperties queueFamilies[256];
+    vkGetPhysicalDeviceQueueFamilyProperties(sVkPhysicalDevice, &queueFamilyCount, queueFamilies);
 
-     sSetObjectName((uint64_t)pipeline, VK_DEBUG_REPORT_OBJECT_TYPE_PIPELINE_EXT, pipelineName);
+    uint32_t validBits = queueFamilies[sVkQueueIndex].timestampValidBits;
+    sVkTimestampMask = validBits >= 64 ? ~0ull : ((1ull << validBits) - 1ull);
+}
 
-    return pipeline;
+static GpuTimerHistory& sGetGpuTimerHistory(const char* name)
+{
+    for(GpuTimerHistory& history : sVkGpuTimerHistories)
+    {
+        if(history.name == name || strcmp(history.name, name) == 0)
+        {
+            return history;
+        }
+    }
+    sVkGpuTimerHistories.push_back(GpuTimerHistory{ .name = name });
+    return sVkGpuTimerHistories.back();
 }
 
-VkPipeline createComputePipeline(const CPBuilder& builder, const char* pipelineName)
+static void sPushGpuTimerSample(GpuTimerHistory& history)
 {
-    VkComputePipelineCreateInfo createInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
-
-    createInfo.stage = builder.stageInfo;
-    createInfo.layout = builder.pipelineLayout;
-
-    VkPipeline pipeline = {};
-    VK_CHECK_CALL(vkCreateComputePipelines(sVkDevice, VK_NULL_HANDLE,
-        1, &createInfo, nullptr, &pipeline));
-    ASSERT(pipeline);
-
-
-    sSetObjectName((uint64_t)pipeline, VK_DEBUG_REPORT_OBJECT_TYPE_PIPELINE_EXT, pipelineName);
-    return pipeline;
+    if(history.count == CarpVk::GpuTimerHistoryLength)
+    {
+        history.sum -= history.samples[history.head];
+    }
+    else
+    {
+        history.count++;
+    }
+    history.samples[history.head] = history.frameMilliseconds;
+    history.sum += history.frameMilliseconds;
+    history.head = (history.head + 1) % CarpVk::GpuTimerHistoryLength;
 }
 
-
-bool updateBindDescriptorSet(VkDescriptorSet descriptorSet,
-    const DescriptorSetLayout* descriptorSetLayout,
-    const DescriptorInfo* descriptorSetInfos, int descriptorSetCount)
+// Reads back timestamps from the frame that used this frame index last time.
+// Must be called after the frame has been waited.
+static void sResolveGpuTimers(int64_t frameIndex)
 {
-    constexpr static int MAX_DESCRIPTOR_COUNT = 32;
-    ASSERT_RETURN_FALSE(descriptorSetCount <= MAX_DESCRIPTOR_COUNT);
-    ASSERT_RETURN_FALSE(descriptorSetCount > 0);
-    ASSERT_RETURN_FALSE(descriptorSetLayout);
-    ASSERT_RETURN_FALSE(descriptorSet);
-    ASSERT_RETURN_FALSE(descriptorSetInfos);
-
-    VkWriteDescriptorSet writeDescriptorSets[MAX_DESCRIPTOR_COUNT];
-    VkDescriptorBufferInfo bufferInfos[MAX_DESCRIPTOR_COUNT];
-    VkDescriptorImageInfo imageInfos[MAX_DESCRIPTOR_COUNT];
+    std::vector<GpuTimerQuery>& timers = sVkGpuTimers[frameIndex];
+    uint32_t queryCount = sVkQueryPoolIndexCounts[frameIndex];
+    if(queryCount == 0 || timers.empty())
+    {
+        timers.clear();
+        return;
+    }
 
-    uint32_t writeIndex = 0u;
-    uint32_t bufferCount = 0u;
-    uint32_t imageCount = 0u;
-    for(int i = 0; i < descriptorSetCount; ++i)
+    uint64_t timestamps[CarpVk::QueryCount] = {};
+    VkResult res = vkGetQueryPoolResults(sVkDevice, sVkQueryPools[frameIndex],
+        0, queryCount, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+    if(res != VK_SUCCESS)
     {
-        if(descriptorSetInfos[i].type == DescriptorInfo::DescriptorType::BUFFER)
-        {
-            const VkDescriptorBufferInfo &bufferInfo = descriptorSetInfos[i].bufferInfo;
-            ASSERT(bufferInfo.buffer);
-            ASSERT(bufferInfo.range > 0u);
-            bufferInfos[bufferCount] = bufferInfo;
+        // Never submitted, VK_NOT_READY
+        timers.clear();
+        return;
+    }
 
-            VkWriteDescriptorSet descriptor{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-            descriptor.dstSet = descriptorSet;
-            descriptor.dstArrayElement = 0;
-            descriptor.descriptorType = descriptorSetLayout[i].descriptorType;
-            descriptor.dstBinding = descriptorSetLayout[i].bindingIndex;
-            descriptor.pBufferInfo = &bufferInfos[bufferCount];
-            descriptor.descriptorCount = 1;
+    int64_t resolvedFrame = sVkGpuTimerFrames[frameIndex];
+    double nanosecondsToMilliseconds = sVkTimestampPeriod / 1'000'000.0;
 
-            writeDescriptorSets[writeIndex] = descriptor;
+    sVkGpuTimerResults.clear();
+    for(const GpuTimerQuery& timer : timers)
+    {
+        uint64_t begin = timestamps[timer.beginQuery] & sVkTimestampMask;
+        uint64_t end = timestamps[timer.endQuery] & sVkTimestampMask;
+        double milliseconds = end >= begin ? double(end - begin) * nanosecondsToMilliseconds : 0.0;
+
+        sVkGpuTimerResults.push_back(GpuTimerResult{
+            .name = timer.name,
+            .milliseconds = milliseconds,
+            .depth = timer.depth,
+        });
+
+        GpuTimerHistory& history = sGetGpuTimerHistory(timer.name);
+        if(history.frame != resolvedFrame)
+        {
+            history.frame = resolvedFrame;
+            history.frameMilliseconds = 0.0;
+        }
+        history.frameMilliseconds += milliseconds;
+    }
 
-            ++bufferCount;
-            ++writeIndex;
+    sVkGpuTimerAverages.clear();
+    for(GpuTimerHistory& history : sVkGpuTimerHistories)
+    {
+        if(history.frame == resolvedFrame)
+        {
+            sPushGpuTimerSample(history);
         }
-        else if(descriptorSetInfos[i].type == DescriptorInfo::DescriptorType::IMAGE)
+        if(history.count == 0)
         {
-            const VkDescriptorImageInfo &imageInfo = descriptorSetInfos[i].imageInfo;
-            ASSERT_RETURN_FALSE(imageInfo.sampler || descriptorSetLayout[i].descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
-            ASSERT_RETURN_FALSE(imageInfo.imageView);
-            ASSERT_RETURN_FALSE(imageInfo.imageLayout);
-
-            imageInfos[imageCount] = imageInfo;
-
-            VkWriteDescriptorSet descriptor{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
-            descriptor.dstSet = descriptorSet;
-            descriptor.dstArrayElement = 0;
-            descriptor.descriptorType = descriptorSetLayout[i].descriptorType;
-            descriptor.dstBinding = descriptorSetLayout[i].bindingIndex;
-            descriptor.pImageInfo = &imageInfos[imageCount];
-            descriptor.descriptorCount = 1;
-
-            writeDescriptorSets[writeIndex] = descriptor;
-
-            ++writeIndex;
-            ++imageCount;
+            continue;
         }
-        else
+        double minValue = history.samples[0];
+        double maxValue = history.samples[0];
+        for(int32_t i = 1; i < history.count; ++i)
         {
-            ASSERT(true);
-            printf("Failed to set descriptor binds!\n");
-            return false;
+            minValue = MIN_VALUE(minValue, history.samples[i]);
+            maxValue = MAX_VALUE(maxValue, history.samples[i]);
         }
+        sVkGpuTimerAverages.push_back(GpuTimerAverage{
+            .name = history.name,
+            .averageMilliseconds = history.sum / double(history.count),
+            .minMilliseconds = minValue,
+            .maxMilliseconds = maxValue,
+            .sampleCount = history.count,
+        });
     }
 
-    if(writeIndex > 0)
-    {
-        vkUpdateDescriptorSets(sVkDevice,
-            uint32_t(writeIndex), writeDescriptorSets,
-            0, nullptr);
-    }
-
-    return true;
+    sVkGpuTimerResultsFrame = resolvedFrame;
+    timers.clear();
 }
 
+static void sResetGpuTimers(VkCommandBuffer commandBuffer, int64_t frameIndex)
+{
+    vkCmdResetQueryPool(commandBuffer, sVkQueryPools[frameIndex], 0, CarpVk::QueryCount);
+    sVkQueryPoolIndexCounts[frameIndex] = 0;
+    sVkGpuTimers[frameIndex].clear();
+    sVkGpuTimerFrames[frameIndex] = sVkFrameIndex;
+    sVkGpuTimerStack.clear();
+}
 
+static void sCopyCompileStage(const VkPipelineShaderStageCreateInfo& stageInfo, PipelineCompileStage& outStage)
+{
+    const char* name = stageInfo.pName ? stageInfo.pName : "main";
+    outStage.entryName.assign(name, name + strlen(name) + 1);
+    const VkSpecializationInfo* specializationInfo = stageInfo.pSpecializationInfo;
+    outStage.specialized = specializationInfo != nullptr;
+    if(specializationInfo)
+    {
+        outStage.specializationInfo = *specializationInfo;
+        outStage.mapEntries.assign(specializationInfo->pMapEntries,
+            specializationInfo->pMapEntries + specializationInfo->mapEntryCount);
+        const uint8_t* data = (const uint8_t*)specializationInfo->pData;
+        outStage.specializationData.assign(data, data + specializationInfo->dataSize);
+    }
+}
 
+// Jobs move around in the queue, pointers into the copies are set right before compiling.
+static void sPointToCompileStage(VkPipelineShaderStageCreateInfo& stageInfo, PipelineCompileStage& stage)
+{
+    stageInfo.pName = stage.entryName.data();
+    stageInfo.pSpecializationInfo = nullptr;
+    if(stage.specialized)
+    {
+        stage.specializationInfo.pMapEntries = stage.mapEntries.data();
+        stage.specializationInfo.pData = stage.specializationData.data();
+        stageInfo.pSpecializationInfo = &stage.specializationInfo;
+    }
+}
 
+static void sPipelineCompileThread()
+{
+    for(;;)
+    {
+        PipelineCompileJob job;
+        {
+            std::unique_lock<std::mutex> lock(sPipelineCompileMutex);
+            sPipelineCompileCondition.wait(lock, []
+            {
+                return sPipelineCompileThreadsQuit || !sPipelineCompileJobs.empty();
+            });
+            // Quitting still drains the queue so no handle is left waiting forever.
+            if(sPipelineCompileJobs.empty())
+            {
+                return;
+            }
+            job = std::move(sPipelineCompileJobs.front());
+            sPipelineCompileJobs.pop_front();
+        }
 
+        VkPipeline pipeline = {};
+        if(job.compute)
+        {
+            sPointToCompileStage(job.computeBuilder.stageInfo, job.stages[0]);
+            pipeline = createComputePipeline(job.computeBuilder, job.pipelineName);
+        }
+        else
+        {
+            for(size_t i = 0; i < job.stageInfos.size(); ++i)
+            {
+                sPointToCompileStage(job.stageInfos[i], job.stages[i]);
+            }
+            job.graphicsBuilder.stageInfos = job.stageInfos.data();
+            job.graphicsBuilder.stageSpecializations = job.stageSpecializations.empty()
+                ? nullptr : job.stageSpecializations.data();
+            job.graphicsBuilder.colorFormats = job.colorFormats.data();
+            job.graphicsBuilder.blendChannels = job.blendChannels.data();
+            pipeline = createGraphicsPipeline(job.graphicsBuilder, job.pipelineName);
+        }
 
+        {
+            std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+            AsyncPipelineSlot& slot = sAsyncPipelineSlots[job.slotIndex];
+            slot.pipeline = pipeline;
+            slot.ready = true;
+        }
+        sPipelineReadyCondition.notify_all();
+    }
+}
 
-
-
-
-
-
-
-
-
-bool beginFrame()
+static void sStartPipelineCompileThreads(int32_t threadCount)
 {
-    sVkScratchBufferOffset = 0;
-    VkDevice device = getVkDevice();
-
-    sVkFrameIndex++;
-    int64_t frameIndex = getFrameIndexWrapped();
+    if(threadCount <= 0)
     {
-        //ScopedTimer aq("Acquire");
-        VK_CHECK_CALL(vkWaitForFences(device, 1, &sVkFences[frameIndex], VK_TRUE, UINT64_MAX));
+        // Leave one core for the thread that records frames.
+        threadCount = int32_t(std::thread::hardware_concurrency()) - 1;
     }
-    if (sVkAcquireSemaphores[frameIndex] == VK_NULL_HANDLE)
+    threadCount = MAX_VALUE(threadCount, 1);
+
+    sPipelineCompileThreadsQuit = false;
+    for(int32_t i = 0; i < threadCount; ++i)
     {
-        return false;
+        sPipelineCompileThreads.emplace_back(sPipelineCompileThread);
     }
-    VkResult res = (vkAcquireNextImageKHR(device, sVkSwapchain, UINT64_MAX,
-        sVkAcquireSemaphores[frameIndex], VK_NULL_HANDLE, &sVkImageIndex));
+}
 
-    if (res == VK_ERROR_OUT_OF_DATE_KHR)
+static void sStopPipelineCompileThreads()
+{
     {
-        if (sResizeSwapchain())
-        {
-            VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
-        }
-        return false;
+        std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+        sPipelineCompileThreadsQuit = true;
     }
-    else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR)
+    sPipelineCompileCondition.notify_all();
+    for(std::thread& thread : sPipelineCompileThreads)
     {
-        VK_CHECK_CALL(res);
-        return false;
+        thread.join();
     }
-
-    VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-    vkResetCommandPool(sVkDevice, sVkCommandPools[frameIndex], 0);
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
-    VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
-
-    //vkCmdResetQueryPool(vulk->commandBuffer, vulk->queryPools[vulk->frameIndex], 0, QUERY_COUNT);
-    //vulk->currentStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-
-
-
-    return true;
-
+    sPipelineCompileThreads.clear();
 }
 
-
-bool presentImage(Image& imageToPresent)
+// Must be called with sPipelineCompileMutex held.
+static uint32_t sAllocateAsyncPipelineSlot()
 {
-    VkDevice device = getVkDevice();
+    uint32_t index = 0;
+    if(!sAsyncPipelineFreeSlots.empty())
+    {
+        index = sAsyncPipelineFreeSlots.back();
+        sAsyncPipelineFreeSlots.pop_back();
+    }
+    else
+    {
+        index = uint32_t(sAsyncPipelineSlots.size());
+        sAsyncPipelineSlots.emplace_back();
+    }
+    sAsyncPipelineSlots[index] = AsyncPipelineSlot{ .used = true };
+    return index;
+}
 
-    int64_t frameIndex = getFrameIndexWrapped();
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
 
-    VkImage swapchainImage = sVkSwapchainImages[sVkImageIndex];
 
-    // Blit from imageToPresent to swapchain
-    {
-        imageBarrier(swapchainImage,
-            VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_UNDEFINED,
-            VK_PIPELINE_STAGE_2_BLIT_BIT,
-            VK_ACCESS_2_TRANSFER_WRITE_BIT,
-            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            VK_IMAGE_ASPECT_COLOR_BIT);
-        imageBarrier(imageToPresent,
-            VK_PIPELINE_STAGE_2_BLIT_BIT,
-            VK_ACCESS_2_TRANSFER_READ_BIT,
-            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
 
-        flushBarriers();
 
-        int width = imageToPresent.width;
-        int height = imageToPresent.height;
 
-        width = width < sVkSwapchainWidth ? width : sVkSwapchainWidth;
-        height = height < sVkSwapchainHeight ? height : sVkSwapchainHeight;
 
-        VkImageBlit2 imageBlitRegion = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
-            .srcSubresource = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .layerCount = 1,
-        },
-        .srcOffsets = {
-                VkOffset3D{ 0, 0, 0 },
-                VkOffset3D{ width, height, 1 },
-        },
 
-        .dstSubresource = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .layerCount = 1,
-        },
-        .dstOffsets = {
-                VkOffset3D{ 0, 0, 0 },
-                VkOffset3D{ sVkSwapchainWidth, sVkSwapchainHeight, 1 },
-        }
 
 
-        };
 
-        VkBlitImageInfo2 imageBlitInfo = {
-            .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
-            .srcImage = imageToPresent.image,
-            .srcImageLayout = imageToPresent.layout,
-            .dstImage = swapchainImage,
-            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .regionCount = 1,
-            .pRegions = &imageBlitRegion,
-            .filter = VkFilter::VK_FILTER_NEAREST,
-        };
 
-        vkCmdBlitImage2(commandBuffer, &imageBlitInfo);
-    }
 
-    // Prepare image for presenting.
-    {
-        VkImageMemoryBarrier2 presentBarrier = {
-            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
-            .srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT,
-            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
-            .dstStageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
-            .dstAccessMask = VK_ACCESS_2_NONE,
-            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
 
-            .image = swapchainImage,
-            .subresourceRange = {
-                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-                .levelCount = 1,
-                .layerCount = 1,
-            },
-        };
 
-        VkDependencyInfo dep2 = {};
-        dep2.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
-        dep2.imageMemoryBarrierCount = 1;
-        dep2.pImageMemoryBarriers = &presentBarrier;
-        vkCmdPipelineBarrier2(commandBuffer, &dep2);
-    }
 
-    VK_CHECK_CALL(vkEndCommandBuffer(commandBuffer));
 
 
 
 
 
-    // Submit
-    {
-        vkResetFences(device, 1, &sVkFences[frameIndex]);
 
-        VkSemaphore acquireSemaphore = sVkAcquireSemaphores[frameIndex];
-        VkSemaphore releaseSemaphore = sVkReleaseSemaphores[frameIndex];
 
-        VkCommandBufferSubmitInfo commandBufferSubmitInfo = {
-            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
-            .commandBuffer = commandBuffer,
-        };
 
 
-        VkSemaphoreSubmitInfo acquireCompleteInfo = {
-            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
-            .semaphore = acquireSemaphore,
-            .stageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT
-        };
 
-        VkSemaphoreSubmitInfo renderingCompleteInfo = {
-            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
-            .semaphore = releaseSemaphore,
-            .stageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT
-        };
 
-        VkSubmitInfo2 submitInfo = {
-            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
-            .waitSemaphoreInfoCount = 1,
-            .pWaitSemaphoreInfos = &acquireCompleteInfo,
-            .commandBufferInfoCount = 1,
-            .pCommandBufferInfos = &commandBufferSubmitInfo,
-            .signalSemaphoreInfoCount = 1,
-            .pSignalSemaphoreInfos = &renderingCompleteInfo
-        };
 
 
 
-        vkQueueSubmit2(sVkQueue, 1, &submitInfo, sVkFences[frameIndex]);
 
-        VkPresentInfoKHR presentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
-        presentInfo.waitSemaphoreCount = 1;
-        presentInfo.pWaitSemaphores = &releaseSemaphore;
-        presentInfo.swapchainCount = 1;
-        presentInfo.pSwapchains = &sVkSwapchain;
-        presentInfo.pImageIndices = &sVkImageIndex;
 
-        VkResult res = (vkQueuePresentKHR(sVkQueue, &presentInfo));
+
+static bool sHasInstanceExtension(const char* extensionName)
+{
+    VkExtensionProperties allExtensions[256] = {};
+    uint32_t extensionCount = 0;
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+    ASSERT(extensionCount < 256);
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, allExtensions);
+    for(uint32_t i = 0; i < extensionCount; ++i)
+    {
+        if(strcmp(allExtensions[i].extensionName, extensionName) == 0)
+            return true;
+    }
+    return false;
+}
+
+static VkSurfaceKHR sCreateHeadlessSurface()
+{
+    auto createHeadlessSurface = (PFN_vkCreateHeadlessSurfaceEXT)vkGetInstanceProcAddr(
+        sVkInstance, "vkCreateHeadlessSurfaceEXT");
+    if(!createHeadlessSurface)
+    {
+        return VK_NULL_HANDLE;
+    }
+    VkHeadlessSurfaceCreateInfoEXT createInfo = { VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT };
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
+    VK_CHECK_CALL(createHeadlessSurface(sVkInstance, &createInfo, nullptr, &surface));
+    return surface;
+}
+
+bool initVulkan(const VulkanInstanceParams &params)
+{
+    sVkInstanceBuilder.vulkanInstanceParams = params;
+    for(int i = 0; i < params.extensionCount; ++i)
+    {
+        sVkInstanceBuilder.extensions[i] = params.extensions[i];
+    }
+    sVkInstanceBuilder.extensionCount = params.extensionCount;
+    if(params.getExtraExtensionsFn)
+    {
+        uint32_t extraExtensionCount = 0;
+        const char *const *extraExtensions = params.getExtraExtensionsFn(&extraExtensionCount);
+
+        for(uint32_t i = 0; i < extraExtensionCount; ++i)
+        {
+            sVkInstanceBuilder.extensions[params.extensionCount + i] = extraExtensions[i];
+        }
+        sVkInstanceBuilder.extensionCount = params.extensionCount + extraExtensionCount;
+    }
+
+    bool useHeadlessSurface = params.headless && params.useHeadlessSurface;
+    if(useHeadlessSurface && !sHasInstanceExtension(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME))
+    {
+        printf("No %s, running without surface\n", VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+        useHeadlessSurface = false;
+    }
+    if(useHeadlessSurface)
+    {
+        sVkInstanceBuilder.extensions[sVkInstanceBuilder.extensionCount++] = VK_KHR_SURFACE_EXTENSION_NAME;
+        sVkInstanceBuilder.extensions[sVkInstanceBuilder.extensionCount++] = VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME;
+    }
+
+
+    sVkInstanceBuilder.m_createInfo.ppEnabledExtensionNames = sVkInstanceBuilder.extensions;
+    sVkInstanceBuilder.m_createInfo.enabledExtensionCount = sVkInstanceBuilder.extensionCount;
+
+    if(params.useValidation && !sUseDefaultValidationLayers())
+    {
+        printf("Failed to initialize vulkan.\n");
+        return false;
+    }
+
+    if(!sCreateInstance())
+    {
+        printf("Failed to initialize vulkan.\n");
+        return false;
+    }
+    printf("Success on creating instance\n");
+
+
+    if(useHeadlessSurface)
+    {
+        sVkSurface = sCreateHeadlessSurface();
+        if(!sVkSurface)
+        {
+            printf("Failed to create headless surface, running without surface\n");
+        }
+    }
+    else if(!params.headless)
+    {
+        ASSERT_RETURN_FALSE(params.createSurfaceFn);
+        sVkSurface = params.createSurfaceFn(sVkInstance, params.userData);
+        if(!sVkSurface)
+        {
+            printf("Failed to create surface\n");
+            return false;
+        }
+    }
+    sVkHeadless = sVkSurface == VK_NULL_HANDLE;
+
+    if(!sCreatePhysicalDevice(params.useIntegratedGpu))
+    {
+        printf("Failed to create physical device\n");
+        return false;
+    }
+
+    if(!sCreateDeviceWithQueues())
+    {
+        printf("Failed to create logical device with queues\n");
+        return false;
+    }
+
+    if(params.pipelineCacheFilename)
+    {
+        setPipelineCacheFilename(params.pipelineCacheFilename);
+    }
+    if(!sCreatePipelineCache())
+    {
+        printf("Failed to create pipeline cache\n");
+        return false;
+    }
+
+    sStartPipelineCompileThreads(params.pipelineCompileThreadCount);
+
+    if(!sCreateSwapchain(params.vsyncMode, params.width, params.height))
+    {
+        printf("Failed to create swapchain\n");
+        return false;
+    }
+
+
+    sInitGpuTimestamps();
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkQueryPools[i] = sCreateQueryPool(CarpVk::QueryCount);
+        ASSERT(sVkQueryPools[i]);
+        if(!sVkQueryPools[i])
+        {
+            printf("Failed to create vulkan query pool!\n");
+            return false;
+        }
+    }
+
+
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkAcquireSemaphores[i] = sCreateSemaphore();
+        ASSERT(sVkAcquireSemaphores[i]);
+        if(!sVkAcquireSemaphores[i])
+        {
+            printf("Failed to create vulkan acquire semapohore!\n");
+            return false;
+        }
+
+        sVkReleaseSemaphores[i] = sCreateSemaphore();
+        ASSERT(sVkReleaseSemaphores[i]);
+        if(!sVkReleaseSemaphores[i])
+        {
+            printf("Failed to create vulkan release semaphore!\n");
+            return false;
+        }
+
+    }
+
+    sVkTimelineSemaphore = sCreateTimelineSemaphore(0);
+    if(!sVkTimelineSemaphore)
+    {
+        printf("Failed to create vulkan timeline semaphore!\n");
+        return false;
+    }
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkFrameSubmissionValues[i] = 0;
+        sVkFrameSubmissionFrames[i] = -1;
+    }
+    for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+    {
+        sVkCommandPools[i] = sCreateCommandPool(sVkQueueIndex);
+        ASSERT(sVkCommandPools[i]);
+        if(!sVkCommandPools[i])
+        {
+            printf("Failed to create vulkan command pool!\n");
+            return false;
+        }
+
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = sVkCommandPools[i];
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocateInfo.commandBufferCount = 1; // CarpVk::FramesInFlight;
+
+        {
+            VK_CHECK_CALL(vkAllocateCommandBuffers(sVkDevice, &allocateInfo, &sVkCommandBuffers[i]));
+            //for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+            {
+                if(!sVkCommandBuffers[i])
+                {
+                    printf("Failed to create vulkan command buffer!\n");
+                    return false;
+                }
+
+                static const char *s = "Main command buffer";
+                sSetObjectName((uint64_t)sVkCommandBuffers[i], VK_DEBUG_REPORT_OBJECT_TYPE_COMMAND_BUFFER_EXT, s);
+            }
+        }
+    }
+
+    if(!sCreateDescriptorPool())
+    {
+        printf("Failed to create descriptor pool\n");
+        return false;
+    }
+    if(sVkDescriptorBufferSupported && !sCreateDescriptorBuffer())
+    {
+        printf("Failed to create descriptor buffer\n");
+        return false;
+    }
+
+    if(!sCreateStagingRing(sVkStagingRing, "Scratch buffer",
+        sGetStagingBlockSize(), params.stagingShrinkIdleFrames))
+    {
+        printf("Failed to create scratch buffer\n");
+        return false;
+    }
+    if(!sAddUniformHeap(cVulkanUniformBufferSize))
+    {
+        printf("Failed to create uniform buffer\n");
+        return false;
+    }
+    if(!sCreateStagingRing(sVkReadbackRing, "Readback buffer",
+        cVulkanReadbackBlockSize, params.stagingShrinkIdleFrames, true))
+    {
+        printf("Failed to create readback buffer\n");
+        return false;
+    }
+    if(!sCreateDynamicUniformRing(params.dynamicUniformRingSize))
+    {
+        printf("Failed to create dynamic uniform ring\n");
+        return false;
+    }
+    if(sVkTransferQueue && !sCreateTransferQueueResources())
+    {
+        printf("Failed to create transfer queue resources\n");
+        return false;
+    }
+    if(sVkComputeQueue && !sCreateComputeQueueResources())
+    {
+        printf("Failed to create compute queue resources\n");
+        return false;
+    }
+    if(sVkBindlessSupported && !sCreateBindlessHeap())
+    {
+        printf("Failed to create bindless heap\n");
+        return false;
+    }
+    return true;
+}
+
+
+
+void deinitVulkan()
+{
+    if(sVkInstance == nullptr)
+    {
+        return;
+    }
+    if(sVkDevice)
+    {
+        sStopPipelineCompileThreads();
+        VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+
+        if(sVkInstanceBuilder.vulkanInstanceParams.destroyBuffersFn)
+        {
+            sVkInstanceBuilder.vulkanInstanceParams.destroyBuffersFn(sVkInstanceBuilder.vulkanInstanceParams.userData);
+        }
+        destroyTransientImages();
+
+        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+        {
+            if(sVkCommandPools[i])
+            {
+                vkDestroyCommandPool(sVkDevice, sVkCommandPools[i], nullptr);
+            }
+            sVkCommandPools[i] = {};
+        }
+        sDestroyThreadCommandBuffers();
+        sDestroySwapchain();
+
+        sDestroyTransferQueueResources();
+        sVkTransferQueue = {};
+        sVkTransferRecordedAcquires.clear();
+        sVkTransferPendingAcquires.clear();
+
+        sDestroyComputeQueueResources();
+        sVkComputeQueue = {};
+        sVkGraphicsWaitInfos.clear();
+
+        sDestroyUniformHeaps();
+        destroyBuffer(sVkDynamicUniformRing.buffer);
+        sVkDynamicUniformRing = DynamicUniformRing{};
+        sVkQueuedUploads.clear();
+        sVkQueuedUploadData.clear();
+        sVkUploadStats = UploadStats{};
+
+        sDestroyStagingRing(sVkStagingRing);
+        sDestroyStagingRing(sVkReadbackRing);
+        sVkReadbacks.clear();
+        sVkReadbackFreeSlots.clear();
+        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+        {
+            vkDestroyQueryPool(sVkDevice, sVkQueryPools[i], nullptr);
+        }
+
+
+        for(uint32_t i = 0; i < CarpVk::FramesInFlight; ++i)
+        {
+            vkDestroySemaphore(sVkDevice, sVkAcquireSemaphores[i], nullptr);
+            vkDestroySemaphore(sVkDevice, sVkReleaseSemaphores[i], nullptr);
+        }
+        vkDestroySemaphore(sVkDevice, sVkTimelineSemaphore, nullptr);
+        sVkTimelineSemaphore = {};
+
+        if(sVkPipelineCache)
+        {
+            savePipelineCache();
+            vkDestroyPipelineCache(sVkDevice, sVkPipelineCache, nullptr);
+            sVkPipelineCache = {};
+        }
+
+        sDestroyBindlessHeap();
+        sDestroyDescriptorSetCache();
+        sDestroyFrameDescriptorPools();
+        sDestroyDescriptorBuffer();
+        sDestroyShaderObjectPrograms();
+        sDestroyReflectedLayouts();
+        sDestroyPipelineVariants();
+        sDestroySharedHandles();
+        if(sVkDescriptorPool)
+        {
+            vkDestroyDescriptorPool(sVkDevice, sVkDescriptorPool, nullptr);
+            sVkDescriptorPool = {};
+        }
+        if(sVkAllocator)
+        {
+            vmaDestroyAllocator(sVkAllocator);
+            sVkAllocator = nullptr;
+        }
+
+
+        vkDestroyDevice(sVkDevice, nullptr);
+        sVkPushDescriptorsSupported = false;
+        sVkCmdPushDescriptorSet = nullptr;
+        sVkDescriptorBufferSupported = false;
+        sVkShaderObjectsSupported = false;
+        sVkDevice = nullptr;
+    }
+
+    if(sVkSurface)
+    {
+        vkDestroySurfaceKHR(sVkInstance, sVkSurface, nullptr);
+        sVkSurface = {};
+    }
+    if(sVkDebugMessenger)
+    {
+        auto dest = (PFN_vkDestroyDebugUtilsMessengerEXT)vkGetInstanceProcAddr(sVkInstance, "vkDestroyDebugUtilsMessengerEXT");
+        dest(sVkInstance, sVkDebugMessenger, nullptr);
+        sVkDebugMessenger = {};
+    }
+
+    vkDestroyInstance(sVkInstance, nullptr);
+}
+
+void printExtensions()
+{
+    VkExtensionProperties allExtensions[256] = {};
+    uint32_t extensionCount = 0;
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+    ASSERT(extensionCount < 256);
+    vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, allExtensions);
+
+    for(int i = 0; i < extensionCount; ++i)
+    {
+        printf("Extenstion: %s\n", allExtensions[i].extensionName);
+    }
+    printf("Extensions: %i\n", extensionCount);
+}
+
+void printLayers()
+{
+    VkLayerProperties allLayers[256] = {};
+    uint32_t layerCount = 0;
+    vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+    ASSERT(layerCount < 256);
+    vkEnumerateInstanceLayerProperties(&layerCount, allLayers);
+    for(int i = 0; i < layerCount; ++i)
+    {
+        printf("Layer: %s\n", allLayers[i].layerName);
+    }
+    printf("Layers: %i\n", layerCount);
+}
+
+
+bool createDescriptorSet(VkDescriptorSetLayout layout, VkDescriptorSet* outSet)
+{
+    if(sVkDescriptorBufferSupported)
+    {
+        *outSet = sAllocateDescriptorBufferSet(layout, -1);
+        return *outSet != VK_NULL_HANDLE;
+    }
+    VkDescriptorSetAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = sVkDescriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+
+    VkDescriptorSet descriptorSet = {};
+    VK_CHECK_CALL(vkAllocateDescriptorSets(sVkDevice, &allocInfo, &descriptorSet));
+    ASSERT(descriptorSet);
+
+    *outSet = descriptorSet;
+    return true;
+}
+
+VkDescriptorSet getCachedDescriptorSet(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount)
+{
+    ASSERT(layout && descriptorSetLayout && descriptorSetInfos && descriptorSetInfoCount > 0);
+    std::vector<uint64_t> key;
+    key.reserve(2 + descriptorSetInfoCount * 4);
+    key.push_back((uint64_t)layout);
+    key.push_back(uint64_t(descriptorSetInfoCount));
+    for(int i = 0; i < descriptorSetInfoCount; ++i)
+    {
+        const DescriptorInfo& info = descriptorSetInfos[i];
+        key.push_back(uint64_t(info.type));
+        if(info.type == DescriptorInfo::DescriptorType::IMAGE)
+        {
+            key.push_back((uint64_t)info.imageInfo.imageView);
+            key.push_back(uint64_t(info.imageInfo.imageLayout));
+            key.push_back((uint64_t)info.imageInfo.sampler);
+        }
+        else
+        {
+            key.push_back((uint64_t)info.bufferInfo.buffer);
+            key.push_back(uint64_t(info.bufferInfo.offset));
+            key.push_back(uint64_t(info.bufferInfo.range));
+        }
+    }
+    uint64_t hash = sHashKey(key);
+
+    uint64_t submissionValue = getNextSubmissionValue();
+    auto range = sVkDescriptorCacheLookup.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[it->second];
+        if(entry.key == key)
+        {
+            entry.lastUsedValue = submissionValue;
+            sUnlinkDescriptorCacheEntry(it->second);
+            sPushFrontDescriptorCacheEntry(it->second);
+            sVkDescriptorCacheStats.hits++;
+            return entry.descriptorSet;
+        }
+    }
+    sVkDescriptorCacheStats.misses++;
+
+    // Full cache recycles the oldest set, unless even that one is still in flight.
+    if(sVkDescriptorCacheStats.cachedSetCount >= uint32_t(CarpVk::DescriptorSetCacheSize)
+        && sVkDescriptorCacheTail != ~0u
+        && sVkDescriptorCacheEntries[sVkDescriptorCacheTail].lastUsedValue <= getCompletedSubmissionValue())
+    {
+        sRemoveDescriptorCacheEntry(sVkDescriptorCacheTail);
+        sVkDescriptorCacheStats.evictions++;
+    }
+
+    VkDescriptorSet descriptorSet = sAllocateCachedDescriptorSet(layout, descriptorSetLayout, descriptorSetInfoCount);
+    if(!descriptorSet || !updateBindDescriptorSet(descriptorSet, descriptorSetLayout,
+        descriptorSetInfos, descriptorSetInfoCount))
+    {
+        ASSERT(false);
+        return VK_NULL_HANDLE;
+    }
+
+    uint32_t index = uint32_t(sVkDescriptorCacheEntries.size());
+    if(!sVkDescriptorCacheFreeEntries.empty())
+    {
+        index = sVkDescriptorCacheFreeEntries.back();
+        sVkDescriptorCacheFreeEntries.pop_back();
+    }
+    else
+    {
+        sVkDescriptorCacheEntries.push_back(DescriptorCacheEntry{});
+    }
+    DescriptorCacheEntry& entry = sVkDescriptorCacheEntries[index];
+    entry.key = std::move(key);
+    entry.hash = hash;
+    entry.layout = layout;
+    entry.descriptorSet = descriptorSet;
+    entry.lastUsedValue = submissionValue;
+    entry.used = true;
+    sPushFrontDescriptorCacheEntry(index);
+    sVkDescriptorCacheLookup.emplace(hash, index);
+    sVkDescriptorCacheStats.cachedSetCount++;
+    return descriptorSet;
+}
+
+DescriptorSetCacheStats getDescriptorSetCacheStats()
+{
+    return sVkDescriptorCacheStats;
+}
+
+VkDescriptorSet allocateFrameDescriptorSet(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount)
+{
+    ASSERT(layout);
+    if(sVkDescriptorBufferSupported)
+    {
+        VkDescriptorSet descriptorSet = sAllocateDescriptorBufferSet(layout, getFrameIndexWrapped());
+        if(!descriptorSet || !updateBindDescriptorSet(descriptorSet, descriptorSetLayout,
+            descriptorSetInfos, descriptorSetInfoCount))
+        {
+            return VK_NULL_HANDLE;
+        }
+        return descriptorSet;
+    }
+    FrameDescriptorPools& framePools = sVkFrameDescriptorPools[getFrameIndexWrapped()];
+
+    VkDescriptorSetAllocateInfo allocInfo = { VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &layout;
+
+    VkDescriptorSet descriptorSet = {};
+    // Full pools stay full until the reset, move forward in the chain and add pools at the end.
+    while(!descriptorSet)
+    {
+        bool freshPool = false;
+        if(framePools.currentPool >= framePools.pools.size())
+        {
+            freshPool = true;
+            VkDescriptorPool pool = {};
+            if(!sCreateGenericDescriptorPool(CarpVk::FrameDescriptorPoolSetCount,
+                CarpVk::FrameDescriptorPoolSetCount * 4, pool))
+            {
+                printf("Failed to create frame descriptor pool\n");
+                ASSERT(false);
+                return VK_NULL_HANDLE;
+            }
+            framePools.pools.push_back(pool);
+        }
+        allocInfo.descriptorPool = framePools.pools[framePools.currentPool];
+        VkResult result = vkAllocateDescriptorSets(sVkDevice, &allocInfo, &descriptorSet);
+        if(result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+        {
+            // Descriptor type not in the pool sizes, or an array larger than a whole pool holds.
+            if(freshPool)
+            {
+                printf("Set does not fit in an empty frame descriptor pool\n");
+                ASSERT(false);
+                return VK_NULL_HANDLE;
+            }
+            descriptorSet = {};
+            framePools.currentPool++;
+        }
+        else if(result != VK_SUCCESS)
+        {
+            VK_CHECK_CALL(result);
+            return VK_NULL_HANDLE;
+        }
+    }
+
+    if(!updateBindDescriptorSet(descriptorSet, descriptorSetLayout, descriptorSetInfos, descriptorSetInfoCount))
+    {
+        return VK_NULL_HANDLE;
+    }
+    return descriptorSet;
+}
+
+
+
+
+VkImageView createImageView(VkImage image, VkFormat format)
+{
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat(format);
+
+    VkImageViewCreateInfo createInfo = { VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+    createInfo.image = image;
+    createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    createInfo.format = format;
+
+    //createInfo.components.r = VK_COMPONENT_SWIZZLE_R; // VK_COMPONENT_SWIZZLE_IDENTITY;
+    //createInfo.components.g = VK_COMPONENT_SWIZZLE_G; //VK_COMPONENT_SWIZZLE_IDENTITY;
+    //createInfo.components.b = VK_COMPONENT_SWIZZLE_B; //VK_COMPONENT_SWIZZLE_IDENTITY;
+    //createInfo.components.a = VK_COMPONENT_SWIZZLE_A; //VK_COMPONENT_SWIZZLE_IDENTITY;
+
+    createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+    createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+
+    createInfo.subresourceRange.aspectMask = aspectMask;
+    createInfo.subresourceRange.baseMipLevel = 0;
+    createInfo.subresourceRange.levelCount = 1;
+    createInfo.subresourceRange.baseArrayLayer = 0;
+    createInfo.subresourceRange.layerCount = 1;
+
+    VkImageView view = {};
+    VK_CHECK_CALL(vkCreateImageView(sVkDevice, &createInfo, nullptr, &view));
+
+    ASSERT(view);
+    return view;
+}
+
+
+static VkImageCreateInfo sGetImageCreateInfo(uint32_t width, uint32_t height,
+    VkFormat imageFormat, VkImageUsageFlags usage)
+{
+    VkImageCreateInfo createInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+    createInfo.imageType = VK_IMAGE_TYPE_2D;
+    createInfo.format = imageFormat;
+    createInfo.extent = { width, height, 1 };
+    createInfo.mipLevels = 1;
+    createInfo.arrayLayers = 1;
+    createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    createInfo.usage = usage;
+    createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    return createInfo;
+}
+
+bool createImage(uint32_t width, uint32_t height,
+    VkFormat imageFormat, VkImageUsageFlags usage, const char* imageName,
+    Image& outImage)
+{
+    VkImageCreateInfo createInfo = sGetImageCreateInfo(width, height, imageFormat, usage);
+    createInfo.queueFamilyIndexCount = 1;
+    uint32_t indices[] = { (uint32_t)sVkQueueIndex };
+    createInfo.pQueueFamilyIndices = indices;
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+
+
+    VK_CHECK_CALL(vmaCreateImage(sVkAllocator,
+        &createInfo, &allocInfo, &outImage.image, &outImage.allocation, nullptr));
+
+    ASSERT_RETURN_FALSE(outImage.image && outImage.allocation);
+
+    outImage.view = createImageView(outImage.image, imageFormat);
+    ASSERT_RETURN_FALSE(outImage.view);
+
+    sSetObjectName((uint64_t)outImage.image, VK_DEBUG_REPORT_OBJECT_TYPE_IMAGE_EXT, imageName);
+    outImage.imageName = imageName;
+    outImage.width = width;
+    outImage.height = height;
+    outImage.format = createInfo.format;
+    outImage.layout = createInfo.initialLayout;
+
+    if((usage & (VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT)) != 0)
+    {
+        sAllRenderTargetImages.push_back(&outImage);
+    }
+    else
+    {
+        sAllImages.push_back(&outImage);
+    }
+    return true;
+}
+void destroyImage(Image& image)
+{
+    sForgetCachedDescriptorSets((uint64_t)image.view);
+    if (image.view)
+        vkDestroyImageView(sVkDevice, image.view, nullptr);
+    if (image.image)
+        vmaDestroyImage(sVkAllocator, image.image, image.allocation);
+
+    image = Image{};
+}
+
+bool createTransientImages(const TransientImageDesc* descs, uint32_t count)
+{
+    destroyTransientImages();
+    ASSERT_RETURN_FALSE(descs || count == 0);
+
+    struct TransientBlock
+    {
+        VkMemoryRequirements requirements = {};
+        std::vector<uint32_t> images;
+    };
+    std::vector<VkImageCreateInfo> createInfos(count);
+    std::vector<VkMemoryRequirements> requirements(count);
+    std::vector<uint32_t> order(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const TransientImageDesc& desc = descs[i];
+        ASSERT_RETURN_FALSE(desc.outImage && desc.firstUse <= desc.lastUse);
+        createInfos[i] = sGetImageCreateInfo(desc.width, desc.height, desc.format, desc.usage);
+
+        VkDeviceImageMemoryRequirements imageRequirements = { VK_STRUCTURE_TYPE_DEVICE_IMAGE_MEMORY_REQUIREMENTS };
+        imageRequirements.pCreateInfo = &createInfos[i];
+        VkMemoryRequirements2 memoryRequirements = { VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2 };
+        vkGetDeviceImageMemoryRequirements(sVkDevice, &imageRequirements, &memoryRequirements);
+        requirements[i] = memoryRequirements.memoryRequirements;
+        order[i] = i;
+        sVkTransientImageStats.requestedBytes += requirements[i].size;
+    }
+
+    // Largest first, each image goes to the first block with compatible memory whose images
+    // are not alive at the same time.
+    std::sort(order.begin(), order.end(), [&requirements](uint32_t a, uint32_t b)
+    {
+        return requirements[a].size > requirements[b].size;
+    });
+    std::vector<TransientBlock> blocks;
+    for(uint32_t index : order)
+    {
+        const TransientImageDesc& desc = descs[index];
+        const VkMemoryRequirements& imageRequirements = requirements[index];
+        TransientBlock* foundBlock = nullptr;
+        for(TransientBlock& block : blocks)
+        {
+            if((block.requirements.memoryTypeBits & imageRequirements.memoryTypeBits) == 0)
+                continue;
+            bool overlaps = false;
+            for(uint32_t other : block.images)
+            {
+                overlaps |= desc.firstUse <= descs[other].lastUse && descs[other].firstUse <= desc.lastUse;
+            }
+            if(!overlaps)
+            {
+                foundBlock = &block;
+                break;
+            }
+        }
+        if(foundBlock == nullptr)
+        {
+            blocks.push_back(TransientBlock{ .requirements = imageRequirements });
+            foundBlock = &blocks.back();
+        }
+        VkMemoryRequirements& blockRequirements = foundBlock->requirements;
+        blockRequirements.size = MAX_VALUE(blockRequirements.size, imageRequirements.size);
+        blockRequirements.alignment = MAX_VALUE(blockRequirements.alignment, imageRequirements.alignment);
+        blockRequirements.memoryTypeBits &= imageRequirements.memoryTypeBits;
+        foundBlock->images.push_back(index);
+    }
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    for(const TransientBlock& block : blocks)
+    {
+        VmaAllocation allocation = {};
+        VK_CHECK_CALL(vmaAllocateMemory(sVkAllocator, &block.requirements, &allocInfo, &allocation, nullptr));
+        ASSERT_RETURN_FALSE(allocation);
+        uint32_t blockIndex = uint32_t(sVkTransientBlocks.size());
+        sVkTransientBlocks.push_back(allocation);
+        sVkTransientImageStats.allocatedBytes += block.requirements.size;
+
+        for(uint32_t index : block.images)
+        {
+            const TransientImageDesc& desc = descs[index];
+            Image& outImage = *desc.outImage;
+            destroyImage(outImage);
+            VK_CHECK_CALL(vmaCreateAliasingImage(sVkAllocator, allocation, &createInfos[index], &outImage.image));
+            ASSERT_RETURN_FALSE(outImage.image);
+
+            outImage.view = createImageView(outImage.image, desc.format);
+            ASSERT_RETURN_FALSE(outImage.view);
+
+            sSetObjectName((uint64_t)outImage.image, VK_DEBUG_REPORT_OBJECT_TYPE_IMAGE_EXT, desc.imageName);
+            // Memory belongs to the block, destroyImage only destroys the image.
+            outImage.allocation = {};
+            outImage.imageName = desc.imageName;
+            outImage.width = desc.width;
+            outImage.height = desc.height;
+            outImage.format = desc.format;
+            outImage.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+            sVkTransientImages.push_back(TransientImage{
+                .image = &outImage,
+                .firstUse = desc.firstUse,
+                .lastUse = desc.lastUse,
+                .blockIndex = blockIndex,
+            });
+        }
+    }
+    sVkTransientImageStats.imageCount = count;
+    sVkTransientImageStats.blockCount = uint32_t(blocks.size());
+    sVkTransientImageStats.savedBytes = sVkTransientImageStats.requestedBytes - sVkTransientImageStats.allocatedBytes;
+    return true;
+}
+
+void destroyTransientImages()
+{
+    // Blocks are shared by several images, wait for the frames in flight instead of deferring
+    // each image. Recreating transients happens on resize, not every frame.
+    if(!sVkTransientBlocks.empty())
+    {
+        sWaitTimelineSemaphore(sVkTimelineSemaphore, sVkSubmissionValue, UINT64_MAX);
+        if(sVkComputeQueue)
+        {
+            sWaitTimelineSemaphore(sVkComputeTimelineSemaphore, sVkComputeSubmissionValue, UINT64_MAX);
+        }
+    }
+    for(TransientImage& transient : sVkTransientImages)
+    {
+        destroyImage(*transient.image);
+    }
+    for(VmaAllocation allocation : sVkTransientBlocks)
+    {
+        vmaFreeMemory(sVkAllocator, allocation);
+    }
+    sVkTransientImages.clear();
+    sVkTransientBlocks.clear();
+    sVkTransientImageStats = {};
+}
+
+void beginTransientImageUse(uint32_t usePoint)
+{
+    for(TransientImage& transient : sVkTransientImages)
+    {
+        if(transient.firstUse != usePoint)
+            continue;
+
+        // Aliasing barrier, waits for every earlier user of the memory and discards the contents.
+        Image& image = *transient.image;
+        for(const TransientImage& other : sVkTransientImages)
+        {
+            if(other.blockIndex != transient.blockIndex)
+                continue;
+            image.stageMask |= other.image->stageMask;
+            image.accessMask |= other.image->accessMask;
+        }
+        image.layout = VK_IMAGE_LAYOUT_UNDEFINED;
+    }
+}
+
+TransientImageStats getTransientImageStats()
+{
+    return sVkTransientImageStats;
+}
+
+bool createBuffer(size_t size,
+    VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags memoryFlags,
+    const char* bufferName,
+    Buffer &outBuffer,
+    bool preferDirectUpload)
+{
+    destroyBuffer(outBuffer);
+
+    VkBufferCreateInfo createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+    createInfo.size = size;
+    createInfo.usage = usage;
+    // Descriptor buffers reference buffers by address.
+    if(sVkDescriptorBufferSupported
+        && (usage & (VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)) != 0)
+    {
+        createInfo.usage |= VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+    }
+
+    VmaAllocationCreateInfo allocInfo = {};
+    allocInfo.usage = VMA_MEMORY_USAGE_AUTO;
+    if(preferDirectUpload)
+    {
+        // Staging copy is the fallback, so the buffer has to be a copy destination.
+        createInfo.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        allocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
+            | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT
+            | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+    else if(memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        allocInfo.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT
+            | VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    }
+    VmaAllocation allocation;
+    VmaAllocationInfo vmaAllocInfo;
+    VK_CHECK_CALL(vmaCreateBuffer(sVkAllocator, &createInfo,
+        &allocInfo, &outBuffer.buffer, &allocation, &vmaAllocInfo));
+
+    void* data = nullptr;
+    bool directUpload = false;
+    if(preferDirectUpload)
+    {
+        VkMemoryPropertyFlags propertyFlags = 0;
+        vmaGetAllocationMemoryProperties(sVkAllocator, allocation, &propertyFlags);
+        directUpload = (propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0
+            && (propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0
+            && vmaAllocInfo.pMappedData != nullptr;
+        data = directUpload ? vmaAllocInfo.pMappedData : nullptr;
+    }
+    else if (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+    {
+        data = vmaAllocInfo.pMappedData;
+        ASSERT(data);
+    }
+    outBuffer.data = data;
+    outBuffer.directUpload = directUpload;
+
+    sSetObjectName((uint64_t)outBuffer.buffer, VK_DEBUG_REPORT_OBJECT_TYPE_BUFFER_EXT, bufferName);
+
+    outBuffer.allocation = allocation;
+    outBuffer.bufferName = bufferName;
+    outBuffer.size = size;
+    outBuffer.usage = createInfo.usage;
+    return true;
+}
+
+
+void uploadToGpuBuffer(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size)
+{
+    if(gpuBuffer.directUpload)
+    {
+        ASSERT_RETURN(dstOffset + size <= gpuBuffer.size);
+        // Host writes are visible to the queue submits that follow, no barrier needed.
+        memcpy((uint8_t*)gpuBuffer.data + dstOffset, data, size);
+        VK_CHECK_CALL(vmaFlushAllocation(sVkAllocator, gpuBuffer.allocation, dstOffset, size));
+        sVkUploadStats.directBytes += size;
+        sVkUploadStats.directCount++;
+        return;
+    }
+    StagingAllocation allocation = sUploadToStagingRing(sVkStagingRing, data, size);
+    allocation.region.dstOffset = dstOffset;
+    sUploadStagingToGpuBuffer(gpuBuffer, allocation);
+    sVkUploadStats.stagedBytes += size;
+    sVkUploadStats.stagedCount++;
+}
+void uploadToUniformBuffer(UniformBuffer &uniformBuffer, const void *data, size_t size)
+{
+    sVkUploadStats.stagedBytes += size;
+    sVkUploadStats.stagedCount++;
+    StagingAllocation allocation = sUploadToStagingRing(sVkStagingRing, data, size);
+    allocation.region.dstOffset = uniformBuffer.offset;
+    sUploadStagingToGpuBuffer(sVkUniformHeaps[uniformBuffer.bufferIndex].buffer, allocation);
+}
+
+static uint8_t* sGetQueuedUploadData(const QueuedUpload& upload)
+{
+    return upload.staging.data
+        ? (uint8_t*)upload.staging.data
+        : sVkQueuedUploadData.data() + upload.dataOffset;
+}
+
+void queueUploadToGpuBuffer(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size)
+{
+    ASSERT_RETURN(data && size > 0);
+    ASSERT_RETURN(gpuBuffer.buffer && dstOffset + size <= gpuBuffer.size);
+    if(gpuBuffer.directUpload)
+    {
+        uploadToGpuBuffer(gpuBuffer, data, dstOffset, size);
+        return;
+    }
+    sVkUploadStats.stagedBytes += size;
+    sVkUploadStats.stagedCount++;
+
+    // Later uploads win, earlier ones overlapping this range take the same bytes so the order
+    // of the copies does not matter.
+    for(QueuedUpload& queued : sVkQueuedUploads)
+    {
+        if(queued.buffer != &gpuBuffer)
+            continue;
+        size_t queuedEnd = queued.dstOffset + queued.size;
+        size_t end = dstOffset + size;
+        size_t overlapBegin = MAX_VALUE(queued.dstOffset, dstOffset);
+        size_t overlapEnd = MIN_VALUE(queuedEnd, end);
+        if(overlapBegin >= overlapEnd)
+            continue;
+        memcpy(sGetQueuedUploadData(queued) + overlapBegin - queued.dstOffset,
+            (const uint8_t*)data + overlapBegin - dstOffset, overlapEnd - overlapBegin);
+    }
+
+    QueuedUpload upload = {
+        .buffer = &gpuBuffer,
+        .dstOffset = dstOffset,
+        .size = size,
+    };
+    if(sVkFrameRecording)
+    {
+        upload.staging = sAllocateFromStagingRing(sVkStagingRing, size);
+        ASSERT_RETURN(upload.staging.data);
+        memcpy(upload.staging.data, data, size);
+    }
+    else
+    {
+        upload.dataOffset = sVkQueuedUploadData.size();
+        sVkQueuedUploadData.insert(sVkQueuedUploadData.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    }
+    sVkQueuedUploads.push_back(upload);
+}
+
+void queueUploadToUniformBuffer(UniformBuffer &uniformBuffer, const void *data, size_t size)
+{
+    ASSERT_RETURN(size <= uniformBuffer.size);
+    queueUploadToGpuBuffer(sVkUniformHeaps[uniformBuffer.bufferIndex].buffer, data, uniformBuffer.offset, size);
+}
+
+UploadStats getUploadStats()
+{
+    return sVkUploadStats;
+}
+
+static ReadbackTicket sAddReadback(const StagingAllocation& allocation, size_t size,
+    FnReadbackDone doneFn, void* userData)
+{
+    uint32_t index = uint32_t(sVkReadbacks.size());
+    if(!sVkReadbackFreeSlots.empty())
+    {
+        index = sVkReadbackFreeSlots.back();
+        sVkReadbackFreeSlots.pop_back();
+    }
+    else
+    {
+        sVkReadbacks.push_back(Readback{});
+    }
+    sVkReadbacks[index] = Readback{
+        .submissionValue = getNextSubmissionValue(),
+        .allocation = allocation,
+        .size = size,
+        .doneFn = doneFn,
+        .userData = userData,
+        .generation = sVkReadbacks[index].generation,
+        .used = true,
+    };
+    // Make the copy visible to host reads after the timeline wait.
+    memoryBarrier(VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+    flushBarriers();
+    return ReadbackTicket{ .index = index, .generation = sVkReadbacks[index].generation };
+}
+
+ReadbackTicket readbackBuffer(Buffer& buffer, size_t offset, size_t size,
+    FnReadbackDone doneFn, void* userData)
+{
+    ASSERT(!sVkAsyncComputeRecording && !sVkThreadCommandBuffer);
+    ASSERT(size > 0 && offset + size <= buffer.size);
+    if(size == 0 || offset + size > buffer.size)
+    {
+        return {};
+    }
+    StagingAllocation allocation = sAllocateFromStagingRing(sVkReadbackRing, size);
+    if(!allocation.buffer)
+    {
+        return {};
+    }
+    bufferBarrier(buffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT);
+    flushBarriers();
+
+    VkBufferCopy copyRegion = {
+        .srcOffset = offset,
+        .dstOffset = allocation.region.srcOffset,
+        .size = VkDeviceSize(size)
+    };
+    vkCmdCopyBuffer(getVkCommandBuffer(), buffer.buffer, allocation.buffer, 1, &copyRegion);
+    return sAddReadback(allocation, size, doneFn, userData);
+}
+
+ReadbackTicket readbackImage(Image& image, uint32_t pixelSize,
+    FnReadbackDone doneFn, void* userData)
+{
+    ASSERT(!sVkAsyncComputeRecording && !sVkThreadCommandBuffer);
+    ASSERT(image.image && pixelSize > 0);
+    size_t size = size_t(image.width) * size_t(image.height) * pixelSize;
+    if(size == 0)
+    {
+        return {};
+    }
+    StagingAllocation allocation = sAllocateFromStagingRing(sVkReadbackRing, size);
+    if(!allocation.buffer)
+    {
+        return {};
+    }
+    imageBarrier(image,
+        VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    flushBarriers();
+
+    // Copies take a single aspect, depth stencil images read their depth.
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat(image.format);
+    if(aspectMask & VK_IMAGE_ASPECT_DEPTH_BIT)
+    {
+        aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    }
+    VkBufferImageCopy2 region{
+        .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+        .bufferOffset = allocation.region.srcOffset,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource {
+            .aspectMask = aspectMask,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .imageOffset = { 0, 0, 0 },
+        .imageExtent = { uint32_t(image.width), uint32_t(image.height), 1 },
+    };
+
+    VkCopyImageToBufferInfo2 copyInfo = {
+        .sType = VK_STRUCTURE_TYPE_COPY_IMAGE_TO_BUFFER_INFO_2,
+        .srcImage = image.image,
+        .srcImageLayout = image.layout,
+        .dstBuffer = allocation.buffer,
+        .regionCount = 1,
+        .pRegions = &region,
+    };
+    vkCmdCopyImageToBuffer2(getVkCommandBuffer(), &copyInfo);
+    return sAddReadback(allocation, size, doneFn, userData);
+}
+
+bool isReadbackReady(ReadbackTicket ticket)
+{
+    if(!sIsReadbackTicketValid(ticket))
+    {
+        return false;
+    }
+    const Readback& readback = sVkReadbacks[ticket.index];
+    // Tickets with a callback are released when it runs, the ticket is stale after this returns.
+    if(!readback.ready && readback.submissionValue <= getCompletedSubmissionValue())
+    {
+        bool hasCallback = readback.doneFn != nullptr;
+        sCompleteReadback(ticket.index);
+        if(hasCallback)
+        {
+            return true;
+        }
+    }
+    return sVkReadbacks[ticket.index].ready;
+}
+
+const void* getReadbackData(ReadbackTicket ticket, size_t* outSize)
+{
+    if(!isReadbackReady(ticket))
+    {
+        return nullptr;
+    }
+    // Completed with a callback, the data went to it.
+    if(!sIsReadbackTicketValid(ticket))
+    {
+        return nullptr;
+    }
+    const Readback& readback = sVkReadbacks[ticket.index];
+    if(outSize)
+    {
+        *outSize = readback.size;
+    }
+    return readback.data.data();
+}
+
+void releaseReadback(ReadbackTicket& ticket)
+{
+    if(sIsReadbackTicketValid(ticket))
+    {
+        // Pending copy still writes into ring memory, which is fine since nothing else reads it.
+        sFreeReadback(ticket.index);
+    }
+    ticket = ReadbackTicket{};
+}
+
+void flushUploads()
+{
+    if(sVkQueuedUploads.empty())
+    {
+        return;
+    }
+    for(QueuedUpload& upload : sVkQueuedUploads)
+    {
+        if(upload.staging.data)
+        {
+            vmaFlushAllocation(sVkAllocator, upload.staging.allocation,
+                upload.staging.region.srcOffset, upload.staging.region.size);
+            continue;
+        }
+        upload.staging = sUploadToStagingRing(sVkStagingRing,
+            sVkQueuedUploadData.data() + upload.dataOffset, upload.size);
+        ASSERT(upload.staging.buffer);
+    }
+
+    // Sort by destination, staging block and offset. Overlapping uploads hold the same bytes,
+    // the overlap is copied once and touching ranges become one region.
+    std::vector<uint32_t> order(sVkQueuedUploads.size());
+    for(uint32_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [](uint32_t a, uint32_t b)
+    {
+        const QueuedUpload& uploadA = sVkQueuedUploads[a];
+        const QueuedUpload& uploadB = sVkQueuedUploads[b];
+        if(uploadA.buffer != uploadB.buffer)
+            return uploadA.buffer < uploadB.buffer;
+        if(uploadA.staging.buffer != uploadB.staging.buffer)
+            return uploadA.staging.buffer < uploadB.staging.buffer;
+        return uploadA.dstOffset < uploadB.dstOffset;
+    });
+
+    for(uint32_t i = 0; i < order.size(); ++i)
+    {
+        Buffer* buffer = sVkQueuedUploads[order[i]].buffer;
+        if(i == 0 || sVkQueuedUploads[order[i - 1]].buffer != buffer)
+        {
+            bufferBarrier(*buffer, VK_PIPELINE_STAGE_2_COPY_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT);
+        }
+    }
+    flushBarriers();
+
+    std::vector<VkBufferCopy2> regions;
+    size_t copiedEnd = 0;
+    for(uint32_t i = 0; i < order.size(); ++i)
+    {
+        const QueuedUpload& upload = sVkQueuedUploads[order[i]];
+        if(!upload.staging.buffer)
+        {
+            continue;
+        }
+        size_t dstOffset = MAX_VALUE(upload.dstOffset, copiedEnd);
+        size_t dstEnd = upload.dstOffset + upload.size;
+        if(dstOffset < dstEnd)
+        {
+            size_t srcOffset = upload.staging.region.srcOffset + dstOffset - upload.dstOffset;
+            VkBufferCopy2* last = regions.empty() ? nullptr : &regions.back();
+            if(last && last->dstOffset + last->size == dstOffset && last->srcOffset + last->size == srcOffset)
+            {
+                last->size += dstEnd - dstOffset;
+            }
+            else
+            {
+                regions.push_back(VkBufferCopy2{
+                    .sType = VK_STRUCTURE_TYPE_BUFFER_COPY_2,
+                    .srcOffset = srcOffset,
+                    .dstOffset = dstOffset,
+                    .size = dstEnd - dstOffset,
+                });
+            }
+            copiedEnd = dstEnd;
+        }
+
+        if(i + 1 < order.size())
+        {
+            const QueuedUpload& next = sVkQueuedUploads[order[i + 1]];
+            if(next.buffer == upload.buffer && next.staging.buffer == upload.staging.buffer)
+                continue;
+        }
+        VkCopyBufferInfo2 copyInfo = {
+            .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2,
+            .srcBuffer = upload.staging.buffer,
+            .dstBuffer = upload.buffer->buffer,
+            .regionCount = uint32_t(regions.size()),
+            .pRegions = regions.data(),
+        };
+        vkCmdCopyBuffer2(getVkCommandBuffer(), &copyInfo);
+        regions.clear();
+        copiedEnd = 0;
+    }
+    sVkQueuedUploads.clear();
+    sVkQueuedUploadData.clear();
+}
+
+void uploadToImage(uint32_t width, uint32_t height, uint32_t pixelSize,
+    Image& targetImage, void* data, uint32_t dataSize)
+{
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+
+    ASSERT(data != nullptr && dataSize > 0u);
+    ASSERT(dataSize >= width * height * pixelSize);
+    ASSERT(targetImage.image);
+
+    StagingAllocation allocation = sUploadToStagingRing(sVkStagingRing, data, dataSize);
+    const BufferCopyRegion& copyRegion = allocation.region;
+    {
+        imageBarrier(targetImage,
+            VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        flushBarriers();
+    }
+
+    VkBufferImageCopy2 region{
+        .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+        .bufferOffset = copyRegion.srcOffset,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource {
+            .aspectMask = sGetAspectMaskFromFormat(targetImage.format),
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .imageOffset = { 0, 0, 0 },
+        .imageExtent = { width, height, 1 },
+    };
+
+    VkCopyBufferToImageInfo2 imageInfo = {
+        .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
+        .srcBuffer = allocation.buffer,
+        .dstImage = targetImage.image,
+        .dstImageLayout = targetImage.layout,
+        .regionCount = 1,
+        .pRegions = &region,
+    };
+
+    vkCmdCopyBufferToImage2(commandBuffer, &imageInfo);
+}
+
+
+bool uploadToGpuBufferAsync(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size)
+{
+    if(!sCanUseTransferQueue(gpuBuffer.stageMask, gpuBuffer.accessMask))
+    {
+        uploadToGpuBuffer(gpuBuffer, data, dstOffset, size);
+        return false;
+    }
+    ASSERT(dstOffset + size <= gpuBuffer.size);
+
+    VkCommandBuffer commandBuffer = sBeginTransferCommandBuffer();
+    StagingAllocation allocation = sUploadToStagingRing(sVkTransferStagingRing, data, size);
+    const BufferCopyRegion& region = allocation.region;
+
+    VkBufferCopy copyRegion = {
+        .srcOffset = region.srcOffset,
+        .dstOffset = dstOffset,
+        .size = VkDeviceSize(size)
+    };
+    vkCmdCopyBuffer(commandBuffer, allocation.buffer, gpuBuffer.buffer, 1, &copyRegion);
+
+    VkBufferMemoryBarrier2 releaseBarrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .dstStageMask = VK_PIPELINE_STAGE_2_NONE,
+        .dstAccessMask = VK_ACCESS_2_NONE,
+        .srcQueueFamilyIndex = sVkTransferQueueIndex,
+        .dstQueueFamilyIndex = sVkQueueIndex,
+        .buffer = gpuBuffer.buffer,
+        .offset = 0,
+        .size = VK_WHOLE_SIZE,
+    };
+    VkDependencyInfo dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependencyInfo.bufferMemoryBarrierCount = 1;
+    dependencyInfo.pBufferMemoryBarriers = &releaseBarrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+    VkBufferMemoryBarrier2 acquireBarrier = releaseBarrier;
+    acquireBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    acquireBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+    acquireBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    acquireBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    sVkTransferRecordedAcquires.push_back(TransferAcquire{ .buffer = &gpuBuffer, .bufferBarrier = acquireBarrier });
+
+    // Mark as used so that another async upload this frame does not take the same path again
+    // before graphics queue owns it.
+    gpuBuffer.stageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    gpuBuffer.accessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    gpuBuffer.pendingAcquire = true;
+    return true;
+}
+
+bool uploadToImageAsync(uint32_t width, uint32_t height, uint32_t pixelSize,
+    Image& targetImage, void* data, uint32_t dataSize)
+{
+    if(!sCanUseTransferQueue(targetImage.stageMask, targetImage.accessMask)
+        || targetImage.layout != VK_IMAGE_LAYOUT_UNDEFINED)
+    {
+        uploadToImage(width, height, pixelSize, targetImage, data, dataSize);
+        return false;
+    }
+    ASSERT(data != nullptr && dataSize > 0u);
+    ASSERT(dataSize >= width * height * pixelSize);
+    ASSERT(targetImage.image);
+
+    VkCommandBuffer commandBuffer = sBeginTransferCommandBuffer();
+    StagingAllocation allocation = sUploadToStagingRing(sVkTransferStagingRing, data, dataSize);
+    const BufferCopyRegion& copyRegion = allocation.region;
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat(targetImage.format);
+
+    VkImageMemoryBarrier2 toTransferBarrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+        .srcStageMask = VK_PIPELINE_STAGE_2_NONE,
+        .srcAccessMask = VK_ACCESS_2_NONE,
+        .dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT,
+        .dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = targetImage.image,
+        .subresourceRange = {
+            .aspectMask = aspectMask,
+            .levelCount = VK_REMAINING_MIP_LEVELS,
+            .layerCount = VK_REMAINING_ARRAY_LAYERS,
+        },
+    };
+    VkDependencyInfo dependencyInfo = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO };
+    dependencyInfo.imageMemoryBarrierCount = 1;
+    dependencyInfo.pImageMemoryBarriers = &toTransferBarrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+    VkBufferImageCopy2 region{
+        .sType = VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2,
+        .bufferOffset = copyRegion.srcOffset,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource {
+            .aspectMask = aspectMask,
+            .mipLevel = 0,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        },
+        .imageOffset = { 0, 0, 0 },
+        .imageExtent = { width, height, 1 },
+    };
+
+    VkCopyBufferToImageInfo2 imageInfo = {
+        .sType = VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2,
+        .srcBuffer = allocation.buffer,
+        .dstImage = targetImage.image,
+        .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .regionCount = 1,
+        .pRegions = &region,
+    };
+    vkCmdCopyBufferToImage2(commandBuffer, &imageInfo);
+
+    VkImageMemoryBarrier2 releaseBarrier = toTransferBarrier;
+    releaseBarrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    releaseBarrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    releaseBarrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+    releaseBarrier.dstAccessMask = VK_ACCESS_2_NONE;
+    releaseBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    releaseBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    releaseBarrier.srcQueueFamilyIndex = sVkTransferQueueIndex;
+    releaseBarrier.dstQueueFamilyIndex = sVkQueueIndex;
+    dependencyInfo.pImageMemoryBarriers = &releaseBarrier;
+    vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+
+    VkImageMemoryBarrier2 acquireBarrier = releaseBarrier;
+    acquireBarrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    acquireBarrier.srcAccessMask = VK_ACCESS_2_NONE;
+    acquireBarrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    acquireBarrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    sVkTransferRecordedAcquires.push_back(TransferAcquire{ .image = &targetImage, .imageBarrier = acquireBarrier });
+
+    targetImage.stageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    targetImage.accessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    targetImage.layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    targetImage.pendingAcquire = true;
+    return true;
+}
+
+bool hasAsyncTransferQueue()
+{
+    return sVkTransferQueue != VK_NULL_HANDLE;
+}
+
+void destroyBuffer(Buffer& buffer)
+{
+    if(!sVkAllocator)
+        return;
+    sForgetCachedDescriptorSets((uint64_t)buffer.buffer);
+    // Queued uploads keep a pointer to the buffer.
+    std::erase_if(sVkQueuedUploads, [&buffer](const QueuedUpload& upload)
+    {
+        return upload.buffer == &buffer;
+    });
+    if(buffer.buffer && buffer.allocation)
+    {
+        vmaDestroyBuffer(sVkAllocator, buffer.buffer, buffer.allocation);
+    }
+    buffer = Buffer{};
+}
+
+
+
+
+
+
+// Barriers are not allowed inside the rendering scope of a secondary command buffer,
+// transitions belong before beginSecondaryRendering. Checked before touching any state.
+static bool sCanRecordBarrier()
+{
+    if(sVkThreadInsideRendering)
+    {
+        printf("Barrier recorded inside secondary rendering, it is ignored\n");
+        ASSERT(false);
+        return false;
+    }
+    return true;
+}
+
+void imageBarrier(Image& image,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!image.pendingAcquire);
+    if(image.accessMask == dstAccessMask && image.layout == newLayout && image.stageMask == dstStageMask)
+        return;
+    imageBarrier(image, image.stageMask, image.accessMask, image.layout,
+        dstStageMask, dstAccessMask, newLayout);
+}
+
+void imageBarrier(Image& image,
+    VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!image.pendingAcquire);
+    if(image.accessMask == dstAccessMask && image.layout == newLayout && image.stageMask == dstStageMask)
+        return;
+
+
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat((VkFormat)image.format);
+    imageBarrier(image.image, srcStageMask, srcAccessMask, oldLayout,
+        dstStageMask, dstAccessMask, newLayout, aspectMask);
+    image.stageMask = dstStageMask;
+    image.accessMask = dstAccessMask;
+    image.layout = newLayout;
+}
+
+void imageBarrier(VkImage image,
+    VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout,
+    uint32_t aspectMask, uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if(!sCanRecordBarrier())
+        return;
+    srcQueueFamilyIndex = srcQueueFamilyIndex == ~0u ? sGetRecordingQueueFamilyIndex() : srcQueueFamilyIndex;
+    dstQueueFamilyIndex = dstQueueFamilyIndex == ~0u ? sGetRecordingQueueFamilyIndex() : dstQueueFamilyIndex;
+    if(srcAccessMask == dstAccessMask && oldLayout == newLayout && srcStageMask == dstStageMask
+        && srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    VkImageMemoryBarrier2 barrier = { VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2 };
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstAccessMask = dstAccessMask;
+    barrier.srcStageMask = srcStageMask;
+    barrier.dstStageMask = dstStageMask;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = srcQueueFamilyIndex;
+    barrier.dstQueueFamilyIndex = dstQueueFamilyIndex;
+    barrier.image = image;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.aspectMask = aspectMask;
+    // Andoird error?
+    barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+    sVkImageBarriers.push_back(barrier);
+}
+
+void bufferBarrier(UniformBuffer& uniformBuffer,
+     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+{
+    if(!sCanRecordBarrier())
+        return;
+    Buffer& buffer = sVkUniformHeaps[uniformBuffer.bufferIndex].buffer;
+    if(buffer.stageMask == dstStageMask && buffer.accessMask == dstAccessMask)
+    {
+        return;
+    }
+    bufferBarrier(buffer.buffer,
+        buffer.stageMask, buffer.accessMask,
+        dstStageMask, dstAccessMask, uniformBuffer.size, uniformBuffer.offset);
+
+    buffer.accessMask = dstAccessMask;
+    buffer.stageMask = dstStageMask;
+}
+
+
+void bufferBarrier(Buffer& buffer,
+     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!buffer.pendingAcquire);
+    if(buffer.stageMask == dstStageMask && buffer.accessMask == dstAccessMask)
+    {
+        return;
+    }
+    bufferBarrier(buffer.buffer,
+        buffer.stageMask, buffer.accessMask,
+        dstStageMask, dstAccessMask,
+        buffer.size, 0);
+
+    buffer.accessMask = dstAccessMask;
+    buffer.stageMask = dstStageMask;
+}
+
+void bufferBarrier(VkBuffer buffer,
+
+    const VkPipelineStageFlags2 srcStageMask, const VkAccessFlags2 srcAccessMask,
+    const VkPipelineStageFlags2 dstStageMask, const VkAccessFlags2 dstAccessMask,
+    const size_t size, const size_t offset,
+    uint32_t srcQueueFamilyIndex, uint32_t dstQueueFamilyIndex)
+{
+    if(!sCanRecordBarrier())
+        return;
+    srcQueueFamilyIndex = srcQueueFamilyIndex == ~0u ? sGetRecordingQueueFamilyIndex() : srcQueueFamilyIndex;
+    dstQueueFamilyIndex = dstQueueFamilyIndex == ~0u ? sGetRecordingQueueFamilyIndex() : dstQueueFamilyIndex;
+    if(srcAccessMask == dstAccessMask && srcStageMask == dstStageMask
+        && srcQueueFamilyIndex == dstQueueFamilyIndex)
+        return;
+
+    ASSERT(size > 0);
+    VkBufferMemoryBarrier2 bufferBarrier = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+        .srcStageMask = srcStageMask,
+        .srcAccessMask = srcAccessMask,
+        .dstStageMask = dstStageMask,
+        .dstAccessMask = dstAccessMask,
+        .srcQueueFamilyIndex = srcQueueFamilyIndex,
+        .dstQueueFamilyIndex = dstQueueFamilyIndex,
+        .buffer = buffer,
+        .offset = offset,
+        .size = size,
+    };
+
+    sVkBufferBarriers.push_back(bufferBarrier);
+}
+
+void memoryBarrier(VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+{
+    if(!sCanRecordBarrier())
+        return;
+    sVkMemoryBarriers.push_back(VkMemoryBarrier2{
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .srcStageMask = srcStageMask,
+        .srcAccessMask = srcAccessMask,
+        .dstStageMask = dstStageMask,
+        .dstAccessMask = dstAccessMask,
+    });
+}
+
+void releaseOwnership(Buffer& buffer, QueueType dstQueue)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!buffer.pendingAcquire);
+    uint32_t srcFamily = sGetRecordingQueueFamilyIndex();
+    uint32_t dstFamily = sGetQueueFamilyIndex(dstQueue);
+    if(srcFamily == dstFamily || (buffer.stageMask == 0 && buffer.accessMask == 0))
+    {
+        return;
+    }
+    bufferBarrier(buffer.buffer,
+        buffer.stageMask, buffer.accessMask,
+        VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+        buffer.size, 0, srcFamily, dstFamily);
+
+    // Semaphore between the submissions covers the rest.
+    buffer.stageMask = VK_PIPELINE_STAGE_2_NONE;
+    buffer.accessMask = VK_ACCESS_2_NONE;
+}
+
+void acquireOwnership(Buffer& buffer, QueueType srcQueue,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!buffer.pendingAcquire);
+    uint32_t srcFamily = sGetQueueFamilyIndex(srcQueue);
+    uint32_t dstFamily = sGetRecordingQueueFamilyIndex();
+    if(srcFamily == dstFamily)
+    {
+        bufferBarrier(buffer, dstStageMask, dstAccessMask);
+        return;
+    }
+    bufferBarrier(buffer.buffer,
+        VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+        dstStageMask, dstAccessMask,
+        buffer.size, 0, srcFamily, dstFamily);
+    buffer.stageMask = dstStageMask;
+    buffer.accessMask = dstAccessMask;
+}
+
+void releaseOwnership(Image& image, QueueType dstQueue, VkImageLayout newLayout)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!image.pendingAcquire);
+    uint32_t srcFamily = sGetRecordingQueueFamilyIndex();
+    uint32_t dstFamily = sGetQueueFamilyIndex(dstQueue);
+    if(srcFamily == dstFamily)
+    {
+        return;
+    }
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat((VkFormat)image.format);
+    imageBarrier(image.image, image.stageMask, image.accessMask, image.layout,
+        VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, newLayout,
+        aspectMask, srcFamily, dstFamily);
+
+    // Acquire has to use the same layout transition, the transition itself happens once.
+    image.stageMask = VK_PIPELINE_STAGE_2_NONE;
+    image.accessMask = VK_ACCESS_2_NONE;
+    image.releasedLayout = image.layout;
+    image.layout = newLayout;
+}
+
+void acquireOwnership(Image& image, QueueType srcQueue,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout)
+{
+    if(!sCanRecordBarrier())
+        return;
+    ASSERT(!image.pendingAcquire);
+    uint32_t srcFamily = sGetQueueFamilyIndex(srcQueue);
+    uint32_t dstFamily = sGetRecordingQueueFamilyIndex();
+    if(srcFamily == dstFamily)
+    {
+        imageBarrier(image, dstStageMask, dstAccessMask, newLayout);
+        return;
+    }
+    ASSERT(image.layout == newLayout);
+    VkImageAspectFlags aspectMask = sGetAspectMaskFromFormat((VkFormat)image.format);
+    imageBarrier(image.image, VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE, image.releasedLayout,
+        dstStageMask, dstAccessMask, newLayout,
+        aspectMask, srcFamily, dstFamily);
+    image.stageMask = dstStageMask;
+    image.accessMask = dstAccessMask;
+    image.layout = newLayout;
+}
+
+
+
+bool createShader(const char* code, int codeSize, VkShaderModule& outModule)
+{
+    VkShaderModuleCreateInfo createInfo = { VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+    createInfo.codeSize = codeSize;
+    createInfo.pCode = (uint32_t*)code;
+    VK_CHECK_CALL(vkCreateShaderModule(sVkDevice, &createInfo, nullptr, &outModule));
+    ASSERT_RETURN_FALSE(outModule);
+
+    // Code from files is not word aligned.
+    std::vector<uint32_t> words((size_t(codeSize) + 3) / 4);
+    memcpy(words.data(), code, codeSize);
+    uint64_t hash = hashSpirv(words.data(), words.size());
+    ShaderReflectionEntry* reflectionEntry = nullptr;
+    auto range = sVkShaderReflections.equal_range(hash);
+    for(auto it = range.first; it != range.second && !reflectionEntry; ++it)
+    {
+        if(it->second.code == words)
+        {
+            reflectionEntry = &it->second;
+        }
+    }
+    if(!reflectionEntry)
+    {
+        ShaderReflection reflection;
+        if(!reflectSpirv(words.data(), words.size(), reflection))
+        {
+            printf("Failed to reflect shader, layouts cannot be made from it\n");
+        }
+        auto inserted = sVkShaderReflections.emplace(hash, ShaderReflectionEntry{
+            .code = std::move(words),
+            .reflection = std::move(reflection),
+            .hash = hash,
+        });
+        reflectionEntry = &inserted->second;
+    }
+    reflectionEntry->moduleCount++;
+    sVkShaderModuleReflections[outModule] = reflectionEntry;
+    return true;
+}
+
+bool createShader(const char* filename, VkShaderModule& outModule)
+{
+    std::ifstream file(filename, std::ios::ate | std::ios::binary);
+
+    if (!file.is_open())
+    {
+        printf("Failed to load file: %s\n", filename);
+        return false;
+    }
+
+    std::vector<char> buffer;
+
+    std::streamsize fileSize = file.tellg();
+    buffer.resize(fileSize);
+    file.seekg(0);
+    file.read(buffer.data(), fileSize);
+    file.close();
+
+    return createShader(buffer.data(), (int)buffer.size(), outModule);
+
+}
+
+
+VkDescriptorSetLayout createSetLayout(const DescriptorSetLayout* descriptors, int32_t count, bool pushDescriptors)
+{
+    // Empty layouts fill the unused set indices of reflected pipeline layouts.
+    ASSERT(count >= 0);
+    ASSERT(count < 16);
+    if(pushDescriptors && !sVkPushDescriptorsSupported)
+    {
+        printf("Push descriptors are not enabled, cannot create push set layout\n");
+        ASSERT(false);
+        return VK_NULL_HANDLE;
+    }
+    if(pushDescriptors && sVkDescriptorBufferSupported && !sVkDescriptorBufferProperties.bufferlessPushDescriptors)
+    {
+        printf("Push descriptors need a push descriptor buffer on this device, cannot create push set layout\n");
+        ASSERT(false);
+        return VK_NULL_HANDLE;
+    }
+
+
+    VkDescriptorSetLayoutBinding setBindings[16] = {};
+    //VkDescriptorBindingFlags setBindingFlags[16] = {};
+
+    for (int32_t i = 0; i < count; ++i)
+    {
+        const DescriptorSetLayout& layout = descriptors[i];
+        ASSERT(layout.descriptorCount > 0);
+        ASSERT(!layout.immutableSampler || layout.descriptorCount == 1);
+        if(sVkDescriptorBufferSupported
+            && (layout.descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+                || layout.descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC))
+        {
+            printf("Dynamic descriptors are not supported with descriptor buffers\n");
+            ASSERT(false);
+            return VK_NULL_HANDLE;
+        }
+
+        setBindings[i] = VkDescriptorSetLayoutBinding{
+            .binding = layout.bindingIndex,
+            .descriptorType = VkDescriptorType(layout.descriptorType),
+            .descriptorCount = layout.descriptorCount,
+            .stageFlags = layout.stage, // VK_SHADER_STAGE_VERTEX_BIT;
+            .pImmutableSamplers = layout.immutableSampler ? &layout.immutableSampler : nullptr,
+        };
+
+        //setBindingFlags[i] = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+    }
+/*
+    VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlags = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .pNext = nullptr,
+        .bindingCount = uint32_t(count),
+        .pBindingFlags = setBindingFlags,
+    };
+*/
+    VkDescriptorSetLayoutCreateInfo createInfo = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        //.pNext = &bindingFlags,
+        //.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT,
+        .flags = (pushDescriptors ? VkDescriptorSetLayoutCreateFlags(VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR) : 0u)
+            | (sVkDescriptorBufferSupported ? VkDescriptorSetLayoutCreateFlags(VK_DESCRIPTOR_SET_LAYOUT_CREATE_DESCRIPTOR_BUFFER_BIT_EXT) : 0u),
+        .bindingCount = uint32_t(count),
+        .pBindings = setBindings,
+    };
+
+    VkDescriptorSetLayout setLayout = {};
+    VK_CHECK_CALL(vkCreateDescriptorSetLayout(sVkDevice, &createInfo, nullptr, &setLayout));
+
+    ASSERT(setLayout);
+    if(setLayout && sVkDescriptorBufferSupported && !pushDescriptors)
+    {
+        sRegisterDescriptorBufferLayout(setLayout, descriptors, count);
+    }
+    return setLayout;
+}
+
+
+void destroyShaderModule(VkShaderModule* shaderModules, int32_t shaderModuleCount)
+{
+    for (int32_t i = 0; i < shaderModuleCount; ++i)
+    {
+        auto moduleReflection = sVkShaderModuleReflections.find(shaderModules[i]);
+        if(moduleReflection != sVkShaderModuleReflections.end())
+        {
+            ShaderReflectionEntry* entry = moduleReflection->second;
+            sVkShaderModuleReflections.erase(moduleReflection);
+            if(--entry->moduleCount == 0)
+            {
+                auto range = sVkShaderReflections.equal_range(entry->hash);
+                for(auto it = range.first; it != range.second; ++it)
+                {
+                    if(&it->second == entry)
+                    {
+                        sVkShaderReflections.erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+        sForgetPipelineVariants(shaderModules[i], VK_NULL_HANDLE);
+        vkDestroyShaderModule(sVkDevice, shaderModules[i], nullptr);
+        shaderModules[i] = {};
+    }
+}
+
+VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout descriptorSetLayout)
+{
+    return createPipelineLayout(&descriptorSetLayout, 1);
+}
+
+VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count)
+{
+    return createPipelineLayout(descriptorSetLayouts, count, nullptr, 0);
+}
+
+VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count,
+    const VkPushConstantRange* pushConstantRanges, int32_t pushConstantRangeCount)
+{
+    ASSERT(count >= 0 && pushConstantRangeCount >= 0);
+    ASSERT(pushConstantRanges || pushConstantRangeCount == 0);
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo = { VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+    pipelineLayoutCreateInfo.setLayoutCount = uint32_t(count);
+    pipelineLayoutCreateInfo.pSetLayouts = descriptorSetLayouts;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = uint32_t(pushConstantRangeCount);
+    pipelineLayoutCreateInfo.pPushConstantRanges = pushConstantRanges;
+    VkPipelineLayout result = {};
+    VK_CHECK_CALL(vkCreatePipelineLayout(sVkDevice, &pipelineLayoutCreateInfo, nullptr, &result));
+    if(result && sVkShaderObjectsSupported)
+    {
+        PipelineLayoutContents& contents = sVkPipelineLayoutContents[result];
+        contents.setLayouts.assign(descriptorSetLayouts, descriptorSetLayouts + count);
+        contents.pushConstantRanges.assign(pushConstantRanges, pushConstantRanges + pushConstantRangeCount);
+    }
+    return result;
+}
+
+const ShaderReflection* getShaderReflection(VkShaderModule module)
+{
+    auto entry = sVkShaderModuleReflections.find(module);
+    if(entry == sVkShaderModuleReflections.end())
+    {
+        return nullptr;
+    }
+    const ShaderReflection& reflection = entry->second->reflection;
+    return reflection.valid ? &reflection : nullptr;
+}
+
+const ReflectedLayouts* getReflectedLayouts(const VkShaderModule* modules, int32_t moduleCount)
+{
+    ASSERT(modules && moduleCount > 0);
+    const ShaderReflection* reflections[8] = {};
+    if(moduleCount > 8)
+    {
+        printf("Too many shader stages for reflected layouts: %i\n", moduleCount);
+        return nullptr;
+    }
+    for(int32_t i = 0; i < moduleCount; ++i)
+    {
+        reflections[i] = getShaderReflection(modules[i]);
+        if(!reflections[i])
+        {
+            printf("No reflection for shader module, cannot make layouts\n");
+            return nullptr;
+        }
+    }
+    ShaderReflection merged;
+    if(!mergeShaderReflections(reflections, uint32_t(moduleCount), merged))
+    {
+        return nullptr;
+    }
+    std::sort(merged.bindings.begin(), merged.bindings.end(),
+        [](const SpirvBinding& a, const SpirvBinding& b)
+        {
+            return a.set != b.set ? a.set < b.set : a.binding < b.binding;
+        });
+
+    std::vector<uint64_t> key;
+    key.reserve(4 + merged.bindings.size() * 2);
+    key.push_back((uint64_t(merged.pushConstantOffset) << 32) | merged.pushConstantSize);
+    key.push_back(merged.stage);
+    for(const SpirvBinding& binding : merged.bindings)
+    {
+        key.push_back((uint64_t(binding.set) << 32) | binding.binding);
+        key.push_back((uint64_t(binding.descriptorType) << 32) | (uint64_t(binding.descriptorCount) << 16)
+            | binding.stageFlags);
+    }
+    uint64_t hash = sHashKey(key);
+    auto range = sVkReflectedLayoutLookup.equal_range(hash);
+    for(auto it = range.first; it != range.second; ++it)
+    {
+        if(sVkReflectedLayouts[it->second].key == key)
+        {
+            return &sVkReflectedLayouts[it->second].layouts;
+        }
+    }
+
+    ReflectedLayouts layouts;
+    uint32_t setCount = merged.bindings.empty() ? 0 : merged.bindings.back().set + 1;
+    if(setCount > uint32_t(CarpVk::MaxReflectedSets))
+    {
+        printf("Shader uses set %u, only %i sets are supported\n", setCount - 1, CarpVk::MaxReflectedSets);
+        return nullptr;
+    }
+    for(const SpirvBinding& binding : merged.bindings)
+    {
+        if(binding.descriptorCount == 0)
+        {
+            printf("Runtime sized descriptor arrays are not supported in reflected layouts, set: %u, binding: %u\n",
+                binding.set, binding.binding);
+            return nullptr;
+        }
+        layouts.setBindings[binding.set].push_back(DescriptorSetLayout{
+            .bindingIndex = binding.binding,
+            .descriptorType = binding.descriptorType,
+            .stage = binding.stageFlags,
+            .descriptorCount = binding.descriptorCount,
+        });
+    }
+    for(uint32_t i = 0; i < setCount; ++i)
+    {
+        const std::vector<DescriptorSetLayout>& setBindings = layouts.setBindings[i];
+        layouts.setLayouts[i] = createSharedSetLayout(setBindings.data(), int32_t(setBindings.size()));
+        if(!layouts.setLayouts[i])
+        {
+            destroyDescriptorSetLayouts(layouts.setLayouts, int32_t(i));
+            return nullptr;
+        }
+    }
+    layouts.setLayoutCount = setCount;
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = merged.stage,
+        .offset = merged.pushConstantOffset,
+        .size = merged.pushConstantSize,
+    };
+    int32_t pushConstantRangeCount = merged.pushConstantSize > 0 ? 1 : 0;
+    layouts.pipelineLayout = createSharedPipelineLayout(layouts.setLayouts, int32_t(setCount),
+        &pushConstantRange, pushConstantRangeCount);
+    layouts.pushConstantStageFlags = pushConstantRangeCount > 0 ? merged.stage : 0;
+    layouts.pushConstantOffset = merged.pushConstantOffset;
+    layouts.pushConstantSize = merged.pushConstantSize;
+    for(uint32_t i = 0; i < 3; ++i)
+    {
+        layouts.workgroupSize[i] = merged.workgroupSize[i];
+    }
+
+    sVkReflectedLayoutLookup.emplace(hash, uint32_t(sVkReflectedLayouts.size()));
+    sVkReflectedLayouts.push_back(ReflectedLayoutsEntry{ .key = std::move(key), .layouts = std::move(layouts) });
+    return &sVkReflectedLayouts.back().layouts;
+}
+
+bool hasBindless()
+{
+    return sVkBindlessDescriptorSet != VK_NULL_HANDLE;
+}
+
+VkDescriptorSetLayout getBindlessSetLayout()
+{
+    return sVkBindlessSetLayout;
+}
+
+VkDescriptorSet getBindlessDescriptorSet()
+{
+    return sVkBindlessDescriptorSet;
+}
+
+void bindBindlessDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex)
+{
+    ASSERT_RETURN(sVkBindlessDescriptorSet);
+    vkCmdBindDescriptorSets(getVkCommandBuffer(), bindPoint, pipelineLayout,
+        setIndex, 1, &sVkBindlessDescriptorSet, 0, nullptr);
+}
+
+void bindDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex,
+    VkDescriptorSet descriptorSet, const uint32_t* dynamicOffsets, uint32_t dynamicOffsetCount)
+{
+    ASSERT_RETURN(descriptorSet);
+    ASSERT_RETURN(dynamicOffsets || dynamicOffsetCount == 0);
+    sBindDescriptorSet(getVkCommandBuffer(), bindPoint, pipelineLayout,
+        setIndex, descriptorSet, dynamicOffsets, dynamicOffsetCount);
+}
+
+uint32_t registerBindlessSampledImage(const Image& image, VkSampler sampler)
+{
+    ASSERT(image.view && sampler);
+    ASSERT(!image.pendingAcquire);
+    VkDescriptorImageInfo imageInfo = {
+        .sampler = sampler,
+        .imageView = image.view,
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+    return sWriteBindlessDescriptor(BindlessBindingSampledImage,
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, &imageInfo, nullptr);
+}
+
+uint32_t registerBindlessStorageImage(const Image& image)
+{
+    ASSERT(image.view);
+    ASSERT(!image.pendingAcquire);
+    VkDescriptorImageInfo imageInfo = {
+        .imageView = image.view,
+        .imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+    };
+    return sWriteBindlessDescriptor(BindlessBindingStorageImage,
+        VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, &imageInfo, nullptr);
+}
+
+uint32_t registerBindlessStorageBuffer(const Buffer& buffer)
+{
+    ASSERT(buffer.buffer && buffer.size > 0);
+    ASSERT(!buffer.pendingAcquire);
+    VkDescriptorBufferInfo bufferInfo = {
+        .buffer = buffer.buffer,
+        .offset = 0,
+        .range = buffer.size,
+    };
+    return sWriteBindlessDescriptor(BindlessBindingStorageBuffer,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, nullptr, &bufferInfo);
+}
+
+void unregisterBindlessSampledImage(uint32_t index)
+{
+    sFreeBindlessIndex(BindlessBindingSampledImage, index);
+}
+
+void unregisterBindlessStorageImage(uint32_t index)
+{
+    sFreeBindlessIndex(BindlessBindingStorageImage, index);
+}
+
+void unregisterBindlessStorageBuffer(uint32_t index)
+{
+    sFreeBindlessIndex(BindlessBindingStorageBuffer, index);
+}
+
+void destroyPipelines(VkPipeline* pipelines, int32_t pipelineCount)
+{
+    for (int32_t i = 0; i < pipelineCount; ++i)
+    {
+        vkDestroyPipeline(sVkDevice, pipelines[i], nullptr);
+        pipelines[i] = {};
+    }
+}
+
+void destroyPipelineLayouts(VkPipelineLayout* pipelineLayouts, int32_t pipelineLayoutCount)
+{
+    for (int32_t i = 0; i < pipelineLayoutCount; ++i)
+    {
+        std::vector<uint64_t> sharedKey;
+        auto shared = sVkSharedPipelineLayouts.entries.find((uint64_t)pipelineLayouts[i]);
+        if(shared != sVkSharedPipelineLayouts.entries.end())
+        {
+            sharedKey = shared->second.key;
+        }
+        if(!sReleaseSharedHandle(sVkSharedPipelineLayouts, (uint64_t)pipelineLayouts[i]))
+        {
+            pipelineLayouts[i] = {};
+            continue;
+        }
+        sVkPipelineLayoutContents.erase(pipelineLayouts[i]);
+        sForgetPipelineVariants(VK_NULL_HANDLE, pipelineLayouts[i]);
+        vkDestroyPipelineLayout(sVkDevice, pipelineLayouts[i], nullptr);
+        pipelineLayouts[i] = {};
+
+        // Shared set layouts are referenced by the shared pipeline layouts made from them.
+        for(size_t word = 2; !sharedKey.empty() && word < 2 + sharedKey[0]; ++word)
+        {
+            if(sVkSharedSetLayouts.entries.contains(sharedKey[word]))
+            {
+                VkDescriptorSetLayout setLayout = (VkDescriptorSetLayout)sharedKey[word];
+                destroyDescriptorSetLayouts(&setLayout, 1);
+            }
+        }
+    }
+}
+
+void destroyDescriptorSetLayouts(VkDescriptorSetLayout* layouts, int32_t amount)
+{
+    for (int32_t i = 0; i < amount; ++i)
+    {
+        if(!sReleaseSharedHandle(sVkSharedSetLayouts, (uint64_t)layouts[i]))
+        {
+            layouts[i] = {};
+            continue;
+        }
+        sForgetDescriptorLayout(layouts[i]);
+        if(sVkDescriptorBufferSupported)
+        {
+            sFreeDescriptorBufferSets(layouts[i]);
+            sVkDescriptorBufferLayouts.erase(layouts[i]);
+        }
+        vkDestroyDescriptorSetLayout(sVkDevice, layouts[i], nullptr);
+        layouts[i] = {};
+    }
+}
+
+VkDescriptorSetLayout createSharedSetLayout(const DescriptorSetLayout* descriptors, int32_t count,
+    bool pushDescriptors)
+{
+    ASSERT(count >= 0 && (descriptors || count == 0));
+    std::vector<uint64_t> key;
+    key.reserve(2 + count * 5);
+    key.push_back(uint64_t(count));
+    key.push_back(pushDescriptors ? 1 : 0);
+    for(int32_t i = 0; i < count; ++i)
+    {
+        const DescriptorSetLayout& layout = descriptors[i];
+        key.push_back(uint64_t(layout.bindingIndex));
+        key.push_back(uint64_t(layout.descriptorType));
+        key.push_back(uint64_t(layout.stage));
+        key.push_back((uint64_t)layout.immutableSampler);
+        key.push_back(uint64_t(layout.descriptorCount));
+    }
+    uint64_t hash = sHashKey(key);
+    if(uint64_t handle = sFindSharedHandle(sVkSharedSetLayouts, key, hash))
+    {
+        return (VkDescriptorSetLayout)handle;
+    }
+    VkDescriptorSetLayout result = createSetLayout(descriptors, count, pushDescriptors);
+    sAddSharedHandle(sVkSharedSetLayouts, std::move(key), hash, (uint64_t)result);
+    return result;
+}
+
+VkPipelineLayout createSharedPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count,
+    const VkPushConstantRange* pushConstantRanges, int32_t pushConstantRangeCount)
+{
+    ASSERT(count >= 0 && pushConstantRangeCount >= 0);
+    // The key holds set layout handles, only handles that cannot be destroyed and reused while
+    // the pipeline layout is cached are allowed: shared ones, referenced below, and bindless.
+    for(int32_t i = 0; i < count; ++i)
+    {
+        if(descriptorSetLayouts[i] != sVkBindlessSetLayout
+            && !sVkSharedSetLayouts.entries.contains((uint64_t)descriptorSetLayouts[i]))
+        {
+            printf("Shared pipeline layouts need set layouts from createSharedSetLayout, set: %i\n", i);
+            ASSERT(false);
+            return VK_NULL_HANDLE;
+        }
+    }
+    std::vector<uint64_t> key;
+    key.reserve(2 + count + pushConstantRangeCount * 2);
+    key.push_back(uint64_t(count));
+    key.push_back(uint64_t(pushConstantRangeCount));
+    for(int32_t i = 0; i < count; ++i)
+    {
+        key.push_back((uint64_t)descriptorSetLayouts[i]);
+    }
+    for(int32_t i = 0; i < pushConstantRangeCount; ++i)
+    {
+        const VkPushConstantRange& range = pushConstantRanges[i];
+        key.push_back(uint64_t(range.stageFlags));
+        key.push_back((uint64_t(range.offset) << 32) | range.size);
+    }
+    uint64_t hash = sHashKey(key);
+    if(uint64_t handle = sFindSharedHandle(sVkSharedPipelineLayouts, key, hash))
+    {
+        return (VkPipelineLayout)handle;
+    }
+    VkPipelineLayout result = createPipelineLayout(descriptorSetLayouts, count,
+        pushConstantRanges, pushConstantRangeCount);
+    if(!result)
+    {
+        return result;
+    }
+    // Keeps the set layout handles in the key from being destroyed and reused for other layouts.
+    for(int32_t i = 0; i < count; ++i)
+    {
+        auto setLayout = sVkSharedSetLayouts.entries.find((uint64_t)descriptorSetLayouts[i]);
+        if(setLayout != sVkSharedSetLayouts.entries.end())
+        {
+            setLayout->second.refCount++;
+        }
+    }
+    sAddSharedHandle(sVkSharedPipelineLayouts, std::move(key), hash, (uint64_t)result);
+    return result;
+}
+
+
+void destroyDescriptorPools(VkDescriptorPool* pools, int32_t poolCount)
+{
+    for (int32_t i = 0; i < poolCount; ++i)
+    {
+        vkDestroyDescriptorPool(sVkDevice, pools[i], nullptr);
+        pools[i] = {};
+    }
+}
+
+
+
+VkInstance_T* getVkInstance()
+{
+    return sVkInstance;
+}
+
+VkDevice_T* getVkDevice()
+{
+    return sVkDevice;
+}
+
+
+VkCommandBuffer_T* getVkCommandBuffer()
+{
+    if(sVkThreadCommandBuffer)
+    {
+        return sVkThreadCommandBuffer;
+    }
+    int64_t frameIndex = getFrameIndexWrapped();
+    if(sVkAsyncComputeRecording)
+    {
+        return sVkComputeCommandBuffers[frameIndex];
+    }
+    VkCommandBuffer commandBuffer = sVkCommandBuffers[frameIndex];
+    return commandBuffer;
+}
+
+VkDescriptorPool getVkDescriptorPool()
+{
+    return sVkDescriptorPool;
+}
+
+const CarpSwapChainFormats& getSwapChainFormats()
+{
+    return sVkSwapchainFormats;
+}
+
+bool isHeadless()
+{
+    return sVkHeadless;
+}
+
+Image* getOffscreenImage()
+{
+    if(!sVkHeadless)
+    {
+        return nullptr;
+    }
+    return &sVkOffscreenImages[sVkImageIndex];
+}
+
+
+
+VkPipeline createGraphicsPipeline(const GPBuilder& builder, const char* pipelineName)
+{
+    VkDevice device = getVkDevice();
+
+    VkPipelineVertexInputStateCreateInfo vertexInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO };
+
+    VkPipelineInputAssemblyStateCreateInfo assemblyInfo = { .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
+    assemblyInfo.topology = builder.topology;
+    assemblyInfo.primitiveRestartEnable = VK_FALSE;
+
+    VkPipelineViewportStateCreateInfo viewportInfo = { VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO };
+    viewportInfo.scissorCount = 1;
+    viewportInfo.viewportCount = 1;
+
+    VkPipelineRasterizationStateCreateInfo rasterInfo = { VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
+    rasterInfo.lineWidth = 1.0f;
+    if (builder.topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+    {
+        rasterInfo.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE; // VK_FRONT_FACE_CLOCKWISE;
+        rasterInfo.cullMode = VK_CULL_MODE_BACK_BIT;
+    }
+    else
+    {
+        rasterInfo.cullMode = VK_CULL_MODE_NONE;
+        // notice VkPhysicalDeviceFeatures .fillModeNonSolid = VK_TRUE required
+        //rasterInfo.polygonMode = VK_POLYGON_MODE_LINE;
+    }
+    VkPipelineMultisampleStateCreateInfo multiSampleInfo = { VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO };
+    multiSampleInfo.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkPipelineDepthStencilStateCreateInfo depthInfo = { VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO };
+    depthInfo.depthTestEnable = builder.depthTest ? VK_TRUE : VK_FALSE;
+    depthInfo.depthWriteEnable = builder.writeDepth ? VK_TRUE : VK_FALSE;
+    depthInfo.depthCompareOp = builder.depthCompareOp;
+
+    VkPipelineColorBlendStateCreateInfo blendInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        .attachmentCount = (uint32_t)builder.blendChannelCount,
+        .pAttachments = builder.blendChannels,
+    };
+
+    VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkPipelineDynamicStateCreateInfo dynamicInfo = { VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO };
+    dynamicInfo.pDynamicStates = dynamicStates;
+    dynamicInfo.dynamicStateCount = ARRAYSIZES(dynamicStates);
+
+
+    // Stage infos are copied when they get specialization constants.
+    std::vector<VkPipelineShaderStageCreateInfo> stageInfos;
+    std::vector<StageSpecializationInfo> specializationInfos;
+    const VkPipelineShaderStageCreateInfo* stages = builder.stageInfos;
+    if(builder.stageSpecializations)
+    {
+        stageInfos.assign(builder.stageInfos, builder.stageInfos + builder.stageInfoCount);
+        specializationInfos.resize(builder.stageInfoCount);
+        for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+        {
+            sApplySpecialization(builder.stageSpecializations[i], specializationInfos[i], stageInfos[i]);
+        }
+        stages = stageInfos.data();
+    }
+
+    VkGraphicsPipelineCreateInfo createInfo = { VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO };
+    createInfo.stageCount = builder.stageInfoCount;
+    createInfo.pStages = stages;
+    createInfo.pVertexInputState = &vertexInfo;
+    createInfo.pInputAssemblyState = &assemblyInfo;
+    createInfo.pViewportState = &viewportInfo;
+    createInfo.pRasterizationState = &rasterInfo;
+    createInfo.pMultisampleState = &multiSampleInfo;
+    createInfo.pDepthStencilState = &depthInfo;
+    createInfo.pColorBlendState = &blendInfo;
+    createInfo.pDynamicState = &dynamicInfo;
+    createInfo.renderPass = VK_NULL_HANDLE;
+    createInfo.layout = builder.pipelineLayout;
+    createInfo.basePipelineHandle = VK_NULL_HANDLE;
+    if(sVkDescriptorBufferSupported)
+    {
+        createInfo.flags |= VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;
+    }
+
+
+    //Needed for dynamic rendering
+
+    VkPipelineCreationFeedback pipelineFeedback = {};
+    VkPipelineCreationFeedbackCreateInfo feedbackCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO,
+        .pPipelineCreationFeedback = &pipelineFeedback,
+    };
+
+    const VkPipelineRenderingCreateInfo pipelineRenderingCreateInfo{
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO_KHR,
+        .pNext = &feedbackCreateInfo,
+        .colorAttachmentCount = (uint32_t)builder.colorFormatCount,
+        .pColorAttachmentFormats = builder.colorFormats,
+        .depthAttachmentFormat = builder.depthFormat,
+    };
+
+    createInfo.pNext = &pipelineRenderingCreateInfo;
+
+
+    VkPipeline pipeline = {};
+    VK_CHECK_CALL(vkCreateGraphicsPipelines(device, sVkPipelineCache, 1, &createInfo, nullptr, &pipeline));
+    ASSERT(pipeline);
+    sRecordPipelineCreationFeedback(pipelineFeedback);
+
+     sSetObjectName((uint64_t)pipeline, VK_DEBUG_REPORT_OBJECT_TYPE_PIPELINE_EXT, pipelineName);
+
+    return pipeline;
+}
+
+VkPipeline createComputePipeline(const CPBuilder& builder, const char* pipelineName)
+{
+    VkPipelineCreationFeedback pipelineFeedback = {};
+    VkPipelineCreationFeedbackCreateInfo feedbackCreateInfo = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO,
+        .pPipelineCreationFeedback = &pipelineFeedback,
+    };
+
+    VkComputePipelineCreateInfo createInfo = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+    createInfo.pNext = &feedbackCreateInfo;
+
+    StageSpecializationInfo specializationInfo;
+    createInfo.stage = builder.stageInfo;
+    sApplySpecialization(builder.specialization, specializationInfo, createInfo.stage);
+    createInfo.layout = builder.pipelineLayout;
+    if(sVkDescriptorBufferSupported)
+    {
+        createInfo.flags |= VK_PIPELINE_CREATE_DESCRIPTOR_BUFFER_BIT_EXT;
+    }
+
+    VkPipeline pipeline = {};
+    VK_CHECK_CALL(vkCreateComputePipelines(sVkDevice, sVkPipelineCache,
+        1, &createInfo, nullptr, &pipeline));
+    ASSERT(pipeline);
+    sRecordPipelineCreationFeedback(pipelineFeedback);
+
+
+    sSetObjectName((uint64_t)pipeline, VK_DEBUG_REPORT_OBJECT_TYPE_PIPELINE_EXT, pipelineName);
+    return pipeline;
+}
+
+GraphicsProgram createGraphicsProgram(const GPBuilder& builder, const char* programName)
+{
+    GraphicsProgram result;
+    // Pipelines need a blend state per color target, shader objects default the missing ones.
+    if(!sVkShaderObjectsSupported || builder.blendChannelCount == builder.colorFormatCount)
+    {
+        createGraphicsPipelinesAsync(&builder, &programName, 1, &result.pipeline);
+    }
+    if(!sVkShaderObjectsSupported)
+    {
+        return result;
+    }
+
+    auto layoutContents = sVkPipelineLayoutContents.find(builder.pipelineLayout);
+    ASSERT(layoutContents != sVkPipelineLayoutContents.end());
+    if(layoutContents == sVkPipelineLayoutContents.end())
+    {
+        return result;
+    }
+
+    // Vertex and fragment only, tessellation and geometry features are not enabled.
+    if(builder.stageInfoCount <= 0 || builder.stageInfoCount > 2)
+    {
+        printf("Graphics program needs a vertex and an optional fragment stage: %s\n", programName ? programName : "");
+        ASSERT(false);
+        return result;
+    }
+    bool hasFragment = false;
+    for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+    {
+        hasFragment |= builder.stageInfos[i].stage == VK_SHADER_STAGE_FRAGMENT_BIT;
+    }
+
+    VkShaderCreateInfoEXT createInfos[2] = {};
+    StageSpecializationInfo specializationInfos[2];
+    for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+    {
+        VkPipelineShaderStageCreateInfo stageInfo = builder.stageInfos[i];
+        if(builder.stageSpecializations)
+        {
+            sApplySpecialization(builder.stageSpecializations[i], specializationInfos[i], stageInfo);
+        }
+        auto moduleReflection = sVkShaderModuleReflections.find(stageInfo.module);
+        ASSERT(moduleReflection != sVkShaderModuleReflections.end());
+        if(moduleReflection == sVkShaderModuleReflections.end())
+        {
+            return result;
+        }
+        const std::vector<uint32_t>& moduleCode = moduleReflection->second->code;
+        createInfos[i] = VkShaderCreateInfoEXT{
+            .sType = VK_STRUCTURE_TYPE_SHADER_CREATE_INFO_EXT,
+            .flags = builder.stageInfoCount > 1 ? VkShaderCreateFlagsEXT(VK_SHADER_CREATE_LINK_STAGE_BIT_EXT) : 0u,
+            .stage = stageInfo.stage,
+            .nextStage = stageInfo.stage == VK_SHADER_STAGE_VERTEX_BIT && hasFragment
+                ? VkShaderStageFlags(VK_SHADER_STAGE_FRAGMENT_BIT) : 0u,
+            .codeType = VK_SHADER_CODE_TYPE_SPIRV_EXT,
+            .codeSize = moduleCode.size() * sizeof(uint32_t),
+            .pCode = moduleCode.data(),
+            .pName = stageInfo.pName,
+            .setLayoutCount = uint32_t(layoutContents->second.setLayouts.size()),
+            .pSetLayouts = layoutContents->second.setLayouts.data(),
+            .pushConstantRangeCount = uint32_t(layoutContents->second.pushConstantRanges.size()),
+            .pPushConstantRanges = layoutContents->second.pushConstantRanges.data(),
+            .pSpecializationInfo = stageInfo.pSpecializationInfo,
+        };
+    }
+
+    VkShaderEXT shaders[2] = {};
+    VK_CHECK_CALL(sVkShaderObjectFns.createShaders(sVkDevice, uint32_t(builder.stageInfoCount),
+        createInfos, nullptr, shaders));
+
+    ShaderObjectProgram program;
+    for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+    {
+        ASSERT(shaders[i]);
+        program.shaders[createInfos[i].stage == VK_SHADER_STAGE_FRAGMENT_BIT ? 1 : 0] = shaders[i];
+    }
+    program.blendChannels.assign(builder.blendChannels, builder.blendChannels + builder.blendChannelCount);
+    program.colorFormats.assign(builder.colorFormats, builder.colorFormats + builder.colorFormatCount);
+    program.depthFormat = builder.depthFormat;
+    program.topology = builder.topology;
+    program.depthCompareOp = builder.depthCompareOp;
+    // Same rasterization as createGraphicsPipeline.
+    if(builder.topology == VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+    {
+        program.cullMode = VK_CULL_MODE_BACK_BIT;
+        program.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    }
+    program.depthTest = builder.depthTest;
+    program.writeDepth = builder.writeDepth;
+    program.used = true;
+
+    uint32_t index = uint32_t(sVkShaderObjectPrograms.size());
+    if(!sVkShaderObjectFreePrograms.empty())
+    {
+        index = sVkShaderObjectFreePrograms.back();
+        sVkShaderObjectFreePrograms.pop_back();
+        sVkShaderObjectPrograms[index] = std::move(program);
+    }
+    else
+    {
+        sVkShaderObjectPrograms.push_back(std::move(program));
+    }
+    result.shaderObjectIndex = index;
+    return result;
+}
+
+void destroyGraphicsPrograms(GraphicsProgram* programs, int32_t programCount)
+{
+    for(int32_t i = 0; i < programCount; ++i)
+    {
+        GraphicsProgram& program = programs[i];
+        if(program.pipeline.index != ~0u)
+        {
+            // Waits for a compile still running, the worker writes into the slot.
+            VkPipeline pipeline = waitForAsyncPipeline(program.pipeline);
+            releaseAsyncPipeline(program.pipeline);
+            if(pipeline)
+            {
+                vkDestroyPipeline(sVkDevice, pipeline, nullptr);
+            }
+        }
+        if(program.shaderObjectIndex < sVkShaderObjectPrograms.size()
+            && sVkShaderObjectPrograms[program.shaderObjectIndex].used)
+        {
+            sDestroyShaderObjectProgram(sVkShaderObjectPrograms[program.shaderObjectIndex]);
+            sVkShaderObjectFreePrograms.push_back(program.shaderObjectIndex);
+        }
+        program = GraphicsProgram{};
+    }
+}
+
+bool hasShaderObjects()
+{
+    return sVkShaderObjectsSupported;
+}
+
+
+struct DescriptorWrites
+{
+    static constexpr int MaxDescriptorCount = 32;
+    VkWriteDescriptorSet writeDescriptorSets[MaxDescriptorCount];
+    VkDescriptorBufferInfo bufferInfos[MaxDescriptorCount];
+    VkDescriptorImageInfo imageInfos[MaxDescriptorCount];
+    uint32_t writeCount = 0;
+};
+
+// Writes point into the info arrays of outWrites, push descriptors use a null dstSet.
+static bool sBuildDescriptorWrites(VkDescriptorSet descriptorSet,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetCount,
+    DescriptorWrites& outWrites)
+{
+    ASSERT_RETURN_FALSE(descriptorSetCount <= DescriptorWrites::MaxDescriptorCount);
+    ASSERT_RETURN_FALSE(descriptorSetCount > 0);
+    ASSERT_RETURN_FALSE(descriptorSetLayout);
+    ASSERT_RETURN_FALSE(descriptorSetInfos);
+
+    VkWriteDescriptorSet* writeDescriptorSets = outWrites.writeDescriptorSets;
+    VkDescriptorBufferInfo* bufferInfos = outWrites.bufferInfos;
+    VkDescriptorImageInfo* imageInfos = outWrites.imageInfos;
+
+    uint32_t writeIndex = 0u;
+    uint32_t bufferCount = 0u;
+    uint32_t imageCount = 0u;
+    for(int i = 0; i < descriptorSetCount; ++i)
+    {
+        if(descriptorSetInfos[i].type == DescriptorInfo::DescriptorType::BUFFER)
+        {
+            const VkDescriptorBufferInfo &bufferInfo = descriptorSetInfos[i].bufferInfo;
+            ASSERT(bufferInfo.buffer);
+            ASSERT(bufferInfo.range > 0u);
+            bufferInfos[bufferCount] = bufferInfo;
+
+            VkWriteDescriptorSet descriptor{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+            descriptor.dstSet = descriptorSet;
+            descriptor.dstArrayElement = 0;
+            descriptor.descriptorType = descriptorSetLayout[i].descriptorType;
+            descriptor.dstBinding = descriptorSetLayout[i].bindingIndex;
+            descriptor.pBufferInfo = &bufferInfos[bufferCount];
+            descriptor.descriptorCount = 1;
+
+            writeDescriptorSets[writeIndex] = descriptor;
+
+            ++bufferCount;
+            ++writeIndex;
+        }
+        else if(descriptorSetInfos[i].type == DescriptorInfo::DescriptorType::IMAGE)
+        {
+            const VkDescriptorImageInfo &imageInfo = descriptorSetInfos[i].imageInfo;
+            ASSERT_RETURN_FALSE(imageInfo.sampler || descriptorSetLayout[i].descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+            ASSERT_RETURN_FALSE(imageInfo.imageView);
+            ASSERT_RETURN_FALSE(imageInfo.imageLayout);
+
+            imageInfos[imageCount] = imageInfo;
+
+            VkWriteDescriptorSet descriptor{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+            descriptor.dstSet = descriptorSet;
+            descriptor.dstArrayElement = 0;
+            descriptor.descriptorType = descriptorSetLayout[i].descriptorType;
+            descriptor.dstBinding = descriptorSetLayout[i].bindingIndex;
+            descriptor.pImageInfo = &imageInfos[imageCount];
+            descriptor.descriptorCount = 1;
+
+            writeDescriptorSets[writeIndex] = descriptor;
+
+            ++writeIndex;
+            ++imageCount;
+        }
+        else
+        {
+            ASSERT(true);
+            printf("Failed to set descriptor binds!\n");
+            return false;
+        }
+    }
+
+    outWrites.writeCount = writeIndex;
+    return true;
+}
+
+bool updateBindDescriptorSet(VkDescriptorSet descriptorSet,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetCount)
+{
+    ASSERT_RETURN_FALSE(descriptorSet);
+    if(sVkDescriptorBufferSupported)
+    {
+        return sWriteDescriptorBufferSet(descriptorSet, descriptorSetLayout, descriptorSetInfos, descriptorSetCount);
+    }
+    DescriptorWrites writes;
+    if(!sBuildDescriptorWrites(descriptorSet, descriptorSetLayout, descriptorSetInfos, descriptorSetCount, writes))
+    {
+        return false;
+    }
+
+    if(writes.writeCount > 0)
+    {
+        vkUpdateDescriptorSets(sVkDevice,
+            writes.writeCount, writes.writeDescriptorSets,
+            0, nullptr);
+    }
+
+    return true;
+}
+
+bool pushDescriptors(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetCount)
+{
+    ASSERT_RETURN_FALSE(sVkCmdPushDescriptorSet);
+    ASSERT_RETURN_FALSE(pipelineLayout);
+    DescriptorWrites writes;
+    if(!sBuildDescriptorWrites(VK_NULL_HANDLE, descriptorSetLayout, descriptorSetInfos, descriptorSetCount, writes))
+    {
+        return false;
+    }
+
+    if(writes.writeCount > 0)
+    {
+        sVkCmdPushDescriptorSet(getVkCommandBuffer(), bindPoint, pipelineLayout, setIndex,
+            writes.writeCount, writes.writeDescriptorSets);
+    }
+    return true;
+}
+
+void pushConstants(VkPipelineLayout pipelineLayout, uint32_t stageFlags, uint32_t offset, uint32_t size,
+    const void* data)
+{
+    ASSERT_RETURN(pipelineLayout && data && size > 0);
+    vkCmdPushConstants(getVkCommandBuffer(), pipelineLayout, stageFlags, offset, size, data);
+}
+
+bool hasPushDescriptors()
+{
+    return sVkPushDescriptorsSupported;
+}
+
+bool hasDescriptorBuffer()
+{
+    return sVkDescriptorBufferSupported;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+bool beginFrame()
+{
+    VkDevice device = getVkDevice();
+
+    sVkFrameIndex++;
+    int64_t frameIndex = getFrameIndexWrapped();
+    {
+        //ScopedTimer aq("Acquire");
+        sWaitTimelineSemaphore(sVkTimelineSemaphore, sVkFrameSubmissionValues[frameIndex], UINT64_MAX);
+        if(sVkTransferQueue)
+        {
+            sWaitTimelineSemaphore(sVkTransferTimelineSemaphore,
+                sVkTransferFrameSubmissionValues[frameIndex], UINT64_MAX);
+        }
+    }
+    sResetStagingRing(sVkStagingRing, uint32_t(frameIndex));
+    sResetDynamicUniformRing(uint32_t(frameIndex));
+    sCompleteReadbacks();
+    sResetStagingRing(sVkReadbackRing, uint32_t(frameIndex));
+    if(sVkTransferQueue)
+    {
+        sResetStagingRing(sVkTransferStagingRing, uint32_t(frameIndex));
+    }
+    sResolveGpuTimers(frameIndex);
+    sRecycleBindlessIndices();
+    sRecycleUniformBlocks();
+    sRecycleDescriptorPools();
+    sRecycleDescriptorBufferRanges();
+    sRecyclePipelineVariants();
+    sResetFrameDescriptorPools(uint32_t(frameIndex));
+    if (sVkAcquireSemaphores[frameIndex] == VK_NULL_HANDLE)
+    {
+        return false;
+    }
+    VkResult res = VK_SUCCESS;
+    if(sVkHeadless)
+    {
+        // Offscreen images are per frame slot, the timeline wait above paces them.
+        sVkImageIndex = uint32_t(frameIndex);
+    }
+    else
+    {
+        res = vkAcquireNextImageKHR(device, sVkSwapchain, UINT64_MAX,
+            sVkAcquireSemaphores[frameIndex], VK_NULL_HANDLE, &sVkImageIndex);
+    }
+
+    if (res == VK_ERROR_OUT_OF_DATE_KHR)
+    {
+        if (sResizeSwapchain())
+        {
+            VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+        }
+        return false;
+    }
+    else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR)
+    {
+        VK_CHECK_CALL(res);
+        return false;
+    }
+
+    VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkResetCommandPool(sVkDevice, sVkCommandPools[frameIndex], 0);
+    sResetThreadCommandBuffers(uint32_t(frameIndex));
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    sBindDescriptorBuffers(commandBuffer);
+
+    sResetGpuTimers(commandBuffer, frameIndex);
+    sVkFrameRecording = true;
+    sAcquireTransferredResources();
+    flushUploads();
+
+    return true;
+
+}
+
+
+bool presentImage(Image& imageToPresent)
+{
+    VkDevice device = getVkDevice();
+
+    int64_t frameIndex = getFrameIndexWrapped();
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+
+    VkImage swapchainImage = sVkSwapchainImages[sVkImageIndex];
+    ASSERT(sVkGpuTimerStack.empty());
+    flushUploads();
+    sVkFrameRecording = false;
+
+    // Blit from imageToPresent to swapchain
+    {
+        imageBarrier(swapchainImage,
+            VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, VK_ACCESS_2_NONE, VK_IMAGE_LAYOUT_UNDEFINED,
+            VK_PIPELINE_STAGE_2_BLIT_BIT,
+            VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            VK_IMAGE_ASPECT_COLOR_BIT);
+        imageBarrier(imageToPresent,
+            VK_PIPELINE_STAGE_2_BLIT_BIT,
+            VK_ACCESS_2_TRANSFER_READ_BIT,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+        flushBarriers();
+
+        int width = imageToPresent.width;
+        int height = imageToPresent.height;
+
+        width = width < sVkSwapchainWidth ? width : sVkSwapchainWidth;
+        height = height < sVkSwapchainHeight ? height : sVkSwapchainHeight;
+
+        VkImageBlit2 imageBlitRegion = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
+            .srcSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .layerCount = 1,
+        },
+        .srcOffsets = {
+                VkOffset3D{ 0, 0, 0 },
+                VkOffset3D{ width, height, 1 },
+        },
+
+        .dstSubresource = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .layerCount = 1,
+        },
+        .dstOffsets = {
+                VkOffset3D{ 0, 0, 0 },
+                VkOffset3D{ sVkSwapchainWidth, sVkSwapchainHeight, 1 },
+        }
+
+
+        };
+
+        VkBlitImageInfo2 imageBlitInfo = {
+            .sType = VK_STRUCTURE_TYPE_BLIT_IMAGE_INFO_2,
+            .srcImage = imageToPresent.image,
+            .srcImageLayout = imageToPresent.layout,
+            .dstImage = swapchainImage,
+            .dstImageLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .regionCount = 1,
+            .pRegions = &imageBlitRegion,
+            .filter = VkFilter::VK_FILTER_NEAREST,
+        };
+
+        vkCmdBlitImage2(commandBuffer, &imageBlitInfo);
+    }
+
+    if(sVkHeadless)
+    {
+        Image& offscreenImage = sVkOffscreenImages[sVkImageIndex];
+        offscreenImage.stageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+        offscreenImage.accessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        offscreenImage.layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    }
+    // Prepare image for presenting.
+    else
+    {
+        VkImageMemoryBarrier2 presentBarrier = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+            .srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT,
+            .srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            .dstStageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
+            .dstAccessMask = VK_ACCESS_2_NONE,
+            .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+
+            .image = swapchainImage,
+            .subresourceRange = {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .levelCount = 1,
+                .layerCount = 1,
+            },
+        };
+
+        VkDependencyInfo dep2 = {};
+        dep2.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dep2.imageMemoryBarrierCount = 1;
+        dep2.pImageMemoryBarriers = &presentBarrier;
+        vkCmdPipelineBarrier2(commandBuffer, &dep2);
+    }
+
+    VK_CHECK_CALL(vkEndCommandBuffer(commandBuffer));
+    sFlushDynamicUniformRing();
+
+
+
+
+
+    // Submit
+    {
+        VkSemaphore acquireSemaphore = sVkAcquireSemaphores[frameIndex];
+        VkSemaphore releaseSemaphore = sVkReleaseSemaphores[frameIndex];
+
+        VkCommandBufferSubmitInfo commandBufferSubmitInfo = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+            .commandBuffer = commandBuffer,
+        };
+
+
+        if(!sVkHeadless)
+        {
+            sVkGraphicsWaitInfos.push_back(VkSemaphoreSubmitInfo{
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = acquireSemaphore,
+                .stageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT
+            });
+        }
+
+        uint64_t submissionValue = ++sVkSubmissionValue;
+        VkSemaphoreSubmitInfo signalInfos[] = {
+            {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = sVkTimelineSemaphore,
+                .value = submissionValue,
+                .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+            },
+            {
+                .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+                .semaphore = releaseSemaphore,
+                .stageMask = VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT
+            },
+        };
+
+        VkSubmitInfo2 submitInfo = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+            .waitSemaphoreInfoCount = uint32_t(sVkGraphicsWaitInfos.size()),
+            .pWaitSemaphoreInfos = sVkGraphicsWaitInfos.data(),
+            .commandBufferInfoCount = 1,
+            .pCommandBufferInfos = &commandBufferSubmitInfo,
+            // Release semaphore is last, headless has no present to wait for it.
+            .signalSemaphoreInfoCount = sVkHeadless ? 1u : uint32_t(ARRAYSIZES(signalInfos)),
+            .pSignalSemaphoreInfos = signalInfos
+        };
+
+
+
+        VK_CHECK_CALL(vkQueueSubmit2(sVkQueue, 1, &submitInfo, VK_NULL_HANDLE));
+        sVkGraphicsWaitInfos.clear();
+        sVkFrameSubmissionValues[frameIndex] = submissionValue;
+        sVkFrameSubmissionFrames[frameIndex] = sVkFrameIndex;
+
+        sSubmitTransferCommandBuffer();
+
+        VkResult res = VK_SUCCESS;
+        if(!sVkHeadless)
+        {
+            VkPresentInfoKHR presentInfo = { VK_STRUCTURE_TYPE_PRESENT_INFO_KHR };
+            presentInfo.waitSemaphoreCount = 1;
+            presentInfo.pWaitSemaphores = &releaseSemaphore;
+            presentInfo.swapchainCount = 1;
+            presentInfo.pSwapchains = &sVkSwapchain;
+            presentInfo.pImageIndices = &sVkImageIndex;
+
+            res = vkQueuePresentKHR(sVkQueue, &presentInfo);
+        }
 
         int32_t w = sVkSwapchainWidth;
         int32_t h = sVkSwapchainHeight;
@@ -2233,247 +7219,1372 @@ bool presentImage(Image& imageToPresent)
         }
 
 
-        if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || needToResize)
+        if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR || needToResize)
+        {
+            sResizeSwapchain();
+            VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+        }
+        else
+        {
+            VK_CHECK_CALL(res);
+        }
+    }
+    //VK_CHECK_CALL(vkDeviceWaitIdle(device));
+    return true;
+}
+
+
+void beginPreFrame()
+{
+    sVkInPreFrame = true;
+
+    int64_t frameIndex = getFrameIndexWrapped();
+    // Staging memory of the slot can still be in use by the last frame.
+    sWaitTimelineSemaphore(sVkTimelineSemaphore, sVkFrameSubmissionValues[frameIndex], UINT64_MAX);
+    sResetStagingRing(sVkStagingRing, uint32_t(frameIndex));
+    sResetDynamicUniformRing(uint32_t(frameIndex));
+    sCompleteReadbacks();
+    sResetStagingRing(sVkReadbackRing, uint32_t(frameIndex));
+    // Timers of the last frame in this slot are reset below.
+    sResolveGpuTimers(frameIndex);
+    sResetFrameDescriptorPools(uint32_t(frameIndex));
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+
+    VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkResetCommandPool(sVkDevice, sVkCommandPools[frameIndex], 0);
+    sResetThreadCommandBuffers(uint32_t(frameIndex));
+    VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    sBindDescriptorBuffers(commandBuffer);
+
+    sResetGpuTimers(commandBuffer, frameIndex);
+    sVkFrameRecording = true;
+}
+
+
+void endPreFrame()
+{
+    flushUploads();
+    sVkFrameRecording = false;
+    flushBarriers();
+    int64_t frameIndex = getFrameIndexWrapped();
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+
+    VK_CHECK_CALL(vkEndCommandBuffer(commandBuffer));
+    sFlushDynamicUniformRing();
+
+    VkCommandBufferSubmitInfo commandBufferSubmitInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .commandBuffer = commandBuffer,
+    };
+
+    uint64_t submissionValue = ++sVkSubmissionValue;
+    VkSemaphoreSubmitInfo timelineSignalInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkTimelineSemaphore,
+        .value = submissionValue,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+    };
+
+    VkSubmitInfo2 submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = &commandBufferSubmitInfo,
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = &timelineSignalInfo
+    };
+
+    VK_CHECK_CALL(vkQueueSubmit2(sVkQueue, 1, &submitInfo, VK_NULL_HANDLE));
+    sVkFrameSubmissionValues[frameIndex] = submissionValue;
+    sVkFrameSubmissionFrames[frameIndex] = sVkFrameIndex;
+
+    // Only wait for the preframe work, not the whole device.
+    waitForSubmission(submissionValue);
+    sVkInPreFrame = false;
+}
+
+VkPipelineShaderStageCreateInfo createDefaultVertexInfo(VkShaderModule module)
+{
+    VkPipelineShaderStageCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_VERTEX_BIT,
+        .module = module,
+        .pName = "main",
+    };
+    return info;
+}
+
+VkPipelineShaderStageCreateInfo createDefaultFragmentInfo(VkShaderModule module)
+{
+    VkPipelineShaderStageCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
+        .module = module,
+        .pName = "main",
+    };
+    return info;
+}
+
+VkPipelineShaderStageCreateInfo createDefaultComputeInfo(VkShaderModule module)
+{
+    VkPipelineShaderStageCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+        //.flags = VK_PIPELINE_SHADER_STAGE_CREATE_REQUIRE_FULL_SUBGROUPS_BIT,
+        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+        .module = module,
+        .pName = "main",
+    };
+    return info;
+}
+
+static void sSetSpecializationConstantBits(SpecializationConstants& constants, uint32_t constantId, uint32_t bits)
+{
+    for(uint32_t i = 0; i < constants.count; ++i)
+    {
+        if(constants.constantIds[i] == constantId)
+        {
+            constants.values[i] = bits;
+            return;
+        }
+    }
+    if(constants.count >= uint32_t(CarpVk::MaxSpecializationConstants))
+    {
+        printf("Too many specialization constants, max is: %i\n", CarpVk::MaxSpecializationConstants);
+        ASSERT(false);
+        return;
+    }
+    constants.constantIds[constants.count] = constantId;
+    constants.values[constants.count] = bits;
+    constants.count++;
+}
+
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, int32_t value)
+{
+    sSetSpecializationConstantBits(constants, constantId, uint32_t(value));
+}
+
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, uint32_t value)
+{
+    sSetSpecializationConstantBits(constants, constantId, value);
+}
+
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, float value)
+{
+    sSetSpecializationConstantBits(constants, constantId, std::bit_cast<uint32_t>(value));
+}
+
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, bool value)
+{
+    sSetSpecializationConstantBits(constants, constantId, value ? VK_TRUE : VK_FALSE);
+}
+
+VkPipeline getGraphicsPipelineVariant(const GPBuilder& builder, const char* pipelineName)
+{
+    ASSERT(builder.stageInfos && builder.stageInfoCount > 0);
+    std::vector<uint64_t> key;
+    key.reserve(64);
+    key.push_back(0);
+    key.push_back((uint64_t)builder.pipelineLayout);
+    key.push_back(uint64_t(builder.stageInfoCount));
+    for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+    {
+        sAppendStageVariantKey(builder.stageInfos[i],
+            builder.stageSpecializations ? &builder.stageSpecializations[i] : nullptr, key);
+    }
+    key.push_back((uint64_t(builder.depthFormat) << 32) | uint64_t(builder.topology));
+    key.push_back((uint64_t(builder.depthCompareOp) << 32) | (builder.depthTest ? 2 : 0) | (builder.writeDepth ? 1 : 0));
+    key.push_back(uint64_t(builder.colorFormatCount));
+    for(int32_t i = 0; i < builder.colorFormatCount; ++i)
+    {
+        key.push_back(uint64_t(builder.colorFormats[i]));
+    }
+    key.push_back(uint64_t(builder.blendChannelCount));
+    for(int32_t i = 0; i < builder.blendChannelCount; ++i)
+    {
+        static_assert(sizeof(VkPipelineColorBlendAttachmentState) == 8 * sizeof(uint32_t));
+        uint32_t words[8] = {};
+        memcpy(words, &builder.blendChannels[i], sizeof(words));
+        for(uint32_t word = 0; word < 8; word += 2)
+        {
+            key.push_back((uint64_t(words[word]) << 32) | words[word + 1]);
+        }
+    }
+    uint64_t hash = sHashKey(key);
+    if(VkPipeline pipeline = sFindPipelineVariant(key, hash))
+    {
+        return pipeline;
+    }
+
+    VkPipeline pipeline = createGraphicsPipeline(builder, pipelineName);
+    if(!pipeline)
+    {
+        return VK_NULL_HANDLE;
+    }
+    PipelineVariant variant = {
+        .key = std::move(key),
+        .pipelineLayout = builder.pipelineLayout,
+        .pipeline = pipeline,
+    };
+    for(int32_t i = 0; i < builder.stageInfoCount; ++i)
+    {
+        variant.modules.push_back(builder.stageInfos[i].module);
+    }
+    sVkPipelineVariants.emplace(hash, std::move(variant));
+    sVkPipelineVariantStats.variantCount = uint32_t(sVkPipelineVariants.size());
+    return pipeline;
+}
+
+VkPipeline getComputePipelineVariant(const CPBuilder& builder, const char* pipelineName)
+{
+    std::vector<uint64_t> key;
+    key.reserve(8 + CarpVk::MaxSpecializationConstants);
+    key.push_back(1);
+    key.push_back((uint64_t)builder.pipelineLayout);
+    sAppendStageVariantKey(builder.stageInfo, &builder.specialization, key);
+    uint64_t hash = sHashKey(key);
+    if(VkPipeline pipeline = sFindPipelineVariant(key, hash))
+    {
+        return pipeline;
+    }
+
+    VkPipeline pipeline = createComputePipeline(builder, pipelineName);
+    if(!pipeline)
+    {
+        return VK_NULL_HANDLE;
+    }
+    sVkPipelineVariants.emplace(hash, PipelineVariant{
+        .key = std::move(key),
+        .modules = { builder.stageInfo.module },
+        .pipelineLayout = builder.pipelineLayout,
+        .pipeline = pipeline,
+    });
+    sVkPipelineVariantStats.variantCount = uint32_t(sVkPipelineVariants.size());
+    return pipeline;
+}
+
+PipelineVariantStats getPipelineVariantStats()
+{
+    return sVkPipelineVariantStats;
+}
+
+UniformBuffer createUniformBuffer(size_t size)
+{
+    ASSERT(size > 0);
+    size = (size + sVkUniformAlignment - 1) & ~(sVkUniformAlignment - 1);
+    for(uint32_t i = 0; i <= sVkUniformHeapCount; ++i)
+    {
+        if(i == sVkUniformHeapCount)
+        {
+            size_t heapSize = MAX_VALUE(cVulkanUniformBufferSize, size);
+            if(i == uint32_t(CarpVk::MaxUniformBuffers) || !sAddUniformHeap(heapSize))
+                break;
+        }
+        uint32_t blockIndex = sAllocateUniformBlock(sVkUniformHeaps[i], size);
+        if(blockIndex != ~0u)
+        {
+            const UniformHeapBlock& block = sVkUniformHeaps[i].blocks[blockIndex];
+            return UniformBuffer{
+                .offset = block.offset,
+                .size = block.size,
+                .bufferIndex = i,
+                .blockIndex = blockIndex,
+            };
+        }
+    }
+    printf("Failed to allocate uniform buffer of size: %zu\n", size);
+    ASSERT(false);
+    return {};
+}
+
+void destroyUniformBuffer(UniformBuffer& uniformBuffer)
+{
+    if(uniformBuffer.blockIndex == ~0u)
+    {
+        return;
+    }
+    ASSERT_RETURN(uniformBuffer.bufferIndex < sVkUniformHeapCount);
+    sVkUniformPendingFrees.push_back(UniformPendingFree{
+        .bufferIndex = uniformBuffer.bufferIndex,
+        .blockIndex = uniformBuffer.blockIndex,
+        .submissionValue = getNextSubmissionValue(),
+    });
+    uniformBuffer = UniformBuffer{};
+}
+
+UniformBufferStats getUniformBufferStats()
+{
+    UniformBufferStats stats = {};
+    uint64_t freeBytes = 0;
+    for(uint32_t i = 0; i < sVkUniformHeapCount; ++i)
+    {
+        const UniformHeap& heap = sVkUniformHeaps[i];
+        stats.capacityBytes += heap.buffer.size;
+        stats.usedBytes += heap.usedBytes;
+        stats.allocationCount += heap.allocationCount;
+        for(const UniformHeapBlock& block : heap.blocks)
+        {
+            if(!block.free)
+                continue;
+            freeBytes += block.size;
+            stats.largestFreeBlock = MAX_VALUE(stats.largestFreeBlock, uint64_t(block.size));
+            stats.freeBlockCount++;
+        }
+    }
+    for(const UniformPendingFree& pending : sVkUniformPendingFrees)
+    {
+        stats.pendingFreeBytes += sVkUniformHeaps[pending.bufferIndex].blocks[pending.blockIndex].size;
+    }
+    stats.backingBufferCount = sVkUniformHeapCount;
+    if(freeBytes > 0)
+    {
+        stats.fragmentation = 1.0f - float(double(stats.largestFreeBlock) / double(freeBytes));
+    }
+    return stats;
+}
+
+DynamicUniform allocateDynamicUniform(size_t size)
+{
+    DynamicUniformRing& ring = sVkDynamicUniformRing;
+    ASSERT(size > 0 && size <= ring.range);
+    size_t offset = (ring.head + ring.alignment - 1) & ~(ring.alignment - 1);
+    if(size > ring.range || offset + size > ring.frameStart + ring.frameSize)
+    {
+        printf("Dynamic uniform ring out of space, size: %zu\n", size);
+        ASSERT(false);
+        return {};
+    }
+    ring.head = offset + size;
+    return DynamicUniform{
+        .data = (uint8_t*)ring.buffer.data + offset,
+        .offset = uint32_t(offset),
+    };
+}
+
+uint32_t writeDynamicUniform(const void* data, size_t size)
+{
+    ASSERT(data);
+    DynamicUniform uniform = allocateDynamicUniform(size);
+    if(uniform.data)
+    {
+        memcpy(uniform.data, data, size);
+    }
+    return uniform.offset;
+}
+
+DescriptorInfo getDynamicUniformDescriptorInfo()
+{
+    return DescriptorInfo(sVkDynamicUniformRing.buffer, 0, sVkDynamicUniformRing.range);
+}
+
+size_t getDynamicUniformRange()
+{
+    return sVkDynamicUniformRing.range;
+}
+
+
+DescriptorInfo::DescriptorInfo(const UniformBuffer& buffer)
+{
+    bufferInfo.buffer = sVkUniformHeaps[buffer.bufferIndex].buffer.buffer;
+    bufferInfo.offset = buffer.offset;
+    bufferInfo.range = buffer.size;
+    type = DescriptorType::BUFFER;
+}
+
+void flushBarriers()
+{
+    if(sVkImageBarriers.size() == 0 && sVkBufferBarriers.size() == 0 && sVkMemoryBarriers.size() == 0)
+    {
+        return;
+    }
+    // Barrier functions refuse to queue inside the rendering scope.
+    ASSERT(!sVkThreadInsideRendering);
+    VkDependencyInfo dependencyInfo = {};
+    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependencyInfo.memoryBarrierCount = sVkMemoryBarriers.size();
+    dependencyInfo.pMemoryBarriers = sVkMemoryBarriers.size() > 0 ? sVkMemoryBarriers.data() : nullptr;
+    dependencyInfo.imageMemoryBarrierCount = sVkImageBarriers.size();
+    dependencyInfo.pImageMemoryBarriers = sVkImageBarriers.size() > 0 ? sVkImageBarriers.data() : nullptr;
+    dependencyInfo.bufferMemoryBarrierCount = sVkBufferBarriers.size();;
+    dependencyInfo.pBufferMemoryBarriers = sVkBufferBarriers.size() > 0 ? sVkBufferBarriers.data() : nullptr;
+
+    vkCmdPipelineBarrier2(getVkCommandBuffer(), &dependencyInfo);
+
+    sVkImageBarriers.clear();
+    sVkBufferBarriers.clear();
+    sVkMemoryBarriers.clear();
+}
+
+static void sSetViewportAndScissor(VkCommandBuffer commandBuffer, int width, int height)
+{
+    VkViewport viewport = { 0.0f, float(height), float(width), -float(height), 0.0f, 1.0f };
+    VkRect2D scissors = { { 0, 0 }, { uint32_t(width), uint32_t(height) } };
+
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissors);
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+    // Shader objects have no static viewport count.
+    if(sVkShaderObjectsSupported)
+    {
+        vkCmdSetScissorWithCount(commandBuffer, 1, &scissors);
+        vkCmdSetViewportWithCount(commandBuffer, 1, &viewport);
+    }
+    sVkThreadRenderWidth = width;
+    sVkThreadRenderHeight = height;
+}
+
+// Shader objects have no baked state, everything the pipelines of createGraphicsPipeline set is
+// set here. Binding a pipeline in between invalidates it, so this runs on every bind.
+static void sBindShaderObjectProgram(VkCommandBuffer commandBuffer, const ShaderObjectProgram& program)
+{
+    const ShaderObjectFunctions& fns = sVkShaderObjectFns;
+    static constexpr VkShaderStageFlagBits stages[2] = { VK_SHADER_STAGE_VERTEX_BIT, VK_SHADER_STAGE_FRAGMENT_BIT };
+    fns.cmdBindShaders(commandBuffer, 2, stages, program.shaders);
+
+    // Pipelines bound before can leave the viewport count invalid.
+    sSetViewportAndScissor(commandBuffer, sVkThreadRenderWidth, sVkThreadRenderHeight);
+    fns.cmdSetVertexInput(commandBuffer, 0, nullptr, 0, nullptr);
+    vkCmdSetPrimitiveTopology(commandBuffer, program.topology);
+    vkCmdSetPrimitiveRestartEnable(commandBuffer, VK_FALSE);
+    vkCmdSetRasterizerDiscardEnable(commandBuffer, VK_FALSE);
+    fns.cmdSetPolygonMode(commandBuffer, VK_POLYGON_MODE_FILL);
+    vkCmdSetLineWidth(commandBuffer, 1.0f);
+    vkCmdSetCullMode(commandBuffer, program.cullMode);
+    vkCmdSetFrontFace(commandBuffer, program.frontFace);
+    vkCmdSetDepthBiasEnable(commandBuffer, VK_FALSE);
+
+    VkSampleMask sampleMask = ~0u;
+    fns.cmdSetRasterizationSamples(commandBuffer, VK_SAMPLE_COUNT_1_BIT);
+    fns.cmdSetSampleMask(commandBuffer, VK_SAMPLE_COUNT_1_BIT, &sampleMask);
+    fns.cmdSetAlphaToCoverageEnable(commandBuffer, VK_FALSE);
+
+    vkCmdSetDepthTestEnable(commandBuffer, program.depthTest ? VK_TRUE : VK_FALSE);
+    vkCmdSetDepthWriteEnable(commandBuffer, program.writeDepth ? VK_TRUE : VK_FALSE);
+    vkCmdSetDepthCompareOp(commandBuffer, program.depthCompareOp);
+    vkCmdSetDepthBoundsTestEnable(commandBuffer, VK_FALSE);
+    vkCmdSetStencilTestEnable(commandBuffer, VK_FALSE);
+
+    // Without blend channels every color target of the scope writes all channels unblended.
+    static constexpr VkPipelineColorBlendAttachmentState defaultBlend = {
+        .blendEnable = VK_FALSE,
+        .srcColorBlendFactor = VK_BLEND_FACTOR_ONE,
+        .dstColorBlendFactor = VK_BLEND_FACTOR_ZERO,
+        .colorBlendOp = VK_BLEND_OP_ADD,
+        .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+        .dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO,
+        .alphaBlendOp = VK_BLEND_OP_ADD,
+        .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
+            | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
+    };
+    uint32_t blendCount = uint32_t(program.blendChannels.size());
+    if(blendCount == 0)
+    {
+        blendCount = sVkThreadRenderColorCount;
+    }
+    if(blendCount > 0)
+    {
+        ASSERT(blendCount <= 32);
+        VkBool32 blendEnables[32] = {};
+        VkColorBlendEquationEXT blendEquations[32] = {};
+        VkColorComponentFlags writeMasks[32] = {};
+        for(uint32_t i = 0; i < blendCount && i < 32; ++i)
         {
-            sResizeSwapchain();
-            VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+            const VkPipelineColorBlendAttachmentState& blend = program.blendChannels.empty()
+                ? defaultBlend : program.blendChannels[i];
+            blendEnables[i] = blend.blendEnable;
+            blendEquations[i] = VkColorBlendEquationEXT{
+                .srcColorBlendFactor = blend.srcColorBlendFactor,
+                .dstColorBlendFactor = blend.dstColorBlendFactor,
+                .colorBlendOp = blend.colorBlendOp,
+                .srcAlphaBlendFactor = blend.srcAlphaBlendFactor,
+                .dstAlphaBlendFactor = blend.dstAlphaBlendFactor,
+                .alphaBlendOp = blend.alphaBlendOp,
+            };
+            writeMasks[i] = blend.colorWriteMask;
         }
-        else
+        fns.cmdSetColorBlendEnable(commandBuffer, 0, blendCount, blendEnables);
+        fns.cmdSetColorBlendEquation(commandBuffer, 0, blendCount, blendEquations);
+        fns.cmdSetColorWriteMask(commandBuffer, 0, blendCount, writeMasks);
+    }
+}
+
+static void sBeginRendering(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget, VkRenderingFlags flags, int& width, int& height)
+{
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    ASSERT(colorTargetCount <= 32);
+    ASSERT(colorTargetCount > 0 || depthTarget);
+
+    VkRenderingAttachmentInfo colorAttachments[32] = {};
+    VkRenderingAttachmentInfo depthAttachment = {};
+
+    for(int i = 0; i < colorTargetCount; ++i)
+    {
+        ASSERT(!colorTargets[i].image->pendingAcquire);
+        width = colorTargets[i].image->width;
+        height = colorTargets[i].image->height;
+        colorAttachments[i].sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        colorAttachments[i].imageView = colorTargets[i].image->view;
+        colorAttachments[i].imageLayout = colorTargets[i].image->layout;
+        colorAttachments[i].loadOp = (VkAttachmentLoadOp)colorTargets[i].loadOp;
+        colorAttachments[i].storeOp = (VkAttachmentStoreOp)colorTargets[i].storeOp;
+        colorAttachments[i].clearValue = colorTargets[i].clearValue;
+        sVkThreadRenderColorFormats[i] = colorTargets[i].image->format;
+    }
+    sVkThreadRenderColorCount = uint32_t(colorTargetCount);
+    sVkThreadRenderDepthFormat = depthTarget ? depthTarget->image->format : VK_FORMAT_UNDEFINED;
+
+    if(depthTarget)
+    {
+        ASSERT(!depthTarget->image->pendingAcquire);
+        width = depthTarget->image->width;
+        height = depthTarget->image->height;
+
+        depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        depthAttachment.imageView = depthTarget->image->view;
+        depthAttachment.imageLayout = depthTarget->image->layout;
+        depthAttachment.loadOp = (VkAttachmentLoadOp)depthTarget->loadOp;
+        depthAttachment.storeOp = (VkAttachmentStoreOp)depthTarget->storeOp;
+        depthAttachment.clearValue = depthTarget->clearValue;
+    }
+
+    VkRenderingInfo renderingInfo{};
+    renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+    renderingInfo.flags = flags;
+    renderingInfo.renderArea = { 0, 0, uint32_t(width), uint32_t(height) };
+    renderingInfo.layerCount = 1;
+    renderingInfo.colorAttachmentCount = colorTargetCount;
+    renderingInfo.pColorAttachments = colorTargetCount > 0 ? colorAttachments : nullptr;
+    renderingInfo.pDepthAttachment = depthTarget ? &depthAttachment : nullptr;
+    //renderingInfo.pStencilAttachment = &depthStencilAttachment;
+
+    vkCmdBeginRendering(commandBuffer, &renderingInfo);
+}
+
+void beginRenderPipeline(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget,
+    VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet,
+    const char* timerName, const uint32_t* dynamicOffsets, uint32_t dynamicOffsetCount)
+{
+    ASSERT_RETURN(dynamicOffsets || dynamicOffsetCount == 0);
+    flushBarriers();
+    sVkRenderPipelineTimer = timerName != nullptr;
+    if(timerName)
+    {
+        beginGpuTimer(timerName);
+    }
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    int width = 0;
+    int height = 0;
+    sBeginRendering(colorTargets, colorTargetCount, depthTarget, 0, width, height);
+
+    // Null set for pipelines whose set 0 is pushed with pushDescriptors.
+    if(descriptorSet)
+    {
+        sBindDescriptorSet(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
+            0, descriptorSet, dynamicOffsets, dynamicOffsetCount);
+    }
+
+    sSetViewportAndScissor(commandBuffer, width, height);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+
+}
+
+void beginRenderPipeline(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget,
+    VkPipelineLayout pipelineLayout, const GraphicsProgram& program, VkDescriptorSet descriptorSet,
+    const char* timerName, const uint32_t* dynamicOffsets, uint32_t dynamicOffsetCount)
+{
+    ASSERT_RETURN(dynamicOffsets || dynamicOffsetCount == 0);
+    flushBarriers();
+    sVkRenderPipelineTimer = timerName != nullptr;
+    if(timerName)
+    {
+        beginGpuTimer(timerName);
+    }
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    int width = 0;
+    int height = 0;
+    sBeginRendering(colorTargets, colorTargetCount, depthTarget, 0, width, height);
+
+    if(descriptorSet)
+    {
+        sBindDescriptorSet(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
+            0, descriptorSet, dynamicOffsets, dynamicOffsetCount);
+    }
+
+    sSetViewportAndScissor(commandBuffer, width, height);
+    bindGraphicsProgram(program);
+}
+
+// Pipeline once the compile threads have it and it fits the formats of the rendering scope,
+// shader objects draw until then.
+static VkPipeline sGetGraphicsProgramPipeline(const GraphicsProgram& program)
+{
+    if(program.pipeline.index == ~0u)
+    {
+        return VK_NULL_HANDLE;
+    }
+    if(program.shaderObjectIndex >= sVkShaderObjectPrograms.size())
+    {
+        // Nothing else to draw with.
+        return waitForAsyncPipeline(program.pipeline);
+    }
+    VkPipeline pipeline = getAsyncPipeline(program.pipeline);
+    const ShaderObjectProgram& shaderObjectProgram = sVkShaderObjectPrograms[program.shaderObjectIndex];
+    if(!pipeline || shaderObjectProgram.colorFormats.size() != sVkThreadRenderColorCount
+        || shaderObjectProgram.depthFormat != sVkThreadRenderDepthFormat)
+    {
+        return VK_NULL_HANDLE;
+    }
+    for(uint32_t i = 0; i < sVkThreadRenderColorCount; ++i)
+    {
+        if(shaderObjectProgram.colorFormats[i] != sVkThreadRenderColorFormats[i])
+            return VK_NULL_HANDLE;
+    }
+    return pipeline;
+}
+
+void bindGraphicsProgram(const GraphicsProgram& program)
+{
+    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    if(VkPipeline pipeline = sGetGraphicsProgramPipeline(program))
+    {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+        // Shader objects bound before set the viewport with count.
+        sSetViewportAndScissor(commandBuffer, sVkThreadRenderWidth, sVkThreadRenderHeight);
+        return;
+    }
+    ASSERT_RETURN(program.shaderObjectIndex < sVkShaderObjectPrograms.size());
+    const ShaderObjectProgram& shaderObjectProgram = sVkShaderObjectPrograms[program.shaderObjectIndex];
+    ASSERT_RETURN(shaderObjectProgram.used);
+    sBindShaderObjectProgram(commandBuffer, shaderObjectProgram);
+}
+
+void beginSecondaryRendering(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget, const char* timerName)
+{
+    ASSERT(colorTargetCount <= 32);
+    flushBarriers();
+    sVkRenderPipelineTimer = timerName != nullptr;
+    if(timerName)
+    {
+        beginGpuTimer(timerName);
+    }
+    int width = 0;
+    int height = 0;
+    sBeginRendering(colorTargets, colorTargetCount, depthTarget,
+        VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT, width, height);
+
+    SecondaryRenderingState& state = sVkSecondaryRendering;
+    state.colorFormatCount = uint32_t(colorTargetCount);
+    for(int32_t i = 0; i < colorTargetCount; ++i)
+    {
+        state.colorFormats[i] = colorTargets[i].image->format;
+    }
+    state.depthFormat = depthTarget ? depthTarget->image->format : VK_FORMAT_UNDEFINED;
+    state.width = width;
+    state.height = height;
+    state.active = true;
+}
+
+void endRenderPipeline()
+{
+    sVkSecondaryRendering.active = false;
+    vkCmdEndRendering(getVkCommandBuffer());
+    if(sVkRenderPipelineTimer)
+    {
+        endGpuTimer();
+        sVkRenderPipelineTimer = false;
+    }
+}
+
+bool beginSecondaryCommandBuffer(uint32_t threadIndex, bool insideRendering,
+    SecondaryCommandBuffer& outCommandBuffer)
+{
+    ASSERT_RETURN_FALSE(threadIndex < uint32_t(CarpVk::MaxRecordingThreads));
+    ASSERT_RETURN_FALSE(!sVkThreadCommandBuffer);
+    ASSERT_RETURN_FALSE(!insideRendering || sVkSecondaryRendering.active);
+    uint32_t frameIndex = uint32_t(getFrameIndexWrapped());
+    ThreadCommandBuffers& threadBuffers = sVkThreadCommandBuffers[frameIndex][threadIndex];
+    if(!threadBuffers.commandPool)
+    {
+        threadBuffers.commandPool = sCreateCommandPool(sVkQueueIndex);
+        ASSERT_RETURN_FALSE(threadBuffers.commandPool);
+    }
+    if(threadBuffers.usedCount == threadBuffers.commandBuffers.size())
+    {
+        VkCommandBufferAllocateInfo allocateInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+        allocateInfo.commandPool = threadBuffers.commandPool;
+        allocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocateInfo.commandBufferCount = 1;
+        VkCommandBuffer commandBuffer = {};
+        VK_CHECK_CALL(vkAllocateCommandBuffers(sVkDevice, &allocateInfo, &commandBuffer));
+        ASSERT_RETURN_FALSE(commandBuffer);
+        threadBuffers.commandBuffers.push_back(commandBuffer);
+        threadBuffers.leftoverBarriers.push_back(RecordedBarriers{});
+    }
+    uint32_t bufferIndex = threadBuffers.usedCount++;
+    VkCommandBuffer commandBuffer = threadBuffers.commandBuffers[bufferIndex];
+
+    const SecondaryRenderingState& state = sVkSecondaryRendering;
+    VkCommandBufferInheritanceRenderingInfo renderingInheritance = {
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO };
+    renderingInheritance.colorAttachmentCount = state.colorFormatCount;
+    renderingInheritance.pColorAttachmentFormats = state.colorFormats;
+    renderingInheritance.depthAttachmentFormat = state.depthFormat;
+    renderingInheritance.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkCommandBufferInheritanceInfo inheritanceInfo = { VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO };
+    inheritanceInfo.pNext = insideRendering ? &renderingInheritance : nullptr;
+
+    VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if(insideRendering)
+    {
+        beginInfo.flags |= VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    }
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    sBindDescriptorBuffers(commandBuffer);
+
+    // Dynamic state is not inherited.
+    if(insideRendering)
+    {
+        sSetViewportAndScissor(commandBuffer, state.width, state.height);
+        for(uint32_t i = 0; i < state.colorFormatCount; ++i)
         {
-            VK_CHECK_CALL(res);
+            sVkThreadRenderColorFormats[i] = state.colorFormats[i];
         }
+        sVkThreadRenderColorCount = state.colorFormatCount;
+        sVkThreadRenderDepthFormat = state.depthFormat;
     }
-    ASSERT(sVkScratchBufferOffset <= cVulkanScratchBufferSize);
 
-    //VK_CHECK_CALL(vkDeviceWaitIdle(device));
+    sVkThreadCommandBuffer = commandBuffer;
+    sVkThreadIndex = threadIndex;
+    sVkThreadBufferIndex = bufferIndex;
+    sVkThreadInsideRendering = insideRendering;
+
+    outCommandBuffer = SecondaryCommandBuffer{
+        .commandBuffer = commandBuffer,
+        .threadIndex = threadIndex,
+        .bufferIndex = bufferIndex,
+    };
     return true;
 }
 
+void endSecondaryCommandBuffer()
+{
+    ASSERT_RETURN(sVkThreadCommandBuffer);
+    if(sVkThreadInsideRendering)
+    {
+        flushBarriers();
+    }
+    VK_CHECK_CALL(vkEndCommandBuffer(sVkThreadCommandBuffer));
+
+    uint32_t frameIndex = uint32_t(getFrameIndexWrapped());
+    RecordedBarriers& leftover =
+        sVkThreadCommandBuffers[frameIndex][sVkThreadIndex].leftoverBarriers[sVkThreadBufferIndex];
+    leftover.imageBarriers.swap(sVkImageBarriers);
+    leftover.bufferBarriers.swap(sVkBufferBarriers);
+    leftover.memoryBarriers.swap(sVkMemoryBarriers);
+    sVkImageBarriers.clear();
+    sVkBufferBarriers.clear();
+    sVkMemoryBarriers.clear();
+
+    sVkThreadCommandBuffer = {};
+    sVkThreadIndex = ~0u;
+    sVkThreadBufferIndex = ~0u;
+    sVkThreadInsideRendering = false;
+}
 
-void beginPreFrame()
+void executeSecondaryCommandBuffers(const SecondaryCommandBuffer* commandBuffers, uint32_t count)
 {
-    sVkScratchBufferOffset = 0;
+    ASSERT_RETURN(!sVkThreadCommandBuffer);
+    if(count == 0)
+        return;
+    ASSERT_RETURN(commandBuffers);
+    if(sVkSecondaryRendering.active)
+    {
+        // Would only be recorded after the draws of the scope.
+        ASSERT(sVkImageBarriers.empty() && sVkBufferBarriers.empty() && sVkMemoryBarriers.empty());
+    }
+    else
+    {
+        flushBarriers();
+    }
 
-    int64_t frameIndex = getFrameIndexWrapped();
+    uint32_t frameIndex = uint32_t(getFrameIndexWrapped());
+    std::vector<VkCommandBuffer> vkCommandBuffers(count);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const SecondaryCommandBuffer& commandBuffer = commandBuffers[i];
+        ASSERT_RETURN(commandBuffer.threadIndex < uint32_t(CarpVk::MaxRecordingThreads));
+        vkCommandBuffers[i] = commandBuffer.commandBuffer;
+
+        RecordedBarriers& leftover =
+            sVkThreadCommandBuffers[frameIndex][commandBuffer.threadIndex].leftoverBarriers[commandBuffer.bufferIndex];
+        ASSERT(!sVkSecondaryRendering.active || (leftover.imageBarriers.empty()
+            && leftover.bufferBarriers.empty() && leftover.memoryBarriers.empty()));
+        sVkImageBarriers.insert(sVkImageBarriers.end(), leftover.imageBarriers.begin(), leftover.imageBarriers.end());
+        sVkBufferBarriers.insert(sVkBufferBarriers.end(), leftover.bufferBarriers.begin(), leftover.bufferBarriers.end());
+        sVkMemoryBarriers.insert(sVkMemoryBarriers.end(), leftover.memoryBarriers.begin(), leftover.memoryBarriers.end());
+        leftover.imageBarriers.clear();
+        leftover.bufferBarriers.clear();
+        leftover.memoryBarriers.clear();
+    }
+    vkCmdExecuteCommands(getVkCommandBuffer(), count, vkCommandBuffers.data());
+}
+
+
+void beginComputePipeline(VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet,
+    const char* timerName, const uint32_t* dynamicOffsets, uint32_t dynamicOffsetCount)
+{
+    ASSERT_RETURN(dynamicOffsets || dynamicOffsetCount == 0);
+    flushBarriers();
+    sVkComputePipelineTimer = timerName != nullptr;
+    if(timerName)
+    {
+        beginGpuTimer(timerName);
+    }
     VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    if(descriptorSet)
+    {
+        sBindDescriptorSet(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            pipelineLayout, 0, descriptorSet, dynamicOffsets, dynamicOffsetCount);
+    }
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+}
+
+void endComputePipeline()
+{
+    if(sVkComputePipelineTimer)
+    {
+        endGpuTimer();
+        sVkComputePipelineTimer = false;
+    }
+}
+
+bool hasAsyncComputeQueue()
+{
+    return sVkComputeQueue != VK_NULL_HANDLE;
+}
+
+bool beginAsyncCompute()
+{
+    ASSERT(!sVkAsyncComputeRecording);
+    if(!sVkComputeQueue || sVkInPreFrame)
+    {
+        return false;
+    }
+    int64_t frameIndex = getFrameIndexWrapped();
+    ASSERT_RETURN_FALSE(sVkComputeSubmittedFrame != sVkFrameIndex);
+
+    // Pending graphics barriers belong to the graphics command buffer.
+    flushBarriers();
+
+    sWaitTimelineSemaphore(sVkComputeTimelineSemaphore,
+        sVkComputeFrameSubmissionValues[frameIndex], UINT64_MAX);
 
     VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
     beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-    vkResetCommandPool(sVkDevice, sVkCommandPools[frameIndex], 0);
-    VK_CHECK_CALL(vkBeginCommandBuffer(commandBuffer, &beginInfo));
+    VK_CHECK_CALL(vkResetCommandPool(sVkDevice, sVkComputeCommandPools[frameIndex], 0));
+    VK_CHECK_CALL(vkBeginCommandBuffer(sVkComputeCommandBuffers[frameIndex], &beginInfo));
+    sBindDescriptorBuffers(sVkComputeCommandBuffers[frameIndex]);
+    sVkAsyncComputeRecording = true;
+    return true;
 }
 
-
-void endPreFrame()
+uint64_t submitAsyncCompute(uint64_t waitGraphicsValue, VkPipelineStageFlags2 waitStageMask)
 {
-    flushBarriers();
+    ASSERT(sVkAsyncComputeRecording);
+    if(!sVkAsyncComputeRecording)
+    {
+        return 0;
+    }
+    if(waitGraphicsValue > sVkSubmissionValue)
+    {
+        printf("Async compute waits for graphics value %llu, last submitted is %llu\n",
+            (unsigned long long)waitGraphicsValue, (unsigned long long)sVkSubmissionValue);
+        ASSERT(false);
+        return 0;
+    }
     int64_t frameIndex = getFrameIndexWrapped();
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
+    VkCommandBuffer commandBuffer = sVkComputeCommandBuffers[frameIndex];
 
+    flushBarriers();
     VK_CHECK_CALL(vkEndCommandBuffer(commandBuffer));
+    sVkAsyncComputeRecording = false;
+    sFlushDynamicUniformRing();
 
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
+    VkCommandBufferSubmitInfo commandBufferSubmitInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO,
+        .commandBuffer = commandBuffer,
+    };
 
-    VK_CHECK_CALL(vkQueueSubmit(sVkQueue, 1, &submitInfo, VK_NULL_HANDLE));
-    VK_CHECK_CALL(vkQueueWaitIdle(sVkQueue));
+    // The value is submitted already, the wait cannot block on work recorded after this.
+    VkSemaphoreSubmitInfo waitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkTimelineSemaphore,
+        .value = waitGraphicsValue,
+        .stageMask = waitStageMask
+    };
 
-    VK_CHECK_CALL(vkDeviceWaitIdle(sVkDevice));
+    uint64_t submissionValue = ++sVkComputeSubmissionValue;
+    VkSemaphoreSubmitInfo signalInfo = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkComputeTimelineSemaphore,
+        .value = submissionValue,
+        .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT
+    };
 
-    ASSERT(sVkScratchBufferOffset <= cVulkanScratchBufferSize);
+    VkSubmitInfo2 submitInfo = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
+        .waitSemaphoreInfoCount = waitGraphicsValue > 0 ? 1u : 0u,
+        .pWaitSemaphoreInfos = waitGraphicsValue > 0 ? &waitInfo : nullptr,
+        .commandBufferInfoCount = 1,
+        .pCommandBufferInfos = &commandBufferSubmitInfo,
+        .signalSemaphoreInfoCount = 1,
+        .pSignalSemaphoreInfos = &signalInfo
+    };
+    VK_CHECK_CALL(vkQueueSubmit2(sVkComputeQueue, 1, &submitInfo, VK_NULL_HANDLE));
+    sVkComputeFrameSubmissionValues[frameIndex] = submissionValue;
+    sVkComputeSubmittedFrame = sVkFrameIndex;
+    return submissionValue;
 }
 
-VkPipelineShaderStageCreateInfo createDefaultVertexInfo(VkShaderModule module)
+void waitAsyncComputeOnGraphics(uint64_t computeValue, VkPipelineStageFlags2 waitStageMask)
 {
-    VkPipelineShaderStageCreateInfo info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_VERTEX_BIT,
-        .module = module,
-        .pName = "main",
-    };
-    return info;
+    if(computeValue == 0 || !sVkComputeQueue)
+    {
+        return;
+    }
+    sVkGraphicsWaitInfos.push_back(VkSemaphoreSubmitInfo{
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+        .semaphore = sVkComputeTimelineSemaphore,
+        .value = computeValue,
+        .stageMask = waitStageMask
+    });
 }
 
-VkPipelineShaderStageCreateInfo createDefaultFragmentInfo(VkShaderModule module)
+bool isAsyncComputeComplete(uint64_t computeValue)
 {
-    VkPipelineShaderStageCreateInfo info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-        .module = module,
-        .pName = "main",
+    if(computeValue == 0 || !sVkComputeTimelineSemaphore)
+    {
+        return true;
+    }
+    uint64_t completedValue = 0;
+    VK_CHECK_CALL(vkGetSemaphoreCounterValue(sVkDevice, sVkComputeTimelineSemaphore, &completedValue));
+    return completedValue >= computeValue;
+}
+
+bool waitForAsyncCompute(uint64_t computeValue, uint64_t timeoutNs)
+{
+    if(!sVkComputeTimelineSemaphore)
+    {
+        return true;
+    }
+    return sWaitTimelineSemaphore(sVkComputeTimelineSemaphore, computeValue, timeoutNs);
+}
+
+VkSampler createSampler(const VkSamplerCreateInfo& info)
+{
+    VkSamplerCreateInfo newInfo = info;
+    newInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    VkSampler sampler = VK_NULL_HANDLE;
+    VK_CHECK_CALL(vkCreateSampler(sVkDevice, &newInfo, nullptr, &sampler));
+    return sampler;
+}
+
+VkSampler createSharedSampler(const VkSamplerCreateInfo& info)
+{
+    // Chained structs cannot be compared, those samplers are not shared.
+    if(info.pNext)
+    {
+        return createSampler(info);
+    }
+    std::vector<uint64_t> key = {
+        uint64_t(info.flags),
+        (uint64_t(info.magFilter) << 32) | uint64_t(info.minFilter),
+        (uint64_t(info.mipmapMode) << 32) | uint64_t(info.addressModeU),
+        (uint64_t(info.addressModeV) << 32) | uint64_t(info.addressModeW),
+        (uint64_t(std::bit_cast<uint32_t>(info.mipLodBias)) << 32) | uint64_t(info.anisotropyEnable),
+        (uint64_t(std::bit_cast<uint32_t>(info.maxAnisotropy)) << 32) | uint64_t(info.compareEnable),
+        (uint64_t(std::bit_cast<uint32_t>(info.minLod)) << 32) | uint64_t(std::bit_cast<uint32_t>(info.maxLod)),
+        (uint64_t(info.compareOp) << 32) | uint64_t(info.borderColor),
+        uint64_t(info.unnormalizedCoordinates),
     };
-    return info;
+    uint64_t hash = sHashKey(key);
+    if(uint64_t handle = sFindSharedHandle(sVkSharedSamplers, key, hash))
+    {
+        return (VkSampler)handle;
+    }
+    VkSampler result = createSampler(info);
+    sAddSharedHandle(sVkSharedSamplers, std::move(key), hash, (uint64_t)result);
+    return result;
 }
 
-VkPipelineShaderStageCreateInfo createDefaultComputeInfo(VkShaderModule module)
+SharedObjectStats getSharedObjectStats()
 {
-    VkPipelineShaderStageCreateInfo info = {
-        .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-        //.flags = VK_PIPELINE_SHADER_STAGE_CREATE_REQUIRE_FULL_SUBGROUPS_BIT,
-        .stage = VK_SHADER_STAGE_COMPUTE_BIT,
-        .module = module,
-        .pName = "main",
+    return SharedObjectStats{
+        .setLayoutRequests = sVkSharedSetLayouts.requests,
+        .pipelineLayoutRequests = sVkSharedPipelineLayouts.requests,
+        .samplerRequests = sVkSharedSamplers.requests,
+        .uniqueSetLayouts = uint32_t(sVkSharedSetLayouts.entries.size()),
+        .uniquePipelineLayouts = uint32_t(sVkSharedPipelineLayouts.entries.size()),
+        .uniqueSamplers = uint32_t(sVkSharedSamplers.entries.size()),
     };
-    return info;
 }
 
-UniformBuffer createUniformBuffer(size_t size)
+void destroySampler(VkSampler& sampler)
 {
-    // Round up to next 256 bytes
-    size += 255;
-    size &= ~(size_t(255));
-    ASSERT(sVkUniformBufferOffset + size <= cVulkanUniformBufferSize);
-    if(sVkUniformBufferOffset + size > cVulkanUniformBufferSize)
+    if(!sReleaseSharedHandle(sVkSharedSamplers, (uint64_t)sampler))
     {
-        return {};
+        sampler = {};
+        return;
     }
-    UniformBuffer result = {};
-    result.size = size;
-    result.offset = sVkUniformBufferOffset;
-
-    sVkUniformBufferOffset += size;
-    return result;
+    sForgetCachedDescriptorSets((uint64_t)sampler);
+    if(sampler)
+        vkDestroySampler(sVkDevice, sampler, nullptr);
+    sampler = {};
 }
 
+Buffer& getUniformBuffer(uint32_t bufferIndex)
+{
+    ASSERT(bufferIndex < sVkUniformHeapCount);
+    return sVkUniformHeaps[bufferIndex].buffer;
+}
 
-DescriptorInfo::DescriptorInfo(const UniformBuffer& buffer)
+int64_t getFrameIndexWrapped()
 {
-    bufferInfo.buffer = sVkUniformBuffer.buffer;
-    bufferInfo.offset = buffer.offset;
-    bufferInfo.range = buffer.size;
-    type = DescriptorType::BUFFER;
+    int64_t frameIndex = sVkFrameIndex % CarpVk::FramesInFlight;
+    frameIndex += CarpVk::FramesInFlight;
+    frameIndex %= CarpVk::FramesInFlight;
+    return frameIndex;
 }
 
-void flushBarriers()
+void setPipelineCacheFilename(const char* filename)
 {
-    if(sVkImageBarriers.size() == 0 && sVkBufferBarriers.size() == 0)
+    if(!filename)
     {
+        sVkPipelineCacheFilename[0] = '\0';
         return;
     }
-    VkDependencyInfo dependencyInfo = {};
-    dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
-    dependencyInfo.imageMemoryBarrierCount = sVkImageBarriers.size();
-    dependencyInfo.pImageMemoryBarriers = sVkImageBarriers.size() > 0 ? sVkImageBarriers.data() : nullptr;
-    dependencyInfo.bufferMemoryBarrierCount = sVkBufferBarriers.size();;
-    dependencyInfo.pBufferMemoryBarriers = sVkBufferBarriers.size() > 0 ? sVkBufferBarriers.data() : nullptr;
+    size_t len = strlen(filename);
+    ASSERT(len < ARRAYSIZES(sVkPipelineCacheFilename));
+    if(len >= ARRAYSIZES(sVkPipelineCacheFilename))
+    {
+        len = ARRAYSIZES(sVkPipelineCacheFilename) - 1;
+    }
+    memcpy(sVkPipelineCacheFilename, filename, len);
+    sVkPipelineCacheFilename[len] = '\0';
+}
 
-    vkCmdPipelineBarrier2(getVkCommandBuffer(), &dependencyInfo);
+bool savePipelineCache()
+{
+    if(!sVkPipelineCache || sVkPipelineCacheFilename[0] == '\0')
+    {
+        return false;
+    }
 
-    sVkImageBarriers.clear();
-    sVkBufferBarriers.clear();
+    size_t dataSize = 0;
+    VK_CHECK_CALL(vkGetPipelineCacheData(sVkDevice, sVkPipelineCache, &dataSize, nullptr));
+    std::vector<char> data(dataSize);
+    if(dataSize > 0)
+    {
+        VK_CHECK_CALL(vkGetPipelineCacheData(sVkDevice, sVkPipelineCache, &dataSize, data.data()));
+    }
+
+    std::ofstream file(sVkPipelineCacheFilename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+        printf("Failed to open pipeline cache file for writing: %s\n", sVkPipelineCacheFilename);
+        return false;
+    }
+    PipelineCacheFileHeader header = sGetPipelineCacheFileHeader(dataSize);
+    file.write((const char*)&header, sizeof(PipelineCacheFileHeader));
+    file.write(data.data(), std::streamsize(dataSize));
+    file.close();
+
+    sVkPipelineCacheStats.savedBytes = dataSize;
+    return true;
 }
 
-void beginRenderPipeline(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
-    RenderingAttachmentInfo *depthTarget,
-    VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet)
+StagingStats getStagingStats(QueueType queueType)
 {
-    flushBarriers();
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
-    int width = 0;
-    int height = 0;
-    ASSERT(colorTargetCount <= 32);
-    ASSERT(colorTargetCount > 0 || depthTarget);
+    if(queueType == QueueType::TRANSFER)
+    {
+        return sVkTransferStagingRing.stats;
+    }
+    return sVkStagingRing.stats;
+}
 
-    VkRenderingAttachmentInfo colorAttachments[32] = {};
-    VkRenderingAttachmentInfo depthAttachment = {};
+PipelineCacheStats getPipelineCacheStats()
+{
+    PipelineCacheStats stats = sVkPipelineCacheStats;
+    stats.hits = sVkPipelineCacheHits;
+    stats.misses = sVkPipelineCacheMisses;
+    stats.unknown = sVkPipelineCacheUnknown;
+    stats.creationTimeNs = sVkPipelineCreationTimeNs;
+    return stats;
+}
 
-    for(int i = 0; i < colorTargetCount; ++i)
+void setPipelineCompileThreadCount(int32_t threadCount)
+{
+    sStopPipelineCompileThreads();
+    sStartPipelineCompileThreads(threadCount);
+}
+
+void createGraphicsPipelinesAsync(const GPBuilder* builders, const char* const* pipelineNames,
+    int32_t count, AsyncPipeline* outPipelines)
+{
+    ASSERT(builders && outPipelines);
+    ASSERT(!sPipelineCompileThreads.empty());
     {
-        width = colorTargets[i].image->width;
-        height = colorTargets[i].image->height;
-        colorAttachments[i].sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
-        colorAttachments[i].imageView = colorTargets[i].image->view;
-        colorAttachments[i].imageLayout = colorTargets[i].image->layout;
-        colorAttachments[i].loadOp = (VkAttachmentLoadOp)colorTargets[i].loadOp;
-        colorAttachments[i].storeOp = (VkAttachmentStoreOp)colorTargets[i].storeOp;
-        colorAttachments[i].clearValue = colorTargets[i].clearValue;
+        std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+        for(int32_t i = 0; i < count; ++i)
+        {
+            const GPBuilder& builder = builders[i];
+
+            PipelineCompileJob job;
+            job.graphicsBuilder = builder;
+            job.stageInfos.assign(builder.stageInfos, builder.stageInfos + builder.stageInfoCount);
+            job.stages.resize(builder.stageInfoCount);
+            for(int32_t j = 0; j < builder.stageInfoCount; ++j)
+            {
+                sCopyCompileStage(builder.stageInfos[j], job.stages[j]);
+            }
+            if(builder.stageSpecializations)
+            {
+                job.stageSpecializations.assign(builder.stageSpecializations,
+                    builder.stageSpecializations + builder.stageInfoCount);
+            }
+            job.colorFormats.assign(builder.colorFormats, builder.colorFormats + builder.colorFormatCount);
+            job.blendChannels.assign(builder.blendChannels, builder.blendChannels + builder.blendChannelCount);
+            job.pipelineName = pipelineNames ? pipelineNames[i] : nullptr;
+            job.slotIndex = sAllocateAsyncPipelineSlot();
+            job.compute = false;
+
+            outPipelines[i].index = job.slotIndex;
+            sPipelineCompileJobs.push_back(std::move(job));
+        }
     }
+    sPipelineCompileCondition.notify_all();
+}
 
-    if(depthTarget)
+void createComputePipelinesAsync(const CPBuilder* builders, const char* const* pipelineNames,
+    int32_t count, AsyncPipeline* outPipelines)
+{
+    ASSERT(builders && outPipelines);
+    ASSERT(!sPipelineCompileThreads.empty());
     {
-        width = depthTarget->image->width;
-        height = depthTarget->image->height;
+        std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+        for(int32_t i = 0; i < count; ++i)
+        {
+            PipelineCompileJob job;
+            job.computeBuilder = builders[i];
+            job.stages.resize(1);
+            sCopyCompileStage(builders[i].stageInfo, job.stages[0]);
+            job.pipelineName = pipelineNames ? pipelineNames[i] : nullptr;
+            job.slotIndex = sAllocateAsyncPipelineSlot();
+            job.compute = true;
+
+            outPipelines[i].index = job.slotIndex;
+            sPipelineCompileJobs.push_back(std::move(job));
+        }
+    }
+    sPipelineCompileCondition.notify_all();
+}
 
-        depthAttachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
-        depthAttachment.imageView = depthTarget->image->view;
-        depthAttachment.imageLayout = depthTarget->image->layout;
-        depthAttachment.loadOp = (VkAttachmentLoadOp)depthTarget->loadOp;
-        depthAttachment.storeOp = (VkAttachmentStoreOp)depthTarget->storeOp;
-        depthAttachment.clearValue = depthTarget->clearValue;
+bool isPipelineReady(AsyncPipeline pipeline)
+{
+    std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+    ASSERT_RETURN_FALSE(pipeline.index < sAsyncPipelineSlots.size());
+    ASSERT(sAsyncPipelineSlots[pipeline.index].used);
+    return sAsyncPipelineSlots[pipeline.index].ready;
+}
+
+VkPipeline getAsyncPipeline(AsyncPipeline pipeline)
+{
+    std::lock_guard<std::mutex> lock(sPipelineCompileMutex);
+    if(pipeline.index >= sAsyncPipelineSlots.size())
+    {
+        ASSERT(!"Invalid async pipeline handle");
+        return VK_NULL_HANDLE;
     }
+    const AsyncPipelineSlot& slot = sAsyncPipelineSlots[pipeline.index];
+    ASSERT(slot.used);
+    return slot.ready ? slot.pipeline : VK_NULL_HANDLE;
+}
 
-    VkRenderingInfo renderingInfo{};
-    renderingInfo.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
-    renderingInfo.renderArea = { 0, 0, uint32_t(width), uint32_t(height) };
-    renderingInfo.layerCount = 1;
-    renderingInfo.colorAttachmentCount = colorTargetCount;
-    renderingInfo.pColorAttachments = colorTargetCount > 0 ? colorAttachments : nullptr;
-    renderingInfo.pDepthAttachment = depthTarget ? &depthAttachment : nullptr;
-    //renderingInfo.pStencilAttachment = &depthStencilAttachment;
+VkPipeline waitForAsyncPipeline(AsyncPipeline pipeline)
+{
+    std::unique_lock<std::mutex> lock(sPipelineCompileMutex);
+    if(pipeline.index >= sAsyncPipelineSlots.size())
+    {
+        ASSERT(!"Invalid async pipeline handle");
+        return VK_NULL_HANDLE;
+    }
+    ASSERT(sAsyncPipelineSlots[pipeline.index].used);
+    sPipelineReadyCondition.wait(lock, [pipeline]
+    {
+        return sAsyncPipelineSlots[pipeline.index].ready;
+    });
+    return sAsyncPipelineSlots[pipeline.index].pipeline;
+}
 
-    vkCmdBeginRendering(commandBuffer, &renderingInfo);
+void releaseAsyncPipeline(AsyncPipeline& pipeline)
+{
+    {
+        std::unique_lock<std::mutex> lock(sPipelineCompileMutex);
+        ASSERT_RETURN(pipeline.index < sAsyncPipelineSlots.size());
+        AsyncPipelineSlot& slot = sAsyncPipelineSlots[pipeline.index];
+        ASSERT(slot.used);
+        // Slot cannot be reused while the worker still has to write into it.
+        sPipelineReadyCondition.wait(lock, [&slot]
+        {
+            return slot.ready;
+        });
+        slot = AsyncPipelineSlot{};
+        sAsyncPipelineFreeSlots.push_back(pipeline.index);
+    }
+    pipeline = AsyncPipeline{};
+}
 
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout,
-        0, 1, &descriptorSet,
-        0, NULL);
+void beginGpuTimer(const char* name)
+{
+    ASSERT(name);
+    int64_t frameIndex = getFrameIndexWrapped();
+    int& queryIndex = sVkQueryPoolIndexCounts[frameIndex];
 
-    VkViewport viewport = { 0.0f, float(height), float(width), -float(height), 0.0f, 1.0f };
-    VkRect2D scissors = { { 0, 0 }, { uint32_t(width), uint32_t(height) } };
+    // Out of queries, timer is skipped but the stack stays balanced. Async compute is skipped
+    // too, the query pool gets reset on the graphics queue.
+    if(queryIndex + 2 > CarpVk::QueryCount || sVkAsyncComputeRecording)
+    {
+        sVkGpuTimerStack.push_back(~0u);
+        return;
+    }
 
-    vkCmdSetScissor(commandBuffer, 0, 1, &scissors);
-    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+    std::vector<GpuTimerQuery>& timers = sVkGpuTimers[frameIndex];
+    sVkGpuTimerStack.push_back(uint32_t(timers.size()));
+    timers.push_back(GpuTimerQuery{
+        .name = name,
+        .beginQuery = uint32_t(queryIndex),
+        .endQuery = uint32_t(queryIndex + 1),
+        .depth = int32_t(sVkGpuTimerStack.size()) - 1,
+    });
+    queryIndex += 2;
+
+    vkCmdWriteTimestamp2(getVkCommandBuffer(), VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT,
+        sVkQueryPools[frameIndex], timers.back().beginQuery);
+}
 
+void endGpuTimer()
+{
+    ASSERT_RETURN(!sVkGpuTimerStack.empty());
+    uint32_t timerIndex = sVkGpuTimerStack.back();
+    sVkGpuTimerStack.pop_back();
+    if(timerIndex == ~0u)
+    {
+        return;
+    }
+    int64_t frameIndex = getFrameIndexWrapped();
+    const GpuTimerQuery& timer = sVkGpuTimers[frameIndex][timerIndex];
+    vkCmdWriteTimestamp2(getVkCommandBuffer(), VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT,
+        sVkQueryPools[frameIndex], timer.endQuery);
 }
 
-void endRenderPipeline()
+const GpuTimerResult* getGpuTimerResults(int32_t* outCount, int64_t* outFrame)
 {
-    vkCmdEndRendering(getVkCommandBuffer());
+    if(outCount)
+    {
+        *outCount = int32_t(sVkGpuTimerResults.size());
+    }
+    if(outFrame)
+    {
+        *outFrame = sVkGpuTimerResultsFrame;
+    }
+    return sVkGpuTimerResults.data();
 }
 
+const GpuTimerAverage* getGpuTimerAverages(int32_t* outCount)
+{
+    if(outCount)
+    {
+        *outCount = int32_t(sVkGpuTimerAverages.size());
+    }
+    return sVkGpuTimerAverages.data();
+}
 
-void beginComputePipeline(VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet)
+int64_t getFrameIndex()
 {
-    flushBarriers();
-    VkCommandBuffer commandBuffer = getVkCommandBuffer();
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
-        pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    return sVkFrameIndex;
 }
 
-void endComputePipeline()
+uint64_t getLastSubmissionValue()
+{
+    return sVkSubmissionValue;
+}
+
+uint64_t getNextSubmissionValue()
 {
+    return sVkSubmissionValue + 1;
+}
 
+uint64_t getCompletedSubmissionValue()
+{
+    uint64_t value = 0;
+    VK_CHECK_CALL(vkGetSemaphoreCounterValue(sVkDevice, sVkTimelineSemaphore, &value));
+    return value;
 }
 
-VkSampler createSampler(const VkSamplerCreateInfo& info)
+bool isSubmissionComplete(uint64_t submissionValue)
 {
-    VkSamplerCreateInfo newInfo = info;
-    newInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    VkSampler sampler = VK_NULL_HANDLE;
-    VK_CHECK_CALL(vkCreateSampler(sVkDevice, &newInfo, nullptr, &sampler));
-    return sampler;
+    ASSERT(submissionValue <= sVkSubmissionValue);
+    return getCompletedSubmissionValue() >= submissionValue;
 }
 
-void destroySampler(VkSampler& sampler)
+bool waitForSubmission(uint64_t submissionValue, uint64_t timeoutNs)
 {
-    if(sampler)
-        vkDestroySampler(sVkDevice, sampler, nullptr);
-    sampler = {};
+    // Waiting for something not submitted yet would never return with infinite timeout.
+    ASSERT_RETURN_FALSE(submissionValue <= sVkSubmissionValue);
+    return sWaitTimelineSemaphore(sVkTimelineSemaphore, submissionValue, timeoutNs);
+}
+
+uint64_t getFrameSubmissionValue(int64_t frame)
+{
+    int64_t frameIndex = frame % CarpVk::FramesInFlight;
+    frameIndex = (frameIndex + CarpVk::FramesInFlight) % CarpVk::FramesInFlight;
+
+    int64_t slotFrame = sVkFrameSubmissionFrames[frameIndex];
+    if(slotFrame == frame)
+    {
+        return sVkFrameSubmissionValues[frameIndex];
+    }
+    // Older frames have been waited already when their frame index got reused.
+    if(frame < slotFrame)
+    {
+        return 0;
+    }
+    return UINT64_MAX;
 }
 
-Buffer& getUniformBuffer()
+bool isFrameComplete(int64_t frame)
 {
-    return sVkUniformBuffer;
+    uint64_t value = getFrameSubmissionValue(frame);
+    if(value == UINT64_MAX)
+    {
+        return false;
+    }
+    return value == 0 || isSubmissionComplete(value);
 }
 
-int64_t getFrameIndexWrapped()
+bool waitForFrame(int64_t frame, uint64_t timeoutNs)
 {
-    int64_t frameIndex = sVkFrameIndex % CarpVk::FramesInFlight;
-    frameIndex += CarpVk::FramesInFlight;
-    frameIndex %= CarpVk::FramesInFlight;
-    return frameIndex;
+    uint64_t value = getFrameSubmissionValue(frame);
+    if(value == UINT64_MAX)
+    {
+        return false;
+    }
+    return waitForSubmission(value, timeoutNs);
 }
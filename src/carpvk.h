@@ -4,6 +4,7 @@
 
 #include "carpvkassert.h"
 #include "carpvkcommon.h"
+#include "carpvkspirv.h"
 
 #define VK_CHECK_CALL(call) do { \
     VkResult callResult = call; \
@@ -50,6 +51,13 @@ enum class VSyncType : unsigned char
     MAILBOX_VSYNC,
 };
 
+enum class QueueType : unsigned char
+{
+    GRAPHICS,
+    ASYNC_COMPUTE,
+    TRANSFER,
+};
+
 struct VulkanInstanceParams
 {
     FnGetExtraInstanceExtensions getExtraExtensionsFn = nullptr;
@@ -62,9 +70,38 @@ struct VulkanInstanceParams
     int extensionCount = 0;
     int width = 0;
     int height = 0;
+    // Pipeline cache is loaded from and saved to this file, nullptr keeps it in memory only.
+    const char* pipelineCacheFilename = nullptr;
+    // Threads used by the async pipeline creation, 0 uses hardware threads - 1.
+    int32_t pipelineCompileThreadCount = 0;
+    // Size of the per frame staging blocks used by uploads, 0 uses 16 MB.
+    size_t stagingBlockSize = 0;
+    // Extra staging blocks are freed after this many frames without needing them, 0 keeps them.
+    uint32_t stagingShrinkIdleFrames = 120;
+    // Per frame size of the host visible dynamic uniform ring, 0 uses 4 MB.
+    size_t dynamicUniformRingSize = 0;
     VSyncType vsyncMode = VSyncType::MAILBOX_VSYNC;
     bool useValidation = false;
     bool useIntegratedGpu = false;
+    // No window, createSurfaceFn is not used. presentImage blits into an offscreen image and
+    // cpu devices are allowed when there is no gpu.
+    bool headless = false;
+    // Headless presents through VK_EXT_headless_surface swapchain when the extension exists.
+    bool useHeadlessSurface = false;
+    // Creates a transfer only queue for the async uploads if the device has a separate family.
+    bool useAsyncTransferQueue = false;
+    // Creates a compute only queue for beginAsyncCompute if the device has a separate family.
+    bool useAsyncComputeQueue = false;
+    // Creates the bindless descriptor heap if the device supports descriptor indexing.
+    bool useBindless = false;
+    // Enables VK_KHR_push_descriptor when the device has it, needed for push set layouts.
+    bool usePushDescriptors = false;
+    // Descriptor sets live in a host visible VK_EXT_descriptor_buffer buffer instead of pools
+    // when the device supports it. Disables the bindless heap and dynamic descriptors.
+    bool useDescriptorBuffer = false;
+    // Graphics programs use VK_EXT_shader_object when supported, pipelines otherwise.
+    // Renderdoc does not capture shader objects.
+    bool useShaderObjects = false;
 };
 
 struct CarpSwapChainFormats
@@ -76,10 +113,132 @@ struct CarpSwapChainFormats
 };
 
 
+struct PipelineCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Driver did not report creation feedback.
+    uint64_t unknown = 0;
+    uint64_t creationTimeNs = 0;
+    size_t loadedBytes = 0;
+    size_t savedBytes = 0;
+};
+
+struct StagingStats
+{
+    // Most staging bytes used in a single frame.
+    uint64_t highWaterMark = 0;
+    uint64_t lastFrameBytes = 0;
+    uint64_t allocatedBytes = 0;
+    uint32_t blockCount = 0;
+    uint32_t growCount = 0;
+    uint32_t shrinkCount = 0;
+};
+
+// Handle to a pending gpu to cpu copy.
+struct ReadbackTicket
+{
+    uint32_t index = ~0u;
+    // Slots are reused, a ticket only matches the use it was given for.
+    uint32_t generation = 0;
+};
+
+// Called from beginFrame/beginPreFrame once the copy has finished, data is only valid during the call.
+using FnReadbackDone = void (*)(const void* data, size_t size, void* userData);
+
+struct DescriptorSetCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint32_t cachedSetCount = 0;
+    uint32_t poolCount = 0;
+};
+
+struct SharedObjectStats
+{
+    // Calls to the createShared functions.
+    uint64_t setLayoutRequests = 0;
+    uint64_t pipelineLayoutRequests = 0;
+    uint64_t samplerRequests = 0;
+    // Distinct objects alive in the shared caches.
+    uint32_t uniqueSetLayouts = 0;
+    uint32_t uniquePipelineLayouts = 0;
+    uint32_t uniqueSamplers = 0;
+};
+
+struct UploadStats
+{
+    uint64_t directBytes = 0;
+    uint64_t stagedBytes = 0;
+    uint32_t directCount = 0;
+    uint32_t stagedCount = 0;
+};
+
+struct UniformBufferStats
+{
+    uint64_t capacityBytes = 0;
+    uint64_t usedBytes = 0;
+    // Destroyed but possibly still read by frames in flight.
+    uint64_t pendingFreeBytes = 0;
+    uint64_t largestFreeBlock = 0;
+    uint32_t allocationCount = 0;
+    uint32_t freeBlockCount = 0;
+    uint32_t backingBufferCount = 0;
+    // 0 when the free memory is a single block, towards 1 the more it is split.
+    float fragmentation = 0.0f;
+};
+
+struct TransientImageDesc
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    VkFormat format = {};
+    VkImageUsageFlags usage = 0;
+    const char* imageName = nullptr;
+    // Inclusive range of use points within a frame, for example render graph pass or level indices.
+    uint32_t firstUse = 0;
+    uint32_t lastUse = 0;
+    Image* outImage = nullptr;
+};
+
+struct TransientImageStats
+{
+    uint32_t imageCount = 0;
+    uint32_t blockCount = 0;
+    // Sum of the image sizes if each had its own allocation.
+    uint64_t requestedBytes = 0;
+    uint64_t allocatedBytes = 0;
+    uint64_t savedBytes = 0;
+};
+
 struct CarpVk
 {
     static const int FramesInFlight = 4;
     static const int QueryCount = 128;
+    // Frames used for gpu timer rolling averages.
+    static const int GpuTimerHistoryLength = 64;
+    // Bindless heap sizes, clamped to the device update after bind limits.
+    static const int BindlessSampledImageCount = 16384;
+    static const int BindlessStorageImageCount = 4096;
+    static const int BindlessStorageBufferCount = 16384;
+    // Backing buffers the uniform allocator can grow to.
+    static const int MaxUniformBuffers = 8;
+    // Thread indices for secondary command buffer recording.
+    static const int MaxRecordingThreads = 16;
+    // Cached descriptor sets kept before the least recently used ones get recycled.
+    static const int DescriptorSetCacheSize = 4096;
+    // Sets per pool in the per frame descriptor pool chains.
+    static const int FrameDescriptorPoolSetCount = 256;
+    // Descriptor buffer range for sets from createDescriptorSet and the descriptor set cache,
+    // and the range for each frame slot of allocateFrameDescriptorSet. Persistent ranges are
+    // reused after the layout of their sets is destroyed.
+    static const int DescriptorBufferPersistentSize = 4 * 1024 * 1024;
+    static const int DescriptorBufferFrameSize = 1024 * 1024;
+    // Highest set count of layouts made from shader reflection.
+    static const int MaxReflectedSets = 8;
+    // Specialization constants per shader stage.
+    static const int MaxSpecializationConstants = 16;
 };
 
 struct DescriptorSetLayout
@@ -88,6 +247,22 @@ struct DescriptorSetLayout
     VkDescriptorType descriptorType = {};
     uint32_t stage = {};
     VkSampler immutableSampler = {};
+    // Array size of the binding, descriptor writes fill the first element.
+    uint32_t descriptorCount = 1;
+};
+
+// Set and pipeline layouts made from the shader reflections of a pipeline's stages.
+struct ReflectedLayouts
+{
+    VkDescriptorSetLayout setLayouts[CarpVk::MaxReflectedSets] = {};
+    // Bindings of each set, for createSetLayout compatible writes with updateBindDescriptorSet.
+    std::vector<DescriptorSetLayout> setBindings[CarpVk::MaxReflectedSets];
+    uint32_t setLayoutCount = 0;
+    VkPipelineLayout pipelineLayout = {};
+    uint32_t pushConstantStageFlags = 0;
+    uint32_t pushConstantOffset = 0;
+    uint32_t pushConstantSize = 0;
+    uint32_t workgroupSize[3] = {};
 };
 
 struct DescriptorInfo
@@ -112,6 +287,7 @@ struct DescriptorInfo
     DescriptorInfo(const Buffer &buffer, const VkDeviceSize offset, const VkDeviceSize range)
     {
         ASSERT(range > 0u);
+        ASSERT(!buffer.pendingAcquire);
         bufferInfo.buffer = buffer.buffer;
         bufferInfo.offset = offset;
         bufferInfo.range = range;
@@ -119,6 +295,7 @@ struct DescriptorInfo
     }
     DescriptorInfo(const Buffer &buffer)
     {
+        ASSERT(!buffer.pendingAcquire);
         bufferInfo.buffer = buffer.buffer;
         bufferInfo.offset = 0;
         bufferInfo.range = buffer.size;
@@ -136,9 +313,21 @@ struct DescriptorInfo
     DescriptorType type = DescriptorType::NOT_VALID;
 };
 
+// Specialization constant values of one shader stage, set with setSpecializationConstant.
+// Every constant is 4 bytes, bools are VkBool32. Replaces pSpecializationInfo of the stage
+// info when count is not 0.
+struct SpecializationConstants
+{
+    uint32_t constantIds[CarpVk::MaxSpecializationConstants] = {};
+    uint32_t values[CarpVk::MaxSpecializationConstants] = {};
+    uint32_t count = 0;
+};
+
 struct GPBuilder
 {
     const VkPipelineShaderStageCreateInfo* stageInfos = {};
+    // One per stage info, nullptr when no stage is specialized.
+    const SpecializationConstants* stageSpecializations = {};
     const VkFormat* colorFormats = {};
     const VkPipelineColorBlendAttachmentState* blendChannels = {};
     VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
@@ -155,12 +344,59 @@ struct GPBuilder
 
 };
 
+// Handle to a pipeline being compiled on the pipeline compile threads.
+struct AsyncPipeline
+{
+    uint32_t index = ~0u;
+};
+
+// Pipeline or linked shader objects of a GPBuilder, see createGraphicsProgram.
+struct GraphicsProgram
+{
+    // Compiled on the pipeline compile threads, bound once ready.
+    AsyncPipeline pipeline = {};
+    uint32_t shaderObjectIndex = ~0u;
+};
+
 struct CPBuilder
 {
     VkPipelineShaderStageCreateInfo stageInfo = {};
     VkPipelineLayout pipelineLayout = {};
+    SpecializationConstants specialization = {};
+};
+
+struct PipelineVariantStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint32_t variantCount = 0;
+};
+
+
+struct GpuTimerResult
+{
+    const char* name = nullptr;
+    double milliseconds = 0.0;
+    // Nesting level, 0 for outermost timers.
+    int32_t depth = 0;
+};
+
+struct GpuTimerAverage
+{
+    const char* name = nullptr;
+    double averageMilliseconds = 0.0;
+    double minMilliseconds = 0.0;
+    double maxMilliseconds = 0.0;
+    int32_t sampleCount = 0;
 };
 
+// Secondary command buffer recorded on a worker thread, executed on the main thread.
+struct SecondaryCommandBuffer
+{
+    VkCommandBuffer_T* commandBuffer = nullptr;
+    uint32_t threadIndex = ~0u;
+    uint32_t bufferIndex = ~0u;
+};
 
 struct RenderingAttachmentInfo
 {
@@ -176,33 +412,146 @@ void deinitVulkan();
 void printExtensions();
 void printLayers();
 
-VkDescriptorSetLayout createSetLayout(const DescriptorSetLayout* descriptors, int32_t count);
+// Push layouts have no sets, their bindings are written with pushDescriptors.
+VkDescriptorSetLayout createSetLayout(const DescriptorSetLayout* descriptors, int32_t count,
+    bool pushDescriptors = false);
 void destroyDescriptorSetLayouts(VkDescriptorSetLayout* layouts, int32_t amount);
+
+// Identical inputs return the same reference counted object, so pipelines made from identical
+// layouts stay layout compatible. Every call adds a reference, the regular destroy functions
+// release one and destroy the object with the last. Call from the recording thread only.
+VkDescriptorSetLayout createSharedSetLayout(const DescriptorSetLayout* descriptors, int32_t count,
+    bool pushDescriptors = false);
+VkPipelineLayout createSharedPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count,
+    const VkPushConstantRange* pushConstantRanges = nullptr, int32_t pushConstantRangeCount = 0);
+// Shared pipeline layouts take shared set layouts or the bindless set layout only.
+// Create infos with a pNext chain always get a new sampler.
+VkSampler createSharedSampler(const VkSamplerCreateInfo& info);
+SharedObjectStats getSharedObjectStats();
 void destroyDescriptorPools(VkDescriptorPool* pools, int32_t poolCount);
 bool createDescriptorSet(VkDescriptorSetLayout layout, VkDescriptorSet* outSet);
 bool updateBindDescriptorSet(VkDescriptorSet descriptorSet,
     const DescriptorSetLayout* descriptorSetLayout,
     const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount);
 
+// Returns a set with these resources written, reusing an identical set when one is cached.
+// Sets come from per layout pools and the least recently used ones are rewritten once no
+// frame in flight uses them, so get the set again every frame it is bound. Destroying an
+// image, buffer or set layout drops the sets using it.
+VkDescriptorSet getCachedDescriptorSet(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount);
+DescriptorSetCacheStats getDescriptorSetCacheStats();
+
+// Records the bindings of a push set layout straight into the command buffer, no pool or set
+// is involved. Call after beginRenderPipeline/beginComputePipeline, those take a null set
+// when set 0 is pushed.
+bool hasPushDescriptors();
+// True when descriptor sets are backed by the descriptor buffer, see useDescriptorBuffer.
+bool hasDescriptorBuffer();
+bool pushDescriptors(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount);
+// Range must be within the layout's push constant range, see ReflectedLayouts.
+void pushConstants(VkPipelineLayout pipelineLayout, uint32_t stageFlags, uint32_t offset, uint32_t size,
+    const void* data);
+
+// Set that is valid until the frame slot comes around again, for descriptors that change
+// every frame. Pools of the slot are reset in beginFrame, call from the recording thread only.
+VkDescriptorSet allocateFrameDescriptorSet(VkDescriptorSetLayout layout,
+    const DescriptorSetLayout* descriptorSetLayout,
+    const DescriptorInfo* descriptorSetInfos, int descriptorSetInfoCount);
+
 
 bool createImage(uint32_t width, uint32_t height,
     VkFormat imageFormat, VkImageUsageFlags usage, const char* imageName,
     Image& outImage);
 void destroyImage(Image& image);
+
+// Images with non overlapping lifetimes share memory blocks. Replaces any previous set,
+// so call again after resize. Replacing or destroying waits for the submitted frames that use them.
+bool createTransientImages(const TransientImageDesc* descs, uint32_t count);
+void destroyTransientImages();
+// Call when reaching a use point, images starting there get their contents discarded and
+// wait for the previous users of their memory on the next imageBarrier.
+void beginTransientImageUse(uint32_t usePoint);
+TransientImageStats getTransientImageStats();
 VkImageView createImageView(VkImage image, VkFormat format);
 void uploadToImage(uint32_t width, uint32_t height, uint32_t pixelSize,
     Image& targetImage, void* data, uint32_t dataSize);
 
+// preferDirectUpload asks for device local memory the cpu can map, as on integrated gpus and
+// with resizable bar, and falls back to plain device local memory. Buffer::directUpload tells
+// which one it got, memoryFlags is ignored then.
 bool createBuffer(size_t size,
     VkBufferUsageFlags usage,
     VkMemoryPropertyFlags memoryFlags,
     const char* bufferName,
-    Buffer &outBuffer);
+    Buffer &outBuffer,
+    bool preferDirectUpload = false);
 void destroyBuffer(Buffer& buffer);
+// Suballocated from the uniform backing buffers, sizes round up to the device uniform offset
+// alignment. Adds a backing buffer when the existing ones are full.
 UniformBuffer createUniformBuffer(size_t size);
+// Space is reused once the frames that could read it have finished.
+void destroyUniformBuffer(UniformBuffer& uniformBuffer);
+UniformBufferStats getUniformBufferStats();
+
+// Per frame ring in host visible memory for constants that change every frame. Write to data,
+// no copies or barriers needed, and pass offset as the dynamic offset when binding a set with
+// a VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC binding described by getDynamicUniformDescriptorInfo.
+// Valid until the end of the frame, size is at most getDynamicUniformRange.
+struct DynamicUniform
+{
+    void* data = nullptr;
+    uint32_t offset = 0;
+};
+DynamicUniform allocateDynamicUniform(size_t size);
+// Copies data into the ring, returns the dynamic offset.
+uint32_t writeDynamicUniform(const void* data, size_t size);
+DescriptorInfo getDynamicUniformDescriptorInfo();
+size_t getDynamicUniformRange();
+// Buffers with directUpload are written right away, the range must not be in use by frames in
+// flight. Others go through a staging copy recorded into the current command buffer.
 void uploadToGpuBuffer(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size);
 void uploadToUniformBuffer(UniformBuffer &uniformBuffer, const void *data, size_t size);
 
+// Queued uploads write the data to staging memory right away, or to a cpu copy outside a frame,
+// and record nothing until flushUploads, which also runs at the start of beginFrame and before
+// presentImage/endPreFrame submit. Later uploads win where ranges overlap. The flush records one
+// barrier batch and one copy per buffer with touching ranges merged. Flush before using the data
+// in the same frame. destroyBuffer drops the uploads queued for the buffer.
+void queueUploadToGpuBuffer(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size);
+void queueUploadToUniformBuffer(UniformBuffer &uniformBuffer, const void *data, size_t size);
+void flushUploads();
+// Totals since initVulkan of the direct and staged buffer upload paths.
+UploadStats getUploadStats();
+
+// Records a copy into host cached readback memory, finished readbacks are picked up without
+// waiting on the gpu. With doneFn the ticket is released after the call, otherwise poll with
+// isReadbackReady and release with releaseReadback. Released tickets are stale, they are never
+// ready and releasing them again does nothing. Images are read whole, tightly packed, depth
+// stencil images read only depth.
+ReadbackTicket readbackBuffer(Buffer& buffer, size_t offset, size_t size,
+    FnReadbackDone doneFn = nullptr, void* userData = nullptr);
+ReadbackTicket readbackImage(Image& image, uint32_t pixelSize,
+    FnReadbackDone doneFn = nullptr, void* userData = nullptr);
+bool isReadbackReady(ReadbackTicket ticket);
+// nullptr until ready, stays valid until releaseReadback.
+const void* getReadbackData(ReadbackTicket ticket, size_t* outSize);
+void releaseReadback(ReadbackTicket& ticket);
+
+// Copies on the transfer queue while the graphics queue renders, the resource is handed to the
+// graphics queue at the start of the next frame. Only resources not yet used on the graphics
+// queue take this path, others and devices without transfer queue fall back to
+// uploadToGpuBuffer/uploadToImage. Returns true if the transfer queue was used.
+// When it was, the resource is usable one frame later: it stays pendingAcquire until the next
+// beginFrame acquires it, barriers and binds on it before that assert.
+bool uploadToGpuBufferAsync(Buffer &gpuBuffer, const void *data, size_t dstOffset, size_t size);
+bool uploadToImageAsync(uint32_t width, uint32_t height, uint32_t pixelSize,
+    Image& targetImage, void* data, uint32_t dataSize);
+bool hasAsyncTransferQueue();
+
 
 
 
@@ -214,10 +563,11 @@ void imageBarrier(Image &image,
     VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout);
 
+// Queue family indices of ~0u mean the family of the command buffer being recorded.
 void imageBarrier(VkImage image,
     VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask, VkImageLayout oldLayout,
     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout,
-    uint32_t aspectMask);
+    uint32_t aspectMask, uint32_t srcQueueFamilyIndex = ~0u, uint32_t dstQueueFamilyIndex = ~0u);
 
 void bufferBarrier(UniformBuffer& buffer,
      VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask);
@@ -228,7 +578,24 @@ void bufferBarrier(Buffer& buffer,
 void bufferBarrier(VkBuffer buffer,
     VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask,
     VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask,
-    size_t size, size_t offset);
+    size_t size, size_t offset,
+    uint32_t srcQueueFamilyIndex = ~0u, uint32_t dstQueueFamilyIndex = ~0u);
+
+// Global barrier, the resource barriers above skip transitions to the state the resource
+// is already in, which write after write with the same access needs.
+void memoryBarrier(VkPipelineStageFlags2 srcStageMask, VkAccessFlags2 srcAccessMask,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask);
+
+// Queue family ownership transfer, release is recorded on the queue that last used the resource
+// and acquire on the queue that uses it next, with a semaphore between the submissions.
+// Both are plain barriers when the queues share a family. Image release and acquire record
+// the same layout transition, so acquire takes the newLayout given to release.
+void releaseOwnership(Buffer& buffer, QueueType dstQueue);
+void acquireOwnership(Buffer& buffer, QueueType srcQueue,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask);
+void releaseOwnership(Image& image, QueueType dstQueue, VkImageLayout newLayout);
+void acquireOwnership(Image& image, QueueType srcQueue,
+    VkPipelineStageFlags2 dstStageMask, VkAccessFlags2 dstAccessMask, VkImageLayout newLayout);
 
 bool createShader(const char* code, int codeSize, VkShaderModule& outModule);
 bool createShader(const char* filename, VkShaderModule& outModule);
@@ -236,6 +603,38 @@ bool createShader(const char* filename, VkShaderModule& outModule);
 
 
 VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout descriptorSetLayout);
+VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count);
+VkPipelineLayout createPipelineLayout(const VkDescriptorSetLayout* descriptorSetLayouts, int32_t count,
+    const VkPushConstantRange* pushConstantRanges, int32_t pushConstantRangeCount);
+
+// createShader reflects the SPIR-V of every module, reflections are cached by code hash and
+// shared by modules with the same code. Valid until the last of those modules is destroyed.
+const ShaderReflection* getShaderReflection(VkShaderModule module);
+// Merges the reflections of the stages into set layouts, one per set index up to the highest
+// used, and a pipeline layout with one push constant range for all stages. Identical stage
+// combinations return the same layouts, made with the createShared functions. They are owned
+// by the cache and destroyed in deinitVulkan, do not destroy them.
+const ReflectedLayouts* getReflectedLayouts(const VkShaderModule* modules, int32_t moduleCount);
+
+// Bindless heap, set layout has binding 0 combined image samplers, 1 storage images and
+// 2 storage buffers as partially bound arrays. Register returns the array index for the shaders
+// or ~0u when the heap is full or not in use. Sampled images are read in shader read only layout
+// and storage images in general layout. Unregistered indices are reused after the frames that
+// could read them have finished.
+bool hasBindless();
+VkDescriptorSetLayout getBindlessSetLayout();
+VkDescriptorSet getBindlessDescriptorSet();
+void bindBindlessDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex);
+// Binds another set, or set 0 with new dynamic offsets, inside beginRenderPipeline/beginComputePipeline.
+// One dynamic offset per dynamic binding, in binding order.
+void bindDescriptorSet(VkPipelineBindPoint bindPoint, VkPipelineLayout pipelineLayout, uint32_t setIndex,
+    VkDescriptorSet descriptorSet, const uint32_t* dynamicOffsets = nullptr, uint32_t dynamicOffsetCount = 0);
+uint32_t registerBindlessSampledImage(const Image& image, VkSampler sampler);
+uint32_t registerBindlessStorageImage(const Image& image);
+uint32_t registerBindlessStorageBuffer(const Buffer& buffer);
+void unregisterBindlessSampledImage(uint32_t index);
+void unregisterBindlessStorageImage(uint32_t index);
+void unregisterBindlessStorageBuffer(uint32_t index);
 void destroyShaderModule(VkShaderModule* shaderModules, int32_t shaderModuleCount);
 void destroyPipelines(VkPipeline* pipelines, int32_t pipelineCount);
 void destroyPipelineLayouts(VkPipelineLayout* pipelineLayouts, int32_t pipelineLayoutCount);
@@ -248,10 +647,48 @@ VkDevice getVkDevice();
 VkCommandBuffer getVkCommandBuffer();
 VkDescriptorPool getVkDescriptorPool();
 const CarpSwapChainFormats& getSwapChainFormats();
+bool isHeadless();
+// Image the last presentImage blitted into when running without surface, nullptr otherwise.
+// Wait for the frame before reading it on cpu.
+Image* getOffscreenImage();
 
 VkPipeline createGraphicsPipeline(const GPBuilder& builder, const char* pipelineName);
 VkPipeline createComputePipeline(const CPBuilder& builder, const char* pipelineName);
 
+// With shader objects the stages are linked into VkShaderEXTs and the builder state is set
+// dynamically when bound, so the program works with any render target formats. The pipeline of
+// the builder is queued on the compile threads, binds switch to it once it is ready and the
+// render target formats match the builder. Without shader objects the first binds wait for the
+// compile instead. Modules, layouts and programName have to stay alive until then, and be
+// created after initVulkan.
+GraphicsProgram createGraphicsProgram(const GPBuilder& builder, const char* programName);
+void destroyGraphicsPrograms(GraphicsProgram* programs, int32_t programCount);
+bool hasShaderObjects();
+
+// Empty or nullptr filename disables saving. Does not reload the cache.
+void setPipelineCacheFilename(const char* filename);
+// Writes the pipeline cache to disk, also done in deinitVulkan.
+bool savePipelineCache();
+PipelineCacheStats getPipelineCacheStats();
+// Graphics for the regular uploads, Transfer for the async transfer queue uploads.
+StagingStats getStagingStats(QueueType queueType = QueueType::GRAPHICS);
+
+// Stops the compile threads after they finish queued work and starts new ones.
+void setPipelineCompileThreadCount(int32_t threadCount);
+// Builders are copied, so the arrays, entry point names and specialization data they point to
+// can be freed right after the call. Shader modules, layouts and pipeline names must stay alive
+// until the pipeline is ready.
+void createGraphicsPipelinesAsync(const GPBuilder* builders, const char* const* pipelineNames,
+    int32_t count, AsyncPipeline* outPipelines);
+void createComputePipelinesAsync(const CPBuilder* builders, const char* const* pipelineNames,
+    int32_t count, AsyncPipeline* outPipelines);
+bool isPipelineReady(AsyncPipeline pipeline);
+// Returns VK_NULL_HANDLE while the pipeline is still compiling, never blocks.
+VkPipeline getAsyncPipeline(AsyncPipeline pipeline);
+VkPipeline waitForAsyncPipeline(AsyncPipeline pipeline);
+// Frees the handle, the pipeline itself is owned by the caller and destroyed with destroyPipelines.
+void releaseAsyncPipeline(AsyncPipeline& pipeline);
+
 bool beginFrame();
 bool presentImage(Image& presentImage);
 void beginPreFrame();
@@ -261,15 +698,103 @@ VkPipelineShaderStageCreateInfo createDefaultVertexInfo(VkShaderModule module);
 VkPipelineShaderStageCreateInfo createDefaultFragmentInfo(VkShaderModule module);
 VkPipelineShaderStageCreateInfo createDefaultComputeInfo(VkShaderModule module);
 
+// Sets or replaces the value of a constant id.
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, int32_t value);
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, uint32_t value);
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, float value);
+void setSpecializationConstant(SpecializationConstants& constants, uint32_t constantId, bool value);
+
+// Returns the pipeline compiled earlier for identical builder state and constant values, or
+// compiles a new one. The key is the shader modules, the SpecializationConstants of the
+// builder and the rest of its state, pSpecializationInfo of the stage infos is not part of it.
+// The cache owns the pipelines, destroying a shader module or pipeline layout drops its
+// variants once the frames in flight are done with them. Call from the recording thread only.
+VkPipeline getGraphicsPipelineVariant(const GPBuilder& builder, const char* pipelineName);
+VkPipeline getComputePipelineVariant(const CPBuilder& builder, const char* pipelineName);
+PipelineVariantStats getPipelineVariantStats();
+
+// Non-null timerName wraps the pipeline in a gpu timer that ends in endRenderPipeline/endComputePipeline.
+// Dynamic offsets are for the dynamic bindings of descriptorSet, as in bindDescriptorSet.
+void beginRenderPipeline(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget,
+    VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet,
+    const char* timerName = nullptr, const uint32_t* dynamicOffsets = nullptr, uint32_t dynamicOffsetCount = 0);
 void beginRenderPipeline(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
     RenderingAttachmentInfo *depthTarget,
-    VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet);
+    VkPipelineLayout pipelineLayout, const GraphicsProgram& program, VkDescriptorSet descriptorSet,
+    const char* timerName = nullptr, const uint32_t* dynamicOffsets = nullptr, uint32_t dynamicOffsetCount = 0);
+// Switches programs inside a rendering scope, also in secondary command buffers.
+void bindGraphicsProgram(const GraphicsProgram& program);
 void endRenderPipeline();
 
-void beginComputePipeline(VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet);
+// Rendering scope whose draws come from secondary command buffers, the secondaries bind their
+// own pipelines and descriptor sets. Ends with endRenderPipeline. Barriers cannot be recorded
+// inside the scope, transition every resource the draws use before beginSecondaryRendering.
+void beginSecondaryRendering(RenderingAttachmentInfo *colorTargets, int32_t colorTargetCount,
+    RenderingAttachmentInfo *depthTarget, const char* timerName = nullptr);
+
+// Parallel recording, each thread index has its own command pool per frame in flight and must
+// be used by one thread at a time. While a secondary is recording, getVkCommandBuffer and the
+// barrier functions on that thread go to it, barriers are kept per thread. Barriers left at the
+// end are merged into the main thread on execute. A resource should only get barriers from one
+// thread per frame. Gpu timers and uploads stay on the main thread. insideRendering inherits the
+// beginSecondaryRendering scope, those secondaries must not queue barriers.
+bool beginSecondaryCommandBuffer(uint32_t threadIndex, bool insideRendering,
+    SecondaryCommandBuffer& outCommandBuffer);
+void endSecondaryCommandBuffer();
+void executeSecondaryCommandBuffers(const SecondaryCommandBuffer* commandBuffers, uint32_t count);
+
+void beginComputePipeline(VkPipelineLayout pipelineLayout, VkPipeline pipeline, VkDescriptorSet descriptorSet,
+    const char* timerName = nullptr, const uint32_t* dynamicOffsets = nullptr, uint32_t dynamicOffsetCount = 0);
 void endComputePipeline();
 
+// Records into the compute queue command buffer of this frame until submitAsyncCompute,
+// getVkCommandBuffer, barriers and compute pipelines go there meanwhile. One submission per
+// frame. Returns false without compute queue, then the work is recorded on the graphics queue.
+bool hasAsyncComputeQueue();
+bool beginAsyncCompute();
+// Waits for graphics timeline value, 0 for no wait. Returns compute timeline value, 0 on error.
+// Only values already submitted can be waited, at most getLastSubmissionValue. The graphics
+// submission of this frame may wait for the compute result, waiting on it would deadlock.
+uint64_t submitAsyncCompute(uint64_t waitGraphicsValue, VkPipelineStageFlags2 waitStageMask);
+// Makes the graphics submission of presentImage wait for the compute value.
+void waitAsyncComputeOnGraphics(uint64_t computeValue, VkPipelineStageFlags2 waitStageMask);
+bool isAsyncComputeComplete(uint64_t computeValue);
+bool waitForAsyncCompute(uint64_t computeValue, uint64_t timeoutNs = UINT64_MAX);
+
+// Gpu timers use the per frame timestamp query pools and can be nested. Results are read back
+// when the frame index is reused, so they lag FramesInFlight frames behind. Only the name
+// pointer is stored, names must stay alive for FramesInFlight frames, string literals do.
+void beginGpuTimer(const char* name);
+void endGpuTimer();
+
+struct ScopedGpuTimer
+{
+    ScopedGpuTimer(const char* name) { beginGpuTimer(name); }
+    ~ScopedGpuTimer() { endGpuTimer(); }
+};
+
+// Timers of the latest read back frame, in the order they were begun.
+const GpuTimerResult* getGpuTimerResults(int32_t* outCount, int64_t* outFrame = nullptr);
+// Average of each timer name over last CarpVk::GpuTimerHistoryLength frames it was used in.
+const GpuTimerAverage* getGpuTimerAverages(int32_t* outCount);
+
 void flushBarriers();
 
-Buffer& getUniformBuffer();
+Buffer& getUniformBuffer(uint32_t bufferIndex = 0);
 int64_t getFrameIndexWrapped();
+int64_t getFrameIndex();
+
+// Every submission to the queue signals the timeline semaphore with the next value.
+uint64_t getLastSubmissionValue();
+// Value the current frame or preframe will signal when it gets submitted.
+uint64_t getNextSubmissionValue();
+uint64_t getCompletedSubmissionValue();
+bool isSubmissionComplete(uint64_t submissionValue);
+bool waitForSubmission(uint64_t submissionValue, uint64_t timeoutNs = UINT64_MAX);
+
+// Returns 0 for frames known to be finished and UINT64_MAX for frames not submitted yet.
+uint64_t getFrameSubmissionValue(int64_t frame);
+bool isFrameComplete(int64_t frame);
+// Returns false on timeout or if the frame was never submitted.
+bool waitForFrame(int64_t frame, uint64_t timeoutNs = UINT64_MAX);
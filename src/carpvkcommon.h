@@ -82,7 +82,11 @@ struct Image
     uint64_t stageMask = 0;
     uint64_t accessMask = 0;
     VkImageLayout layout = {};
+    // Layout before releaseOwnership, the acquire barrier repeats the release transition.
+    VkImageLayout releasedLayout = {};
     VkFormat format = {};
+    // Uploaded on the transfer queue, not usable before the next beginFrame acquires it.
+    bool pendingAcquire = false;
     int32_t width = 0;
     int32_t height = 0;
 };
@@ -99,10 +103,16 @@ struct Buffer
     VmaAllocation_T* allocation = {};
     size_t size = 0ull;
     uint32_t usage = 0;
+    // Mapped memory the gpu reads directly, uploads memcpy into data instead of a staging copy.
+    bool directUpload = false;
+    // Uploaded on the transfer queue, not usable before the next beginFrame acquires it.
+    bool pendingAcquire = false;
 };
 
 struct UniformBuffer
 {
     size_t offset = 0;
     size_t size = 0;
+    uint32_t bufferIndex = 0;
+    uint32_t blockIndex = ~0u;
 };
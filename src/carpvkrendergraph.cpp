@@ -0,0 +1,426 @@
+#include <stdio.h>
+
+#include <vulkan/vulkan_core.h>
+
+#include "carpvkrendergraph.h"
+
+static constexpr VkAccessFlags2 cWriteAccessMask =
+    VK_ACCESS_2_SHADER_WRITE_BIT |
+    VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT |
+    VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+    VK_ACCESS_2_TRANSFER_WRITE_BIT |
+    VK_ACCESS_2_HOST_WRITE_BIT |
+    VK_ACCESS_2_MEMORY_WRITE_BIT;
+
+struct RenderGraphReader
+{
+    uint32_t passIndex = 0;
+    VkImageLayout layout = {};
+};
+
+struct RenderGraphResourceTrack
+{
+    const void* resource = nullptr;
+    int32_t lastWriter = -1;
+    // Readers since the last write.
+    std::vector<RenderGraphReader> readers;
+};
+
+struct RenderGraphMergedUse
+{
+    void* resource = nullptr;
+    VkPipelineStageFlags2 stageMask = 0;
+    VkAccessFlags2 accessMask = 0;
+    VkImageLayout layout = {};
+    bool write = false;
+};
+
+static RenderGraphResourceTrack& sFindTrack(std::vector<RenderGraphResourceTrack>& tracks, const void* resource)
+{
+    for(RenderGraphResourceTrack& track : tracks)
+    {
+        if(track.resource == resource)
+            return track;
+    }
+    tracks.push_back(RenderGraphResourceTrack{ .resource = resource });
+    return tracks.back();
+}
+
+static void sAddUnique(std::vector<uint32_t>& values, uint32_t value)
+{
+    for(uint32_t existing : values)
+    {
+        if(existing == value)
+            return;
+    }
+    values.push_back(value);
+}
+
+static void sAddUse(RenderGraphPass& pass, RenderGraphResourceTrack& track, uint32_t passIndex,
+    VkImageLayout layout, bool write)
+{
+    if(write)
+    {
+        // Writes can be partial, previous writer always counts as a producer.
+        if(track.lastWriter >= 0 && uint32_t(track.lastWriter) != passIndex)
+        {
+            sAddUnique(pass.dependencies, uint32_t(track.lastWriter));
+            sAddUnique(pass.producers, uint32_t(track.lastWriter));
+        }
+        for(const RenderGraphReader& reader : track.readers)
+        {
+            if(reader.passIndex != passIndex)
+                sAddUnique(pass.dependencies, reader.passIndex);
+        }
+        track.lastWriter = int32_t(passIndex);
+        track.readers.clear();
+        return;
+    }
+
+    if(track.lastWriter >= 0 && uint32_t(track.lastWriter) != passIndex)
+    {
+        sAddUnique(pass.dependencies, uint32_t(track.lastWriter));
+        sAddUnique(pass.producers, uint32_t(track.lastWriter));
+    }
+    // Reads in different layouts cannot share a barrier batch.
+    for(const RenderGraphReader& reader : track.readers)
+    {
+        if(reader.passIndex != passIndex && reader.layout != layout)
+            sAddUnique(pass.dependencies, reader.passIndex);
+    }
+    track.readers.push_back(RenderGraphReader{ .passIndex = passIndex, .layout = layout });
+}
+
+static void sMergeUse(std::vector<RenderGraphMergedUse>& uses, void* resource,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask, VkImageLayout layout, bool write)
+{
+    for(RenderGraphMergedUse& use : uses)
+    {
+        if(use.resource != resource)
+            continue;
+        // Dependencies keep conflicting uses of different passes in separate levels, what is
+        // left is shared reads or a pass that reads and writes the resource. Those become one
+        // use, a write when either is. Both need the same layout, GENERAL for storage images.
+        if(use.layout != layout)
+        {
+            printf("Resource used in layouts %i and %i in one level, falling back to general layout\n",
+                int(use.layout), int(layout));
+            ASSERT(false);
+            use.layout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        use.stageMask |= stageMask;
+        use.accessMask |= accessMask;
+        use.write |= write;
+        return;
+    }
+    uses.push_back(RenderGraphMergedUse{
+        .resource = resource,
+        .stageMask = stageMask,
+        .accessMask = accessMask,
+        .layout = layout,
+        .write = write,
+    });
+}
+
+// Reads covered by the current read only state need no barrier.
+static bool sIsCoveredRead(uint64_t currentStageMask, uint64_t currentAccessMask,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask)
+{
+    return currentAccessMask != 0
+        && (currentAccessMask & cWriteAccessMask) == 0
+        && (stageMask & ~currentStageMask) == 0
+        && (accessMask & ~currentAccessMask) == 0;
+}
+
+void resetRenderGraph(RenderGraph& graph)
+{
+    graph = RenderGraph{};
+}
+
+uint32_t addRenderGraphPass(RenderGraph& graph, const char* name, FnRenderGraphPass executeFn, void* userData)
+{
+    ASSERT(executeFn);
+    graph.compiled = false;
+    graph.passes.push_back(RenderGraphPass{
+        .name = name,
+        .executeFn = executeFn,
+        .userData = userData,
+    });
+    return uint32_t(graph.passes.size() - 1);
+}
+
+void setRenderGraphPassSideEffects(RenderGraph& graph, uint32_t passIndex)
+{
+    ASSERT_RETURN(passIndex < graph.passes.size());
+    graph.passes[passIndex].sideEffects = true;
+}
+
+void renderGraphReadImage(RenderGraph& graph, uint32_t passIndex, Image& image,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask, VkImageLayout layout)
+{
+    ASSERT_RETURN(passIndex < graph.passes.size());
+    graph.passes[passIndex].imageUses.push_back(RenderGraphImageUse{
+        .image = &image,
+        .stageMask = stageMask,
+        .accessMask = accessMask,
+        .layout = layout,
+        .write = false,
+    });
+}
+
+void renderGraphWriteImage(RenderGraph& graph, uint32_t passIndex, Image& image,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask, VkImageLayout layout)
+{
+    ASSERT_RETURN(passIndex < graph.passes.size());
+    graph.passes[passIndex].imageUses.push_back(RenderGraphImageUse{
+        .image = &image,
+        .stageMask = stageMask,
+        .accessMask = accessMask,
+        .layout = layout,
+        .write = true,
+    });
+}
+
+void renderGraphReadBuffer(RenderGraph& graph, uint32_t passIndex, Buffer& buffer,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask)
+{
+    ASSERT_RETURN(passIndex < graph.passes.size());
+    graph.passes[passIndex].bufferUses.push_back(RenderGraphBufferUse{
+        .buffer = &buffer,
+        .stageMask = stageMask,
+        .accessMask = accessMask,
+        .write = false,
+    });
+}
+
+void renderGraphWriteBuffer(RenderGraph& graph, uint32_t passIndex, Buffer& buffer,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask)
+{
+    ASSERT_RETURN(passIndex < graph.passes.size());
+    graph.passes[passIndex].bufferUses.push_back(RenderGraphBufferUse{
+        .buffer = &buffer,
+        .stageMask = stageMask,
+        .accessMask = accessMask,
+        .write = true,
+    });
+}
+
+void renderGraphColorTarget(RenderGraph& graph, uint32_t passIndex, Image& image)
+{
+    renderGraphWriteImage(graph, passIndex, image,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+}
+
+void renderGraphDepthTarget(RenderGraph& graph, uint32_t passIndex, Image& image)
+{
+    renderGraphWriteImage(graph, passIndex, image,
+        VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+        VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
+}
+
+void renderGraphSampledImage(RenderGraph& graph, uint32_t passIndex, Image& image, VkPipelineStageFlags2 stageMask)
+{
+    renderGraphReadImage(graph, passIndex, image,
+        stageMask, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+}
+
+void markRenderGraphOutput(RenderGraph& graph, const Image& image)
+{
+    graph.compiled = false;
+    graph.outputImages.push_back(&image);
+}
+
+void markRenderGraphOutput(RenderGraph& graph, const Buffer& buffer)
+{
+    graph.compiled = false;
+    graph.outputBuffers.push_back(&buffer);
+}
+
+bool compileRenderGraph(RenderGraph& graph)
+{
+    uint32_t passCount = uint32_t(graph.passes.size());
+    graph.executionOrder.clear();
+    graph.levelStarts.clear();
+    graph.stats = RenderGraphStats{};
+    graph.stats.passCount = passCount;
+
+    // Dependencies from the declaration order, they always point to earlier passes.
+    std::vector<RenderGraphResourceTrack> tracks;
+    for(uint32_t i = 0; i < passCount; ++i)
+    {
+        RenderGraphPass& pass = graph.passes[i];
+        pass.dependencies.clear();
+        pass.producers.clear();
+        pass.level = -1;
+        pass.culled = true;
+        for(const RenderGraphImageUse& use : pass.imageUses)
+        {
+            ASSERT_RETURN_FALSE(use.image);
+            sAddUse(pass, sFindTrack(tracks, use.image), i, use.layout, use.write);
+        }
+        for(const RenderGraphBufferUse& use : pass.bufferUses)
+        {
+            ASSERT_RETURN_FALSE(use.buffer);
+            sAddUse(pass, sFindTrack(tracks, use.buffer), i, VK_IMAGE_LAYOUT_UNDEFINED, use.write);
+        }
+    }
+
+    // Culling, passes stay if they have side effects or produce data for an output.
+    std::vector<uint32_t> alivePasses;
+    bool hasOutputs = !graph.outputImages.empty() || !graph.outputBuffers.empty();
+    for(uint32_t i = 0; i < passCount; ++i)
+    {
+        if(graph.passes[i].sideEffects || !hasOutputs)
+            alivePasses.push_back(i);
+    }
+    for(const RenderGraphResourceTrack& track : tracks)
+    {
+        if(track.lastWriter < 0)
+            continue;
+        bool isOutput = false;
+        for(const Image* image : graph.outputImages)
+            isOutput |= image == track.resource;
+        for(const Buffer* buffer : graph.outputBuffers)
+            isOutput |= buffer == track.resource;
+        if(isOutput)
+            alivePasses.push_back(uint32_t(track.lastWriter));
+    }
+    while(!alivePasses.empty())
+    {
+        uint32_t passIndex = alivePasses.back();
+        alivePasses.pop_back();
+        RenderGraphPass& pass = graph.passes[passIndex];
+        if(!pass.culled)
+            continue;
+        pass.culled = false;
+        for(uint32_t producer : pass.producers)
+            alivePasses.push_back(producer);
+    }
+
+    // Level is one past the deepest dependency, passes of a level are independent.
+    int32_t levelCount = 0;
+    for(uint32_t i = 0; i < passCount; ++i)
+    {
+        RenderGraphPass& pass = graph.passes[i];
+        if(pass.culled)
+        {
+            graph.stats.culledPassCount++;
+            continue;
+        }
+        pass.level = 0;
+        for(uint32_t dependency : pass.dependencies)
+        {
+            const RenderGraphPass& dependencyPass = graph.passes[dependency];
+            if(!dependencyPass.culled)
+                pass.level = MAX_VALUE(pass.level, dependencyPass.level + 1);
+        }
+        levelCount = MAX_VALUE(levelCount, pass.level + 1);
+    }
+
+    for(int32_t level = 0; level < levelCount; ++level)
+    {
+        graph.levelStarts.push_back(uint32_t(graph.executionOrder.size()));
+        for(uint32_t i = 0; i < passCount; ++i)
+        {
+            if(graph.passes[i].level == level)
+                graph.executionOrder.push_back(i);
+        }
+    }
+    graph.stats.levelCount = uint32_t(levelCount);
+    graph.compiled = true;
+    return true;
+}
+
+void executeRenderGraph(RenderGraph& graph)
+{
+    if(!graph.compiled && !compileRenderGraph(graph))
+    {
+        printf("Failed to compile render graph\n");
+        return;
+    }
+    graph.stats.imageBarrierCount = 0;
+    graph.stats.bufferBarrierCount = 0;
+    graph.stats.mergedReadCount = 0;
+
+    std::vector<RenderGraphMergedUse> imageUses;
+    std::vector<RenderGraphMergedUse> bufferUses;
+    uint32_t levelCount = uint32_t(graph.levelStarts.size());
+    for(uint32_t level = 0; level < levelCount; ++level)
+    {
+        uint32_t start = graph.levelStarts[level];
+        uint32_t end = level + 1 < levelCount
+            ? graph.levelStarts[level + 1]
+            : uint32_t(graph.executionOrder.size());
+
+        // Aliased images starting here take over the state of their memory before the barriers.
+        beginTransientImageUse(level);
+
+        imageUses.clear();
+        bufferUses.clear();
+        for(uint32_t i = start; i < end; ++i)
+        {
+            const RenderGraphPass& pass = graph.passes[graph.executionOrder[i]];
+            for(const RenderGraphImageUse& use : pass.imageUses)
+                sMergeUse(imageUses, use.image, use.stageMask, use.accessMask, use.layout, use.write);
+            for(const RenderGraphBufferUse& use : pass.bufferUses)
+                sMergeUse(bufferUses, use.buffer, use.stageMask, use.accessMask, VK_IMAGE_LAYOUT_UNDEFINED, use.write);
+        }
+
+        for(const RenderGraphMergedUse& use : imageUses)
+        {
+            Image& image = *(Image*)use.resource;
+            if(!use.write && image.layout == use.layout
+                && sIsCoveredRead(image.stageMask, image.accessMask, use.stageMask, use.accessMask))
+            {
+                graph.stats.mergedReadCount++;
+                continue;
+            }
+            if(image.stageMask == use.stageMask && image.accessMask == use.accessMask && image.layout == use.layout)
+            {
+                // Write after write in the same state, image barrier would be skipped.
+                memoryBarrier(image.stageMask, image.accessMask, use.stageMask, use.accessMask);
+            }
+            else
+            {
+                imageBarrier(image, use.stageMask, use.accessMask, use.layout);
+            }
+            graph.stats.imageBarrierCount++;
+        }
+        for(const RenderGraphMergedUse& use : bufferUses)
+        {
+            Buffer& buffer = *(Buffer*)use.resource;
+            if(!use.write && sIsCoveredRead(buffer.stageMask, buffer.accessMask, use.stageMask, use.accessMask))
+            {
+                graph.stats.mergedReadCount++;
+                continue;
+            }
+            if(buffer.stageMask == use.stageMask && buffer.accessMask == use.accessMask)
+            {
+                memoryBarrier(buffer.stageMask, buffer.accessMask, use.stageMask, use.accessMask);
+            }
+            else
+            {
+                bufferBarrier(buffer, use.stageMask, use.accessMask);
+            }
+            graph.stats.bufferBarrierCount++;
+        }
+        // One barrier batch for the whole level.
+        flushBarriers();
+
+        for(uint32_t i = start; i < end; ++i)
+        {
+            const RenderGraphPass& pass = graph.passes[graph.executionOrder[i]];
+            pass.executeFn(pass.userData);
+        }
+    }
+}
+
+const RenderGraphStats& getRenderGraphStats(const RenderGraph& graph)
+{
+    return graph.stats;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <vector>
+
+#include "carpvk.h"
+
+// Need to include vulkan_core.h before this file, same as carpvk.h.
+
+// Pass callback records the pass with beginRenderPipeline/beginComputePipeline etc,
+// barriers for the declared uses are already flushed when it is called.
+using FnRenderGraphPass = void (*)(void* userData);
+
+struct RenderGraphImageUse
+{
+    Image* image = nullptr;
+    VkPipelineStageFlags2 stageMask = 0;
+    VkAccessFlags2 accessMask = 0;
+    VkImageLayout layout = {};
+    bool write = false;
+};
+
+struct RenderGraphBufferUse
+{
+    Buffer* buffer = nullptr;
+    VkPipelineStageFlags2 stageMask = 0;
+    VkAccessFlags2 accessMask = 0;
+    bool write = false;
+};
+
+struct RenderGraphPass
+{
+    const char* name = nullptr;
+    FnRenderGraphPass executeFn = nullptr;
+    void* userData = nullptr;
+    std::vector<RenderGraphImageUse> imageUses;
+    std::vector<RenderGraphBufferUse> bufferUses;
+    // Passes that have to run before this one, and the ones of them producing data this pass reads.
+    std::vector<uint32_t> dependencies;
+    std::vector<uint32_t> producers;
+    int32_t level = -1;
+    // Never culled, for passes with effects outside of the graph like readbacks.
+    bool sideEffects = false;
+    bool culled = false;
+};
+
+struct RenderGraphStats
+{
+    uint32_t passCount = 0;
+    uint32_t culledPassCount = 0;
+    // One vkCmdPipelineBarrier2 at most per level.
+    uint32_t levelCount = 0;
+    uint32_t imageBarrierCount = 0;
+    uint32_t bufferBarrierCount = 0;
+    // Reads of resources already readable in the same layout that did not need a barrier.
+    uint32_t mergedReadCount = 0;
+};
+
+struct RenderGraph
+{
+    std::vector<RenderGraphPass> passes;
+    std::vector<const Image*> outputImages;
+    std::vector<const Buffer*> outputBuffers;
+    // Filled by compileRenderGraph, pass indices sorted by level.
+    std::vector<uint32_t> executionOrder;
+    std::vector<uint32_t> levelStarts;
+    RenderGraphStats stats;
+    bool compiled = false;
+};
+
+void resetRenderGraph(RenderGraph& graph);
+
+uint32_t addRenderGraphPass(RenderGraph& graph, const char* name, FnRenderGraphPass executeFn, void* userData);
+void setRenderGraphPassSideEffects(RenderGraph& graph, uint32_t passIndex);
+
+// A pass can read and write the same resource, the image layouts of both uses must match.
+void renderGraphReadImage(RenderGraph& graph, uint32_t passIndex, Image& image,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask, VkImageLayout layout);
+void renderGraphWriteImage(RenderGraph& graph, uint32_t passIndex, Image& image,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask, VkImageLayout layout);
+void renderGraphReadBuffer(RenderGraph& graph, uint32_t passIndex, Buffer& buffer,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask);
+void renderGraphWriteBuffer(RenderGraph& graph, uint32_t passIndex, Buffer& buffer,
+    VkPipelineStageFlags2 stageMask, VkAccessFlags2 accessMask);
+
+// Shorthands for the common uses.
+void renderGraphColorTarget(RenderGraph& graph, uint32_t passIndex, Image& image);
+void renderGraphDepthTarget(RenderGraph& graph, uint32_t passIndex, Image& image);
+void renderGraphSampledImage(RenderGraph& graph, uint32_t passIndex, Image& image, VkPipelineStageFlags2 stageMask);
+
+// Resources read after the graph, like the image given to presentImage. Passes that do not
+// contribute to an output or have side effects are culled.
+void markRenderGraphOutput(RenderGraph& graph, const Image& image);
+void markRenderGraphOutput(RenderGraph& graph, const Buffer& buffer);
+
+// Builds the dependencies from the declaration order, culls and sorts the passes into levels.
+// Passes in the same level do not depend on each other and share one barrier batch.
+bool compileRenderGraph(RenderGraph& graph);
+// Calls beginTransientImageUse with the level index before the barriers of each level, so
+// transient images used by a graph take levels as their use points.
+void executeRenderGraph(RenderGraph& graph);
+
+const RenderGraphStats& getRenderGraphStats(const RenderGraph& graph);
@@ -0,0 +1,534 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include <vulkan/vulkan_core.h>
+
+#include "carpvkassert.h"
+#include "carpvkspirv.h"
+
+// Opcodes and enums from the SPIR-V specification, only the ones reflection needs.
+static constexpr uint32_t cSpirvMagic = 0x07230203;
+
+enum SpirvOp : uint32_t
+{
+    SpirvOpEntryPoint = 15,
+    SpirvOpExecutionMode = 16,
+    SpirvOpTypeBool = 20,
+    SpirvOpTypeInt = 21,
+    SpirvOpTypeFloat = 22,
+    SpirvOpTypeVector = 23,
+    SpirvOpTypeMatrix = 24,
+    SpirvOpTypeImage = 25,
+    SpirvOpTypeSampler = 26,
+    SpirvOpTypeSampledImage = 27,
+    SpirvOpTypeArray = 28,
+    SpirvOpTypeRuntimeArray = 29,
+    SpirvOpTypeStruct = 30,
+    SpirvOpTypePointer = 32,
+    SpirvOpConstantTrue = 41,
+    SpirvOpConstantFalse = 42,
+    SpirvOpConstant = 43,
+    SpirvOpConstantComposite = 44,
+    SpirvOpSpecConstantTrue = 48,
+    SpirvOpSpecConstantFalse = 49,
+    SpirvOpSpecConstant = 50,
+    SpirvOpSpecConstantComposite = 51,
+    SpirvOpVariable = 59,
+    SpirvOpDecorate = 71,
+    SpirvOpMemberDecorate = 72,
+    SpirvOpExecutionModeId = 331,
+    SpirvOpTypeAccelerationStructureKHR = 5341,
+};
+
+enum SpirvDecoration : uint32_t
+{
+    SpirvDecorationSpecId = 1,
+    SpirvDecorationBlock = 2,
+    SpirvDecorationBufferBlock = 3,
+    SpirvDecorationArrayStride = 6,
+    SpirvDecorationMatrixStride = 7,
+    SpirvDecorationBuiltIn = 11,
+    SpirvDecorationBinding = 33,
+    SpirvDecorationDescriptorSet = 34,
+    SpirvDecorationOffset = 35,
+};
+
+enum SpirvStorageClass : uint32_t
+{
+    SpirvStorageClassUniformConstant = 0,
+    SpirvStorageClassUniform = 2,
+    SpirvStorageClassPushConstant = 9,
+    SpirvStorageClassStorageBuffer = 12,
+};
+
+static constexpr uint32_t cSpirvBuiltInWorkgroupSize = 25;
+static constexpr uint32_t cSpirvExecutionModeLocalSize = 17;
+static constexpr uint32_t cSpirvExecutionModeLocalSizeId = 38;
+static constexpr uint32_t cSpirvDimBuffer = 5;
+static constexpr uint32_t cSpirvDimSubpassData = 6;
+
+struct SpirvId
+{
+    uint32_t opcode = 0;
+    // Type operands, or the result type for constants and variables.
+    uint32_t typeId = 0;
+    uint32_t storageClass = ~0u;
+    uint32_t set = ~0u;
+    uint32_t binding = ~0u;
+    uint32_t specId = ~0u;
+    uint32_t builtIn = ~0u;
+    uint32_t arrayStride = 0;
+    uint64_t constantValue = 0;
+    // Operand words after the result id.
+    const uint32_t* operands = nullptr;
+    uint32_t operandCount = 0;
+    bool block = false;
+    bool bufferBlock = false;
+};
+
+struct SpirvMemberInfo
+{
+    uint32_t offset = 0;
+    uint32_t matrixStride = 0;
+};
+
+static uint32_t sGetStageFromExecutionModel(uint32_t executionModel)
+{
+    switch(executionModel)
+    {
+        case 0: return VK_SHADER_STAGE_VERTEX_BIT;
+        case 1: return VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+        case 2: return VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+        case 3: return VK_SHADER_STAGE_GEOMETRY_BIT;
+        case 4: return VK_SHADER_STAGE_FRAGMENT_BIT;
+        case 5: return VK_SHADER_STAGE_COMPUTE_BIT;
+        case 5364: return VK_SHADER_STAGE_TASK_BIT_EXT;
+        case 5365: return VK_SHADER_STAGE_MESH_BIT_EXT;
+        default: return 0;
+    }
+}
+
+uint64_t hashSpirv(const uint32_t* code, size_t wordCount)
+{
+    // FNV-1a over the words.
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < wordCount; ++i)
+    {
+        hash = (hash ^ code[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Size of the type in a push constant block, members use their Offset decorations.
+static uint32_t sGetTypeSize(const std::vector<SpirvId>& ids,
+    const std::unordered_map<uint64_t, SpirvMemberInfo>& members, uint32_t typeId)
+{
+    if(typeId >= ids.size())
+    {
+        return 0;
+    }
+    const SpirvId& type = ids[typeId];
+    switch(type.opcode)
+    {
+        case SpirvOpTypeBool: return 4;
+        case SpirvOpTypeInt:
+        case SpirvOpTypeFloat:
+            return type.operands[0] / 8;
+        case SpirvOpTypeVector:
+            return sGetTypeSize(ids, members, type.operands[0]) * type.operands[1];
+        case SpirvOpTypeMatrix:
+            return sGetTypeSize(ids, members, type.operands[0]) * type.operands[1];
+        case SpirvOpTypeArray:
+        {
+            uint32_t lengthId = type.operands[1];
+            uint32_t length = lengthId < ids.size() ? uint32_t(ids[lengthId].constantValue) : 0;
+            uint32_t stride = type.arrayStride ? type.arrayStride : sGetTypeSize(ids, members, type.operands[0]);
+            return stride * length;
+        }
+        case SpirvOpTypeStruct:
+        {
+            uint32_t size = 0;
+            for(uint32_t i = 0; i < type.operandCount; ++i)
+            {
+                auto member = members.find((uint64_t(typeId) << 32) | i);
+                uint32_t offset = member != members.end() ? member->second.offset : size;
+                uint32_t memberSize = sGetTypeSize(ids, members, type.operands[i]);
+                // Matrices with padded columns.
+                const SpirvId& memberType = ids[type.operands[i]];
+                if(memberType.opcode == SpirvOpTypeMatrix && member != members.end() && member->second.matrixStride)
+                {
+                    memberSize = member->second.matrixStride * memberType.operands[1];
+                }
+                size = MAX_VALUE(size, offset + memberSize);
+            }
+            return size;
+        }
+        default: return 0;
+    }
+}
+
+static bool sGetDescriptorType(const std::vector<SpirvId>& ids, uint32_t storageClass, uint32_t typeId,
+    VkDescriptorType& outType)
+{
+    const SpirvId& type = ids[typeId];
+    if(storageClass == SpirvStorageClassStorageBuffer)
+    {
+        outType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        return true;
+    }
+    if(storageClass == SpirvStorageClassUniform)
+    {
+        if(type.bufferBlock)
+        {
+            outType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            return true;
+        }
+        outType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        return true;
+    }
+    if(storageClass != SpirvStorageClassUniformConstant)
+    {
+        return false;
+    }
+    switch(type.opcode)
+    {
+        case SpirvOpTypeSampler:
+            outType = VK_DESCRIPTOR_TYPE_SAMPLER;
+            return true;
+        case SpirvOpTypeSampledImage:
+            outType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+            return true;
+        case SpirvOpTypeAccelerationStructureKHR:
+            outType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            return true;
+        case SpirvOpTypeImage:
+        {
+            // Operands: sampled type, dim, depth, arrayed, ms, sampled, format.
+            uint32_t dim = type.operands[1];
+            uint32_t sampled = type.operands[5];
+            if(dim == cSpirvDimBuffer)
+                outType = sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            else if(dim == cSpirvDimSubpassData)
+                outType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+            else
+                outType = sampled == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+            return true;
+        }
+        default: return false;
+    }
+}
+
+bool reflectSpirv(const uint32_t* code, size_t wordCount, ShaderReflection& outReflection)
+{
+    outReflection = ShaderReflection{};
+    if(!code || wordCount < 5 || code[0] != cSpirvMagic)
+    {
+        printf("Not a SPIR-V module\n");
+        return false;
+    }
+    uint32_t idBound = code[3];
+    outReflection.hash = hashSpirv(code, wordCount);
+
+    std::vector<SpirvId> ids(idBound);
+    std::unordered_map<uint64_t, SpirvMemberInfo> members;
+    std::vector<uint32_t> variables;
+    uint32_t entryPointId = ~0u;
+    uint32_t localSizeIds[3] = { ~0u, ~0u, ~0u };
+
+    size_t wordIndex = 5;
+    while(wordIndex < wordCount)
+    {
+        const uint32_t* words = code + wordIndex;
+        uint32_t opcode = words[0] & 0xffffu;
+        uint32_t instructionWordCount = words[0] >> 16;
+        if(instructionWordCount == 0 || wordIndex + instructionWordCount > wordCount)
+        {
+            printf("Broken SPIR-V instruction at word %zu\n", wordIndex);
+            return false;
+        }
+
+        switch(opcode)
+        {
+            case SpirvOpEntryPoint:
+            {
+                if(entryPointId == ~0u)
+                {
+                    outReflection.stage = sGetStageFromExecutionModel(words[1]);
+                    entryPointId = words[2];
+                }
+                break;
+            }
+            case SpirvOpExecutionMode:
+            {
+                if(words[1] == entryPointId && instructionWordCount >= 6
+                    && words[2] == cSpirvExecutionModeLocalSize)
+                {
+                    outReflection.workgroupSize[0] = words[3];
+                    outReflection.workgroupSize[1] = words[4];
+                    outReflection.workgroupSize[2] = words[5];
+                }
+                break;
+            }
+            // Execution modes with id operands, LocalSizeId only comes with this one.
+            case SpirvOpExecutionModeId:
+            {
+                if(words[1] == entryPointId && instructionWordCount >= 6
+                    && words[2] == cSpirvExecutionModeLocalSizeId)
+                {
+                    localSizeIds[0] = words[3];
+                    localSizeIds[1] = words[4];
+                    localSizeIds[2] = words[5];
+                }
+                break;
+            }
+            case SpirvOpDecorate:
+            {
+                uint32_t target = words[1];
+                if(target >= idBound || instructionWordCount < 3)
+                    break;
+                SpirvId& id = ids[target];
+                uint32_t value = instructionWordCount > 3 ? words[3] : 0;
+                switch(words[2])
+                {
+                    case SpirvDecorationSpecId: id.specId = value; break;
+                    case SpirvDecorationBlock: id.block = true; break;
+                    case SpirvDecorationBufferBlock: id.bufferBlock = true; break;
+                    case SpirvDecorationArrayStride: id.arrayStride = value; break;
+                    case SpirvDecorationBuiltIn: id.builtIn = value; break;
+                    case SpirvDecorationBinding: id.binding = value; break;
+                    case SpirvDecorationDescriptorSet: id.set = value; break;
+                    default: break;
+                }
+                break;
+            }
+            case SpirvOpMemberDecorate:
+            {
+                if(instructionWordCount < 5)
+                    break;
+                SpirvMemberInfo& member = members[(uint64_t(words[1]) << 32) | words[2]];
+                if(words[3] == SpirvDecorationOffset)
+                    member.offset = words[4];
+                else if(words[3] == SpirvDecorationMatrixStride)
+                    member.matrixStride = words[4];
+                break;
+            }
+            case SpirvOpTypeBool:
+            case SpirvOpTypeInt:
+            case SpirvOpTypeFloat:
+            case SpirvOpTypeVector:
+            case SpirvOpTypeMatrix:
+            case SpirvOpTypeImage:
+            case SpirvOpTypeSampler:
+            case SpirvOpTypeSampledImage:
+            case SpirvOpTypeArray:
+            case SpirvOpTypeRuntimeArray:
+            case SpirvOpTypeStruct:
+            case SpirvOpTypePointer:
+            case SpirvOpTypeAccelerationStructureKHR:
+            {
+                uint32_t result = words[1];
+                if(result >= idBound)
+                    break;
+                SpirvId& id = ids[result];
+                id.opcode = opcode;
+                id.operands = words + 2;
+                id.operandCount = instructionWordCount - 2;
+                break;
+            }
+            case SpirvOpConstantTrue:
+            case SpirvOpConstantFalse:
+            case SpirvOpConstant:
+            case SpirvOpConstantComposite:
+            case SpirvOpSpecConstantTrue:
+            case SpirvOpSpecConstantFalse:
+            case SpirvOpSpecConstant:
+            case SpirvOpSpecConstantComposite:
+            {
+                uint32_t result = words[2];
+                if(result >= idBound)
+                    break;
+                SpirvId& id = ids[result];
+                id.opcode = opcode;
+                id.typeId = words[1];
+                id.operands = words + 3;
+                id.operandCount = instructionWordCount - 3;
+                if(opcode == SpirvOpConstant || opcode == SpirvOpSpecConstant)
+                {
+                    id.constantValue = instructionWordCount > 3 ? words[3] : 0;
+                    if(instructionWordCount > 4)
+                        id.constantValue |= uint64_t(words[4]) << 32;
+                }
+                else if(opcode == SpirvOpConstantTrue || opcode == SpirvOpSpecConstantTrue)
+                {
+                    id.constantValue = 1;
+                }
+                break;
+            }
+            case SpirvOpVariable:
+            {
+                uint32_t result = words[2];
+                if(result >= idBound)
+                    break;
+                SpirvId& id = ids[result];
+                id.opcode = opcode;
+                id.typeId = words[1];
+                id.storageClass = words[3];
+                variables.push_back(result);
+                break;
+            }
+            default: break;
+        }
+        wordIndex += instructionWordCount;
+    }
+
+    if(entryPointId == ~0u || outReflection.stage == 0)
+    {
+        printf("SPIR-V module has no supported entry point\n");
+        return false;
+    }
+
+    for(uint32_t variableId : variables)
+    {
+        const SpirvId& variable = ids[variableId];
+        if(variable.typeId >= idBound || ids[variable.typeId].opcode != SpirvOpTypePointer)
+            continue;
+        uint32_t typeId = ids[variable.typeId].operands[1];
+        if(typeId >= idBound)
+            continue;
+
+        if(variable.storageClass == SpirvStorageClassPushConstant)
+        {
+            uint32_t minOffset = ~0u;
+            const SpirvId& type = ids[typeId];
+            for(uint32_t i = 0; i < type.operandCount; ++i)
+            {
+                auto member = members.find((uint64_t(typeId) << 32) | i);
+                uint32_t memberOffset = member != members.end() ? member->second.offset : 0u;
+                minOffset = MIN_VALUE(minOffset, memberOffset);
+            }
+            uint32_t size = sGetTypeSize(ids, members, typeId);
+            outReflection.pushConstantOffset = minOffset == ~0u ? 0 : minOffset;
+            outReflection.pushConstantSize = size - outReflection.pushConstantOffset;
+            continue;
+        }
+
+        if(variable.set == ~0u || variable.binding == ~0u)
+            continue;
+
+        SpirvBinding binding;
+        binding.set = variable.set;
+        binding.binding = variable.binding;
+        binding.stageFlags = outReflection.stage;
+        binding.descriptorCount = 1;
+        if(ids[typeId].opcode == SpirvOpTypeArray)
+        {
+            uint32_t lengthId = ids[typeId].operands[1];
+            binding.descriptorCount = lengthId < idBound ? uint32_t(ids[lengthId].constantValue) : 1;
+            typeId = ids[typeId].operands[0];
+        }
+        else if(ids[typeId].opcode == SpirvOpTypeRuntimeArray)
+        {
+            binding.descriptorCount = 0;
+            typeId = ids[typeId].operands[0];
+        }
+        if(typeId >= idBound || !sGetDescriptorType(ids, variable.storageClass, typeId, binding.descriptorType))
+        {
+            continue;
+        }
+        outReflection.bindings.push_back(binding);
+    }
+
+    for(uint32_t i = 0; i < idBound; ++i)
+    {
+        const SpirvId& id = ids[i];
+        if(id.specId != ~0u
+            && (id.opcode == SpirvOpSpecConstant || id.opcode == SpirvOpSpecConstantTrue
+                || id.opcode == SpirvOpSpecConstantFalse))
+        {
+            SpirvSpecConstant specConstant;
+            specConstant.constantId = id.specId;
+            specConstant.defaultValue = id.constantValue;
+            specConstant.size = 4;
+            if(id.opcode == SpirvOpSpecConstant && id.typeId < idBound && ids[id.typeId].operandCount > 0)
+            {
+                specConstant.size = MAX_VALUE(ids[id.typeId].operands[0] / 8, 4u);
+            }
+            outReflection.specConstants.push_back(specConstant);
+        }
+        // gl_WorkGroupSize, the older way of specializing the local size.
+        if(id.builtIn == cSpirvBuiltInWorkgroupSize
+            && (id.opcode == SpirvOpConstantComposite || id.opcode == SpirvOpSpecConstantComposite))
+        {
+            for(uint32_t j = 0; j < 3 && j < id.operandCount; ++j)
+            {
+                localSizeIds[j] = id.operands[j];
+            }
+        }
+    }
+    for(uint32_t i = 0; i < 3; ++i)
+    {
+        if(localSizeIds[i] < idBound)
+        {
+            const SpirvId& sizeId = ids[localSizeIds[i]];
+            outReflection.workgroupSize[i] = uint32_t(sizeId.constantValue);
+            outReflection.workgroupSizeSpecIds[i] = sizeId.specId;
+        }
+    }
+
+    outReflection.valid = true;
+    return true;
+}
+
+bool mergeShaderReflections(const ShaderReflection* const* reflections, uint32_t count,
+    ShaderReflection& outMerged)
+{
+    outMerged = ShaderReflection{};
+    uint32_t pushConstantEnd = 0;
+    uint32_t pushConstantOffset = ~0u;
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        const ShaderReflection* reflection = reflections[i];
+        ASSERT_RETURN_FALSE(reflection && reflection->valid);
+        outMerged.stage |= reflection->stage;
+        for(const SpirvBinding& binding : reflection->bindings)
+        {
+            bool found = false;
+            for(SpirvBinding& merged : outMerged.bindings)
+            {
+                if(merged.set != binding.set || merged.binding != binding.binding)
+                    continue;
+                if(merged.descriptorType != binding.descriptorType)
+                {
+                    printf("Stages disagree on the type of set: %u, binding: %u\n", binding.set, binding.binding);
+                    return false;
+                }
+                merged.stageFlags |= binding.stageFlags;
+                merged.descriptorCount = MAX_VALUE(merged.descriptorCount, binding.descriptorCount);
+                found = true;
+                break;
+            }
+            if(!found)
+            {
+                outMerged.bindings.push_back(binding);
+            }
+        }
+        if(reflection->pushConstantSize > 0)
+        {
+            pushConstantOffset = MIN_VALUE(pushConstantOffset, reflection->pushConstantOffset);
+            pushConstantEnd = MAX_VALUE(pushConstantEnd, reflection->pushConstantOffset + reflection->pushConstantSize);
+        }
+        for(uint32_t j = 0; j < 3; ++j)
+        {
+            outMerged.workgroupSize[j] = MAX_VALUE(outMerged.workgroupSize[j], reflection->workgroupSize[j]);
+        }
+    }
+    if(pushConstantEnd > 0)
+    {
+        outMerged.pushConstantOffset = pushConstantOffset;
+        outMerged.pushConstantSize = pushConstantEnd - pushConstantOffset;
+    }
+    outMerged.valid = true;
+    return true;
+}
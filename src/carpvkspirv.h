@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+// Need to include vulkan_core.h before this file, same as carpvk.h.
+
+struct SpirvBinding
+{
+    uint32_t set = 0;
+    uint32_t binding = 0;
+    VkDescriptorType descriptorType = {};
+    // 0 for runtime sized arrays.
+    uint32_t descriptorCount = 1;
+    uint32_t stageFlags = 0;
+};
+
+struct SpirvSpecConstant
+{
+    uint32_t constantId = 0;
+    // Default value bits and size in bytes, bools are 4 bytes like VkBool32.
+    uint64_t defaultValue = 0;
+    uint32_t size = 0;
+};
+
+struct ShaderReflection
+{
+    // Hash of the SPIR-V words, reflections are cached with it.
+    uint64_t hash = 0;
+    // VkShaderStageFlagBits of the first entry point.
+    uint32_t stage = 0;
+    std::vector<SpirvBinding> bindings;
+    std::vector<SpirvSpecConstant> specConstants;
+    uint32_t pushConstantOffset = 0;
+    uint32_t pushConstantSize = 0;
+    // Compute local size, 0 when the shader has none. Spec constant ids of the size, ~0u when
+    // the dimension is not specialized.
+    uint32_t workgroupSize[3] = {};
+    uint32_t workgroupSizeSpecIds[3] = { ~0u, ~0u, ~0u };
+    bool valid = false;
+};
+
+uint64_t hashSpirv(const uint32_t* code, size_t wordCount);
+bool reflectSpirv(const uint32_t* code, size_t wordCount, ShaderReflection& outReflection);
+
+// Bindings used by several stages get their stage flags combined, push constants become one
+// range covering every stage. Fails when stages disagree on a binding type.
+bool mergeShaderReflections(const ShaderReflection* const* reflections, uint32_t count,
+    ShaderReflection& outMerged);